@@ -0,0 +1,793 @@
+//Micro- and frame benchmarks for raytracer_core
+//Usage: Benchmarks [filter]   only runs benchmarks whose name contains filter
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <execution>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "BVH.h"
+#include "BVHCache.h"
+#include "DataTypes.h"
+#include "Material.h"
+#include "Renderer.h"
+#include "Scene.h"
+#include "Utils.h"
+
+using namespace dae;
+
+namespace
+{
+	std::string g_Filter{};
+
+	//Runs fn a number of times, prints the average and fastest time in ms and returns the average
+	template<typename Fn>
+	double RunBenchmark(const std::string& name, int iterations, Fn&& fn)
+	{
+		if (!g_Filter.empty() && name.find(g_Filter) == std::string::npos)
+			return 0.0;
+
+		//Warm up caches and lazily built data
+		fn();
+
+		double total{ 0.0 };
+		double fastest{ 1e30 };
+		for (int i{ 0 }; i < iterations; ++i)
+		{
+			const auto start = std::chrono::steady_clock::now();
+			fn();
+			const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+			total += ms;
+			fastest = std::min(fastest, ms);
+		}
+
+		std::cout << std::left << std::setw(48) << name
+			<< " avg " << std::right << std::setw(10) << std::fixed << std::setprecision(3) << total / iterations << " ms"
+			<< "   min " << std::setw(10) << fastest << " ms" << std::endl;
+		return total / iterations;
+	}
+
+	TriangleMesh LoadMesh(const std::string& fileName)
+	{
+		TriangleMesh mesh{};
+		mesh.cullMode = TriangleCullMode::NoCulling;
+		Utils::ParseOBJ(fileName, mesh.positions, mesh.normals, mesh.indices);
+		mesh.Scale(Vector3(2, 2, 2));
+		mesh.UpdateTransforms();
+		return mesh;
+	}
+
+	//Heightfield of 2 * resolution^2 triangles
+	TriangleMesh CreateGridMesh(int resolution)
+	{
+		TriangleMesh mesh{};
+		mesh.cullMode = TriangleCullMode::NoCulling;
+		for (int z{ 0 }; z <= resolution; ++z)
+		{
+			for (int x{ 0 }; x <= resolution; ++x)
+			{
+				mesh.positions.emplace_back(float(x), std::sin(x * 0.3f) * std::cos(z * 0.2f) * 4.f, float(z));
+			}
+		}
+		for (int z{ 0 }; z < resolution; ++z)
+		{
+			for (int x{ 0 }; x < resolution; ++x)
+			{
+				const int i0 = z * (resolution + 1) + x, i1 = i0 + 1, i2 = i0 + resolution + 1, i3 = i2 + 1;
+				mesh.indices.insert(mesh.indices.end(), { i0, i2, i1, i1, i2, i3 });
+			}
+		}
+		mesh.CalculateNormals();
+		mesh.UpdateTransforms();
+		return mesh;
+	}
+
+	void BenchmarkBVHBuild()
+	{
+		TriangleMesh bunny = LoadMesh("resources/lowpoly_bunny.obj");
+		bunny.BuildBVH();
+
+		RunBenchmark("BVH build (bunny)", 50, [&]()
+			{
+				bunny.bvh->BuildBVH();
+			});
+
+		float yaw{ 0.f };
+		RunBenchmark("BVH refit (bunny)", 50, [&]()
+			{
+				yaw += 0.01f;
+				bunny.RotateY(yaw);
+				bunny.UpdateTransforms();
+			});
+
+		//Large bumpy grid, shows how the build scales with the number of build threads
+		TriangleMesh grid = CreateGridMesh(256);
+		grid.BuildBVH();
+		for (const uint32_t nrOfThreads : { 1u, 0u })
+		{
+			BVHBuildSettings settings{ grid.bvh->GetBuildSettings() };
+			settings.nrOfBuildThreads = nrOfThreads;
+			grid.bvh->SetBuildSettings(settings);
+
+			RunBenchmark(nrOfThreads == 1 ? "BVH build 131k tris (1 thread)" : "BVH build 131k tris (all threads)", 10, [&]()
+				{
+					grid.bvh->BuildBVH();
+				});
+		}
+
+		//Startup with the BVH cache: a miss builds and writes the file, a hit maps it
+		const std::filesystem::path cacheDirectory{ std::filesystem::temp_directory_path() / "gp1_bvh_cache_benchmark" };
+		BVHCache::SetDirectory(cacheDirectory.string());
+		RunBenchmark("BVH cache miss 131k tris (build + store)", 5, [&]()
+			{
+				std::filesystem::remove_all(cacheDirectory);
+				std::filesystem::create_directories(cacheDirectory);
+				grid.bvh->LoadOrBuildBVH();
+			});
+		RunBenchmark("BVH cache hit 131k tris (map)", 10, [&]()
+			{
+				grid.bvh->LoadOrBuildBVH();
+			});
+		BVHCache::SetDirectory({});
+		std::filesystem::remove_all(cacheDirectory);
+	}
+
+	//Grid of NrOfSpheres spheres on a floor, shows how frame time scales with object count
+	template<int NrOfSpheres>
+	class Scene_SphereField final : public Scene
+	{
+	public:
+		explicit Scene_SphereField(uint32_t minSphereBVHSpheres = 4096)
+		{
+			m_MinSphereBVHSpheres = minSphereBVHSpheres;
+		}
+
+		void Initialize() override
+		{
+			m_Camera.origin = { 0.f, 20.f, -30.f };
+			m_Camera.fovAngle = 60.f;
+			m_Camera.forward = Vector3{ 0.f, -0.6f, 1.f }.Normalized();
+
+			const auto matLambert_GrayBlue = AddMaterial(new Material_Lambert({ 0.49f, 0.57f, 0.57f }, 1.f));
+			const auto matLambert_White = AddMaterial(new Material_Lambert(colors::White, 1.f));
+
+			AddPlane({ 0.f, 0.f, 0.f }, { 0.f, 1.f, 0.f }, matLambert_GrayBlue);
+
+			int gridSize{ 1 };
+			while (gridSize * gridSize < NrOfSpheres) ++gridSize;
+			const float spacing{ 60.f / float(gridSize) };
+			for (int idx{ 0 }; idx < NrOfSpheres; ++idx)
+			{
+				const float x{ (idx % gridSize - gridSize / 2) * spacing }, z{ (idx / gridSize) * spacing };
+				AddSphere({ x, spacing * 0.4f, z }, spacing * 0.4f, matLambert_White);
+			}
+
+			AddPointLight({ 0.f, 40.f, 0.f }, 2000.f, colors::White);
+
+			BuildAccelerationStructure();
+		}
+
+		void Rebuild() { BuildAccelerationStructure(); }
+	};
+
+	//Removing and adding spheres in a large scene updates the scene BVH in place, compared to rebuilding it
+	void BenchmarkSceneEdits()
+	{
+		// one scene BVH leaf per sphere, then the same field in a sphere BVH: edited spheres leave it for leaves of their own
+		for (const bool useSphereBVH : { false, true })
+		{
+			Scene_SphereField<100000> scene{ useSphereBVH ? 4096u : 0u };
+			scene.Initialize();
+			const std::string suffix{ useSphereBVH ? " (100k spheres, sphere BVH)" : " (100k spheres)" };
+
+			uint32_t seed{ 24680 };
+			auto random = [&seed]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) / float(1 << 24); };
+			auto addSphere = [&]() { return scene.AddSphere({ random() * 60.f - 30.f, random() * 5.f, random() * 60.f }, 0.1f); };
+
+			std::vector<SceneObjectHandle> handles{};
+			for (int idx{ 0 }; idx < 1000; ++idx) handles.push_back(addSphere());
+
+			RunBenchmark("Scene BVH rebuild" + suffix, 5, [&]() { scene.Rebuild(); });
+			RunBenchmark("Scene BVH remove + add 1000" + suffix, 10, [&]()
+				{
+					for (SceneObjectHandle& handle : handles)
+					{
+						scene.RemoveObject(handle);
+						handle = addSphere();
+					}
+				});
+			RunBenchmark("Scene BVH move 1000" + suffix, 10, [&]()
+				{
+					for (const SceneObjectHandle& handle : handles)
+					{
+						scene.GetSphere(handle)->origin += Vector3{ random() - 0.5f, 0.f, random() - 0.5f };
+						scene.UpdateObject(handle);
+					}
+				});
+		}
+	}
+
+	//Sphere BVH against one scene BVH leaf per sphere, on a million random spheres in a disc
+	void BenchmarkSphereBVH()
+	{
+		uint32_t seed{ 97531 };
+		auto random = [&seed]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) / float(1 << 24); };
+		std::vector<Sphere> spheres(1000000);
+		for (Sphere& sphere : spheres)
+		{
+			const float radius{ 2.f + 28.f * random() * random() }, angle{ random() * 2.f * PI };
+			sphere.origin = { radius * cosf(angle), (random() - 0.5f) * 4.f, radius * sinf(angle) };
+			sphere.radius = 0.03f + 0.05f * random();
+		}
+
+		std::vector<Ray> rays{};
+		for (int idx{ 0 }; idx < 100000; ++idx)
+		{
+			const Vector3 origin{ random() * 20.f - 10.f, 30.f, -60.f };
+			const Vector3 target{ random() * 60.f - 30.f, 0.f, random() * 60.f - 30.f };
+			rays.push_back(Ray{ origin, (target - origin).Normalized() });
+		}
+
+		SphereBVH sphereBVH{};
+		TLAS tlas{};
+		RunBenchmark("Sphere BVH build 1M spheres (all threads)", 5, [&]() { sphereBVH.Build(spheres); });
+		// more threads than cores shows what the top level synchronization costs
+		for (const uint32_t nrOfThreads : { 32u, 1u })
+		{
+			SphereBVHSettings settings{};
+			settings.nrOfBuildThreads = nrOfThreads;
+			sphereBVH.SetSettings(settings);
+			RunBenchmark("Sphere BVH build 1M spheres (" + std::to_string(nrOfThreads) + (nrOfThreads == 1 ? " thread)" : " threads)"), 5,
+				[&]() { sphereBVH.Build(spheres); });
+		}
+		RunBenchmark("Scene BVH build 1M spheres", 2, [&]() { tlas.Build({ &spheres }); });
+
+		RunBenchmark("Sphere BVH trace 100k rays (1M spheres)", 10, [&]()
+			{
+				for (const Ray& ray : rays)
+				{
+					HitRecord hit{};
+					sphereBVH.ClosestHit(ray, hit);
+				}
+			});
+		RunBenchmark("Scene BVH trace 100k rays (1M spheres)", 10, [&]()
+			{
+				for (const Ray& ray : rays)
+				{
+					HitRecord hit{};
+					GeometryUtils::HitTest_TLAS(tlas, 0, ray, hit);
+				}
+			});
+		RunBenchmark("Sphere BVH occlusion 100k rays (1M spheres)", 10, [&]()
+			{
+				for (const Ray& ray : rays) sphereBVH.AnyHit(ray);
+			});
+	}
+
+	//Grid of NrOfMeshes tiny meshes, four triangles each, either merged into the combined mesh or each with its own BVH
+	template<int NrOfMeshes, bool CombineMeshes>
+	class Scene_SmallMeshes final : public Scene
+	{
+	public:
+		void Initialize() override
+		{
+			m_Camera.origin = { 0.f, 20.f, -30.f };
+			m_Camera.fovAngle = 60.f;
+			m_Camera.forward = Vector3{ 0.f, -0.6f, 1.f }.Normalized();
+
+			const auto matLambert_GrayBlue = AddMaterial(new Material_Lambert({ 0.49f, 0.57f, 0.57f }, 1.f));
+			const auto matLambert_White = AddMaterial(new Material_Lambert(colors::White, 1.f));
+
+			AddPlane({ 0.f, 0.f, 0.f }, { 0.f, 1.f, 0.f }, matLambert_GrayBlue);
+
+			int gridSize{ 1 };
+			while (gridSize * gridSize < NrOfMeshes) ++gridSize;
+			const float spacing{ 60.f / float(gridSize) };
+			for (int idx{ 0 }; idx < NrOfMeshes; ++idx)
+			{
+				//pyramid without a bottom
+				const Vector3 base{ (idx % gridSize - gridSize / 2) * spacing, 0.f, (idx / gridSize) * spacing };
+				const float size{ spacing * 0.4f };
+				TriangleMesh* pMesh = AddTriangleMesh(TriangleCullMode::BackFaceCulling, matLambert_White);
+				pMesh->positions = { base + Vector3{ -size, 0.f, -size }, base + Vector3{ size, 0.f, -size }, base + Vector3{ size, 0.f, size },
+					base + Vector3{ -size, 0.f, size }, base + Vector3{ 0.f, size * 2.f, 0.f } };
+				pMesh->indices = { 0, 4, 1, 1, 4, 2, 2, 4, 3, 3, 4, 0 };
+				pMesh->CalculateNormals();
+				pMesh->UpdateTransforms();
+			}
+
+			AddPointLight({ 0.f, 40.f, 0.f }, 2000.f, colors::White);
+
+			m_MaxCombinedMeshTriangles = CombineMeshes ? 64 : 0;
+			BuildAccelerationStructure();
+		}
+	};
+
+	//Rays from in front of the bunny aimed at random points inside its bounds
+	std::vector<Ray> CreateBunnyRays(const aabb& bounds)
+	{
+		std::vector<Ray> rays{};
+		uint32_t seed{ 1 };
+		auto random = [&seed]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) / float(1 << 24); };
+		for (int i{ 0 }; i < 100000; ++i)
+		{
+			const Vector3 origin{ random() * 8.f - 4.f, random() * 6.f - 1.f, -6.f };
+			const Vector3 target{ bounds.bmin.x + (bounds.bmax.x - bounds.bmin.x) * random(),
+				bounds.bmin.y + (bounds.bmax.y - bounds.bmin.y) * random(),
+				bounds.bmin.z + (bounds.bmax.z - bounds.bmin.z) * random() };
+			rays.emplace_back(origin, (target - origin).Normalized());
+		}
+		return rays;
+	}
+
+	//Traces a fixed set of rays against the bunny BVH only, no shading or scene overhead.
+	//Runs once with the scalar leaf test and once with the SSE one (BVHBuildSettings::simdLeaves)
+	void BenchmarkBVHTrace()
+	{
+		TriangleMesh bunny = LoadMesh("resources/lowpoly_bunny.obj");
+		bunny.BuildBVH();
+		const std::vector<Ray> rays = CreateBunnyRays(bunny.bvh->GetBvhNode(0).aabb);
+
+		int nrOfHits{ 0 };
+		for (const bool simdLeaves : { false, true })
+		{
+			BVHBuildSettings settings{ bunny.bvh->GetBuildSettings() };
+			settings.simdLeaves = simdLeaves;
+			bunny.bvh->SetBuildSettings(settings);
+			bunny.bvh->BuildBVH();
+
+			const std::string leaves{ simdLeaves ? "SIMD leaves" : "scalar leaves" };
+			RunBenchmark("BVH trace 100k rays (bunny, " + leaves + ")", 20, [&]()
+				{
+					for (const Ray& ray : rays)
+					{
+						HitRecord hitRecord{};
+						nrOfHits += GeometryUtils::HitTest_TriangleMesh(bunny, 0, ray, hitRecord);
+					}
+				});
+
+			RunBenchmark("BVH occlusion 100k rays (bunny, " + leaves + ")", 20, [&]()
+				{
+					for (const Ray& ray : rays)
+					{
+						nrOfHits += GeometryUtils::HitTest_TriangleMesh(bunny, ray);
+					}
+				});
+		}
+	}
+
+	//Build time against trace time of the SAH builder and the LBVH, with and without treelet optimization
+	void BenchmarkBVHBuilders()
+	{
+		struct BuilderConfig
+		{
+			std::string name;
+			BVHBuilder builder;
+			bool optimizeTreelets;
+		};
+		const BuilderConfig configs[]{
+			{ "SAH", BVHBuilder::BinnedSAH, false },
+			{ "LBVH", BVHBuilder::LBVH, false },
+			{ "LBVH + treelets", BVHBuilder::LBVH, true } };
+
+		TriangleMesh bunny = LoadMesh("resources/lowpoly_bunny.obj");
+		bunny.BuildBVH();
+		const std::vector<Ray> rays = CreateBunnyRays(bunny.bvh->GetBvhNode(0).aabb);
+		TriangleMesh grid = CreateGridMesh(256);
+		grid.BuildBVH();
+
+		int nrOfHits{ 0 };
+		for (const BuilderConfig& config : configs)
+		{
+			BVHBuildSettings settings{};
+			settings.builder = config.builder;
+			settings.optimizeTreelets = config.optimizeTreelets;
+			bunny.bvh->SetBuildSettings(settings);
+			grid.bvh->SetBuildSettings(settings);
+
+			RunBenchmark(config.name + " build (bunny)", 50, [&]() { bunny.bvh->BuildBVH(); });
+			RunBenchmark(config.name + " build 131k tris", 5, [&]() { grid.bvh->BuildBVH(); });
+			RunBenchmark(config.name + " trace 100k rays (bunny)", 10, [&]()
+				{
+					for (const Ray& ray : rays)
+					{
+						HitRecord hitRecord{};
+						nrOfHits += GeometryUtils::HitTest_TriangleMesh(bunny, 0, ray, hitRecord);
+					}
+				});
+		}
+	}
+
+	//Memory against trace time of the regular BVH and the compressed one (BVHBuildSettings::compressNodes)
+	void BenchmarkCompressedBVH()
+	{
+		TriangleMesh bunny = LoadMesh("resources/lowpoly_bunny.obj");
+		bunny.BuildBVH();
+		const std::vector<Ray> rays = CreateBunnyRays(bunny.bvh->GetBvhNode(0).aabb);
+		TriangleMesh grid = CreateGridMesh(256);
+		grid.BuildBVH();
+
+		int nrOfHits{ 0 };
+		for (const bool compressNodes : { false, true })
+		{
+			BVHBuildSettings settings{};
+			settings.compressNodes = compressNodes;
+			bunny.bvh->SetBuildSettings(settings);
+			bunny.bvh->BuildBVH();
+			grid.bvh->SetBuildSettings(settings);
+			grid.bvh->BuildBVH();
+
+			const std::string name{ compressNodes ? "compressed BVH" : "BVH" };
+			RunBenchmark(name + " trace 100k rays (bunny)", 20, [&]()
+				{
+					for (const Ray& ray : rays)
+					{
+						HitRecord hitRecord{};
+						nrOfHits += GeometryUtils::HitTest_TriangleMesh(bunny, 0, ray, hitRecord);
+					}
+				});
+			RunBenchmark(name + " occlusion 100k rays (bunny)", 20, [&]()
+				{
+					for (const Ray& ray : rays)
+					{
+						nrOfHits += GeometryUtils::HitTest_TriangleMesh(bunny, ray);
+					}
+				});
+
+			const std::string memoryName{ name + " memory 131k tris" };
+			if (g_Filter.empty() || memoryName.find(g_Filter) != std::string::npos)
+			{
+				const BVHStats stats = grid.bvh->ComputeStats();
+				std::cout << std::left << std::setw(48) << memoryName
+					<< " " << std::fixed << std::setprecision(2) << (stats.nodeBytes + stats.triangleBytes) / (1024.f * 1024.f) << " MiB (nodes "
+					<< stats.nodeBytes / (1024.f * 1024.f) << " MiB, triangles " << stats.triangleBytes / (1024.f * 1024.f) << " MiB)" << std::endl;
+			}
+		}
+	}
+
+	//Trace time of the stack traversals, binary and 4-wide, against the stackless one over skip links (BVHBuildSettings::stacklessTraversal)
+	void BenchmarkStacklessBVH()
+	{
+		struct TraversalConfig
+		{
+			std::string name;
+			bool collapseToBVH4;
+			bool stacklessTraversal;
+		};
+		const TraversalConfig configs[]{
+			{ "binary stack", false, false },
+			{ "binary stackless", false, true },
+			{ "BVH4 stack", true, false } };
+
+		TriangleMesh bunny = LoadMesh("resources/lowpoly_bunny.obj");
+		bunny.BuildBVH();
+		const std::vector<Ray> bunnyRays = CreateBunnyRays(bunny.bvh->GetBvhNode(0).aabb);
+		TriangleMesh grid = CreateGridMesh(256);
+		grid.BuildBVH();
+		const std::vector<Ray> gridRays = CreateBunnyRays(grid.bvh->GetBvhNode(0).aabb);
+
+		int nrOfHits{ 0 };
+		for (const TraversalConfig& config : configs)
+		{
+			BVHBuildSettings settings{};
+			settings.collapseToBVH4 = config.collapseToBVH4;
+			settings.stacklessTraversal = config.stacklessTraversal;
+			for (TriangleMesh* pMesh : { &bunny, &grid })
+			{
+				pMesh->bvh->SetBuildSettings(settings);
+				pMesh->bvh->BuildBVH();
+			}
+
+			auto benchmarkMesh = [&](const TriangleMesh& mesh, const std::vector<Ray>& rays, const std::string& meshName)
+				{
+					RunBenchmark(config.name + " trace 100k rays (" + meshName + ")", 10, [&]()
+						{
+							for (const Ray& ray : rays)
+							{
+								HitRecord hitRecord{};
+								nrOfHits += GeometryUtils::HitTest_TriangleMesh(mesh, 0, ray, hitRecord);
+							}
+						});
+					RunBenchmark(config.name + " occlusion 100k rays (" + meshName + ")", 10, [&]()
+						{
+							for (const Ray& ray : rays)
+							{
+								nrOfHits += GeometryUtils::HitTest_TriangleMesh(mesh, ray);
+							}
+						});
+				};
+			benchmarkMesh(bunny, bunnyRays, "bunny");
+			benchmarkMesh(grid, gridRays, "131k tris");
+		}
+	}
+
+	//Small randomly oriented triangles spread evenly through a box, the case uniform grids are made for
+	TriangleMesh CreateParticleMesh(int nrOfParticles)
+	{
+		TriangleMesh mesh{};
+		mesh.cullMode = TriangleCullMode::NoCulling;
+		uint32_t seed{ 11 };
+		auto random = [&seed]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) / float(1 << 24); };
+		for (int i{ 0 }; i < nrOfParticles; ++i)
+		{
+			const Vector3 center{ random() * 8.f - 4.f, random() * 6.f - 1.f, random() * 8.f };
+			const int firstIdx{ int(mesh.positions.size()) };
+			for (int vertex{ 0 }; vertex < 3; ++vertex)
+			{
+				mesh.positions.push_back(center + Vector3{ random() - 0.5f, random() - 0.5f, random() - 0.5f } * 0.2f);
+			}
+			mesh.indices.insert(mesh.indices.end(), { firstIdx, firstIdx + 1, firstIdx + 2 });
+		}
+		mesh.CalculateNormals();
+		mesh.UpdateTransforms();
+		return mesh;
+	}
+
+	//Floor and walls of a 4x4 block of rooms made of a few large quads, with small boxes of clutter on the floor.
+	//Large and tiny triangles side by side, where a uniform grid can't pick one good cell size
+	TriangleMesh CreateRoomsMesh(int nrOfBoxes)
+	{
+		TriangleMesh mesh{};
+		mesh.cullMode = TriangleCullMode::NoCulling;
+		auto addQuad = [&mesh](const Vector3& corner, const Vector3& side0, const Vector3& side1)
+			{
+				const int firstIdx{ int(mesh.positions.size()) };
+				mesh.positions.insert(mesh.positions.end(), { corner, corner + side0, corner + side0 + side1, corner + side1 });
+				mesh.indices.insert(mesh.indices.end(), { firstIdx, firstIdx + 1, firstIdx + 2, firstIdx, firstIdx + 2, firstIdx + 3 });
+			};
+
+		const float roomSize{ 5.f }, wallHeight{ 3.f }, doorWidth{ 1.f };
+		addQuad({ -10.f, 0.f, 0.f }, { 20.f, 0.f, 0.f }, { 0.f, 0.f, 20.f });
+		for (int line{ 0 }; line <= 4; ++line)
+		{
+			for (int room{ 0 }; room < 4; ++room)
+			{
+				//every wall segment has a doorway in the middle
+				const float start{ room * roomSize }, doorStart{ start + (roomSize - doorWidth) * 0.5f };
+				for (const auto& [from, length] : { std::pair{ start, doorStart - start }, std::pair{ doorStart + doorWidth, start + roomSize - doorStart - doorWidth } })
+				{
+					addQuad({ -10.f + from, 0.f, line * roomSize }, { length, 0.f, 0.f }, { 0.f, wallHeight, 0.f });
+					addQuad({ -10.f + line * roomSize, 0.f, from }, { 0.f, 0.f, length }, { 0.f, wallHeight, 0.f });
+				}
+			}
+		}
+
+		uint32_t seed{ 5 };
+		auto random = [&seed]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) / float(1 << 24); };
+		for (int i{ 0 }; i < nrOfBoxes; ++i)
+		{
+			const Vector3 corner{ random() * 19.f - 9.5f, 0.f, random() * 19.f + 0.5f };
+			const float size{ 0.1f + random() * 0.2f };
+			const Vector3 x{ size, 0.f, 0.f }, y{ 0.f, size, 0.f }, z{ 0.f, 0.f, size };
+			addQuad(corner, x, z);
+			addQuad(corner + y, x, z);
+			addQuad(corner, x, y);
+			addQuad(corner + z, x, y);
+			addQuad(corner, z, y);
+			addQuad(corner + x, z, y);
+		}
+		mesh.CalculateNormals();
+		mesh.UpdateTransforms();
+		return mesh;
+	}
+
+	//Build time, trace time and memory of the BVH, kd-tree and uniform grid (MeshAccelerator) on the bunny,
+	//on evenly spread particles and on rooms with clutter
+	void BenchmarkAccelerators()
+	{
+		struct TestMesh
+		{
+			std::string name;
+			TriangleMesh mesh;
+		};
+		TestMesh meshes[]{ { "bunny", LoadMesh("resources/lowpoly_bunny.obj") }, { "20k particles", CreateParticleMesh(20000) },
+			{ "rooms + 24k clutter", CreateRoomsMesh(2000) } };
+
+		int nrOfHits{ 0 };
+		for (TestMesh& testMesh : meshes)
+		{
+			TriangleMesh& mesh = testMesh.mesh;
+			for (const AcceleratorType type : { AcceleratorType::BVH, AcceleratorType::KdTree, AcceleratorType::Grid })
+			{
+				mesh.BuildAccelerator(type);
+				const std::vector<Ray> rays = CreateBunnyRays(mesh.accelerator->GetBounds());
+
+				const std::string name{ std::string(GetAcceleratorName(type)) + " (" + testMesh.name + ")" };
+				RunBenchmark(name + " build", 5, [&]() { mesh.accelerator->Build(); });
+				RunBenchmark(name + " trace 100k rays", 10, [&]()
+					{
+						for (const Ray& ray : rays)
+						{
+							HitRecord hitRecord{};
+							nrOfHits += GeometryUtils::HitTest_TriangleMesh(mesh, 0, ray, hitRecord);
+						}
+					});
+				RunBenchmark(name + " occlusion 100k rays", 10, [&]()
+					{
+						for (const Ray& ray : rays)
+						{
+							nrOfHits += GeometryUtils::HitTest_TriangleMesh(mesh, ray);
+						}
+					});
+
+				if (g_Filter.empty() || name.find(g_Filter) != std::string::npos)
+				{
+					std::cout << std::left << std::setw(48) << name + " memory"
+						<< " " << std::right << std::setw(10) << std::setprecision(1) << mesh.accelerator->GetMemoryBytes() / 1024.f << " KiB" << std::endl;
+				}
+
+				mesh.ClearAccelerator();
+			}
+		}
+	}
+
+	//Long narrow planks running diagonally through the whole scene, their bounds overlap a lot
+	TriangleMesh CreatePlankMesh(int nrOfPlanks)
+	{
+		TriangleMesh mesh{};
+		mesh.cullMode = TriangleCullMode::NoCulling;
+		uint32_t seed{ 7 };
+		auto random = [&seed]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) / float(1 << 24); };
+		for (int i{ 0 }; i < nrOfPlanks; ++i)
+		{
+			const float height{ random() * 10.f }, offset{ random() * 20.f - 10.f };
+			const Vector3 start{ -10.f + offset, height, -10.f - offset }, end{ 10.f + offset, height, 10.f - offset }, width{ 0.3f, 0.f, -0.3f };
+			const int firstIdx{ int(mesh.positions.size()) };
+			mesh.positions.insert(mesh.positions.end(), { start, end, end + width, start + width });
+			mesh.indices.insert(mesh.indices.end(), { firstIdx, firstIdx + 1, firstIdx + 2, firstIdx, firstIdx + 2, firstIdx + 3 });
+		}
+		mesh.CalculateNormals();
+		mesh.UpdateTransforms();
+		return mesh;
+	}
+
+	//Tree quality and trace time of the SAH builder against the SBVH, on the bunny and on diagonal planks
+	void BenchmarkSBVH()
+	{
+		struct TestMesh
+		{
+			std::string name;
+			TriangleMesh mesh;
+		};
+		TestMesh meshes[]{ { "bunny", LoadMesh("resources/lowpoly_bunny.obj") }, { "4k plank tris", CreatePlankMesh(2000) } };
+
+		int nrOfHits{ 0 };
+		for (TestMesh& testMesh : meshes)
+		{
+			TriangleMesh& mesh = testMesh.mesh;
+			mesh.BuildBVH();
+			const std::vector<Ray> rays = CreateBunnyRays(mesh.bvh->GetBvhNode(0).aabb);
+
+			for (const BVHBuilder builder : { BVHBuilder::BinnedSAH, BVHBuilder::SBVH })
+			{
+				BVHBuildSettings settings{};
+				settings.builder = builder;
+				mesh.bvh->SetBuildSettings(settings);
+
+				const std::string name{ std::string(builder == BVHBuilder::SBVH ? "SBVH" : "SAH") + " (" + testMesh.name + ")" };
+				RunBenchmark(name + " build", 5, [&]() { mesh.bvh->BuildBVH(); });
+				RunBenchmark(name + " trace 100k rays", 10, [&]()
+					{
+						for (const Ray& ray : rays)
+						{
+							HitRecord hitRecord{};
+							nrOfHits += GeometryUtils::HitTest_TriangleMesh(mesh, 0, ray, hitRecord);
+						}
+					});
+
+				if (g_Filter.empty() || name.find(g_Filter) != std::string::npos)
+				{
+					mesh.bvh->BuildBVH();
+					std::cout << std::left << std::setw(48) << name + " tree"
+						<< " SAH cost " << std::setprecision(2) << mesh.bvh->ComputeSAHCost()
+						<< "   overlap " << mesh.bvh->ComputeOverlap()
+						<< "   references " << mesh.bvh->GetReferenceCount() << std::endl;
+				}
+			}
+		}
+	}
+
+	template<typename SceneType>
+	void BenchmarkRender(const std::string& name, uint32_t nrOfThreads, int iterations = 10)
+	{
+		SceneType scene{};
+		scene.Initialize();
+
+		Renderer renderer{ 640, 480, nrOfThreads };
+		RunBenchmark(name, iterations, [&]()
+			{
+				renderer.Render(&scene);
+			});
+	}
+
+	//The per-pixel std::execution::par loop the renderer used before the tile scheduler, against the scheduler at several tile sizes
+	template<typename SceneType>
+	void BenchmarkRenderScheduling(const std::string& name)
+	{
+		SceneType scene{};
+		scene.Initialize();
+
+		Renderer perPixelRenderer{ 640, 480, 0 };
+		std::vector<uint32_t> pixelIndices(640 * 480);
+		for (uint32_t idx{ 0 }; idx < uint32_t(pixelIndices.size()); ++idx) pixelIndices[idx] = idx;
+		RunBenchmark(name + " per pixel (std::execution::par)", 5, [&]()
+			{
+				Camera& camera = scene.GetCamera();
+				const Matrix cameraToWorld = camera.CalculateCameraToWorld();
+				std::for_each(std::execution::par, pixelIndices.begin(), pixelIndices.end(), [&](uint32_t pixelIdx)
+					{
+						perPixelRenderer.RenderPixel(&scene, pixelIdx, camera.FOV, 640.f / 480.f, cameraToWorld, camera.origin);
+					});
+			});
+
+		for (const uint32_t tileSize : { 4u, 8u, 16u, 32u, 64u })
+		{
+			Renderer renderer{ 640, 480, 0, tileSize };
+			RunBenchmark(name + " tiles " + std::to_string(tileSize) + "x" + std::to_string(tileSize), 5, [&]() { renderer.Render(&scene); });
+		}
+	}
+
+	//Renders with and without shadow rays, the difference is the time spent on shadow rays
+	template<typename SceneType>
+	void BenchmarkShadowShare(const std::string& name)
+	{
+		SceneType scene{};
+		scene.Initialize();
+
+		Renderer renderer{ 640, 480, 0 };
+		const double withShadows = RunBenchmark(name + " shadows on", 5, [&]() { renderer.Render(&scene); });
+		renderer.ToggleShadows();
+		const double withoutShadows = RunBenchmark(name + " shadows off", 5, [&]() { renderer.Render(&scene); });
+
+		if (withShadows > 0.0 && withoutShadows > 0.0)
+		{
+			std::cout << std::left << std::setw(48) << name + " shadow ray share"
+				<< "     " << std::right << std::setw(10) << std::setprecision(1) << 100.0 * (withShadows - withoutShadows) / withShadows << " %" << std::endl;
+		}
+	}
+}
+
+int main(int argc, char* args[])
+{
+	if (argc > 1) g_Filter = args[1];
+
+	BenchmarkBVHBuild();
+	BenchmarkBVHTrace();
+	BenchmarkBVHBuilders();
+	BenchmarkSBVH();
+	BenchmarkCompressedBVH();
+	BenchmarkStacklessBVH();
+	BenchmarkAccelerators();
+	BenchmarkSceneEdits();
+	BenchmarkSphereBVH();
+
+	BenchmarkRender<Scene_W4_ReferenceScene>("Render W4_Reference 640x480", 0);
+	BenchmarkRender<Scene_W4_Bunny>("Render W4_Bunny 640x480", 0);
+	BenchmarkRender<Scene_W4_Bunny>("Render W4_Bunny 640x480 (1 thread)", 1);
+	BenchmarkRender<Scene_W4_InstancedBunnies>("Render W4_Instanced 640x480", 0);
+
+	BenchmarkRenderScheduling<Scene_W4_ReferenceScene>("Render W4_Reference 640x480");
+	BenchmarkRenderScheduling<Scene_W4_Bunny>("Render W4_Bunny 640x480");
+
+	BenchmarkShadowShare<Scene_W4_ReferenceScene>("Render W4_Reference");
+	BenchmarkShadowShare<Scene_W4_Bunny>("Render W4_Bunny");
+
+	BenchmarkRender<Scene_SphereField<100>>("Render 100 spheres 640x480", 0, 3);
+	BenchmarkRender<Scene_SphereField<1000>>("Render 1000 spheres 640x480", 0, 3);
+	BenchmarkRender<Scene_SphereField<10000>>("Render 10000 spheres 640x480", 0, 3);
+	BenchmarkRender<Scene_Particles>("Render Particles 640x480 (1M spheres)", 0, 3);
+
+	BenchmarkRender<Scene_SmallMeshes<1000, false>>("Render 1000 small meshes 640x480", 0, 3);
+	BenchmarkRender<Scene_SmallMeshes<1000, true>>("Render 1000 small meshes combined 640x480", 0, 3);
+	BenchmarkRender<Scene_SmallMeshes<10000, false>>("Render 10000 small meshes 640x480", 0, 3);
+	BenchmarkRender<Scene_SmallMeshes<10000, true>>("Render 10000 small meshes combined 640x480", 0, 3);
+
+	return 0;
+}
@@ -1,52 +1,456 @@
 #include "BVH.h"
 
+#include <algorithm>
+#include <bit>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
 #include <iostream>
+#include <thread>
 
+#include "BVHCache.h"
 #include "DataTypes.h"
+#include "Utils.h"
 
+namespace
+{
+	// Spreads the lower 10 bits of v out to every third bit
+	uint32_t ExpandBits(uint32_t v)
+	{
+		v = (v * 0x00010001u) & 0xFF0000FFu;
+		v = (v * 0x00000101u) & 0x0F00F00Fu;
+		v = (v * 0x00000011u) & 0xC30C30C3u;
+		v = (v * 0x00000005u) & 0x49249249u;
+		return v;
+	}
+
+	// Bounds of the part of a triangle between two planes on one axis, empty when it doesn't reach in between
+	aabb ClipTriangle(const Tri& triangle, int axis, float planeMin, float planeMax)
+	{
+		const dae::Vector3 vertices[3]{ triangle.vertex0, triangle.vertex1, triangle.vertex2 };
+		aabb bounds{};
+		for (int i = 0; i < 3; i++)
+		{
+			const dae::Vector3& start = vertices[i];
+			const dae::Vector3& end = vertices[(i + 1) % 3];
+			if (start[axis] >= planeMin && start[axis] <= planeMax) bounds.grow(start);
+
+			// points where the edge crosses either plane
+			for (const float plane : { planeMin, planeMax })
+			{
+				if ((start[axis] < plane) == (end[axis] < plane) || start[axis] == plane || end[axis] == plane) continue;
+
+				dae::Vector3 crossing = start + (end - start) * ((plane - start[axis]) / (end[axis] - start[axis]));
+				crossing[axis] = plane;
+				bounds.grow(crossing);
+			}
+		}
+		return bounds;
+	}
+
+	aabb Intersection(const aabb& a, const aabb& b)
+	{
+		return aabb{ dae::Vector3::Max(a.bmin, b.bmin), dae::Vector3::Min(a.bmax, b.bmax) };
+	}
+
+	bool IsEmpty(const aabb& bounds)
+	{
+		return bounds.bmin.x > bounds.bmax.x || bounds.bmin.y > bounds.bmax.y || bounds.bmin.z > bounds.bmax.z;
+	}
 
-BVH::BVH(dae::TriangleMesh* triangleMesh) :mesh{ triangleMesh }
+	float GetSpacing(int exponent)
+	{
+		return std::bit_cast<float>(uint32_t(exponent + 127) << 23);
+	}
+
+	// Rounds the child boxes outwards onto a power of two grid over the node box. Decoding is one exact
+	// multiply and one add, done the same way here, so the rounding can be checked instead of assumed
+	BVH4QuantizedNode QuantizeNode(const BVH4Node& node)
+	{
+		BVH4QuantizedNode quantized{};
+		quantized.childCount = uint8_t(node.childCount);
+		const float* bmin[3]{ node.bminX, node.bminY, node.bminZ };
+		const float* bmax[3]{ node.bmaxX, node.bmaxY, node.bmaxZ };
+		uint8_t* qmin[3]{ quantized.qminX, quantized.qminY, quantized.qminZ };
+		uint8_t* qmax[3]{ quantized.qmaxX, quantized.qmaxY, quantized.qmaxZ };
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float low = FLT_MAX, high = -FLT_MAX;
+			for (uint32_t i = 0; i < node.childCount; i++)
+			{
+				low = std::min(low, bmin[axis][i]);
+				high = std::max(high, bmax[axis][i]);
+			}
+
+			// the smallest spacing whose 255 steps still reach the top of the node
+			int exponent = high > low ? int(std::ceil(std::log2((high - low) / 255.f))) : -126;
+			exponent = std::clamp(exponent, -126, 127);
+			while (exponent < 127 && low + 255.f * GetSpacing(exponent) < high) exponent++;
+			const float spacing = GetSpacing(exponent);
+			quantized.origin[axis] = low;
+			quantized.exponent[axis] = int8_t(exponent);
+
+			for (uint32_t i = 0; i < node.childCount; i++)
+			{
+				int lower = std::clamp(int(std::floor((bmin[axis][i] - low) / spacing)), 0, 255);
+				int upper = std::clamp(int(std::ceil((bmax[axis][i] - low) / spacing)), 0, 255);
+				while (lower > 0 && low + float(lower) * spacing > bmin[axis][i]) lower--;
+				while (upper < 255 && low + float(upper) * spacing < bmax[axis][i]) upper++;
+				qmin[axis][i] = uint8_t(lower);
+				qmax[axis][i] = uint8_t(upper);
+			}
+		}
+
+		for (uint32_t i = 0; i < node.childCount; i++)
+		{
+			quantized.child[i] = node.child[i];
+			quantized.triCount[i] = uint16_t(node.triCount[i]);
+		}
+		return quantized;
+	}
+
+	// 30-bit Morton code of a point already scaled to [0, 1024) on every axis
+	uint32_t MortonCode(float x, float y, float z)
+	{
+		const auto quantize = [](float value) { return uint32_t(std::clamp(value, 0.f, 1023.f)); };
+		return (ExpandBits(quantize(x)) << 2) | (ExpandBits(quantize(y)) << 1) | ExpandBits(quantize(z));
+	}
+}
+
+
+BVH::BVH(dae::TriangleMesh* triangleMesh, const BVHBuildSettings& settings) :mesh{ triangleMesh }, settings{ settings }
 {
 	NrOfTriangles = triangleMesh->normals.size();
 	tri.resize(NrOfTriangles);
-	bvhNodes.resize(NrOfTriangles * 2 - 1);
+	triIntersect.resize(NrOfTriangles);
 }
 
+BVH::~BVH() = default;
+
 void BVH::BuildBVH()
 {
+	const auto buildStart = std::chrono::steady_clock::now();
+	const uint32_t nrOfThreads = GetBuildThreadCount();
+	pCacheFile.reset();
+
+	// an SBVH may have left duplicated references behind
+	tri.resize(NrOfTriangles);
+	triIntersect.resize(NrOfTriangles);
+
+	// worst case capacity during the build, trimmed to the nodes actually used afterwards. The capacity stays for the next rebuild
+	bvhNodes.resize(NrOfTriangles * 2 - 1);
 	nodesUsed = 1;
-	for (int i = 0; i < NrOfTriangles; i++)
-	{
-		tri[i].vertex0 = mesh->transformedPositions[mesh->indices[(i * 3)]];
-		tri[i].vertex1 = mesh->transformedPositions[mesh->indices[(i * 3) + 1]];
-		tri[i].vertex2 = mesh->transformedPositions[mesh->indices[(i * 3) + 2]];
-		tri[i].normals = mesh->transformedNormals[i];
-		tri[i].centroid = (tri[i].vertex0 + tri[i].vertex1 + tri[i].vertex2) * 0.3333f;
-	}
+	GetWorkerPool(nrOfThreads).ParallelForSlices(0, NrOfTriangles, nrOfThreads, [this](uint32_t, uint32_t first, uint32_t end)
+		{
+			for (uint32_t i = first; i < end; i++) LoadTriangle(i, i);
+		});
 
 	// assign all triangles to root node
 	BVHNode& root = bvhNodes[rootNodeIdx];
-	root.leftNode = 0;
 	root.firstTriIdx = 0, root.triCount = NrOfTriangles;
 	UpdateNodeBounds(rootNodeIdx);
- 
-	Subdivide(rootNodeIdx);
 
-	//std::cout << nodesUsed << std::endl;
-	//uint32_t maxTriangles{ 0 };
-	//uint32_t minTriangles{ 999 };
+	aabb centroidBounds{};
+	for (int i = 0; i < NrOfTriangles; i++) centroidBounds.grow(tri[i].centroid);
+
+	if (settings.builder == BVHBuilder::LBVH)
+	{
+		BuildLBVH(centroidBounds, nrOfThreads);
+	}
+	else if (settings.builder == BVHBuilder::SBVH)
+	{
+		BuildSBVH();
+	}
+	else if (nrOfThreads > 1)
+	{
+		// split the top levels with parallel binning, then build the subtrees below them as independent tasks
+		buildTasks.clear();
+		SubdivideTopLevel(rootNodeIdx, centroidBounds, nrOfThreads, buildTasks);
+		GetWorkerPool(nrOfThreads).ParallelFor(uint32_t(buildTasks.size()), [this](uint32_t taskIdx)
+			{
+				BuildTask& task = buildTasks[taskIdx];
+				uint32_t nodeCounter = task.nodeIdx + 1;
+				Subdivide(task.nodeIdx, task.centroidBounds, nodeCounter);
+				task.nodeCount = nodeCounter - task.nodeIdx;
+			});
+
+		// the reserved ranges are only partly used, copying the tree depth-first closes the gaps.
+		// Both arrays keep the worst case capacity, swapping them leaves nothing to allocate on the next build
+		for (const BuildTask& task : buildTasks) nodesUsed += task.nodeCount - 1;
+		compactNodes.clear();
+		compactNodes.reserve(bvhNodes.size());
+		CopySubtree(rootNodeIdx, compactNodes);
+		bvhNodes.swap(compactNodes);
+	}
+	else
+	{
+		Subdivide(rootNodeIdx, centroidBounds);
+		bvhNodes.resize(nodesUsed);
+	}
+	UpdateViews();
+	buildSAHCost = ComputeSAHCost();
+	UpdateIntersectionData();
+	UpdateTriCullModes();
+
+	BuildTraversalNodes();
+	buildTimeMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - buildStart).count();
+}
+
+void BVH::Refit()
+{
+	// a compressed tree has dropped the triangle data refitting works on
+	if (HasQuantizedNodes())
+	{
+		BuildBVH();
+		return;
+	}
+
+	// a mapped tree is read-only, refitting works on a private copy
+	if (pCacheFile) CopyCacheFile();
+
+	for (uint32_t i = 0; i < uint32_t(tri.size()); i++) LoadTriangle(i, tri[i].meshTriIdx);
+	UpdateIntersectionData();
 
-	//for (int i{0}; i < nodesUsed; i++)
-	//{
-	//	std::cout << "Nr of node: " << i << std::endl;
-	//	std::cout << "Nr of triangles: " << bvhNodes[i].triCount << std::endl;
-	//	std::cout << "Left Child Idx: " << bvhNodes[i].leftNode << std::endl<< std::endl;
-	//	maxTriangles = std::max(maxTriangles, bvhNodes[i].triCount);
-	//	minTriangles = std::min(minTriangles, bvhNodes[i].triCount);
-	//}
-	//std::cout << "Max Nr of triangles: " << maxTriangles << std::endl;
-	//std::cout << "Min Nr of triangles: " << minTriangles << std::endl;
+	// children are always stored after their parent, so a reverse sweep is bottom-up
+	for (int nodeIdx = nodesUsed - 1; nodeIdx >= 0; nodeIdx--)
+	{
+		BVHNode& node = bvhNodes[nodeIdx];
+		if (node.IsLeaf())
+		{
+			UpdateNodeBounds(nodeIdx);
+			continue;
+		}
+
+		node.aabb = bvhNodes[nodeIdx + 1].aabb;
+		node.aabb.grow(bvhNodes[node.rightNode].aabb);
+	}
+
+	if (ComputeSAHCost() > buildSAHCost * settings.maxRefitCostRatio) BuildBVH();
+	else BuildTraversalNodes();
+}
+
+float BVH::ComputeSAHCost() const
+{
+	// expected cost of a random ray hitting the root, relative to the root's surface area
+	const float rootArea = pNodes[rootNodeIdx].aabb.halfArea();
+	if (rootArea <= 0) return 0;
 
+	float cost = 0;
+	for (uint32_t nodeIdx = 0; nodeIdx < nodesUsed; nodeIdx++)
+	{
+		const BVHNode& node = pNodes[nodeIdx];
+		const float nodeCost = node.IsLeaf() ? GetLeafCost(node.triCount) : settings.traversalCost;
+		cost += nodeCost * node.aabb.halfArea();
+	}
+	return cost / rootArea;
+}
+
+float BVH::ComputeOverlap() const
+{
+	const float rootArea = pNodes[rootNodeIdx].aabb.halfArea();
+	if (rootArea <= 0) return 0;
+
+	float overlap = 0;
+	for (uint32_t nodeIdx = 0; nodeIdx < nodesUsed; nodeIdx++)
+	{
+		const BVHNode& node = pNodes[nodeIdx];
+		if (node.IsLeaf()) continue;
+
+		const aabb siblingOverlap = Intersection(pNodes[nodeIdx + 1].aabb, pNodes[node.rightNode].aabb);
+		if (!IsEmpty(siblingOverlap)) overlap += siblingOverlap.halfArea();
+	}
+	return overlap / rootArea;
+}
+
+BVHStats BVH::ComputeStats() const
+{
+	BVHStats stats{};
+	stats.nodeCount = nodesUsed;
+	stats.triangleCount = uint32_t(NrOfTriangles);
+	stats.referenceCount = referenceCount;
+	stats.sahCost = ComputeSAHCost();
+	stats.overlap = ComputeOverlap();
+	stats.nodeBytes = ComputeNodeBytes();
+	stats.triangleBytes = ComputeTriangleBytes();
+	stats.buildTimeMs = buildTimeMs;
+	stats.mappedFromCache = IsMappedFromCache();
+
+	// children are stored after their parent, so one forward sweep hands every node its depth
+	std::vector<uint32_t> depths(nodesUsed, 0);
+	uint64_t summedLeafDepth = 0;
+	for (uint32_t nodeIdx = rootNodeIdx; nodeIdx < nodesUsed; nodeIdx++)
+	{
+		const BVHNode& node = pNodes[nodeIdx];
+		const uint32_t depth = depths[nodeIdx];
+		if (!node.IsLeaf())
+		{
+			depths[nodeIdx + 1] = depths[node.rightNode] = depth + 1;
+			continue;
+		}
+
+		stats.leafCount++;
+		stats.maxDepth = std::max(stats.maxDepth, depth);
+		summedLeafDepth += depth;
+		if (stats.leavesPerDepth.size() <= depth) stats.leavesPerDepth.resize(depth + 1);
+		if (stats.leavesPerSize.size() <= node.triCount) stats.leavesPerSize.resize(node.triCount + 1);
+		stats.leavesPerDepth[depth]++;
+		stats.leavesPerSize[node.triCount]++;
+	}
+
+	if (stats.leafCount > 0)
+	{
+		stats.averageLeafDepth = float(summedLeafDepth) / stats.leafCount;
+		stats.averageLeafSize = float(referenceCount) / stats.leafCount;
+	}
+	return stats;
+}
+
+size_t BVH::ComputeNodeBytes() const
+{
+	return nodesUsed * sizeof(BVHNode) + skipNodeCount * sizeof(BVHSkipNode) + bvh4NodeCount * sizeof(BVH4Node) +
+		quantizedNodeCount * sizeof(BVH4QuantizedNode);
+}
+
+size_t BVH::ComputeTriangleBytes() const
+{
+	if (HasQuantizedNodes()) return referenceCount * sizeof(uint32_t);
+	return referenceCount * (sizeof(Tri) + sizeof(TriIntersect)) + triGroupCount * sizeof(TriIntersect4) +
+		(triGroupCount > 0 ? referenceCount * sizeof(uint32_t) : 0) + triCullModeCount;
+}
+
+bool BVH::ClosestHit(const dae::Ray& ray, dae::HitRecord& hitRecord) const
+{
+	dae::GeometryUtils::HitTest_TriangleMesh(*mesh, 0, ray, hitRecord);
+	return hitRecord.didHit;
+}
+
+bool BVH::AnyHit(const dae::Ray& ray) const
+{
+	return dae::GeometryUtils::HitTest_TriangleMesh(*mesh, ray);
+}
+
+void BVHStats::Print(std::ostream& out) const
+{
+	// histograms are drawn as bars relative to their largest bucket
+	auto printHistogram = [&out](const char* label, const std::vector<uint32_t>& buckets)
+		{
+			const uint32_t largest = buckets.empty() ? 0 : *std::max_element(buckets.begin(), buckets.end());
+			for (size_t bucket = 0; bucket < buckets.size(); bucket++)
+			{
+				if (buckets[bucket] == 0) continue;
+				out << "    " << label << " " << std::setw(3) << bucket << ": " << std::setw(7) << buckets[bucket] << " "
+					<< std::string(size_t(40.f * buckets[bucket] / largest + 0.5f), '#') << "\n";
+			}
+		};
+
+	const std::ios_base::fmtflags flags = out.flags();
+	const std::streamsize precision = out.precision();
+	out << std::fixed << std::setprecision(2)
+		<< "  triangles " << triangleCount << ", references " << referenceCount << "\n"
+		<< "  nodes " << nodeCount << ", leaves " << leafCount << "\n"
+		<< "  SAH cost " << sahCost << ", overlap " << overlap << "\n"
+		<< "  depth max " << maxDepth << ", leaf average " << averageLeafDepth << "\n"
+		<< "  leaf size average " << averageLeafSize << "\n"
+		<< "  memory " << (nodeBytes + triangleBytes) / 1024.f << " KiB (nodes " << nodeBytes / 1024.f
+		<< " KiB, triangles " << triangleBytes / 1024.f << " KiB)\n"
+		<< "  " << (mappedFromCache ? "mapped from cache in " : "built in ") << buildTimeMs << " ms\n"
+		<< "  leaves per depth\n";
+	printHistogram("depth", leavesPerDepth);
+	out << "  leaves per size\n";
+	printHistogram("size ", leavesPerSize);
+	out.flags(flags);
+	out.precision(precision);
+}
+
+void BVH::DumpTree(std::ostream& out) const
+{
+	out << "# nodes " << nodesUsed << ", triangles " << NrOfTriangles << ", references " << referenceCount << "\n"
+		<< "# node bminX bminY bminZ bmaxX bmaxY bmaxZ inner <left> <right> | leaf <count> <mesh triangles>\n";
+	out << std::setprecision(9);
+	for (uint32_t nodeIdx = 0; nodeIdx < nodesUsed; nodeIdx++)
+	{
+		const BVHNode& node = pNodes[nodeIdx];
+		out << nodeIdx << " " << node.aabb.bmin.x << " " << node.aabb.bmin.y << " " << node.aabb.bmin.z << " "
+			<< node.aabb.bmax.x << " " << node.aabb.bmax.y << " " << node.aabb.bmax.z;
+		if (!node.IsLeaf())
+		{
+			out << " inner " << nodeIdx + 1 << " " << node.rightNode << "\n";
+			continue;
+		}
+
+		out << " leaf " << node.triCount;
+		for (uint32_t i = 0; i < node.triCount; i++)
+			out << " " << (HasQuantizedNodes() ? pLeafMeshTriIndices[node.firstTriIdx + i] : pTri[node.firstTriIdx + i].meshTriIdx);
+		out << "\n";
+	}
+}
+
+void BVH::LoadTriangle(uint32_t triIdx, uint32_t meshTriIdx)
+{
+	Tri& triangle = tri[triIdx];
+	triangle.vertex0 = mesh->transformedPositions[mesh->indices[(meshTriIdx * 3)]];
+	triangle.vertex1 = mesh->transformedPositions[mesh->indices[(meshTriIdx * 3) + 1]];
+	triangle.vertex2 = mesh->transformedPositions[mesh->indices[(meshTriIdx * 3) + 2]];
+	triangle.normals = mesh->transformedNormals[meshTriIdx].Normalized();
+	triangle.centroid = (triangle.vertex0 + triangle.vertex1 + triangle.vertex2) * 0.3333f;
+	triangle.meshTriIdx = meshTriIdx;
+}
+
+void BVH::UpdateIntersectionData()
+{
+	for (size_t i = 0; i < tri.size(); i++)
+	{
+		const Tri& triangle = tri[i];
+		triIntersect[i].vertex0 = triangle.vertex0;
+		triIntersect[i].edge1 = triangle.vertex1 - triangle.vertex0;
+		triIntersect[i].edge2 = triangle.vertex2 - triangle.vertex0;
+	}
+
+	triGroups.clear();
+	if (!settings.simdLeaves)
+	{
+		leafFirstGroup.clear();
+		return;
+	}
+
+	// pack every leaf into whole groups of four, the node topology is already final here
+	leafFirstGroup.resize(tri.size());
+	for (uint32_t nodeIdx = 0; nodeIdx < nodesUsed; nodeIdx++)
+	{
+		const BVHNode& node = bvhNodes[nodeIdx];
+		if (!node.IsLeaf()) continue;
+
+		leafFirstGroup[node.firstTriIdx] = uint32_t(triGroups.size());
+		for (uint32_t i = 0; i < node.triCount; i++)
+		{
+			if (i % 4 == 0) triGroups.emplace_back();
+
+			const TriIntersect& triangle = triIntersect[node.firstTriIdx + i];
+			TriIntersect4& group = triGroups.back();
+			const uint32_t lane = i % 4;
+			group.vertex0X[lane] = triangle.vertex0.x, group.vertex0Y[lane] = triangle.vertex0.y, group.vertex0Z[lane] = triangle.vertex0.z;
+			group.edge1X[lane] = triangle.edge1.x, group.edge1Y[lane] = triangle.edge1.y, group.edge1Z[lane] = triangle.edge1.z;
+			group.edge2X[lane] = triangle.edge2.x, group.edge2Y[lane] = triangle.edge2.y, group.edge2Z[lane] = triangle.edge2.z;
+		}
+	}
+}
+
+void BVH::UpdateTriCullModes()
+{
+	// packed in leaf order so the leaf tests don't have to go through the cold triangle data
+	triCullModes.clear();
+	if (mesh->triangleCullModes.empty()) return;
+
+	triCullModes.resize(tri.size());
+	for (size_t i = 0; i < tri.size(); i++) triCullModes[i] = uint8_t(mesh->triangleCullModes[tri[i].meshTriIdx]);
+}
+
+float BVH::GetLeafCost(uint32_t triCount) const
+{
+	if (settings.simdLeaves) return settings.groupIntersectionCost * float((triCount + 3) / 4);
+	return settings.intersectionCost * float(triCount);
 }
 
 void BVH::UpdateNodeBounds(uint32_t const nodeIdx)
@@ -67,42 +471,107 @@ void BVH::UpdateNodeBounds(uint32_t const nodeIdx)
 	}
 }
 
-void BVH::Subdivide(uint32_t const nodeIdx)
+uint32_t BVH::GetBuildThreadCount() const
 {
-	// terminate recursion
+	// starting threads costs more than it saves on meshes that fit in a single task
+	if (uint32_t(NrOfTriangles) < 2 * settings.minTrianglesPerBuildTask) return 1;
+	return settings.nrOfBuildThreads > 0 ? settings.nrOfBuildThreads : std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+dae::WorkerPool& BVH::GetWorkerPool(uint32_t nrOfThreads)
+{
+	if (!workerPool || workerPool->GetNrOfWorkers() != nrOfThreads) workerPool = std::make_unique<dae::WorkerPool>(nrOfThreads);
+	return *workerPool;
+}
+
+void BVH::Subdivide(uint32_t const nodeIdx, const aabb& centroidBounds)
+{
+	Subdivide(nodeIdx, centroidBounds, nodesUsed);
+}
+
+void BVH::Subdivide(uint32_t nodeIdx, const aabb& centroidBounds, uint32_t& nodeCounter)
+{
+	Split split{};
+	uint32_t splitTriIdx{ 0 };
+	if (!PartitionNode(nodeIdx, centroidBounds, 1, split, splitTriIdx)) return;
+
+	// create child nodes depth-first, their bounds are known from the bins.
+	// The left child is allocated right after its parent, the right one after the whole left subtree
 	BVHNode& node = bvhNodes[nodeIdx];
-	if (node.triCount <= 3) return;
+	const uint32_t leftCount = splitTriIdx - node.firstTriIdx;
+	const uint32_t rightCount = node.triCount - leftCount;
 
-	// determine split axis using SAH
-	int bestAxis = -1;
-	float bestPos = 0, bestCost = 1e30f;
-	const int nrOfTestsPerAxis = 5;
-	for (int axis = 0; axis < 3; axis++)
-	{
-		for (uint32_t i = 0; i < nrOfTestsPerAxis; i++)
-		{
-			float IntervalJump = (i + 1) / (nrOfTestsPerAxis + 1.f);
-			float possibleSplitPos = (node.aabb.bmin + (node.aabb.bmax - node.aabb.bmin) * IntervalJump)[axis];
+	const uint32_t leftChildIdx = nodeCounter++;
+	bvhNodes[leftChildIdx].firstTriIdx = node.firstTriIdx;
+	bvhNodes[leftChildIdx].triCount = leftCount;
+	bvhNodes[leftChildIdx].aabb = split.leftBounds;
+	node.triCount = 0;
+	Subdivide(leftChildIdx, split.leftCentroidBounds, nodeCounter);
 
-			float cost = EvaluateSAH(node, axis, possibleSplitPos);
-			if (cost < bestCost) bestPos = possibleSplitPos, bestAxis = axis, bestCost = cost;
-		}
+	const uint32_t rightChildIdx = nodeCounter++;
+	bvhNodes[rightChildIdx].firstTriIdx = splitTriIdx;
+	bvhNodes[rightChildIdx].triCount = rightCount;
+	bvhNodes[rightChildIdx].aabb = split.rightBounds;
+	node.rightNode = rightChildIdx;
+	Subdivide(rightChildIdx, split.rightCentroidBounds, nodeCounter);
+}
+
+void BVH::SubdivideTopLevel(uint32_t nodeIdx, const aabb& centroidBounds, uint32_t nrOfThreads, std::vector<BuildTask>& tasks)
+{
+	if (bvhNodes[nodeIdx].triCount < settings.minTrianglesPerBuildTask)
+	{
+		tasks.push_back({ nodeIdx, centroidBounds });
+		return;
 	}
 
-	dae::Vector3 e = node.aabb.bmax - node.aabb.bmin; // extent of parent
-	float parentArea = node.aabb.halfArea();
-	float parentCost = node.triCount * parentArea;
-	int axis = bestAxis;
-	float splitPos = bestPos;
+	Split split{};
+	uint32_t splitTriIdx{ 0 };
+	if (!PartitionNode(nodeIdx, centroidBounds, nrOfThreads, split, splitTriIdx)) return;
+
+	// a node over n triangles owns the 2n - 1 node slots starting at its own index, the most its subtree can use.
+	// The left child gets the 2 * leftCount - 1 slots after its parent and the right child the rest,
+	// so the tasks allocate from disjoint ranges without any locking
+	BVHNode& node = bvhNodes[nodeIdx];
+	const uint32_t leftCount = splitTriIdx - node.firstTriIdx;
+	const uint32_t rightCount = node.triCount - leftCount;
+
+	const uint32_t leftChildIdx = nodeIdx + 1;
+	bvhNodes[leftChildIdx].firstTriIdx = node.firstTriIdx;
+	bvhNodes[leftChildIdx].triCount = leftCount;
+	bvhNodes[leftChildIdx].aabb = split.leftBounds;
+
+	const uint32_t rightChildIdx = nodeIdx + 2 * leftCount;
+	bvhNodes[rightChildIdx].firstTriIdx = splitTriIdx;
+	bvhNodes[rightChildIdx].triCount = rightCount;
+	bvhNodes[rightChildIdx].aabb = split.rightBounds;
+
+	node.rightNode = rightChildIdx;
+	node.triCount = 0;
+	nodesUsed += 2;
+	SubdivideTopLevel(leftChildIdx, split.leftCentroidBounds, nrOfThreads, tasks);
+	SubdivideTopLevel(rightChildIdx, split.rightCentroidBounds, nrOfThreads, tasks);
+}
+
+bool BVH::PartitionNode(uint32_t nodeIdx, const aabb& centroidBounds, uint32_t nrOfThreads, Split& split, uint32_t& splitTriIdx)
+{
+	// terminate recursion
+	const BVHNode& node = bvhNodes[nodeIdx];
+	if (node.triCount < settings.minTrianglesToSplit) return false;
 
-	if (parentCost <= bestCost) return;
+	// determine split axis and position using binned SAH
+	split = FindBestSplit(node, centroidBounds, nrOfThreads);
+	const float leafCost = GetLeafCost(node.triCount) * node.aabb.halfArea();
+	if (split.axis == -1 || leafCost <= split.cost) return false;
 
-	// in-place partition
+	// in-place partition, using the same binning as FindBestSplit so the counts match
+	const int axis = split.axis;
+	const float binMin = centroidBounds.bmin[axis];
+	const float binScale = GetBinCount() / (centroidBounds.bmax[axis] - binMin);
 	int i = node.firstTriIdx;
 	int j = i + node.triCount - 1;
 	while (i <= j)
 	{
-		if (tri[i].centroid[axis] < splitPos)
+		if (GetBinIdx(tri[i].centroid[axis], binMin, binScale) <= split.lastLeftBin)
 		{
 			i++;
 		}
@@ -113,59 +582,1076 @@ void BVH::Subdivide(uint32_t const nodeIdx)
 		}
 	}
 	// abort split if one of the sides is empty
-	int leftCount = i - node.firstTriIdx;
-	if (leftCount == 0 || leftCount == node.triCount) return;
-	// create child nodes
-	int leftChildIdx = nodesUsed;
-	nodesUsed++;
-	int rightChildIdx = nodesUsed;
-	nodesUsed++;
-	bvhNodes[leftChildIdx].firstTriIdx = node.firstTriIdx;
-	bvhNodes[leftChildIdx].triCount = leftCount;
-	bvhNodes[rightChildIdx].firstTriIdx = i;
-	bvhNodes[rightChildIdx].triCount = node.triCount - leftCount;
-	node.leftNode = leftChildIdx;
+	const uint32_t leftCount = i - node.firstTriIdx;
+	if (leftCount == 0 || leftCount == node.triCount) return false;
+
+	splitTriIdx = uint32_t(i);
+	return true;
+}
+
+uint32_t BVH::CopySubtree(uint32_t nodeIdx, std::vector<BVHNode>& compactNodes) const
+{
+	const uint32_t compactIdx = uint32_t(compactNodes.size());
+	compactNodes.push_back(bvhNodes[nodeIdx]);
+	if (bvhNodes[nodeIdx].IsLeaf()) return compactIdx;
+
+	// the left child lands right after its parent again
+	CopySubtree(nodeIdx + 1, compactNodes);
+	compactNodes[compactIdx].rightNode = CopySubtree(bvhNodes[nodeIdx].rightNode, compactNodes);
+	return compactIdx;
+}
+
+void BVH::BuildSBVH()
+{
+	// Stich et al., "Spatial splits in bounding volume hierarchies".
+	// The tree is built over references: each starts as a whole triangle, spatial splits clip
+	// a reference to either side of their plane and may put it in both children
+	std::vector<SBVHReference> references(NrOfTriangles);
+	aabb rootBounds{};
+	for (uint32_t i = 0; i < uint32_t(NrOfTriangles); i++)
+	{
+		references[i].triIdx = i;
+		references[i].bounds.grow(tri[i].vertex0);
+		references[i].bounds.grow(tri[i].vertex1);
+		references[i].bounds.grow(tri[i].vertex2);
+		rootBounds.grow(references[i].bounds);
+	}
+
+	SBVHBuildState state{};
+	state.duplicationBudget = uint32_t(NrOfTriangles * std::max(settings.spatialSplitBudget, 0.f));
+	state.rootArea = rootBounds.halfArea();
+	state.leafTriIndices.reserve(NrOfTriangles + state.duplicationBudget);
+
+	// nodes are appended depth-first, so the left child follows its parent here as well
+	bvhNodes.clear();
+	SubdivideSBVH(references, rootBounds, 0, state);
+	nodesUsed = uint32_t(bvhNodes.size());
+	bvhNodes.shrink_to_fit();
+
+	// every leaf gets its own contiguous copy of the triangles it references
+	triScratch.resize(state.leafTriIndices.size());
+	for (size_t i = 0; i < state.leafTriIndices.size(); i++) triScratch[i] = tri[state.leafTriIndices[i]];
+	tri.swap(triScratch);
+	triIntersect.resize(tri.size());
+}
+
+uint32_t BVH::SubdivideSBVH(std::vector<SBVHReference>& references, const aabb& bounds, uint32_t depth, SBVHBuildState& state)
+{
+	// deep enough for any sane mesh, and well within the traversal stacks
+	constexpr uint32_t MaxDepth{ 48 };
+
+	const uint32_t nodeIdx = uint32_t(bvhNodes.size());
+	bvhNodes.emplace_back();
+	bvhNodes[nodeIdx].aabb = bounds;
+	const uint32_t referenceCount = uint32_t(references.size());
+
+	std::vector<SBVHReference> left{}, right{};
+	bool didSplit = false;
+	if (referenceCount >= settings.minTrianglesToSplit && depth < MaxDepth)
+	{
+		aabb centroidBounds{};
+		for (const SBVHReference& reference : references) centroidBounds.grow((reference.bounds.bmin + reference.bounds.bmax) * 0.5f);
+		const Split objectSplit = FindObjectSplit(references, bounds, centroidBounds);
+
+		// clipping only pays off where the children of the object split overlap a lot, or when there is no object split at all
+		SpatialSplit spatialSplit{};
+		if (state.duplicationBudget > 0)
+		{
+			const aabb overlap = Intersection(objectSplit.leftBounds, objectSplit.rightBounds);
+			if (objectSplit.axis == -1 || (!IsEmpty(overlap) && overlap.halfArea() > settings.spatialSplitAlpha * state.rootArea))
+				spatialSplit = FindSpatialSplit(references, bounds);
+		}
+
+		const float leafCost = GetLeafCost(referenceCount) * bounds.halfArea();
+		if (spatialSplit.axis != -1 && spatialSplit.cost < objectSplit.cost && spatialSplit.cost < leafCost)
+			didSplit = PartitionSpatialSplit(references, spatialSplit, state.duplicationBudget, left, right);
+		if (!didSplit && objectSplit.axis != -1 && objectSplit.cost < leafCost)
+			didSplit = PartitionObjectSplit(references, objectSplit, centroidBounds, left, right);
+	}
+
+	if (!didSplit)
+	{
+		bvhNodes[nodeIdx].firstTriIdx = uint32_t(state.leafTriIndices.size());
+		bvhNodes[nodeIdx].triCount = referenceCount;
+		for (const SBVHReference& reference : references) state.leafTriIndices.push_back(reference.triIdx);
+		return nodeIdx;
+	}
+
+	// the children are bounded by their (clipped) references
+	aabb leftBounds{}, rightBounds{};
+	for (const SBVHReference& reference : left) leftBounds.grow(reference.bounds);
+	for (const SBVHReference& reference : right) rightBounds.grow(reference.bounds);
+	references = {};
+
+	bvhNodes[nodeIdx].triCount = 0;
+	SubdivideSBVH(left, leftBounds, depth + 1, state);
+	const uint32_t rightChildIdx = SubdivideSBVH(right, rightBounds, depth + 1, state);
+	bvhNodes[nodeIdx].rightNode = rightChildIdx;
+	return nodeIdx;
+}
+
+BVH::Split BVH::FindObjectSplit(const std::vector<SBVHReference>& references, const aabb& bounds, const aabb& centroidBounds) const
+{
+	// the same binned SAH as FindBestSplit, on the reference bounds instead of the triangles
+	const uint32_t nrOfBins = GetBinCount();
+	float binMin[3]{}, binScale[3]{};
+	for (int axis = 0; axis < 3; axis++)
+	{
+		const float extent = centroidBounds.bmax[axis] - centroidBounds.bmin[axis];
+		binMin[axis] = centroidBounds.bmin[axis];
+		binScale[axis] = extent > 0 ? nrOfBins / extent : 0;
+	}
+
+	BinSet binSet{};
+	for (const SBVHReference& reference : references)
+	{
+		const dae::Vector3 centroid = (reference.bounds.bmin + reference.bounds.bmax) * 0.5f;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			if (binScale[axis] == 0) continue;
+
+			Bin& bin = binSet.bins[axis][GetBinIdx(centroid[axis], binMin[axis], binScale[axis])];
+			bin.triCount++;
+			bin.bounds.grow(reference.bounds);
+			bin.centroidBounds.grow(centroid);
+		}
+	}
+	return EvaluateBins(binSet, binScale, bounds.halfArea());
+}
+
+BVH::SpatialSplit BVH::FindSpatialSplit(const std::vector<SBVHReference>& references, const aabb& bounds) const
+{
+	struct SpatialBin
+	{
+		aabb bounds{};
+		uint32_t entries{ 0 }, exits{ 0 };
+	};
+
+	// evenly spaced planes over the node bounds, every reference is clipped into each bin it overlaps
+	const uint32_t nrOfBins = GetBinCount();
+	SpatialSplit best{};
+	for (int axis = 0; axis < 3; axis++)
+	{
+		const float binMin = bounds.bmin[axis];
+		const float extent = bounds.bmax[axis] - binMin;
+		if (extent <= 0) continue;
+
+		const float binWidth = extent / nrOfBins;
+		const float binScale = nrOfBins / extent;
+		SpatialBin bins[BVHBuildSettings::MaxBins]{};
+		for (const SBVHReference& reference : references)
+		{
+			const uint32_t firstBin = GetBinIdx(reference.bounds.bmin[axis], binMin, binScale);
+			const uint32_t lastBin = GetBinIdx(reference.bounds.bmax[axis], binMin, binScale);
+			bins[firstBin].entries++;
+			bins[lastBin].exits++;
+			if (firstBin == lastBin)
+			{
+				bins[firstBin].bounds.grow(reference.bounds);
+				continue;
+			}
+
+			for (uint32_t bin = firstBin; bin <= lastBin; bin++)
+			{
+				const float planeMin = binMin + bin * binWidth;
+				const float planeMax = bin == nrOfBins - 1 ? bounds.bmax[axis] : binMin + (bin + 1) * binWidth;
+				const aabb part = Intersection(ClipTriangle(tri[reference.triIdx], axis, planeMin, planeMax), reference.bounds);
+				if (!IsEmpty(part)) bins[bin].bounds.grow(part);
+			}
+		}
+
+		// same sweeps as for the object split, with entries counted on the left and exits on the right
+		float rightArea[BVHBuildSettings::MaxBins]{};
+		uint32_t rightCount[BVHBuildSettings::MaxBins]{};
+		aabb rightBox{};
+		uint32_t rightSum = 0;
+		for (uint32_t bin = nrOfBins - 1; bin > 0; bin--)
+		{
+			rightSum += bins[bin].exits;
+			rightBox.grow(bins[bin].bounds);
+			rightCount[bin - 1] = rightSum;
+			rightArea[bin - 1] = rightBox.halfArea();
+		}
+
+		aabb leftBox{};
+		uint32_t leftSum = 0;
+		for (uint32_t bin = 0; bin < nrOfBins - 1; bin++)
+		{
+			leftSum += bins[bin].entries;
+			leftBox.grow(bins[bin].bounds);
+			if (leftSum == 0 || rightCount[bin] == 0) continue;
+
+			const float cost = settings.traversalCost * bounds.halfArea() +
+				GetLeafCost(leftSum) * leftBox.halfArea() + GetLeafCost(rightCount[bin]) * rightArea[bin];
+			if (cost < best.cost)
+			{
+				best.axis = axis;
+				best.position = binMin + (bin + 1) * binWidth;
+				best.cost = cost;
+			}
+		}
+	}
+	return best;
+}
+
+bool BVH::PartitionObjectSplit(const std::vector<SBVHReference>& references, const Split& split, const aabb& centroidBounds,
+	std::vector<SBVHReference>& left, std::vector<SBVHReference>& right) const
+{
+	const int axis = split.axis;
+	const float binMin = centroidBounds.bmin[axis];
+	const float binScale = GetBinCount() / (centroidBounds.bmax[axis] - binMin);
+	for (const SBVHReference& reference : references)
+	{
+		const float centroid = (reference.bounds.bmin[axis] + reference.bounds.bmax[axis]) * 0.5f;
+		(GetBinIdx(centroid, binMin, binScale) <= split.lastLeftBin ? left : right).push_back(reference);
+	}
+	return !left.empty() && !right.empty();
+}
+
+bool BVH::PartitionSpatialSplit(const std::vector<SBVHReference>& references, const SpatialSplit& split, uint32_t& duplicationBudget,
+	std::vector<SBVHReference>& left, std::vector<SBVHReference>& right) const
+{
+	struct Straddling
+	{
+		const SBVHReference* pReference;
+		aabb leftPart, rightPart;
+	};
+
+	// start from the split the cost was estimated for: every straddling reference clipped into both children
+	const int axis = split.axis;
+	std::vector<Straddling> straddling{};
+	aabb leftBounds{}, rightBounds{};
+	for (const SBVHReference& reference : references)
+	{
+		if (reference.bounds.bmax[axis] <= split.position)
+		{
+			left.push_back(reference);
+			leftBounds.grow(reference.bounds);
+		}
+		else if (reference.bounds.bmin[axis] >= split.position)
+		{
+			right.push_back(reference);
+			rightBounds.grow(reference.bounds);
+		}
+		else
+		{
+			const Tri& triangle = tri[reference.triIdx];
+			Straddling entry{ &reference,
+				Intersection(ClipTriangle(triangle, axis, -1e30f, split.position), reference.bounds),
+				Intersection(ClipTriangle(triangle, axis, split.position, 1e30f), reference.bounds) };
+			leftBounds.grow(entry.leftPart);
+			rightBounds.grow(entry.rightPart);
+			straddling.push_back(entry);
+		}
+	}
+
+	// reference unsplitting: a straddling reference moves wholly to one side when that is cheaper than
+	// duplicating it, or when the budget has run out
+	uint32_t leftCount = uint32_t(left.size() + straddling.size()), rightCount = uint32_t(right.size() + straddling.size());
+	uint32_t nrOfDuplicates = 0;
+	auto grown = [](aabb bounds, const aabb& other) { bounds.grow(other); return bounds; };
+	for (const Straddling& entry : straddling)
+	{
+		const SBVHReference& reference = *entry.pReference;
+		const aabb leftGrown = grown(leftBounds, reference.bounds), rightGrown = grown(rightBounds, reference.bounds);
+		const float costDuplicate = leftBounds.halfArea() * GetLeafCost(leftCount) + rightBounds.halfArea() * GetLeafCost(rightCount);
+		const float costLeft = leftGrown.halfArea() * GetLeafCost(leftCount) + rightBounds.halfArea() * GetLeafCost(rightCount - 1);
+		const float costRight = leftBounds.halfArea() * GetLeafCost(leftCount - 1) + rightGrown.halfArea() * GetLeafCost(rightCount);
+
+		const bool canDuplicate = nrOfDuplicates < duplicationBudget && !IsEmpty(entry.leftPart) && !IsEmpty(entry.rightPart);
+		if (canDuplicate && costDuplicate < costLeft && costDuplicate < costRight)
+		{
+			left.push_back({ entry.leftPart, reference.triIdx });
+			right.push_back({ entry.rightPart, reference.triIdx });
+			nrOfDuplicates++;
+		}
+		else if (costLeft <= costRight)
+		{
+			left.push_back(reference);
+			leftBounds = leftGrown;
+			rightCount--;
+		}
+		else
+		{
+			right.push_back(reference);
+			rightBounds = rightGrown;
+			leftCount--;
+		}
+	}
+
+	if (left.empty() || right.empty())
+	{
+		left.clear();
+		right.clear();
+		return false;
+	}
+	duplicationBudget -= nrOfDuplicates;
+	return true;
+}
+
+void BVH::BuildLBVH(const aabb& centroidBounds, uint32_t nrOfThreads)
+{
+	// sort the triangles along a Morton curve through their centroids
+	const dae::Vector3 extent = centroidBounds.bmax - centroidBounds.bmin;
+	const dae::Vector3 scale{ extent.x > 0 ? 1024.f / extent.x : 0, extent.y > 0 ? 1024.f / extent.y : 0, extent.z > 0 ? 1024.f / extent.z : 0 };
+	dae::WorkerPool& pool = GetWorkerPool(nrOfThreads);
+	mortonKeys.resize(NrOfTriangles);
+	pool.ParallelForSlices(0, NrOfTriangles, nrOfThreads, [&](uint32_t, uint32_t first, uint32_t end)
+		{
+			for (uint32_t i = first; i < end; i++)
+			{
+				const dae::Vector3 offset = tri[i].centroid - centroidBounds.bmin;
+				mortonKeys[i] = uint64_t(MortonCode(offset.x * scale.x, offset.y * scale.y, offset.z * scale.z)) << 32 | i;
+			}
+		});
+	SortMortonKeys(nrOfThreads);
+
+	triScratch.resize(NrOfTriangles);
+	pool.ParallelForSlices(0, NrOfTriangles, nrOfThreads, [this](uint32_t, uint32_t first, uint32_t end)
+		{
+			for (uint32_t i = first; i < end; i++) triScratch[i] = tri[uint32_t(mortonKeys[i])];
+		});
+	tri.swap(triScratch);
+
+	// like the parallel SAH build every node reserves 2n - 1 slots, so subtrees are emitted without sharing a counter
+	lbvhNodes.resize(NrOfTriangles * 2 - 1);
+	lbvhNodes[0] = LBVHNode{};
+	lbvhNodes[0].triCount = NrOfTriangles;
+	if (nrOfThreads > 1)
+	{
+		lbvhTopLevelNodes.clear();
+		buildTasks.clear();
+		EmitLBVHTopLevel(0, lbvhTopLevelNodes, buildTasks);
+		pool.ParallelFor(uint32_t(buildTasks.size()), [this](uint32_t taskIdx)
+			{
+				EmitLBVH(buildTasks[taskIdx].nodeIdx);
+			});
+
+		// reverse pre-order finishes every node after its subtree
+		for (auto it = lbvhTopLevelNodes.rbegin(); it != lbvhTopLevelNodes.rend(); ++it) FinishLBVHNode(*it);
+	}
+	else
+	{
+		EmitLBVH(0);
+	}
+
+	// the capacity stays for the next rebuild
+	nodesUsed = 0;
+	FlattenLBVH(0);
+	bvhNodes.resize(nodesUsed);
+}
+
+void BVH::SortMortonKeys(uint32_t nrOfThreads)
+{
+	// LSD radix sort on the 30 code bits, 3 passes of 10 bits. Every slice counts its own digits
+	// and scatters to its own part of each bucket, so the sort is stable for any number of threads
+	constexpr uint32_t RadixBits{ 10 }, NrOfBuckets{ 1 << RadixBits };
+	dae::WorkerPool& pool = GetWorkerPool(nrOfThreads);
+	mortonScratch.resize(NrOfTriangles);
+	radixOffsets.resize(nrOfThreads * NrOfBuckets);
+	for (uint32_t pass = 0; pass < 3; pass++)
+	{
+		const uint32_t shift = 32 + pass * RadixBits;
+		std::fill(radixOffsets.begin(), radixOffsets.end(), 0);
+		pool.ParallelForSlices(0, NrOfTriangles, nrOfThreads, [&](uint32_t sliceIdx, uint32_t first, uint32_t end)
+			{
+				uint32_t* counts = &radixOffsets[sliceIdx * NrOfBuckets];
+				for (uint32_t i = first; i < end; i++) counts[(mortonKeys[i] >> shift) & (NrOfBuckets - 1)]++;
+			});
+
+		uint32_t sum = 0;
+		for (uint32_t bucket = 0; bucket < NrOfBuckets; bucket++)
+		{
+			for (uint32_t sliceIdx = 0; sliceIdx < nrOfThreads; sliceIdx++)
+			{
+				const uint32_t count = radixOffsets[sliceIdx * NrOfBuckets + bucket];
+				radixOffsets[sliceIdx * NrOfBuckets + bucket] = sum;
+				sum += count;
+			}
+		}
+
+		pool.ParallelForSlices(0, NrOfTriangles, nrOfThreads, [&](uint32_t sliceIdx, uint32_t first, uint32_t end)
+			{
+				uint32_t* slots = &radixOffsets[sliceIdx * NrOfBuckets];
+				for (uint32_t i = first; i < end; i++) mortonScratch[slots[(mortonKeys[i] >> shift) & (NrOfBuckets - 1)]++] = mortonKeys[i];
+			});
+		mortonKeys.swap(mortonScratch);
+	}
+}
+
+bool BVH::FindMortonSplit(uint32_t firstTriIdx, uint32_t triCount, uint32_t& splitTriIdx) const
+{
+	// with SIMD leaves up to four triangles cost the same as one, so splitting them never pays off
+	if (triCount < settings.minTrianglesToSplit || (settings.simdLeaves && triCount <= 4)) return false;
+
+	const uint32_t firstCode = uint32_t(mortonKeys[firstTriIdx] >> 32);
+	const uint32_t lastCode = uint32_t(mortonKeys[firstTriIdx + triCount - 1] >> 32);
+	if (firstCode == lastCode)
+	{
+		splitTriIdx = firstTriIdx + triCount / 2;
+		return true;
+	}
+
+	// the codes are sorted and share every bit above the highest one that differs,
+	// the right child starts at the first code that has that bit set
+	const uint64_t splitBit = uint64_t(1) << (32 + 31 - std::countl_zero(firstCode ^ lastCode));
+	const auto first = mortonKeys.begin() + firstTriIdx;
+	splitTriIdx = uint32_t(std::partition_point(first, first + triCount, [splitBit](uint64_t key) { return (key & splitBit) == 0; }) - mortonKeys.begin());
+	return true;
+}
+
+void BVH::SplitLBVHNode(uint32_t nodeIdx, uint32_t splitTriIdx)
+{
+	LBVHNode& node = lbvhNodes[nodeIdx];
+	const uint32_t leftCount = splitTriIdx - node.firstTriIdx;
+
+	node.leftNode = nodeIdx + 1;
+	node.rightNode = nodeIdx + 2 * leftCount;
+	lbvhNodes[node.leftNode] = LBVHNode{};
+	lbvhNodes[node.leftNode].firstTriIdx = node.firstTriIdx;
+	lbvhNodes[node.leftNode].triCount = leftCount;
+	lbvhNodes[node.rightNode] = LBVHNode{};
+	lbvhNodes[node.rightNode].firstTriIdx = splitTriIdx;
+	lbvhNodes[node.rightNode].triCount = node.triCount - leftCount;
 	node.triCount = 0;
-	UpdateNodeBounds(leftChildIdx);
-	UpdateNodeBounds(rightChildIdx);
-	// recurse
-	Subdivide(leftChildIdx);
-	Subdivide(rightChildIdx);
+}
+
+void BVH::EmitLBVH(uint32_t nodeIdx)
+{
+	const LBVHNode& node = lbvhNodes[nodeIdx];
+	uint32_t splitTriIdx{ 0 };
+	if (FindMortonSplit(node.firstTriIdx, node.triCount, splitTriIdx))
+	{
+		SplitLBVHNode(nodeIdx, splitTriIdx);
+		EmitLBVH(node.leftNode);
+		EmitLBVH(node.rightNode);
+	}
+	FinishLBVHNode(nodeIdx);
+}
+
+void BVH::EmitLBVHTopLevel(uint32_t nodeIdx, std::vector<uint32_t>& topLevelNodes, std::vector<BuildTask>& tasks)
+{
+	const LBVHNode& node = lbvhNodes[nodeIdx];
+	uint32_t splitTriIdx{ 0 };
+	if (node.triCount < settings.minTrianglesPerBuildTask || !FindMortonSplit(node.firstTriIdx, node.triCount, splitTriIdx))
+	{
+		tasks.push_back({ nodeIdx });
+		return;
+	}
+
+	topLevelNodes.push_back(nodeIdx);
+	SplitLBVHNode(nodeIdx, splitTriIdx);
+	EmitLBVHTopLevel(node.leftNode, topLevelNodes, tasks);
+	EmitLBVHTopLevel(node.rightNode, topLevelNodes, tasks);
+}
+
+void BVH::FinishLBVHNode(uint32_t nodeIdx)
+{
+	LBVHNode& node = lbvhNodes[nodeIdx];
+	if (node.triCount > 0)
+	{
+		node.bounds = aabb{};
+		for (uint32_t i = node.firstTriIdx; i < node.firstTriIdx + node.triCount; i++)
+		{
+			node.bounds.grow(tri[i].vertex0);
+			node.bounds.grow(tri[i].vertex1);
+			node.bounds.grow(tri[i].vertex2);
+		}
+		node.cost = GetLeafCost(node.triCount) * node.bounds.halfArea();
+		return;
+	}
+
+	node.bounds = lbvhNodes[node.leftNode].bounds;
+	node.bounds.grow(lbvhNodes[node.rightNode].bounds);
+	node.cost = settings.traversalCost * node.bounds.halfArea() + lbvhNodes[node.leftNode].cost + lbvhNodes[node.rightNode].cost;
+	if (settings.optimizeTreelets) OptimizeTreelet(nodeIdx);
+}
+
+void BVH::OptimizeTreelet(uint32_t rootIdx)
+{
+	// Karras and Aila, "Fast parallel construction of high-quality bounding volume hierarchies".
+	// Grow a treelet by opening its largest node until it has 7 leaves,
+	// then pick the topology over those leaves with the lowest SAH cost
+	constexpr uint32_t MaxTreeletLeaves{ 7 };
+	uint32_t leaves[MaxTreeletLeaves]{ lbvhNodes[rootIdx].leftNode, lbvhNodes[rootIdx].rightNode };
+	uint32_t internals[MaxTreeletLeaves - 1]{ rootIdx };
+	uint32_t nrOfLeaves = 2, nrOfInternals = 1;
+	while (nrOfLeaves < MaxTreeletLeaves)
+	{
+		int largestLeaf = -1;
+		float largestArea = -1.f;
+		for (uint32_t i = 0; i < nrOfLeaves; i++)
+		{
+			const LBVHNode& leaf = lbvhNodes[leaves[i]];
+			if (leaf.triCount == 0 && leaf.bounds.halfArea() > largestArea)
+			{
+				largestLeaf = int(i);
+				largestArea = leaf.bounds.halfArea();
+			}
+		}
+		if (largestLeaf == -1) break;
+
+		const LBVHNode& opened = lbvhNodes[leaves[largestLeaf]];
+		internals[nrOfInternals++] = leaves[largestLeaf];
+		leaves[largestLeaf] = opened.leftNode;
+		leaves[nrOfLeaves++] = opened.rightNode;
+	}
+	// two leaves only have one topology
+	if (nrOfLeaves < 3) return;
+
+	// every subset is built from smaller ones, which always have a lower index
+	aabb subsetBounds[1 << MaxTreeletLeaves];
+	float subsetCost[1 << MaxTreeletLeaves];
+	uint32_t bestPartition[1 << MaxTreeletLeaves];
+	const uint32_t fullSet = (1u << nrOfLeaves) - 1;
+	for (uint32_t subset = 1; subset <= fullSet; subset++)
+	{
+		const uint32_t lowestBit = subset & (0u - subset);
+		const LBVHNode& lowestLeaf = lbvhNodes[leaves[std::countr_zero(subset)]];
+		if (subset == lowestBit)
+		{
+			subsetBounds[subset] = lowestLeaf.bounds;
+			subsetCost[subset] = lowestLeaf.cost;
+			continue;
+		}
+
+		subsetBounds[subset] = subsetBounds[subset ^ lowestBit];
+		subsetBounds[subset].grow(lowestLeaf.bounds);
+
+		// each way to split the subset in two, visited once by keeping the lowest leaf on the left
+		float bestCost = 1e30f;
+		for (uint32_t left = (subset - 1) & subset; left > 0; left = (left - 1) & subset)
+		{
+			if ((left & lowestBit) == 0) continue;
+
+			const float cost = subsetCost[left] + subsetCost[subset ^ left];
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestPartition[subset] = left;
+			}
+		}
+		subsetCost[subset] = settings.traversalCost * subsetBounds[subset].halfArea() + bestCost;
+	}
+	if (subsetCost[fullSet] >= lbvhNodes[rootIdx].cost) return;
+
+	// rebuild the treelet from its own internal nodes, starting with the root so its parent stays valid
+	uint32_t nextInternal = 0;
+	auto restructure = [&](auto& self, uint32_t subset) -> uint32_t
+		{
+			if ((subset & (subset - 1)) == 0) return leaves[std::countr_zero(subset)];
+
+			const uint32_t nodeIdx = internals[nextInternal++];
+			const uint32_t leftNode = self(self, bestPartition[subset]);
+			const uint32_t rightNode = self(self, subset ^ bestPartition[subset]);
+			LBVHNode& node = lbvhNodes[nodeIdx];
+			node.leftNode = leftNode, node.rightNode = rightNode;
+			node.bounds = subsetBounds[subset];
+			node.cost = subsetCost[subset];
+			return nodeIdx;
+		};
+	restructure(restructure, fullSet);
+}
+
+uint32_t BVH::FlattenLBVH(uint32_t lbvhNodeIdx)
+{
+	const LBVHNode& lbvhNode = lbvhNodes[lbvhNodeIdx];
+	const uint32_t nodeIdx = nodesUsed++;
+	BVHNode& node = bvhNodes[nodeIdx];
+	node.aabb = lbvhNode.bounds;
+	node.triCount = lbvhNode.triCount;
+	if (lbvhNode.triCount > 0)
+	{
+		node.firstTriIdx = lbvhNode.firstTriIdx;
+		return nodeIdx;
+	}
+
+	// depth-first like the SAH build, the left child follows its parent
+	FlattenLBVH(lbvhNode.leftNode);
+	const uint32_t rightNode = FlattenLBVH(lbvhNode.rightNode);
+	bvhNodes[nodeIdx].rightNode = rightNode;
+	return nodeIdx;
+}
+
+void BVH::FillBins(uint32_t firstTriIdx, uint32_t triCount, const float binMin[3], const float binScale[3], BinSet& binSet) const
+{
+	for (uint32_t i = firstTriIdx; i < firstTriIdx + triCount; i++)
+	{
+		const Tri& triangle = tri[i];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			if (binScale[axis] == 0) continue;
+
+			Bin& bin = binSet.bins[axis][GetBinIdx(triangle.centroid[axis], binMin[axis], binScale[axis])];
+			bin.triCount++;
+			bin.bounds.grow(triangle.vertex0);
+			bin.bounds.grow(triangle.vertex1);
+			bin.bounds.grow(triangle.vertex2);
+			bin.centroidBounds.grow(triangle.centroid);
+		}
+	}
+}
+
+BVH::Split BVH::FindBestSplit(const BVHNode& node, const aabb& centroidBounds, uint32_t nrOfThreads)
+{
+	const uint32_t nrOfBins = GetBinCount();
+
+	float binMin[3]{}, binScale[3]{};
+	for (int axis = 0; axis < 3; axis++)
+	{
+		const float extent = centroidBounds.bmax[axis] - centroidBounds.bmin[axis];
+		binMin[axis] = centroidBounds.bmin[axis];
+		binScale[axis] = extent > 0 ? nrOfBins / extent : 0;
+	}
+
+	// one pass over the triangles fills the bins of all three axes. With several threads every thread bins
+	// its own slice, merging them gives exactly the same bins since they only hold counts and bounds
+	BinSet binSet{};
+	if (nrOfThreads <= 1)
+	{
+		FillBins(node.firstTriIdx, node.triCount, binMin, binScale, binSet);
+	}
+	else
+	{
+		sliceBinSets.assign(nrOfThreads, BinSet{});
+		GetWorkerPool(nrOfThreads).ParallelForSlices(node.firstTriIdx, node.triCount, nrOfThreads, [&](uint32_t sliceIdx, uint32_t first, uint32_t end)
+			{
+				FillBins(first, end - first, binMin, binScale, sliceBinSets[sliceIdx]);
+			});
+
+		for (const BinSet& slice : sliceBinSets)
+		{
+			for (int axis = 0; axis < 3; axis++)
+			{
+				for (uint32_t bin = 0; bin < nrOfBins; bin++)
+				{
+					binSet.bins[axis][bin].triCount += slice.bins[axis][bin].triCount;
+					binSet.bins[axis][bin].bounds.grow(slice.bins[axis][bin].bounds);
+					binSet.bins[axis][bin].centroidBounds.grow(slice.bins[axis][bin].centroidBounds);
+				}
+			}
+		}
+	}
+	return EvaluateBins(binSet, binScale, node.aabb.halfArea());
+}
+
+BVH::Split BVH::EvaluateBins(const BinSet& binSet, const float binScale[3], float nodeArea) const
+{
+	const uint32_t nrOfBins = GetBinCount();
+	const auto& bins = binSet.bins;
+
+	// sweep from the right to gather the cost terms of every right side,
+	// then sweep from the left and evaluate each split plane between two bins
+	Split best{};
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (binScale[axis] == 0) continue;
+
+		float rightArea[BVHBuildSettings::MaxBins]{};
+		uint32_t rightCount[BVHBuildSettings::MaxBins]{};
+		aabb rightBox{};
+		uint32_t rightSum = 0;
+		for (uint32_t bin = nrOfBins - 1; bin > 0; bin--)
+		{
+			rightSum += bins[axis][bin].triCount;
+			rightBox.grow(bins[axis][bin].bounds);
+			rightCount[bin - 1] = rightSum;
+			rightArea[bin - 1] = rightBox.halfArea();
+		}
+
+		aabb leftBox{};
+		uint32_t leftSum = 0;
+		for (uint32_t bin = 0; bin < nrOfBins - 1; bin++)
+		{
+			leftSum += bins[axis][bin].triCount;
+			leftBox.grow(bins[axis][bin].bounds);
+			if (leftSum == 0 || rightCount[bin] == 0) continue;
+
+			const float cost = settings.traversalCost * nodeArea +
+				GetLeafCost(leftSum) * leftBox.halfArea() + GetLeafCost(rightCount[bin]) * rightArea[bin];
+			if (cost < best.cost)
+			{
+				best.axis = axis;
+				best.lastLeftBin = bin;
+				best.cost = cost;
+			}
+		}
+	}
+
+	if (best.axis == -1) return best;
+
+	// gather the child bounds of the winning split
+	for (uint32_t bin = 0; bin < nrOfBins; bin++)
+	{
+		const Bin& current = bins[best.axis][bin];
+		if (bin <= best.lastLeftBin)
+		{
+			best.leftBounds.grow(current.bounds);
+			best.leftCentroidBounds.grow(current.centroidBounds);
+		}
+		else
+		{
+			best.rightBounds.grow(current.bounds);
+			best.rightCentroidBounds.grow(current.centroidBounds);
+		}
+	}
+	return best;
+}
+
+uint32_t BVH::GetBinCount() const
+{
+	return std::clamp(settings.nrOfBins, 2u, BVHBuildSettings::MaxBins);
+}
+
+uint32_t BVH::GetBinIdx(float centroid, float binMin, float binScale) const
+{
+	const int binIdx = int((centroid - binMin) * binScale);
+	return uint32_t(std::clamp(binIdx, 0, int(GetBinCount()) - 1));
+}
+
+void BVH::CollapseToBVH4()
+{
+	if (pCacheFile) CopyCacheFile();
+
+	bvh4Nodes.clear();
+	bvh4Nodes.reserve(nodesUsed / 2 + 1);
+	bvh4Nodes.emplace_back();
+	CollapseNode(0, rootNodeIdx);
+	UpdateViews();
+}
+
+void BVH::CollapseNode(uint32_t bvh4NodeIdx, uint32_t nodeIdx)
+{
+	// gather up to four descendants by repeatedly opening the largest inner node
+	uint32_t children[4]{ nodeIdx };
+	uint32_t childCount = 1;
+	while (childCount < 4)
+	{
+		int largestChild = -1;
+		float largestArea = -1.f;
+		for (uint32_t i = 0; i < childCount; i++)
+		{
+			const BVHNode& child = bvhNodes[children[i]];
+			if (!child.IsLeaf() && child.aabb.halfArea() > largestArea)
+			{
+				largestChild = int(i);
+				largestArea = child.aabb.halfArea();
+			}
+		}
+		if (largestChild == -1) break;
+
+		const uint32_t openedNode = children[largestChild];
+		children[largestChild] = openedNode + 1;
+		children[childCount++] = bvhNodes[openedNode].rightNode;
+	}
+
+	// the vector may grow while recursing, so the node is looked up again for every child
+	bvh4Nodes[bvh4NodeIdx].childCount = childCount;
+	for (uint32_t i = 0; i < 4; i++)
+	{
+		BVH4Node& node4 = bvh4Nodes[bvh4NodeIdx];
+		if (i >= childCount)
+		{
+			node4.bminX[i] = node4.bminY[i] = node4.bminZ[i] = 1e30f;
+			node4.bmaxX[i] = node4.bmaxY[i] = node4.bmaxZ[i] = -1e30f;
+			node4.child[i] = 0, node4.triCount[i] = 0;
+			continue;
+		}
+
+		const BVHNode& child = bvhNodes[children[i]];
+		node4.bminX[i] = child.aabb.bmin.x, node4.bminY[i] = child.aabb.bmin.y, node4.bminZ[i] = child.aabb.bmin.z;
+		node4.bmaxX[i] = child.aabb.bmax.x, node4.bmaxY[i] = child.aabb.bmax.y, node4.bmaxZ[i] = child.aabb.bmax.z;
+
+		if (child.IsLeaf())
+		{
+			node4.child[i] = child.firstTriIdx, node4.triCount[i] = child.triCount;
+			continue;
+		}
+
+		const uint32_t childNode4Idx = uint32_t(bvh4Nodes.size());
+		node4.child[i] = childNode4Idx, node4.triCount[i] = 0;
+		bvh4Nodes.emplace_back();
+		CollapseNode(childNode4Idx, children[i]);
+	}
 }
 
 BVHNode& BVH::GetBvhNodes(int nodeIdx)
 {
+	if (pCacheFile) CopyCacheFile();
 	return bvhNodes[nodeIdx];
 }
 
 Tri& BVH::GetTriAtIdx(int idx)
 {
+	if (pCacheFile) CopyCacheFile();
 	return tri[idx];
 }
 
-float BVH::EvaluateSAH(BVHNode& node, int axis, float pos)
+void BVH::UpdateViews()
 {
-	// determine triangle counts and bounds for this split candidate
-	aabb leftBox, rightBox;
-	int leftCount = 0, rightCount = 0;
-	for (uint32_t i = 0; i < node.triCount; i++)
+	pNodes = bvhNodes.data();
+	pTri = tri.data();
+	pTriIntersect = triIntersect.data();
+	pTriGroups = triGroups.data();
+	pLeafFirstGroup = leafFirstGroup.data();
+	pTriCullModes = triCullModes.data();
+	pBvh4Nodes = bvh4Nodes.data();
+	pQuantizedNodes = quantizedNodes.data();
+	pLeafMeshTriIndices = leafMeshTriIndices.data();
+	pSkipNodes = skipNodes.data();
+	referenceCount = uint32_t(quantizedNodes.empty() ? tri.size() : leafMeshTriIndices.size());
+	triGroupCount = uint32_t(triGroups.size());
+	bvh4NodeCount = uint32_t(bvh4Nodes.size());
+	quantizedNodeCount = uint32_t(quantizedNodes.size());
+	skipNodeCount = uint32_t(skipNodes.size());
+	triCullModeCount = uint32_t(triCullModes.size());
+}
+
+bool BVH::CompressNodes()
+{
+	// leaves too large for the 16-bit triangle count keep the uncompressed tree
+	for (const BVH4Node& node : bvh4Nodes)
 	{
-		Tri& triangle = tri[node.firstTriIdx + i];
-		if (triangle.centroid[axis] < pos)
+		for (uint32_t i = 0; i < node.childCount; i++)
 		{
-			leftCount++;
-			leftBox.grow(triangle.vertex0);
-			leftBox.grow(triangle.vertex1);
-			leftBox.grow(triangle.vertex2);
+			if (node.triCount[i] > UINT16_MAX) return false;
 		}
-		else
+	}
+
+	quantizedNodes.resize(bvh4Nodes.size());
+	for (size_t nodeIdx = 0; nodeIdx < bvh4Nodes.size(); nodeIdx++) quantizedNodes[nodeIdx] = QuantizeNode(bvh4Nodes[nodeIdx]);
+
+	leafMeshTriIndices.resize(tri.size());
+	for (size_t i = 0; i < tri.size(); i++) leafMeshTriIndices[i] = tri[i].meshTriIdx;
+
+	// the binary nodes stay for the statistics, everything else the traversal read is dropped
+	tri = {};
+	triIntersect = {};
+	triGroups = {};
+	leafFirstGroup = {};
+	triCullModes = {};
+	bvh4Nodes = {};
+	return true;
+}
+
+void BVH::BuildSkipNodes()
+{
+	// children are stored after their parent, so one forward sweep hands every node its skip link:
+	// a left child continues at its sibling when missed, a right child wherever its parent would
+	skipNodes.resize(nodesUsed);
+	skipNodes[rootNodeIdx].skipNode = nodesUsed;
+	for (uint32_t nodeIdx = rootNodeIdx; nodeIdx < nodesUsed; nodeIdx++)
+	{
+		const BVHNode& node = bvhNodes[nodeIdx];
+		BVHSkipNode& skipNode = skipNodes[nodeIdx];
+		skipNode.aabb = node.aabb;
+		skipNode.triCount = node.triCount;
+		if (node.IsLeaf())
 		{
-			rightCount++;
-			rightBox.grow(triangle.vertex0);
-			rightBox.grow(triangle.vertex1);
-			rightBox.grow(triangle.vertex2);
+			skipNode.firstTriIdx = node.firstTriIdx;
+			continue;
 		}
+
+		skipNodes[nodeIdx + 1].skipNode = node.rightNode;
+		skipNodes[node.rightNode].skipNode = skipNode.skipNode;
+	}
+}
+
+void BVH::BuildTraversalNodes()
+{
+	// the node copies the traversal reads instead of the binary tree, the quantized nodes are made from the 4-wide ones
+	bvh4Nodes.clear();
+	quantizedNodes.clear();
+	leafMeshTriIndices.clear();
+	skipNodes.clear();
+	if (settings.compressNodes)
+	{
+		CollapseToBVH4();
+		CompressNodes();
+	}
+	else if (settings.stacklessTraversal) BuildSkipNodes();
+	else if (settings.collapseToBVH4) CollapseToBVH4();
+	UpdateViews();
+}
+
+#pragma region Cache
+namespace
+{
+	// Bump whenever the file layout or one of the stored structs changes
+	constexpr uint32_t CacheVersion{ 4 };
+	constexpr char CacheMagic[8]{ 'G', 'P', '1', 'B', 'V', 'H', '\0', '\0' };
+
+	enum CacheSection : uint32_t
+	{
+		NodesSection, TriSection, TriIntersectSection, TriGroupsSection, LeafFirstGroupSection, BVH4NodesSection,
+		QuantizedNodesSection, LeafMeshTriIndicesSection, SkipNodesSection, TriCullModesSection, NrOfSections
+	};
+
+	// Every section starts on a cache line, so the mapped arrays are aligned like the vectors they replace
+	struct CacheHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t nrOfTriangles;
+		uint64_t key;
+		uint32_t structSizes[NrOfSections]; // catches builds whose struct layout differs
+		uint64_t offsets[NrOfSections];
+		uint32_t counts[NrOfSections];
+		uint32_t nodesUsed;
+		uint32_t rootNodeIdx;
+		float buildSAHCost;
+	};
+
+	constexpr uint32_t StructSizes[NrOfSections]{ sizeof(BVHNode), sizeof(Tri), sizeof(TriIntersect), sizeof(TriIntersect4), sizeof(uint32_t), sizeof(BVH4Node),
+		sizeof(BVH4QuantizedNode), sizeof(uint32_t), sizeof(BVHSkipNode), sizeof(uint8_t) };
+
+	uint64_t AlignToCacheLine(uint64_t offset)
+	{
+		return (offset + 63) & ~uint64_t(63);
+	}
+}
+
+void BVH::LoadOrBuildBVH()
+{
+	if (BVHCache::GetDirectory().empty())
+	{
+		BuildBVH();
+		return;
+	}
+
+	const auto loadStart = std::chrono::steady_clock::now();
+	const uint64_t key = ComputeCacheKey();
+	if (LoadFromCache(key))
+	{
+		buildTimeMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - loadStart).count();
+		return;
+	}
+
+	BuildBVH();
+	SaveToCache(key);
+}
+
+uint64_t BVH::ComputeCacheKey() const
+{
+	// the tree depends on the transformed mesh and on every setting that shapes it, the thread counts don't
+	uint64_t key = BVHCache::Hash(&CacheVersion, sizeof(CacheVersion));
+	key = BVHCache::Hash(mesh->transformedPositions.data(), mesh->transformedPositions.size() * sizeof(dae::Vector3), key);
+	key = BVHCache::Hash(mesh->transformedNormals.data(), mesh->transformedNormals.size() * sizeof(dae::Vector3), key);
+	key = BVHCache::Hash(mesh->indices.data(), mesh->indices.size() * sizeof(int), key);
+	key = BVHCache::Hash(mesh->triangleCullModes.data(), mesh->triangleCullModes.size() * sizeof(dae::TriangleCullMode), key);
+
+	auto hashSetting = [&key](const auto& value) { key = BVHCache::Hash(&value, sizeof(value), key); };
+	hashSetting(settings.builder);
+	hashSetting(settings.optimizeTreelets);
+	hashSetting(settings.spatialSplitAlpha);
+	hashSetting(settings.spatialSplitBudget);
+	hashSetting(settings.nrOfBins);
+	hashSetting(settings.traversalCost);
+	hashSetting(settings.intersectionCost);
+	hashSetting(settings.groupIntersectionCost);
+	hashSetting(settings.minTrianglesToSplit);
+	hashSetting(settings.collapseToBVH4);
+	hashSetting(settings.simdLeaves);
+	hashSetting(settings.compressNodes);
+	hashSetting(settings.stacklessTraversal);
+	return key;
+}
+
+bool BVH::LoadFromCache(uint64_t key)
+{
+	std::unique_ptr<MappedFile> pFile = MappedFile::Open(BVHCache::GetPath(key));
+	if (!pFile || pFile->GetSize() < sizeof(CacheHeader)) return false;
+
+	// anything unexpected means a stale or foreign file, it gets rebuilt and overwritten
+	CacheHeader header{};
+	std::memcpy(&header, pFile->GetData(), sizeof(CacheHeader));
+	if (std::memcmp(header.magic, CacheMagic, sizeof(CacheMagic)) != 0 || header.version != CacheVersion ||
+		header.key != key || header.nrOfTriangles != uint32_t(NrOfTriangles) || header.nodesUsed == 0 ||
+		header.counts[NodesSection] != header.nodesUsed || header.rootNodeIdx >= header.nodesUsed)
+		return false;
+	for (uint32_t section = 0; section < NrOfSections; section++)
+	{
+		if (header.structSizes[section] != StructSizes[section] || header.offsets[section] % 64 != 0 ||
+			header.offsets[section] + uint64_t(header.counts[section]) * StructSizes[section] > pFile->GetSize())
+			return false;
 	}
-	float cost = leftCount * leftBox.halfArea() + rightCount * rightBox.halfArea();
-	return cost > 0 ? cost : 1e30f;
+
+	auto section = [&](CacheSection section) { return pFile->GetData() + header.offsets[section]; };
+	pNodes = reinterpret_cast<const BVHNode*>(section(NodesSection));
+	pTri = reinterpret_cast<const Tri*>(section(TriSection));
+	pTriIntersect = reinterpret_cast<const TriIntersect*>(section(TriIntersectSection));
+	pTriGroups = reinterpret_cast<const TriIntersect4*>(section(TriGroupsSection));
+	pLeafFirstGroup = reinterpret_cast<const uint32_t*>(section(LeafFirstGroupSection));
+	pBvh4Nodes = reinterpret_cast<const BVH4Node*>(section(BVH4NodesSection));
+	pQuantizedNodes = reinterpret_cast<const BVH4QuantizedNode*>(section(QuantizedNodesSection));
+	pLeafMeshTriIndices = reinterpret_cast<const uint32_t*>(section(LeafMeshTriIndicesSection));
+	pSkipNodes = reinterpret_cast<const BVHSkipNode*>(section(SkipNodesSection));
+	pTriCullModes = section(TriCullModesSection);
+	triGroupCount = header.counts[TriGroupsSection];
+	bvh4NodeCount = header.counts[BVH4NodesSection];
+	quantizedNodeCount = header.counts[QuantizedNodesSection];
+	skipNodeCount = header.counts[SkipNodesSection];
+	triCullModeCount = header.counts[TriCullModesSection];
+	referenceCount = quantizedNodeCount > 0 ? header.counts[LeafMeshTriIndicesSection] : header.counts[TriSection];
+	nodesUsed = header.nodesUsed;
+	rootNodeIdx = header.rootNodeIdx;
+	buildSAHCost = header.buildSAHCost;
+
+	// the vectors stay empty until something needs to modify the tree
+	bvhNodes.clear(), tri.clear(), triIntersect.clear(), triGroups.clear(), leafFirstGroup.clear(), bvh4Nodes.clear();
+	quantizedNodes.clear(), leafMeshTriIndices.clear(), skipNodes.clear(), triCullModes.clear();
+	pCacheFile = std::move(pFile);
+	return true;
+}
+
+void BVH::SaveToCache(uint64_t key) const
+{
+	CacheHeader header{};
+	std::memcpy(header.magic, CacheMagic, sizeof(CacheMagic));
+	header.version = CacheVersion;
+	header.nrOfTriangles = uint32_t(NrOfTriangles);
+	header.key = key;
+	header.nodesUsed = nodesUsed;
+	header.rootNodeIdx = rootNodeIdx;
+	header.buildSAHCost = buildSAHCost;
+
+	const void* sectionData[NrOfSections]{ bvhNodes.data(), tri.data(), triIntersect.data(), triGroups.data(), leafFirstGroup.data(), bvh4Nodes.data(),
+		quantizedNodes.data(), leafMeshTriIndices.data(), skipNodes.data(), triCullModes.data() };
+	const uint32_t counts[NrOfSections]{ nodesUsed, uint32_t(tri.size()), uint32_t(triIntersect.size()),
+		uint32_t(triGroups.size()), uint32_t(leafFirstGroup.size()), uint32_t(bvh4Nodes.size()),
+		uint32_t(quantizedNodes.size()), uint32_t(leafMeshTriIndices.size()), uint32_t(skipNodes.size()), uint32_t(triCullModes.size()) };
+	uint64_t fileSize = AlignToCacheLine(sizeof(CacheHeader));
+	for (uint32_t section = 0; section < NrOfSections; section++)
+	{
+		header.structSizes[section] = StructSizes[section];
+		header.counts[section] = counts[section];
+		header.offsets[section] = fileSize;
+		fileSize = AlignToCacheLine(fileSize + uint64_t(counts[section]) * StructSizes[section]);
+	}
+
+	std::vector<uint8_t> file(fileSize);
+	std::memcpy(file.data(), &header, sizeof(CacheHeader));
+	for (uint32_t section = 0; section < NrOfSections; section++)
+	{
+		if (counts[section] > 0) std::memcpy(file.data() + header.offsets[section], sectionData[section], size_t(counts[section]) * StructSizes[section]);
+	}
+	BVHCache::WriteFile(BVHCache::GetPath(key), file.data(), file.size());
+}
+
+void BVH::CopyCacheFile()
+{
+	const uint32_t triCount = HasQuantizedNodes() ? 0 : referenceCount;
+	bvhNodes.assign(pNodes, pNodes + nodesUsed);
+	tri.assign(pTri, pTri + triCount);
+	triIntersect.assign(pTriIntersect, pTriIntersect + triCount);
+	triGroups.assign(pTriGroups, pTriGroups + triGroupCount);
+	leafFirstGroup.assign(pLeafFirstGroup, pLeafFirstGroup + (triGroupCount > 0 ? triCount : 0));
+	bvh4Nodes.assign(pBvh4Nodes, pBvh4Nodes + bvh4NodeCount);
+	quantizedNodes.assign(pQuantizedNodes, pQuantizedNodes + quantizedNodeCount);
+	leafMeshTriIndices.assign(pLeafMeshTriIndices, pLeafMeshTriIndices + (HasQuantizedNodes() ? referenceCount : 0));
+	skipNodes.assign(pSkipNodes, pSkipNodes + skipNodeCount);
+	triCullModes.assign(pTriCullModes, pTriCullModes + triCullModeCount);
+	pCacheFile.reset();
+	UpdateViews();
 }
+#pragma endregion
@@ -1,12 +1,18 @@
 #pragma once
 
+#include <bit>
 #include <cstdint>
+#include <iosfwd>
+#include <memory>
 #include <vector>
+#include "MeshAccelerator.h"
 #include "Vector3.h"
+#include "WorkerPool.h"
 
 namespace dae
 {
 	struct TriangleMesh;
+	enum class TriangleCullMode;
 }
 
 
@@ -15,17 +21,25 @@ struct aabb
 	dae::Vector3 bmin{ 1e30f, 1e30f, 1e30f };
 	dae::Vector3 bmax{ -1e30f, -1e30f, -1e30f };
 	void grow(dae::Vector3 p) { bmin = dae::Vector3::Min(bmin, p), bmax = dae::Vector3::Max(bmax, p); }
-	float halfArea()
+	void grow(const aabb& b) { if (b.bmin.x != 1e30f) { grow(b.bmin); grow(b.bmax); } }
+	float halfArea() const
 	{
 		dae::Vector3 e = bmax - bmin; // box extent
 		return e.x * e.y + e.y * e.z + e.z * e.x;
 	}
 };
 
-struct BVHNode
+// Nodes are stored depth-first: an inner node's left child directly follows it,
+// so only the right child needs an index and the node fits in half a cache line
+struct alignas(32) BVHNode
 {
-	aabb aabb;
-	uint32_t leftNode, firstTriIdx, triCount;
+	::aabb aabb;
+	union
+	{
+		uint32_t rightNode;   // inner nodes
+		uint32_t firstTriIdx; // leaves
+	};
+	uint32_t triCount;
 
 	bool IsLeaf() const
 	{
@@ -34,30 +48,336 @@ struct BVHNode
 };
 
 
+static_assert(sizeof(BVHNode) == 32, "BVHNode should fill exactly half a cache line");
+
+// BVHNode for the stackless traversal: an inner node stores where to continue when its box is missed,
+// the first node after its subtree, instead of its right child. A leaf is its whole subtree, so after it the traversal always continues at the next node
+struct alignas(32) BVHSkipNode
+{
+	::aabb aabb;
+	union
+	{
+		uint32_t skipNode;    // inner nodes, index of the first node after the subtree (the node count for the root)
+		uint32_t firstTriIdx; // leaves
+	};
+	uint32_t triCount;
+
+	bool IsLeaf() const { return triCount > 0; }
+};
+static_assert(sizeof(BVHSkipNode) == 32);
+
+// Collapsed node with up to four children, their bounds are stored per axis (SoA)
+// so a single SSE slab test intersects all of them at once
+struct alignas(16) BVH4Node
+{
+	float bminX[4], bminY[4], bminZ[4];
+	float bmaxX[4], bmaxY[4], bmaxZ[4];
+	uint32_t child[4];    // BVH4 node index, or the first tri for leaf children
+	uint32_t triCount[4]; // > 0 for leaf children
+	uint32_t childCount;
+};
+
+// BVH4Node with the child boxes quantized to 8 bits on a grid over the node's own box, 64 bytes instead of 144.
+// The grid spacing is a power of two and the boxes are rounded outwards, so the decoded boxes always contain the exact ones
+struct alignas(64) BVH4QuantizedNode
+{
+	float origin[3];     // minimum corner of the node box
+	int8_t exponent[3];  // grid spacing per axis is 2^exponent
+	uint8_t childCount;
+	uint8_t qminX[4], qminY[4], qminZ[4];
+	uint8_t qmaxX[4], qmaxY[4], qmaxZ[4];
+	uint32_t child[4];    // node index, or the first entry in the leaf triangle indices for leaf children
+	uint16_t triCount[4]; // > 0 for leaf children
+
+	float GetSpacing(int axis) const { return std::bit_cast<float>(uint32_t(exponent[axis] + 127) << 23); }
+};
+static_assert(sizeof(BVH4QuantizedNode) == 64);
+
+enum class BVHBuilder : uint8_t
+{
+	BinnedSAH, // top-down binned SAH, the best trees
+	LBVH,      // linear BVH from Morton sorted centroids, builds much faster for meshes that deform every frame
+	SBVH       // binned SAH plus spatial splits that clip and duplicate large triangles, slow to build, for static meshes
+};
+
+struct BVHBuildSettings
+{
+	static constexpr uint32_t MaxBins{ 32 };
+
+	BVHBuilder builder{ BVHBuilder::BinnedSAH };
+	bool optimizeTreelets{ false };   // LBVH only: reorganize treelets of up to 7 nodes for the lowest SAH cost
+	float spatialSplitAlpha{ 1e-5f }; // SBVH only: spatial splits are tried once the object split children overlap by this fraction of the root area
+	float spatialSplitBudget{ 0.3f }; // SBVH only: extra triangle references spatial splits may add, as a fraction of the triangle count
+	uint32_t nrOfBins{ 16 };          // split candidates per axis, clamped to [2, MaxBins]
+	float traversalCost{ 1.f };       // SAH cost of visiting an inner node
+	float intersectionCost{ 1.f };    // SAH cost of one triangle test, i.e. the leaf cost per triangle
+	float groupIntersectionCost{ 1.5f }; // SAH cost of testing one group of four triangles, used with simdLeaves
+	uint32_t minTrianglesToSplit{ 4 }; // nodes with fewer triangles always stay leaves
+	float maxRefitCostRatio{ 1.3f };  // Refit rebuilds once the SAH cost grew past this factor of the cost at build time
+	bool collapseToBVH4{ true };      // traverse a 4-wide copy of the binary tree, see BVH4Node
+	bool simdLeaves{ true };          // test leaf triangles four at a time, see TriIntersect4
+	bool compressNodes{ false };      // static meshes: quantized 4-wide nodes and leaves that index the mesh's vertices, see BVH4QuantizedNode
+	bool stacklessTraversal{ false }; // traverse binary nodes with skip links instead of the 4-wide ones, see BVHSkipNode. Ignored with compressNodes
+	uint32_t nrOfBuildThreads{ 0 };   // 0 = one per hardware thread, 1 builds on the calling thread only
+	uint32_t minTrianglesPerBuildTask{ 8192 }; // smaller subtrees are built by a single thread, larger nodes are split with parallel binning
+};
+
+// Cold triangle data: read by the build and refit, and for the normal once a hit was found
 struct Tri
 {
 	dae::Vector3 vertex0, vertex1, vertex2;
 	dae::Vector3 centroid;
-	dae::Vector3 normals;
+	dae::Vector3 normals; // normalized
+	uint32_t meshTriIdx; // triangle index in the mesh, the build reorders tri
+};
+
+// Hot triangle data: only what the ray/triangle test reads, packed in the same order as tri
+struct TriIntersect
+{
+	dae::Vector3 vertex0;
+	dae::Vector3 edge1; // vertex1 - vertex0
+	dae::Vector3 edge2; // vertex2 - vertex0
+};
+
+// The same data for four triangles of one leaf in SoA form, tested at once with SSE.
+// Every leaf starts a new group, unused lanes have zero edges and never hit
+struct alignas(16) TriIntersect4
+{
+	float vertex0X[4], vertex0Y[4], vertex0Z[4];
+	float edge1X[4], edge1Y[4], edge1Z[4];
+	float edge2X[4], edge2Y[4], edge2Z[4];
+};
+
+// Quality and size of one tree, see BVH::ComputeStats
+struct BVHStats
+{
+	uint32_t nodeCount{ 0 }, leafCount{ 0 };
+	uint32_t triangleCount{ 0 }, referenceCount{ 0 }; // more references than triangles when an SBVH duplicated some
+	float sahCost{ 0.f };
+	float overlap{ 0.f }; // see BVH::ComputeOverlap
+	uint32_t maxDepth{ 0 };
+	float averageLeafDepth{ 0.f }, averageLeafSize{ 0.f };
+	std::vector<uint32_t> leavesPerDepth{}; // leaves at every depth, the root is depth 0
+	std::vector<uint32_t> leavesPerSize{};  // leaves with every triangle count
+	size_t nodeBytes{ 0 };     // binary, skip and 4-wide nodes
+	size_t triangleBytes{ 0 }; // cold, hot and grouped triangle data, and the cull modes of meshes with one per triangle
+	float buildTimeMs{ 0.f };  // the last BuildBVH, or mapping the tree from the cache
+	bool mappedFromCache{ false };
+
+	void Print(std::ostream& out) const;
 };
 
-class BVH
+class MappedFile;
+
+class BVH final : public dae::MeshAccelerator
 {
 public:
-	BVH(dae::TriangleMesh* triangleMesh);
-	~BVH() = default;
+	BVH(dae::TriangleMesh* triangleMesh, const BVHBuildSettings& settings = {});
+	~BVH() override;
 	void BuildBVH();
+	// Maps the tree from the BVH cache when it holds one for this mesh and these settings,
+	// otherwise builds it and stores it there. Same as BuildBVH while no cache directory is set
+	void LoadOrBuildBVH();
+	// True while the tree is read straight from a mapped cache file, until Refit or a rebuild copies it
+	bool IsMappedFromCache() const { return pCacheFile != nullptr; }
+	// Keeps the topology and recomputes the bounds from the mesh's transformed vertices,
+	// falls back to BuildBVH when the tree quality degraded too much. Compressed trees are always rebuilt
+	void Refit() override;
+	void SetMesh(dae::TriangleMesh* triangleMesh) override { mesh = triangleMesh; }
+	float ComputeSAHCost() const;
+	// Summed surface area of the overlap between every pair of siblings, relative to the root's surface area
+	float ComputeOverlap() const;
+	// Triangle references in the leaves, more than the mesh's triangle count when an SBVH duplicated some
+	uint32_t GetReferenceCount() const { return referenceCount; }
+	BVHStats ComputeStats() const;
+
+	// MeshAccelerator, the hit tests go through GeometryUtils::HitTest_TriangleMesh like the renderer's do
+	void Build() override { BuildBVH(); }
+	bool ClosestHit(const dae::Ray& ray, dae::HitRecord& hitRecord) const override;
+	bool AnyHit(const dae::Ray& ray) const override;
+	aabb GetBounds() const override { return pNodes[rootNodeIdx].aabb; }
+	size_t GetMemoryBytes() const override { return ComputeNodeBytes() + ComputeTriangleBytes(); }
+	dae::AcceleratorType GetType() const override { return dae::AcceleratorType::BVH; }
+
+	// One line per node in depth-first order: its bounds, then its children or the mesh triangles of the leaf
+	void DumpTree(std::ostream& out) const;
 	void UpdateNodeBounds(uint32_t const nodeIdx);
-	void Subdivide(uint32_t const nodeIdx);
+	void Subdivide(uint32_t const nodeIdx, const aabb& centroidBounds);
 	BVHNode& GetBvhNodes(int nodeIdx);
+	const BVHNode& GetBvhNode(uint32_t nodeIdx) const { return pNodes[nodeIdx]; }
+	uint32_t GetNodeCount() const { return nodesUsed; }
 	Tri& GetTriAtIdx(int idx);
-	float EvaluateSAH(BVHNode& node, int axis, float pos);
+	const Tri& GetTriAtIdx(uint32_t idx) const { return pTri[idx]; }
+	const TriIntersect& GetTriIntersectAtIdx(uint32_t idx) const { return pTriIntersect[idx]; }
+	bool HasTriGroups() const { return triGroupCount > 0; }
+	const TriIntersect4& GetTriGroupAtIdx(uint32_t idx) const { return pTriGroups[idx]; }
+	// First TriIntersect4 group of the leaf starting at firstTriIdx
+	uint32_t GetLeafFirstGroup(uint32_t firstTriIdx) const { return pLeafFirstGroup[firstTriIdx]; }
+	// Only kept for meshes with a cull mode per triangle, in the same order as tri, see TriangleMesh::triangleCullModes
+	bool HasTriCullModes() const { return triCullModeCount > 0; }
+	dae::TriangleCullMode GetTriCullMode(uint32_t idx) const { return static_cast<dae::TriangleCullMode>(pTriCullModes[idx]); }
+	// Rebuilds the 4-wide nodes from the binary tree, done by BuildBVH and Refit when enabled in the settings
+	void CollapseToBVH4();
+	bool HasBVH4() const { return bvh4NodeCount > 0; }
+	const BVH4Node& GetBvh4Node(uint32_t nodeIdx) const { return pBvh4Nodes[nodeIdx]; }
+	bool HasQuantizedNodes() const { return quantizedNodeCount > 0; }
+	const BVH4QuantizedNode& GetQuantizedNode(uint32_t nodeIdx) const { return pQuantizedNodes[nodeIdx]; }
+	// Mesh triangle of a leaf entry, the only triangle data a compressed BVH keeps
+	uint32_t GetLeafMeshTriIdx(uint32_t idx) const { return pLeafMeshTriIndices[idx]; }
+	bool HasSkipNodes() const { return skipNodeCount > 0; }
+	const BVHSkipNode& GetSkipNode(uint32_t nodeIdx) const { return pSkipNodes[nodeIdx]; }
+
+	const BVHBuildSettings& GetBuildSettings() const { return settings; }
+	void SetBuildSettings(const BVHBuildSettings& buildSettings) { settings = buildSettings; }
 
 	dae::TriangleMesh* mesh;
 private:
+	// what ComputeStats reports as nodeBytes and triangleBytes
+	size_t ComputeNodeBytes() const;
+	size_t ComputeTriangleBytes() const;
+
+	struct Bin
+	{
+		aabb bounds{};
+		aabb centroidBounds{};
+		uint32_t triCount{ 0 };
+	};
+
+	// The bins of all three axes, filled in a single pass over the triangles
+	struct BinSet
+	{
+		Bin bins[3][BVHBuildSettings::MaxBins]{};
+	};
+
+	struct Split
+	{
+		int axis{ -1 };
+		uint32_t lastLeftBin{ 0 };
+		float cost{ 1e30f };
+		aabb leftBounds{}, rightBounds{};
+		aabb leftCentroidBounds{}, rightCentroidBounds{};
+	};
+
+	// Subtree below the top levels, built by one thread in the node range its root reserved
+	struct BuildTask
+	{
+		uint32_t nodeIdx{ 0 };
+		aabb centroidBounds{};
+		uint32_t nodeCount{ 0 };
+	};
+
+	// SBVH build reference: a triangle, or the part of it on one side of a spatial split
+	struct SBVHReference
+	{
+		aabb bounds{};
+		uint32_t triIdx{ 0 };
+	};
+
+	struct SpatialSplit
+	{
+		int axis{ -1 };
+		float position{ 0.f };
+		float cost{ 1e30f };
+	};
+
+	struct SBVHBuildState
+	{
+		std::vector<uint32_t> leafTriIndices{}; // tri index of every reference in leaf order
+		uint32_t duplicationBudget{ 0 };
+		float rootArea{ 0.f };
+	};
+
+	// LBVH build node, children are linked explicitly so treelets can be reorganized before flattening
+	struct LBVHNode
+	{
+		aabb bounds{};
+		uint32_t leftNode{ 0 }, rightNode{ 0 };
+		uint32_t firstTriIdx{ 0 }, triCount{ 0 };
+		float cost{ 0.f }; // SAH cost of the subtree, not normalized by the root area
+	};
+
+	void LoadTriangle(uint32_t triIdx, uint32_t meshTriIdx);
+	void UpdateIntersectionData();
+	void UpdateTriCullModes();
+	float GetLeafCost(uint32_t triCount) const;
+	uint32_t GetBuildThreadCount() const;
+	// The build's pool, started again only when the number of threads changes
+	dae::WorkerPool& GetWorkerPool(uint32_t nrOfThreads);
+	void Subdivide(uint32_t nodeIdx, const aabb& centroidBounds, uint32_t& nodeCounter);
+	void SubdivideTopLevel(uint32_t nodeIdx, const aabb& centroidBounds, uint32_t nrOfThreads, std::vector<BuildTask>& tasks);
+	bool PartitionNode(uint32_t nodeIdx, const aabb& centroidBounds, uint32_t nrOfThreads, Split& split, uint32_t& splitTriIdx);
+	uint32_t CopySubtree(uint32_t nodeIdx, std::vector<BVHNode>& compactNodes) const;
+	void BuildLBVH(const aabb& centroidBounds, uint32_t nrOfThreads);
+	void SortMortonKeys(uint32_t nrOfThreads);
+	bool FindMortonSplit(uint32_t firstTriIdx, uint32_t triCount, uint32_t& splitTriIdx) const;
+	void SplitLBVHNode(uint32_t nodeIdx, uint32_t splitTriIdx);
+	void EmitLBVH(uint32_t nodeIdx);
+	void EmitLBVHTopLevel(uint32_t nodeIdx, std::vector<uint32_t>& topLevelNodes, std::vector<BuildTask>& tasks);
+	void FinishLBVHNode(uint32_t nodeIdx);
+	void OptimizeTreelet(uint32_t rootIdx);
+	uint32_t FlattenLBVH(uint32_t lbvhNodeIdx);
+	void FillBins(uint32_t firstTriIdx, uint32_t triCount, const float binMin[3], const float binScale[3], BinSet& binSet) const;
+	Split FindBestSplit(const BVHNode& node, const aabb& centroidBounds, uint32_t nrOfThreads = 1);
+	Split EvaluateBins(const BinSet& binSet, const float binScale[3], float nodeArea) const;
+	void BuildSBVH();
+	uint32_t SubdivideSBVH(std::vector<SBVHReference>& references, const aabb& bounds, uint32_t depth, SBVHBuildState& state);
+	Split FindObjectSplit(const std::vector<SBVHReference>& references, const aabb& bounds, const aabb& centroidBounds) const;
+	SpatialSplit FindSpatialSplit(const std::vector<SBVHReference>& references, const aabb& bounds) const;
+	bool PartitionObjectSplit(const std::vector<SBVHReference>& references, const Split& split, const aabb& centroidBounds,
+		std::vector<SBVHReference>& left, std::vector<SBVHReference>& right) const;
+	bool PartitionSpatialSplit(const std::vector<SBVHReference>& references, const SpatialSplit& split, uint32_t& duplicationBudget,
+		std::vector<SBVHReference>& left, std::vector<SBVHReference>& right) const;
+	uint32_t GetBinCount() const;
+	uint32_t GetBinIdx(float centroid, float binMin, float binScale) const;
+	void CollapseNode(uint32_t bvh4NodeIdx, uint32_t nodeIdx);
+	bool CompressNodes();
+	void BuildSkipNodes();
+	void BuildTraversalNodes();
+	void UpdateViews();
+	uint64_t ComputeCacheKey() const;
+	bool LoadFromCache(uint64_t key);
+	void SaveToCache(uint64_t key) const;
+	void CopyCacheFile();
+
+	BVHBuildSettings settings{};
 	int NrOfTriangles{ 0 };
 	std::vector<Tri>tri{};
+	std::vector<TriIntersect> triIntersect{};
+	std::vector<TriIntersect4> triGroups{};
+	std::vector<uint32_t> leafFirstGroup{};
+	std::vector<uint8_t> triCullModes{};
 	std::vector <BVHNode> bvhNodes;
+	std::vector<BVH4Node> bvh4Nodes{};
+	std::vector<BVH4QuantizedNode> quantizedNodes{};
+	std::vector<uint32_t> leafMeshTriIndices{};
+	std::vector<BVHSkipNode> skipNodes{};
+	// LBVH scratch, kept between builds so per-frame rebuilds don't allocate
+	std::vector<uint64_t> mortonKeys{}, mortonScratch{}; // Morton code in the upper 32 bits, triangle index in the lower ones
+	std::vector<Tri> triScratch{};
+	std::vector<LBVHNode> lbvhNodes{};
+	std::vector<uint32_t> radixOffsets{}; // bucket offsets of every slice of the radix sort
+	std::vector<uint32_t> lbvhTopLevelNodes{};
+	// Parallel build scratch, also kept between builds
+	std::vector<BuildTask> buildTasks{};
+	std::vector<BinSet> sliceBinSets{};
+	std::vector<BVHNode> compactNodes{};
+	std::unique_ptr<dae::WorkerPool> workerPool{};
 	uint32_t rootNodeIdx = 0, nodesUsed = 1;
+	float buildSAHCost{ 0.f };
+	float buildTimeMs{ 0.f };
+
+	// What the accessors read: the vectors above after a build, or the cache file the tree was mapped from
+	const BVHNode* pNodes{ nullptr };
+	const Tri* pTri{ nullptr };
+	const TriIntersect* pTriIntersect{ nullptr };
+	const TriIntersect4* pTriGroups{ nullptr };
+	const uint32_t* pLeafFirstGroup{ nullptr };
+	const uint8_t* pTriCullModes{ nullptr };
+	const BVH4Node* pBvh4Nodes{ nullptr };
+	const BVH4QuantizedNode* pQuantizedNodes{ nullptr };
+	const uint32_t* pLeafMeshTriIndices{ nullptr };
+	const BVHSkipNode* pSkipNodes{ nullptr };
+	uint32_t referenceCount{ 0 }, triGroupCount{ 0 }, bvh4NodeCount{ 0 }, quantizedNodeCount{ 0 }, skipNodeCount{ 0 }, triCullModeCount{ 0 };
+	std::unique_ptr<MappedFile> pCacheFile{};
 
 };
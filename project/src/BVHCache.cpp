@@ -0,0 +1,136 @@
+#include "BVHCache.h"
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#pragma region MappedFile
+std::unique_ptr<MappedFile> MappedFile::Open(const std::string& path)
+{
+	std::unique_ptr<MappedFile> pFile{ new MappedFile{} };
+#ifdef _WIN32
+	pFile->fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (pFile->fileHandle == INVALID_HANDLE_VALUE)
+	{
+		pFile->fileHandle = nullptr;
+		return nullptr;
+	}
+
+	LARGE_INTEGER fileSize{};
+	if (!GetFileSizeEx(pFile->fileHandle, &fileSize) || fileSize.QuadPart == 0) return nullptr;
+	pFile->size = size_t(fileSize.QuadPart);
+
+	pFile->mappingHandle = CreateFileMappingA(pFile->fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (pFile->mappingHandle == nullptr) return nullptr;
+
+	pFile->pData = static_cast<const uint8_t*>(MapViewOfFile(pFile->mappingHandle, FILE_MAP_READ, 0, 0, 0));
+	if (pFile->pData == nullptr) return nullptr;
+#else
+	const int fileDescriptor = open(path.c_str(), O_RDONLY);
+	if (fileDescriptor < 0) return nullptr;
+
+	struct stat fileStatus {};
+	if (fstat(fileDescriptor, &fileStatus) != 0 || fileStatus.st_size == 0)
+	{
+		close(fileDescriptor);
+		return nullptr;
+	}
+
+	// the mapping keeps its own reference to the file
+	void* pMapping = mmap(nullptr, size_t(fileStatus.st_size), PROT_READ, MAP_SHARED, fileDescriptor, 0);
+	close(fileDescriptor);
+	if (pMapping == MAP_FAILED) return nullptr;
+
+	pFile->pData = static_cast<const uint8_t*>(pMapping);
+	pFile->size = size_t(fileStatus.st_size);
+#endif
+	return pFile;
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+	if (pData != nullptr) UnmapViewOfFile(pData);
+	if (mappingHandle != nullptr) CloseHandle(mappingHandle);
+	if (fileHandle != nullptr) CloseHandle(fileHandle);
+#else
+	if (pData != nullptr) munmap(const_cast<uint8_t*>(pData), size);
+#endif
+}
+#pragma endregion
+
+#pragma region BVHCache
+namespace
+{
+	std::string g_CacheDirectory{};
+}
+
+void BVHCache::SetDirectory(const std::string& directory)
+{
+	g_CacheDirectory = directory;
+	if (!directory.empty())
+	{
+		std::error_code error{};
+		std::filesystem::create_directories(directory, error);
+	}
+}
+
+const std::string& BVHCache::GetDirectory()
+{
+	return g_CacheDirectory;
+}
+
+std::string BVHCache::GetPath(uint64_t key)
+{
+	char fileName[32]{};
+	std::snprintf(fileName, sizeof(fileName), "%016llx.bvh", static_cast<unsigned long long>(key));
+	return (std::filesystem::path{ g_CacheDirectory } / fileName).string();
+}
+
+uint64_t BVHCache::Hash(const void* pData, size_t size, uint64_t hash)
+{
+	const uint8_t* pBytes = static_cast<const uint8_t*>(pData);
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= pBytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+bool BVHCache::WriteFile(const std::string& path, const void* pData, size_t size)
+{
+	// unique per process and thread, so concurrent writers of the same tree don't share a temporary file
+	const size_t writerId = std::hash<std::thread::id>{}(std::this_thread::get_id()) ^ size_t(std::chrono::steady_clock::now().time_since_epoch().count());
+	const std::string tempPath = path + "." + std::to_string(writerId) + ".tmp";
+	std::error_code error{};
+	{
+		std::ofstream file{ tempPath, std::ios::binary | std::ios::trunc };
+		if (!file.write(static_cast<const char*>(pData), std::streamsize(size)))
+		{
+			file.close();
+			std::filesystem::remove(tempPath, error);
+			return false;
+		}
+	}
+
+	// losing the race against another writer is fine, it wrote the same tree
+	std::filesystem::rename(tempPath, path, error);
+	if (error) std::filesystem::remove(tempPath, error);
+	return true;
+}
+#pragma endregion
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Read-only mapping of a whole file. The pages come straight from the OS file cache,
+// so every process that maps the same file shares one copy in memory
+class MappedFile
+{
+public:
+	// nullptr when the file doesn't exist or can't be mapped
+	static std::unique_ptr<MappedFile> Open(const std::string& path);
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const uint8_t* GetData() const { return pData; }
+	size_t GetSize() const { return size; }
+
+private:
+	MappedFile() = default;
+
+	const uint8_t* pData{ nullptr };
+	size_t size{ 0 };
+#ifdef _WIN32
+	void* fileHandle{ nullptr };
+	void* mappingHandle{ nullptr };
+#endif
+};
+
+// On-disk cache of built BVHs, see BVH::LoadOrBuildBVH.
+// Every file holds one tree and is named after a hash of the mesh and the build settings
+namespace BVHCache
+{
+	constexpr uint64_t HashSeed{ 14695981039346656037ull };
+
+	// Empty disables the cache, the default
+	void SetDirectory(const std::string& directory);
+	const std::string& GetDirectory();
+	std::string GetPath(uint64_t key);
+
+	// 64-bit FNV-1a, chain calls by passing the previous result as hash
+	uint64_t Hash(const void* pData, size_t size, uint64_t hash = HashSeed);
+
+	// Writes to a temporary file first and renames it into place, so other processes never map a partial tree
+	bool WriteFile(const std::string& path, const void* pData, size_t size);
+}
@@ -1,14 +1,26 @@
 #pragma once
 #include <iostream>
-#include <SDL_keyboard.h>
-#include <SDL_mouse.h>
 
 #include "Maths.h"
-#include "SDL_events.h"
 #include "Timer.h"
 
 namespace dae
 {
+	//Input state for one frame, filled in by the application (e.g. from SDL)
+	struct CameraInput
+	{
+		bool moveForward{ false };
+		bool moveBackward{ false };
+		bool moveRight{ false };
+		bool moveLeft{ false };
+		bool moveUp{ false };
+		bool moveDown{ false };
+
+		bool isRotating{ false };
+		int mouseDeltaX{ 0 };
+		int mouseDeltaY{ 0 };
+	};
+
 	struct Camera
 	{
 		Camera() = default;
@@ -36,6 +48,8 @@ namespace dae
 
 		Matrix cameraToWorld{};
 
+		CameraInput input{};
+
 
 		Matrix CalculateCameraToWorld()
 		{
@@ -47,8 +61,6 @@ namespace dae
 
 		void Update(Timer* pTimer)
 		{
-			SDL_SetRelativeMouseMode(SDL_TRUE);
-
 			if (fovAngle != previousfovAngle)
 			{
 				FOV = tan ((fovAngle * (PI / 180)) / 2);
@@ -56,19 +68,13 @@ namespace dae
 				previousfovAngle = fovAngle;
 			}
 
-			SDL_Event event;
-
 			const float deltaTime = pTimer->GetElapsed();
 
-			//Keyboard Input
-			const uint8_t* pKeyboardState = SDL_GetKeyboardState(nullptr);
-
 			//Mouse Input
-			int mouseX{}, mouseY{};
-			const uint32_t mouseState = SDL_GetRelativeMouseState(&mouseX, &mouseY);
+			const int mouseX{ input.mouseDeltaX }, mouseY{ input.mouseDeltaY };
 
 			// Process mouse movements (relative to the last frame)
-			if (mouseState & SDL_BUTTON(SDL_BUTTON_RIGHT))
+			if (input.isRotating)
 			{
 				
 				if (mouseX != 0 || mouseY != 0)
@@ -97,27 +103,27 @@ namespace dae
 
 			Vector3 upVector = Vector3{}.Cross(forward,right).Normalized() * movSpeed * deltaTime;
 
-			if (pKeyboardState[SDL_SCANCODE_W])
+			if (input.moveForward)
 			{
 				origin += forwardVec;
 			}
 
-			if (pKeyboardState[SDL_SCANCODE_S])
+			if (input.moveBackward)
 			{
 				origin -= forwardVec;
 			}
 
-			if (pKeyboardState[SDL_SCANCODE_D])
+			if (input.moveRight)
 			{
 				origin += rightVector;
 			}
 
-			if (pKeyboardState[SDL_SCANCODE_A])
+			if (input.moveLeft)
 			{
 				origin -= rightVector;
 			}
 
-			if (pKeyboardState[SDL_SCANCODE_SPACE])
+			if (input.moveUp)
 			{
 				if (forward.z < 0)
 				{
@@ -131,7 +137,7 @@ namespace dae
 				
 			}
 
-			if (pKeyboardState[SDL_SCANCODE_LSHIFT])
+			if (input.moveDown)
 			{
 				if (forward.z < 0)
 				{
@@ -1,6 +1,8 @@
 #pragma once
 #include <filesystem>
+#include <memory>
 #include <stdexcept>
+#include <utility>
 #include <vector>
 #include "BVH.h"
 
@@ -79,6 +81,39 @@ namespace dae
 			UpdateTransforms();
 		}
 
+		//The accelerator points back at the mesh, moving the mesh hands it the new address.
+		//Keep the member list in step with the members below
+		TriangleMesh(TriangleMesh&& other) noexcept
+		{
+			*this = std::move(other);
+		}
+
+		TriangleMesh& operator=(TriangleMesh&& other) noexcept
+		{
+			if (this == &other) return *this;
+
+			positions = std::move(other.positions);
+			normals = std::move(other.normals);
+			indices = std::move(other.indices);
+			materialIndex = other.materialIndex;
+			cullMode = other.cullMode;
+			triangleMaterials = std::move(other.triangleMaterials);
+			triangleCullModes = std::move(other.triangleCullModes);
+			rotationTransform = other.rotationTransform;
+			translationTransform = other.translationTransform;
+			scaleTransform = other.scaleTransform;
+			minAABB = other.minAABB;
+			maxAABB = other.maxAABB;
+			transformedMinAABB = other.transformedMinAABB;
+			transformedMaxAABB = other.transformedMaxAABB;
+			transformedPositions = std::move(other.transformedPositions);
+			transformedNormals = std::move(other.transformedNormals);
+			accelerator = std::move(other.accelerator);
+			bvh = std::exchange(other.bvh, nullptr);
+			if (accelerator != nullptr) accelerator->SetMesh(this);
+			return *this;
+		}
+
 		std::vector<Vector3> positions{};
 		std::vector<Vector3> normals{};
 		std::vector<int> indices{};
@@ -87,6 +122,11 @@ namespace dae
 
 		TriangleCullMode cullMode{ TriangleCullMode::BackFaceCulling };
 
+		//Per triangle overrides, set when the mesh combines several meshes (see Scene::BuildAccelerationStructure).
+		//Empty means materialIndex and cullMode hold for every triangle. Build the BVH after setting triangleCullModes
+		std::vector<unsigned char> triangleMaterials{};
+		std::vector<TriangleCullMode> triangleCullModes{};
+
 		Matrix rotationTransform{};
 		Matrix translationTransform{};
 		Matrix scaleTransform{};
@@ -99,8 +139,20 @@ namespace dae
 
 		std::vector<Vector3> transformedPositions{};
 		std::vector<Vector3> transformedNormals{};
-		BVH* bvh;
+		//Built by BuildAccelerator. bvh is the same object while it is a BVH, the hit tests traverse that one inline
+		std::unique_ptr<MeshAccelerator> accelerator{};
+		BVH* bvh{ nullptr };
+
+
+		unsigned char GetMaterialIndex(uint32_t triIdx) const
+		{
+			return triangleMaterials.empty() ? materialIndex : triangleMaterials[triIdx];
+		}
 
+		TriangleCullMode GetCullMode(uint32_t triIdx) const
+		{
+			return triangleCullModes.empty() ? cullMode : triangleCullModes[triIdx];
+		}
 
 		void Translate(const Vector3& translation)
 		{
@@ -177,18 +229,27 @@ namespace dae
 			}
 
 
-			for (auto& p: positions)
-			{
-				transformedPositions.emplace_back(FullTransformMatrix.TransformPoint(p));
-			}
+			if (accelerator != nullptr) accelerator->Refit();
+		}
 
-			if (bvh != nullptr) bvh->BuildBVH();
+		void BuildBVH(const BVHBuildSettings& settings = {})
+		{
+			std::unique_ptr<BVH> pBVH = std::make_unique<BVH>(this, settings);
+			pBVH->LoadOrBuildBVH();
+			bvh = pBVH.get();
+			accelerator = std::move(pBVH);
 		}
 
-		void BuildBVH()
+		void BuildAccelerator(AcceleratorType type = GetDefaultAcceleratorType())
 		{
-			bvh = new BVH(this);
-			bvh->BuildBVH();
+			accelerator = CreateAccelerator(this, type);
+			bvh = type == AcceleratorType::BVH ? static_cast<BVH*>(accelerator.get()) : nullptr;
+		}
+
+		void ClearAccelerator()
+		{
+			accelerator.reset();
+			bvh = nullptr;
 		}
 
 	};
@@ -216,11 +277,21 @@ namespace dae
 #pragma region MISC
 	struct Ray
 	{
+		Ray() = default;
+		Ray(const Vector3& _origin, const Vector3& _direction, float _min = 0.0001f, float _max = FLT_MAX) :
+			origin{ _origin }, direction{ _direction }, min{ _min }, max{ _max },
+			rcpDirection{ 1.f / _direction.x, 1.f / _direction.y, 1.f / _direction.z },
+			sign{ rcpDirection.x < 0.f, rcpDirection.y < 0.f, rcpDirection.z < 0.f } {}
+
 		Vector3 origin{};
 		Vector3 direction{};
 
 		float min{ 0.0001f };
 		float max{ FLT_MAX };
+
+		//Cached for the slab tests, set by the constructor so don't change direction afterwards
+		Vector3 rcpDirection{};
+		bool sign[3]{}; //true where the direction is negative, bmax is then the near plane of a box on that axis
 	};
 
 	struct HitRecord
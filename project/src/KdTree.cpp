@@ -0,0 +1,268 @@
+#include "KdTree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+#include "Utils.h"
+
+namespace dae
+{
+	namespace
+	{
+		// the traversal stack holds at most one entry per level
+		constexpr uint32_t MaxKdTreeDepth{ 60 };
+
+		struct KdTraversalEntry
+		{
+			uint32_t nodeIdx;
+			float tMin, tMax;
+		};
+	}
+
+	KdTree::KdTree(TriangleMesh* pMesh, const KdTreeSettings& settings) :
+		pMesh{ pMesh }, settings{ settings }
+	{
+	}
+
+	void KdTree::Build()
+	{
+		const uint32_t nrOfTriangles = uint32_t(pMesh->indices.size() / 3);
+		triIntersect.resize(nrOfTriangles);
+		triBounds.resize(nrOfTriangles);
+		bounds = aabb{};
+		for (uint32_t triIdx = 0; triIdx < nrOfTriangles; triIdx++)
+		{
+			const Vector3& vertex0 = pMesh->transformedPositions[pMesh->indices[triIdx * 3]];
+			const Vector3& vertex1 = pMesh->transformedPositions[pMesh->indices[triIdx * 3 + 1]];
+			const Vector3& vertex2 = pMesh->transformedPositions[pMesh->indices[triIdx * 3 + 2]];
+			triIntersect[triIdx] = { vertex0, vertex1 - vertex0, vertex2 - vertex0 };
+
+			aabb& triangleBounds = triBounds[triIdx];
+			triangleBounds = aabb{};
+			triangleBounds.grow(vertex0);
+			triangleBounds.grow(vertex1);
+			triangleBounds.grow(vertex2);
+			bounds.grow(triangleBounds);
+		}
+
+		nodes.clear();
+		triIndices.clear();
+		if (nrOfTriangles == 0) return;
+
+		maxDepth = std::min(MaxKdTreeDepth, settings.maxDepth > 0 ? settings.maxDepth : uint32_t(8.f + 1.3f * std::log2(float(nrOfTriangles))));
+		std::vector<uint32_t> rootTriIndices(nrOfTriangles);
+		std::iota(rootTriIndices.begin(), rootTriIndices.end(), 0u);
+		nodes.emplace_back();
+		Subdivide(0, bounds, rootTriIndices, 0);
+
+		nodes.shrink_to_fit();
+		triIndices.shrink_to_fit();
+		triBounds = {};
+	}
+
+	void KdTree::Subdivide(uint32_t nodeIdx, const aabb& nodeBounds, std::vector<uint32_t>& nodeTriIndices, uint32_t depth)
+	{
+		const uint32_t nrOfTriangles = uint32_t(nodeTriIndices.size());
+		if (nrOfTriangles < settings.minTrianglesToSplit || depth >= maxDepth)
+		{
+			MakeLeaf(nodeIdx, nodeTriIndices);
+			return;
+		}
+
+		const SplitCandidate split = FindSplit(nodeBounds, nodeTriIndices);
+		if (split.cost >= settings.intersectionCost * float(nrOfTriangles))
+		{
+			MakeLeaf(nodeIdx, nodeTriIndices);
+			return;
+		}
+
+		// same rules as FindSplit counted with: triangles lying in the plane go below it, straddling ones to both sides
+		std::vector<uint32_t> below{}, above{};
+		for (const uint32_t triIdx : nodeTriIndices)
+		{
+			const float low = std::max(triBounds[triIdx].bmin[split.axis], nodeBounds.bmin[split.axis]);
+			const float high = std::min(triBounds[triIdx].bmax[split.axis], nodeBounds.bmax[split.axis]);
+			if (low < split.position || (low == split.position && high == split.position)) below.push_back(triIdx);
+			if (high > split.position) above.push_back(triIdx);
+		}
+		nodeTriIndices = {};
+
+		aabb belowBounds = nodeBounds, aboveBounds = nodeBounds;
+		belowBounds.bmax[split.axis] = split.position;
+		aboveBounds.bmin[split.axis] = split.position;
+
+		// the child below the split directly follows its parent
+		nodes.emplace_back();
+		Subdivide(nodeIdx + 1, belowBounds, below, depth + 1);
+		const uint32_t aboveIdx = uint32_t(nodes.size());
+		nodes.emplace_back();
+		Subdivide(aboveIdx, aboveBounds, above, depth + 1);
+
+		KdNode& node = nodes[nodeIdx];
+		node.split = split.position;
+		node.data = split.axis | (aboveIdx << 2);
+	}
+
+	KdTree::SplitCandidate KdTree::FindSplit(const aabb& nodeBounds, const std::vector<uint32_t>& nodeTriIndices) const
+	{
+		SplitCandidate best{};
+		const float nodeArea = nodeBounds.halfArea();
+		if (nodeArea <= 0.f) return best;
+
+		const size_t nrOfTriangles = nodeTriIndices.size();
+		std::vector<float> lows(nrOfTriangles), highs(nrOfTriangles), planars{}, candidates{};
+		for (uint32_t axis = 0; axis < 3; axis++)
+		{
+			const float nodeMin = nodeBounds.bmin[axis], nodeMax = nodeBounds.bmax[axis];
+			if (nodeMax <= nodeMin) continue;
+
+			// the triangle bounds clipped to the node, sorted so one sweep over the candidates counts both sides
+			planars.clear();
+			for (size_t i = 0; i < nrOfTriangles; i++)
+			{
+				const aabb& triangleBounds = triBounds[nodeTriIndices[i]];
+				lows[i] = std::max(triangleBounds.bmin[axis], nodeMin);
+				highs[i] = std::min(triangleBounds.bmax[axis], nodeMax);
+				if (lows[i] == highs[i]) planars.push_back(lows[i]);
+			}
+			std::sort(lows.begin(), lows.end());
+			std::sort(highs.begin(), highs.end());
+			std::sort(planars.begin(), planars.end());
+
+			candidates.resize(nrOfTriangles * 2);
+			std::merge(lows.begin(), lows.end(), highs.begin(), highs.end(), candidates.begin());
+			candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+			size_t lowCount = 0, highCount = 0, planarsBefore = 0, planarsUpTo = 0;
+			for (const float position : candidates)
+			{
+				if (position <= nodeMin || position >= nodeMax) continue;
+
+				while (lowCount < nrOfTriangles && lows[lowCount] < position) lowCount++;
+				while (highCount < nrOfTriangles && highs[highCount] <= position) highCount++;
+				while (planarsBefore < planars.size() && planars[planarsBefore] < position) planarsBefore++;
+				while (planarsUpTo < planars.size() && planars[planarsUpTo] <= position) planarsUpTo++;
+				const float belowCount = float(lowCount + planarsUpTo - planarsBefore);
+				const float aboveCount = float(nrOfTriangles - highCount);
+
+				aabb belowBounds = nodeBounds, aboveBounds = nodeBounds;
+				belowBounds.bmax[axis] = position;
+				aboveBounds.bmin[axis] = position;
+				float cost = settings.traversalCost + settings.intersectionCost *
+					(belowBounds.halfArea() * belowCount + aboveBounds.halfArea() * aboveCount) / nodeArea;
+				if (belowCount == 0.f || aboveCount == 0.f) cost *= 1.f - settings.emptyBonus;
+
+				if (cost < best.cost) best = { axis, position, cost };
+			}
+		}
+		return best;
+	}
+
+	void KdTree::MakeLeaf(uint32_t nodeIdx, const std::vector<uint32_t>& nodeTriIndices)
+	{
+		KdNode& node = nodes[nodeIdx];
+		node.firstTriIdx = uint32_t(triIndices.size());
+		node.data = 3 | (uint32_t(nodeTriIndices.size()) << 2);
+		triIndices.insert(triIndices.end(), nodeTriIndices.begin(), nodeTriIndices.end());
+	}
+
+	bool KdTree::TestLeaf(const KdNode& node, const Ray& ray, float& closestT, uint32_t& closestTriIdx) const
+	{
+		bool didHit = false;
+		for (uint32_t i = node.firstTriIdx; i < node.firstTriIdx + node.GetTriCount(); i++)
+		{
+			const uint32_t triIdx = triIndices[i];
+			float t;
+			if (GeometryUtils::IntersectTriangle(triIntersect[triIdx], pMesh->GetCullMode(triIdx), ray, t) && t < closestT)
+			{
+				closestT = t;
+				closestTriIdx = triIdx;
+				didHit = true;
+			}
+		}
+		return didHit;
+	}
+
+	template<bool IsAnyHit>
+	bool KdTree::Traverse(const Ray& ray, float& closestT, uint32_t& closestTriIdx) const
+	{
+		float tMin, tMax;
+		if (nodes.empty() || !GeometryUtils::ClipRayToAABB(ray, bounds, closestT, tMin, tMax)) return false;
+
+		// Vector3's subscript isn't inlined, copy the ray out once for the per-axis lookups
+		const float rayOrigin[3]{ ray.origin.x, ray.origin.y, ray.origin.z };
+		const float rayDirection[3]{ ray.direction.x, ray.direction.y, ray.direction.z };
+		const float rayRcpDirection[3]{ ray.rcpDirection.x, ray.rcpDirection.y, ray.rcpDirection.z };
+
+		KdTraversalEntry stack[MaxKdTreeDepth];
+		uint32_t stackSize = 0;
+		uint32_t nodeIdx = 0;
+		bool didHit = false;
+		while (true)
+		{
+			// descend to the first leaf along the ray, the far side of every split it crosses waits on the stack
+			const KdNode* node = &nodes[nodeIdx];
+			while (!node->IsLeaf())
+			{
+				const uint32_t axis = node->GetAxis();
+				const float origin = rayOrigin[axis], direction = rayDirection[axis];
+				const bool belowFirst = origin < node->split || (origin == node->split && direction <= 0.f);
+				const uint32_t firstChild = belowFirst ? nodeIdx + 1 : node->GetAboveChild();
+				const uint32_t secondChild = belowFirst ? node->GetAboveChild() : nodeIdx + 1;
+				const float tSplit = direction != 0.f ? (node->split - origin) * rayRcpDirection[axis] : FLT_MAX;
+
+				if (tSplit > tMax || tSplit <= 0.f) nodeIdx = firstChild;
+				else if (tSplit < tMin) nodeIdx = secondChild;
+				else
+				{
+					stack[stackSize++] = { secondChild, tSplit, tMax };
+					nodeIdx = firstChild;
+					tMax = tSplit;
+				}
+				node = &nodes[nodeIdx];
+			}
+
+			if (TestLeaf(*node, ray, closestT, closestTriIdx))
+			{
+				didHit = true;
+				if constexpr (IsAnyHit) return true;
+			}
+
+			// leaves are visited front to back and don't overlap, nothing behind this one can be closer than a hit inside it
+			if (didHit && closestT <= tMax) return true;
+			if (stackSize == 0) return didHit;
+
+			const KdTraversalEntry& entry = stack[--stackSize];
+			nodeIdx = entry.nodeIdx;
+			tMin = entry.tMin;
+			tMax = entry.tMax;
+		}
+	}
+
+	bool KdTree::ClosestHit(const Ray& ray, HitRecord& hitRecord) const
+	{
+		float closestT = hitRecord.t;
+		uint32_t closestTriIdx = UINT32_MAX;
+		if (!Traverse<false>(ray, closestT, closestTriIdx)) return hitRecord.didHit;
+
+		hitRecord.t = closestT;
+		hitRecord.didHit = true;
+		hitRecord.origin = ray.origin + ray.direction * closestT;
+		hitRecord.normal = pMesh->transformedNormals[closestTriIdx].Normalized();
+		hitRecord.materialIndex = pMesh->GetMaterialIndex(closestTriIdx);
+		return true;
+	}
+
+	bool KdTree::AnyHit(const Ray& ray) const
+	{
+		float closestT = ray.max;
+		uint32_t closestTriIdx = UINT32_MAX;
+		return Traverse<true>(ray, closestT, closestTriIdx);
+	}
+
+	size_t KdTree::GetMemoryBytes() const
+	{
+		return nodes.size() * sizeof(KdNode) + triIndices.size() * sizeof(uint32_t) + triIntersect.size() * sizeof(TriIntersect);
+	}
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "BVH.h"
+#include "MeshAccelerator.h"
+
+namespace dae
+{
+	struct TriangleMesh;
+
+	struct KdTreeSettings
+	{
+		float traversalCost{ 1.f };    // SAH cost of visiting an inner node
+		float intersectionCost{ 1.5f }; // SAH cost of one triangle test
+		float emptyBonus{ 0.2f };      // splits that cut off empty space get this fraction off their cost
+		uint32_t maxDepth{ 0 };        // 0 = 8 + 1.3 * log2(triangle count)
+		uint32_t minTrianglesToSplit{ 2 };
+	};
+
+	// Inner nodes store their split plane, leaves a range in the triangle indices. Nodes are stored depth-first:
+	// the child below the split directly follows its parent, so only the one above needs an index
+	struct KdNode
+	{
+		union
+		{
+			float split;          // inner nodes
+			uint32_t firstTriIdx; // leaves
+		};
+		uint32_t data; // axis in the lower 2 bits, 3 for leaves. The upper bits hold the child above the split, or the leaf's triangle count
+
+		bool IsLeaf() const { return (data & 3) == 3; }
+		uint32_t GetAxis() const { return data & 3; }
+		uint32_t GetAboveChild() const { return data >> 2; }
+		uint32_t GetTriCount() const { return data >> 2; }
+	};
+	static_assert(sizeof(KdNode) == 8);
+
+	// SAH kd-tree over a mesh's transformed triangles. A triangle is referenced by every leaf its bounds overlap,
+	// in exchange the leaves never overlap and are visited strictly front to back
+	class KdTree final : public MeshAccelerator
+	{
+	public:
+		explicit KdTree(TriangleMesh* pMesh, const KdTreeSettings& settings = {});
+
+		void Build() override;
+		// kd-trees can't be refit, the split planes would no longer separate the triangles
+		void Refit() override { Build(); }
+		void SetMesh(TriangleMesh* pTriangleMesh) override { pMesh = pTriangleMesh; }
+		bool ClosestHit(const Ray& ray, HitRecord& hitRecord) const override;
+		bool AnyHit(const Ray& ray) const override;
+		aabb GetBounds() const override { return bounds; }
+		size_t GetMemoryBytes() const override;
+		AcceleratorType GetType() const override { return AcceleratorType::KdTree; }
+
+		uint32_t GetNodeCount() const { return uint32_t(nodes.size()); }
+		uint32_t GetReferenceCount() const { return uint32_t(triIndices.size()); }
+
+	private:
+		struct SplitCandidate
+		{
+			uint32_t axis{ 0 };
+			float position{ 0.f };
+			float cost{ 1e30f };
+		};
+
+		void Subdivide(uint32_t nodeIdx, const aabb& nodeBounds, std::vector<uint32_t>& nodeTriIndices, uint32_t depth);
+		SplitCandidate FindSplit(const aabb& nodeBounds, const std::vector<uint32_t>& nodeTriIndices) const;
+		void MakeLeaf(uint32_t nodeIdx, const std::vector<uint32_t>& nodeTriIndices);
+		bool TestLeaf(const KdNode& node, const Ray& ray, float& closestT, uint32_t& closestTriIdx) const;
+		template<bool IsAnyHit>
+		bool Traverse(const Ray& ray, float& closestT, uint32_t& closestTriIdx) const;
+
+		TriangleMesh* pMesh;
+		KdTreeSettings settings;
+		uint32_t maxDepth{ 0 }; // settings.maxDepth, or its default for the mesh's triangle count
+		aabb bounds{};
+		std::vector<KdNode> nodes{};
+		std::vector<uint32_t> triIndices{};      // mesh triangle of every leaf reference
+		std::vector<TriIntersect> triIntersect{}; // per mesh triangle
+		std::vector<aabb> triBounds{};            // per mesh triangle, build only
+	};
+}
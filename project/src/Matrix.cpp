@@ -1,4 +1,5 @@
 #include <cassert>
+#include <cfloat>
 #include <stdexcept>
 #include <cmath>
 
@@ -81,6 +82,37 @@ namespace dae {
 		return out;
 	}
 
+	const Matrix& Matrix::Inverse()
+	{
+		//Affine inverse: invert the 3x3 part with cofactors, then move the translation back
+		const Vector3 x{ data[0] }, y{ data[1] }, z{ data[2] };
+		const Vector3 t{ data[3] };
+
+		const float determinant{ Vector3::Dot(x, Vector3::Cross(y, z)) };
+		assert(abs(determinant) > FLT_EPSILON);
+		const float invDeterminant{ 1.f / determinant };
+
+		//Rows are x, y and z, so the inverse has the cross products as its columns
+		const Vector3 c0{ Vector3::Cross(y, z) * invDeterminant };
+		const Vector3 c1{ Vector3::Cross(z, x) * invDeterminant };
+		const Vector3 c2{ Vector3::Cross(x, y) * invDeterminant };
+
+		data[0] = { c0.x, c1.x, c2.x, 0 };
+		data[1] = { c0.y, c1.y, c2.y, 0 };
+		data[2] = { c0.z, c1.z, c2.z, 0 };
+		data[3] = { -Vector3::Dot(t, c0), -Vector3::Dot(t, c1), -Vector3::Dot(t, c2), 1 };
+
+		return *this;
+	}
+
+	Matrix Matrix::Inverse(const Matrix& m)
+	{
+		Matrix out{ m };
+		out.Inverse();
+
+		return out;
+	}
+
 	Vector3 Matrix::GetAxisX() const
 	{
 		return data[0];
@@ -0,0 +1,63 @@
+#include "MeshAccelerator.h"
+
+#include "DataTypes.h"
+#include "KdTree.h"
+#include "UniformGrid.h"
+
+namespace dae
+{
+	namespace
+	{
+		AcceleratorType g_DefaultAcceleratorType{ AcceleratorType::BVH };
+	}
+
+	void SetDefaultAcceleratorType(AcceleratorType type)
+	{
+		g_DefaultAcceleratorType = type;
+	}
+
+	AcceleratorType GetDefaultAcceleratorType()
+	{
+		return g_DefaultAcceleratorType;
+	}
+
+	const char* GetAcceleratorName(AcceleratorType type)
+	{
+		switch (type)
+		{
+		case AcceleratorType::BVH: return "bvh";
+		case AcceleratorType::KdTree: return "kdtree";
+		case AcceleratorType::Grid: return "grid";
+		}
+		return "unknown";
+	}
+
+	bool ParseAcceleratorType(const std::string& name, AcceleratorType& type)
+	{
+		for (const AcceleratorType candidate : { AcceleratorType::BVH, AcceleratorType::KdTree, AcceleratorType::Grid })
+		{
+			if (name != GetAcceleratorName(candidate)) continue;
+			type = candidate;
+			return true;
+		}
+		return false;
+	}
+
+	std::unique_ptr<MeshAccelerator> CreateAccelerator(TriangleMesh* pMesh, AcceleratorType type)
+	{
+		std::unique_ptr<MeshAccelerator> pAccelerator{};
+		switch (type)
+		{
+		case AcceleratorType::BVH:
+		{
+			std::unique_ptr<BVH> pBVH = std::make_unique<BVH>(pMesh);
+			pBVH->LoadOrBuildBVH();
+			return pBVH;
+		}
+		case AcceleratorType::KdTree: pAccelerator = std::make_unique<KdTree>(pMesh); break;
+		case AcceleratorType::Grid: pAccelerator = std::make_unique<UniformGrid>(pMesh); break;
+		}
+		pAccelerator->Build();
+		return pAccelerator;
+	}
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+struct aabb;
+
+namespace dae
+{
+	struct Ray;
+	struct HitRecord;
+	struct TriangleMesh;
+
+	enum class AcceleratorType : uint8_t
+	{
+		BVH,    // binned SAH BVH, see BVH.h. The best all-rounder and the only one that can refit
+		KdTree, // SAH kd-tree, leaves don't overlap so closest hit can stop at the first leaf with a hit
+		Grid    // uniform grid with a second level in its dense cells, builds fastest and suits evenly spread triangles
+	};
+
+	// Spatial index over the transformed triangles of one mesh, built by TriangleMesh::BuildAccelerator.
+	// HitTest_TriangleMesh goes through this interface for everything but the BVH, which it traverses inline
+	class MeshAccelerator
+	{
+	public:
+		virtual ~MeshAccelerator() = default;
+
+		virtual void Build() = 0;
+		// Follows the mesh after its transformed vertices changed, accelerators that can't refit rebuild
+		virtual void Refit() = 0;
+		// Called when the mesh moved to another address, the accelerator reads its triangles through this pointer
+		virtual void SetMesh(TriangleMesh* pMesh) = 0;
+		// Only overwrites hitRecord with hits closer than hitRecord.t, returns hitRecord.didHit
+		virtual bool ClosestHit(const Ray& ray, HitRecord& hitRecord) const = 0;
+		// Stops at the first hit closer than ray.max, for shadow rays
+		virtual bool AnyHit(const Ray& ray) const = 0;
+		virtual aabb GetBounds() const = 0;
+		virtual size_t GetMemoryBytes() const = 0;
+		virtual AcceleratorType GetType() const = 0;
+	};
+
+	// What TriangleMesh::BuildAccelerator builds when no type is given, the BVH by default
+	void SetDefaultAcceleratorType(AcceleratorType type);
+	AcceleratorType GetDefaultAcceleratorType();
+
+	const char* GetAcceleratorName(AcceleratorType type);
+	// Accepts the names GetAcceleratorName returns, false for anything else
+	bool ParseAcceleratorType(const std::string& name, AcceleratorType& type);
+
+	// Builds an accelerator of this type over the mesh's transformed triangles. BVHs come from the BVH cache when it holds one
+	std::unique_ptr<MeshAccelerator> CreateAccelerator(TriangleMesh* pMesh, AcceleratorType type);
+}
@@ -1,11 +1,7 @@
-//External includes
-#include "SDL.h"
-#include "SDL_surface.h"
-
 //Project includes
 #include "Renderer.h"
 
-#include <execution>
+#include <fstream>
 #include <iostream>
 
 #include "Maths.h"
@@ -16,23 +12,37 @@
 
 using namespace dae;
 
-Renderer::Renderer(SDL_Window * pWindow) :
-	m_pWindow(pWindow),
-	m_pBuffer(SDL_GetWindowSurface(pWindow))
+Renderer::Renderer(int width, int height, uint32_t nrOfThreads, uint32_t tileSize) :
+	Renderer(width, height, nullptr, PixelFormat::RGBA(), nrOfThreads, tileSize)
+{
+}
+
+Renderer::Renderer(int width, int height, uint32_t* pPixels, const PixelFormat& format, uint32_t nrOfThreads, uint32_t tileSize) :
+	m_pBufferPixels(pPixels),
+	m_PixelFormat(format),
+	m_Width(width),
+	m_Height(height),
+	m_TileScheduler(nrOfThreads, tileSize)
 {
 	//Initialize
-	SDL_GetWindowSize(pWindow, &m_Width, &m_Height);
+	if (!m_pBufferPixels)
+	{
+		m_OwnedBuffer.resize(size_t(m_Width) * m_Height);
+		m_pBufferPixels = m_OwnedBuffer.data();
+	}
+
 	m_AspectRatio = (m_Width / float(m_Height)) ;
-	m_pBufferPixels = static_cast<uint32_t*>(m_pBuffer->pixels);
 
 	m_HorizontalIterator.resize(m_Width);
 	m_VerticalIterator.resize(m_Height);
 
 	for (uint32_t i = 0; i < m_Width; i++) m_HorizontalIterator[i] = i;
 	for (uint32_t i = 0; i < m_Height; i++) m_VerticalIterator[i] = i;
+
+	m_TileScheduler.SetFrameSize(m_Width, m_Height);
 }
 
-void Renderer::Render(Scene* pScene) const
+void Renderer::Render(Scene* pScene)
 {
 	Camera& camera = pScene->GetCamera();
 	const Matrix cameraToWorld = camera.CalculateCameraToWorld();
@@ -40,15 +50,17 @@ void Renderer::Render(Scene* pScene) const
 
 	if (m_IsMultiThreadingEnabled)
 	{
-		std::vector<uint32_t> pixelIndices{};
-
-		pixelIndices.reserve(amountOfPixels);
-		for (uint32_t index{ 0 }; index < amountOfPixels; index++) pixelIndices.emplace_back(index);
-
-		std::for_each(std::execution::par, pixelIndices.begin(), pixelIndices.end(), [&](int i)
+		auto renderTile = [&](const Tile& tile)
 			{
-				RenderPixel(pScene, i, camera.FOV, m_AspectRatio, cameraToWorld, camera.origin);
-			});
+				for (uint32_t py{ tile.minY }; py < tile.maxY; py++)
+				{
+					for (uint32_t px{ tile.minX }; px < tile.maxX; px++)
+					{
+						RenderPixel(pScene, px + (py * m_Width), camera.FOV, m_AspectRatio, cameraToWorld, camera.origin);
+					}
+				}
+			};
+		m_TileScheduler.Execute(renderTile);
 	}
 
 	else
@@ -58,10 +70,6 @@ void Renderer::Render(Scene* pScene) const
 			RenderPixel(pScene, pixelIndex, camera.FOV, m_AspectRatio, cameraToWorld, camera.origin);
 		}
 	}
-
-	//@END
-	//Update SDL Surface
-	SDL_UpdateWindowSurface(m_pWindow);
 }
 
 void Renderer::RenderPixel(Scene* pScene, uint32_t pixelIndex, float fov, float aspectRatio, const Matrix& cameraToWorld,const Vector3& cameraOrigin) const
@@ -97,13 +105,13 @@ void Renderer::RenderPixel(Scene* pScene, uint32_t pixelIndex, float fov, float
 		{
 			Vector3 lightVec = LightUtils::GetDirectionToLight(lights[idx], closestHit.origin);
 			float maxRayLenght = lightVec.Normalize();
-			Ray shadowRay(closestHit.origin + closestHit.normal * 0.0001f, lightVec, 0.0001f, maxRayLenght);
-			bool shadowDoesHit = pScene->DoesHit(shadowRay);
 			float observedArea = Vector3::Dot(closestHit.normal, lightVec);
 
 			if (observedArea > 0.f)
 			{
-				if (!m_ShadowsEnabled or (m_ShadowsEnabled && !shadowDoesHit))
+				//Only trace the shadow ray when the light could contribute
+				Ray shadowRay(closestHit.origin + closestHit.normal * 0.0001f, lightVec, 0.0001f, maxRayLenght);
+				if (!m_ShadowsEnabled or !pScene->DoesHit(shadowRay))
 				{
 					if (m_CurrentLightingMode == LightingMode::ObservedArea)
 					{
@@ -146,14 +154,79 @@ void Renderer::RenderPixel(Scene* pScene, uint32_t pixelIndex, float fov, float
 	//Update Color in Buffer
 	finalColor.MaxToOne();
 
-	m_pBufferPixels[px + (py * m_Width)] = SDL_MapRGB(m_pBuffer->format,
-		static_cast<uint8_t>(finalColor.r * 255),
-		static_cast<uint8_t>(finalColor.g * 255),
-		static_cast<uint8_t>(finalColor.b * 255));
+	m_pBufferPixels[px + (py * m_Width)] = 
+		uint32_t(static_cast<uint8_t>(finalColor.r * 255)) << m_PixelFormat.rShift |
+		uint32_t(static_cast<uint8_t>(finalColor.g * 255)) << m_PixelFormat.gShift |
+		uint32_t(static_cast<uint8_t>(finalColor.b * 255)) << m_PixelFormat.bShift |
+		m_PixelFormat.aMask;
 
 }
 
-bool Renderer::SaveBufferToImage() const
+void Renderer::CycleTileSize()
 {
-	return SDL_SaveBMP(m_pBuffer, "RayTracing_Buffer.bmp");
+	//8 -> 16 -> 32 -> 64 -> 8
+	const uint32_t tileSize = m_TileScheduler.GetTileSize();
+	m_TileScheduler.SetTileSize(tileSize >= 64 ? 8 : tileSize * 2);
+}
+
+void Renderer::PrintSchedulingMode() const
+{
+	if (!m_IsMultiThreadingEnabled)
+	{
+		std::cout << "Scheduling: single threaded" << std::endl;
+	}
+	else
+	{
+		std::cout << "Scheduling: tiled " << m_TileScheduler.GetTileSize() << "x" << m_TileScheduler.GetTileSize()
+			<< " (" << m_TileScheduler.GetNrOfTiles() << " tiles, " << m_TileScheduler.GetNrOfWorkers() << " threads)" << std::endl;
+	}
+}
+
+bool Renderer::SaveBufferToImage(const std::string& filePath) const
+{
+	//24-bit uncompressed BMP, rows stored bottom-up and padded to 4 bytes
+	std::ofstream file(filePath, std::ios::binary);
+	if (!file)
+		return false;
+
+	const uint32_t rowSize{ (uint32_t(m_Width) * 3 + 3) & ~3u };
+	const uint32_t imageSize{ rowSize * uint32_t(m_Height) };
+	const uint32_t headerSize{ 14 + 40 };
+
+	auto write16 = [&file](uint16_t value) { file.put(char(value & 0xFF)).put(char(value >> 8)); };
+	auto write32 = [&file](uint32_t value) { for (int i{}; i < 4; ++i) file.put(char((value >> (i * 8)) & 0xFF)); };
+
+	//File header
+	write16(0x4D42); //"BM"
+	write32(headerSize + imageSize);
+	write32(0);
+	write32(headerSize);
+
+	//Info header
+	write32(40);
+	write32(uint32_t(m_Width));
+	write32(uint32_t(m_Height));
+	write16(1);  //planes
+	write16(24); //bits per pixel
+	write32(0);  //no compression
+	write32(imageSize);
+	write32(2835); //72 DPI
+	write32(2835);
+	write32(0);
+	write32(0);
+
+	std::vector<char> row(rowSize, 0);
+	for (int py{ m_Height - 1 }; py >= 0; --py)
+	{
+		for (int px{}; px < m_Width; ++px)
+		{
+			const uint32_t pixel{ m_pBufferPixels[px + (py * m_Width)] };
+			row[px * 3 + 0] = char((pixel >> m_PixelFormat.bShift) & 0xFF);
+			row[px * 3 + 1] = char((pixel >> m_PixelFormat.gShift) & 0xFF);
+			row[px * 3 + 2] = char((pixel >> m_PixelFormat.rShift) & 0xFF);
+		}
+		file.write(row.data(), rowSize);
+	}
+
+	return bool(file);
 }
@@ -1,21 +1,36 @@
 #pragma once
 
 #include <cstdint>
+#include <string>
 #include <vector>
 
 #include "Matrix.h"
-
-struct SDL_Window;
-struct SDL_Surface;
+#include "TileScheduler.h"
 
 namespace dae
 {
 	class Scene;
 
+	//Where each 8-bit channel lives inside a 32-bit pixel
+	struct PixelFormat
+	{
+		uint8_t rShift{ 0 };
+		uint8_t gShift{ 8 };
+		uint8_t bShift{ 16 };
+		uint32_t aMask{ 0xFF000000 };
+
+		//R, G, B, A bytes in memory order (little endian)
+		static PixelFormat RGBA() { return {}; }
+	};
+
 	class Renderer final
 	{
 	public:
-		Renderer(SDL_Window* pWindow);
+		//Headless: renders into a RGBA buffer owned by the renderer
+		//nrOfThreads = 0 uses one render thread per hardware thread
+		Renderer(int width, int height, uint32_t nrOfThreads = 0, uint32_t tileSize = 16);
+		//Renders into an external buffer of width * height pixels (e.g. a window surface)
+		Renderer(int width, int height, uint32_t* pPixels, const PixelFormat& format, uint32_t nrOfThreads = 0, uint32_t tileSize = 16);
 		~Renderer() = default;
 
 		Renderer(const Renderer&) = delete;
@@ -23,10 +38,15 @@ namespace dae
 		Renderer& operator=(const Renderer&) = delete;
 		Renderer& operator=(Renderer&&) noexcept = delete;
 
-		void Render(Scene* pScene) const;
+		void Render(Scene* pScene);
 		void RenderPixel(Scene* pScene, uint32_t pixelIndex, float fov, float aspectRatio, const Matrix& cameraToWorld,
 		                 const Vector3& cameraOrigin) const;
-		bool SaveBufferToImage() const;
+		bool SaveBufferToImage(const std::string& filePath = "RayTracing_Buffer.bmp") const;
+
+		const uint32_t* GetBufferPixels() const { return m_pBufferPixels; }
+		const PixelFormat& GetPixelFormat() const { return m_PixelFormat; }
+		int GetWidth() const { return m_Width; }
+		int GetHeight() const { return m_Height; }
 		void CycleLightingMode()
 		{
 			// Cast the current mode to int to check if it's the last mode
@@ -45,6 +65,8 @@ namespace dae
 		};
 		void ToggleShadows() { m_ShadowsEnabled = !m_ShadowsEnabled; }
 		void ToggleMultiThreading() { m_IsMultiThreadingEnabled = !m_IsMultiThreadingEnabled; }
+		void CycleTileSize();
+		void PrintSchedulingMode() const;
 
 
 	private:
@@ -60,15 +82,17 @@ namespace dae
 		LightingMode m_CurrentLightingMode{LightingMode::Combined};
 		bool m_ShadowsEnabled{true};
 		bool m_IsMultiThreadingEnabled{ true };
-		SDL_Window* m_pWindow{};
 
-		SDL_Surface* m_pBuffer{};
+		std::vector<uint32_t> m_OwnedBuffer{};
 		uint32_t* m_pBufferPixels{};
+		PixelFormat m_PixelFormat{};
 
 		int m_Width{};
 		int m_Height{};
 		float m_AspectRatio{};
 
 		std::vector<uint32_t> m_HorizontalIterator, m_VerticalIterator;
+
+		TileScheduler m_TileScheduler;
 	};
 }
@@ -1,4 +1,8 @@
 #include "Scene.h"
+
+#include <algorithm>
+#include <numeric>
+
 #include "Utils.h"
 #include "Material.h"
 
@@ -30,22 +34,7 @@ namespace dae {
 	{
 		HitRecord tempHit {};
 
-		//Checks through all the sphere
-		for (int idx{0};m_SphereGeometries.size() > idx;idx++)
-		{
-
-			if (GeometryUtils::HitTest_Sphere(m_SphereGeometries[idx], ray, tempHit))  // Check if there's a hit from spheres
-			{
-				if (tempHit.t < closestHit.t)  
-				{
-					closestHit = tempHit;
-
-				}
-			}
-			
-		}
-
-		//Checks through all the planes
+		//Checks through all the planes, they are unbounded so not part of the BVH
 		for (int idx{ 0 }; m_PlaneGeometries.size() > idx; idx++)
 		{
 			if (GeometryUtils::HitTest_Plane(m_PlaneGeometries[idx],ray,tempHit))  // Check if there's a hit from planes
@@ -57,78 +46,127 @@ namespace dae {
 			}
 		}
 
-		//Checks through all the Triangles
-		for (int idx{ 0 }; m_Triangles.size() > idx; idx++)
-		{
-			if (GeometryUtils::HitTest_Triangle(m_Triangles[idx], ray, tempHit))  // Check if there's a hit from planes
-			{
-				if (tempHit.t < closestHit.t)
-				{
-					closestHit = tempHit;
-				}
-			}
-		}
+		//Checks the spheres, triangles, meshes and mesh instances through the scene BVH
+		GeometryUtils::HitTest_TLAS(m_TLAS, ray, closestHit);
+	}
 
-		
-		//Checks through all the Triangles Meshes
-		for (int idx{ 0 }; m_TriangleMeshGeometries.size() > idx; idx++)
+	bool Scene::DoesHit(const Ray& ray) const
+	{
+		for (int idx{ 0 }; idx < m_PlaneGeometries.size(); ++idx)
 		{
-			if (GeometryUtils::HitTest_TriangleMesh(m_TriangleMeshGeometries[idx], 0, ray, tempHit, 0))  // Check if there's a hit from planes
+			if (GeometryUtils::HitTest_Plane(m_PlaneGeometries[idx], ray)) // Check if there's a hit from planes
 			{
-				if (tempHit.t < closestHit.t)
-				{
-					closestHit = tempHit;
-				}
+				return true;
 			}
+
 		}
 
-		tempHit = closestHit;
+		//Checks the spheres, triangles, meshes and mesh instances through the scene BVH
+		return GeometryUtils::HitTest_TLAS(m_TLAS, ray);
 	}
 
-	bool Scene::DoesHit(const Ray& ray) const
+	void Scene::BuildAccelerationStructure()
 	{
-		//Checks through all the sphere
-		for (int idx{ 0 }; idx < m_SphereGeometries.size() ; ++idx)
+		CombineSmallMeshes();
+
+		//Meshes are referenced by the scene BVH through their own accelerator, merged meshes through the combined one
+		for (size_t idx{ 0 }; idx < m_TriangleMeshGeometries.size(); ++idx)
 		{
-			if (GeometryUtils::HitTest_Sphere(m_SphereGeometries[idx], ray))  // Check if there's a hit from spheres
-			{
-				return true;
-			}
+			TriangleMesh& mesh = m_TriangleMeshGeometries[idx];
+			const bool isCombined = std::find(m_CombinedMeshSources.begin(), m_CombinedMeshSources.end(), uint32_t(idx)) != m_CombinedMeshSources.end();
+			if (isCombined) mesh.ClearAccelerator();
+			else if (mesh.accelerator == nullptr) mesh.BuildAccelerator();
 		}
 
+		//Large sphere sets are one leaf of the scene BVH with their own BVH below it
+		m_UseSphereBVH = m_MinSphereBVHSpheres > 0 && m_SphereGeometries.size() >= m_MinSphereBVHSpheres;
+		if (m_UseSphereBVH) BuildSphereBVH();
+		else m_SphereBVHIndices.clear();
 
-		for (int idx{ 0 }; idx < m_PlaneGeometries.size(); ++idx)
+		m_TLAS.Build({ &m_SphereGeometries, &m_Triangles, &m_TriangleMeshGeometries, &m_MeshInstances,
+			m_CombinedMesh.accelerator != nullptr ? &m_CombinedMesh : nullptr, m_UseSphereBVH ? &m_SphereBVH : nullptr });
+		m_IsAccelerationStructureBuilt = true;
+		m_HasSpheresOutsideSphereBVH = false;
+	}
+
+	void Scene::RefitAccelerationStructure()
+	{
+		UpdateCombinedMesh();
+		//Rebuilding costs little more than a refit and keeps the tree as good as new however far the spheres moved
+		if (m_UseSphereBVH) BuildSphereBVH();
+
+		//Spheres that had their own leaves are back in the sphere BVH
+		if (m_HasSpheresOutsideSphereBVH) m_TLAS.Build(m_TLAS.GetGeometry());
+		else m_TLAS.Refit();
+		m_HasSpheresOutsideSphereBVH = false;
+	}
+
+	void Scene::BuildSphereBVH()
+	{
+		m_SphereBVH.Build(m_SphereGeometries);
+		m_SphereBVHIndices.resize(m_SphereGeometries.size());
+		std::iota(m_SphereBVHIndices.begin(), m_SphereBVHIndices.end(), 0u);
+	}
+
+	void Scene::CombineSmallMeshes()
+	{
+		m_CombinedMesh = TriangleMesh{};
+		m_CombinedMeshSources.clear();
+
+		for (uint32_t idx{ 0 }; idx < m_TriangleMeshGeometries.size(); ++idx)
 		{
-			if (GeometryUtils::HitTest_Plane(m_PlaneGeometries[idx], ray)) // Check if there's a hit from planes
-			{
-				return true;
-			}
+			const TriangleMesh& mesh = m_TriangleMeshGeometries[idx];
+			if (!mesh.indices.empty() && mesh.indices.size() / 3 <= m_MaxCombinedMeshTriangles) m_CombinedMeshSources.push_back(idx);
+		}
 
+		//A single small mesh gains nothing from merging
+		if (m_CombinedMeshSources.size() < 2)
+		{
+			m_CombinedMeshSources.clear();
+			return;
 		}
 
-		//Checks through all the Triangles
-		for (int idx{ 0 }; idx < m_Triangles.size(); ++idx)
+		//Every mesh keeps its own vertices, only the indices are offset
+		for (const uint32_t idx : m_CombinedMeshSources)
 		{
-			if (GeometryUtils::HitTest_Triangle(m_Triangles[idx], ray))  
+			const TriangleMesh& mesh = m_TriangleMeshGeometries[idx];
+			const int firstVertex = int(m_CombinedMesh.transformedPositions.size());
+			for (const int index : mesh.indices) m_CombinedMesh.indices.push_back(firstVertex + index);
+
+			const size_t nrOfTriangles = mesh.indices.size() / 3;
+			for (size_t triIdx{ 0 }; triIdx < nrOfTriangles; ++triIdx)
 			{
-				return true;
+				m_CombinedMesh.triangleMaterials.push_back(mesh.GetMaterialIndex(uint32_t(triIdx)));
+				m_CombinedMesh.triangleCullModes.push_back(mesh.GetCullMode(uint32_t(triIdx)));
 			}
+			m_CombinedMesh.transformedPositions.insert(m_CombinedMesh.transformedPositions.end(), mesh.transformedPositions.begin(), mesh.transformedPositions.end());
+			m_CombinedMesh.transformedNormals.insert(m_CombinedMesh.transformedNormals.end(), mesh.transformedNormals.begin(), mesh.transformedNormals.end());
 		}
 
-		//Checks through all the Triangles Meshes
-		for (int idx{ 0 };idx < m_TriangleMeshGeometries.size(); idx++)
+		//The triangles are already in world space, the combined mesh keeps an identity transform
+		m_CombinedMesh.positions = m_CombinedMesh.transformedPositions;
+		m_CombinedMesh.normals = m_CombinedMesh.transformedNormals;
+		m_CombinedMesh.BuildAccelerator();
+	}
+
+	void Scene::UpdateCombinedMesh()
+	{
+		if (m_CombinedMesh.accelerator == nullptr) return;
+
+		//The merged meshes may have moved, their vertex and triangle counts can't have changed
+		auto positionIt = m_CombinedMesh.transformedPositions.begin();
+		auto normalIt = m_CombinedMesh.transformedNormals.begin();
+		for (const uint32_t idx : m_CombinedMeshSources)
 		{
-			if (GeometryUtils::HitTest_TriangleMesh(m_TriangleMeshGeometries[idx], ray))  // Check if there's a hit from planes
-			{
-				return true;
-			}
+			const TriangleMesh& mesh = m_TriangleMeshGeometries[idx];
+			positionIt = std::copy(mesh.transformedPositions.begin(), mesh.transformedPositions.end(), positionIt);
+			normalIt = std::copy(mesh.transformedNormals.begin(), mesh.transformedNormals.end(), normalIt);
 		}
-	
-		return false;
+		m_CombinedMesh.accelerator->Refit();
 	}
 
 #pragma region Scene Helpers
-	Sphere* Scene::AddSphere(const Vector3& origin, float radius, unsigned char materialIndex)
+	SceneObjectHandle Scene::AddSphere(const Vector3& origin, float radius, unsigned char materialIndex)
 	{
 		Sphere s;
 		s.origin = origin;
@@ -136,7 +174,18 @@ namespace dae {
 		s.materialIndex = materialIndex;
 
 		m_SphereGeometries.emplace_back(s);
-		return &m_SphereGeometries.back();
+		const uint32_t sphereIdx = static_cast<uint32_t>(m_SphereGeometries.size() - 1);
+		const SceneObjectHandle handle = AllocateObjectSlot(TLASObjectType::Sphere, sphereIdx);
+		m_SphereSlots.push_back(handle.slotIdx);
+		if (!m_IsAccelerationStructureBuilt) return handle;
+
+		if (m_UseSphereBVH)
+		{
+			m_SphereBVHIndices.push_back(UINT32_MAX);
+			m_HasSpheresOutsideSphereBVH = true;
+		}
+		m_TLAS.InsertObject(TLASObjectType::Sphere, sphereIdx);
+		return handle;
 	}
 
 	Plane* Scene::AddPlane(const Vector3& origin, const Vector3& normal, unsigned char materialIndex)
@@ -156,10 +205,116 @@ namespace dae {
 		m.cullMode = cullMode;
 		m.materialIndex = materialIndex;
 
-		m_TriangleMeshGeometries.emplace_back(m);
+		m_TriangleMeshGeometries.emplace_back(std::move(m));
 		return &m_TriangleMeshGeometries.back();
 	}
 
+	TriangleMesh* Scene::AddInstancedMesh(TriangleCullMode cullMode)
+	{
+		TriangleMesh m{};
+		m.cullMode = cullMode;
+
+		m_InstancedMeshes.emplace_back(std::move(m));
+		return &m_InstancedMeshes.back();
+	}
+
+	SceneObjectHandle Scene::AddMeshInstance(const TriangleMesh* pMesh, const Matrix& transform, unsigned char materialIndex)
+	{
+		m_MeshInstances.emplace_back(pMesh, transform, materialIndex);
+		const uint32_t instanceIdx = static_cast<uint32_t>(m_MeshInstances.size() - 1);
+		const SceneObjectHandle handle = AllocateObjectSlot(TLASObjectType::MeshInstance, instanceIdx);
+		m_MeshInstanceSlots.push_back(handle.slotIdx);
+		if (m_IsAccelerationStructureBuilt) m_TLAS.InsertObject(TLASObjectType::MeshInstance, instanceIdx);
+		return handle;
+	}
+
+	SceneObjectHandle Scene::AllocateObjectSlot(TLASObjectType type, uint32_t geometryIdx)
+	{
+		uint32_t slotIdx;
+		if (m_FreeObjectSlots.empty())
+		{
+			slotIdx = static_cast<uint32_t>(m_ObjectSlots.size());
+			m_ObjectSlots.push_back({ type, geometryIdx, 0 });
+		}
+		else
+		{
+			slotIdx = m_FreeObjectSlots.back();
+			m_FreeObjectSlots.pop_back();
+			m_ObjectSlots[slotIdx].type = type;
+			m_ObjectSlots[slotIdx].geometryIdx = geometryIdx;
+		}
+		return { slotIdx, m_ObjectSlots[slotIdx].generation };
+	}
+
+	bool Scene::IsValid(SceneObjectHandle handle) const
+	{
+		return handle.slotIdx < m_ObjectSlots.size() && m_ObjectSlots[handle.slotIdx].generation == handle.generation;
+	}
+
+	bool Scene::RemoveObject(SceneObjectHandle handle)
+	{
+		if (!IsValid(handle)) return false;
+		const ObjectSlot slot = m_ObjectSlots[handle.slotIdx];
+
+		//Swap and pop, the handle of the last object follows it to the freed index
+		auto removeGeometry = [this, &slot](auto& geometries, std::vector<uint32_t>& slots)
+			{
+				const uint32_t lastIdx = static_cast<uint32_t>(geometries.size() - 1);
+				if (m_IsAccelerationStructureBuilt) m_TLAS.RemoveObject(slot.type, slot.geometryIdx, lastIdx);
+
+				geometries[slot.geometryIdx] = geometries[lastIdx];
+				slots[slot.geometryIdx] = slots[lastIdx];
+				m_ObjectSlots[slots[slot.geometryIdx]].geometryIdx = slot.geometryIdx;
+				geometries.pop_back();
+				slots.pop_back();
+			};
+		if (slot.type == TLASObjectType::Sphere)
+		{
+			//A sphere still in the sphere BVH is hidden there, the last sphere's index in it follows the sphere
+			if (m_UseSphereBVH)
+			{
+				if (m_SphereBVHIndices[slot.geometryIdx] != UINT32_MAX) m_SphereBVH.RemoveSphere(m_SphereBVHIndices[slot.geometryIdx]);
+				m_SphereBVHIndices[slot.geometryIdx] = m_SphereBVHIndices.back();
+				m_SphereBVHIndices.pop_back();
+			}
+			removeGeometry(m_SphereGeometries, m_SphereSlots);
+		}
+		else removeGeometry(m_MeshInstances, m_MeshInstanceSlots);
+
+		++m_ObjectSlots[handle.slotIdx].generation;
+		m_FreeObjectSlots.push_back(handle.slotIdx);
+		return true;
+	}
+
+	Sphere* Scene::GetSphere(SceneObjectHandle handle)
+	{
+		if (!IsValid(handle) || m_ObjectSlots[handle.slotIdx].type != TLASObjectType::Sphere) return nullptr;
+		return &m_SphereGeometries[m_ObjectSlots[handle.slotIdx].geometryIdx];
+	}
+
+	MeshInstance* Scene::GetMeshInstance(SceneObjectHandle handle)
+	{
+		if (!IsValid(handle) || m_ObjectSlots[handle.slotIdx].type != TLASObjectType::MeshInstance) return nullptr;
+		return &m_MeshInstances[m_ObjectSlots[handle.slotIdx].geometryIdx];
+	}
+
+	void Scene::UpdateObject(SceneObjectHandle handle)
+	{
+		if (!IsValid(handle)) return;
+		const ObjectSlot& slot = m_ObjectSlots[handle.slotIdx];
+		if (!m_IsAccelerationStructureBuilt) return;
+
+		//A sphere that changed leaves the sphere BVH for a leaf of its own, rebuilding the sphere BVH would cost far more
+		if (slot.type == TLASObjectType::Sphere && m_UseSphereBVH && m_SphereBVHIndices[slot.geometryIdx] != UINT32_MAX)
+		{
+			m_SphereBVH.RemoveSphere(m_SphereBVHIndices[slot.geometryIdx]);
+			m_SphereBVHIndices[slot.geometryIdx] = UINT32_MAX;
+			m_TLAS.InsertObject(TLASObjectType::Sphere, slot.geometryIdx);
+			m_HasSpheresOutsideSphereBVH = true;
+		}
+		else m_TLAS.UpdateObject(slot.type, slot.geometryIdx);
+	}
+
 	Light* Scene::AddPointLight(const Vector3& origin, float intensity, const ColorRGB& color)
 	{
 		Light l;
@@ -213,6 +368,8 @@ namespace dae {
 		AddPlane({ 0.f, -75.f, 0.f }, { 0.f, 1.f,0.f }, matId_Solid_Yellow);
 		AddPlane({ 0.f, 75.f, 0.f }, { 0.f, -1.f,0.f }, matId_Solid_Yellow);
 		AddPlane({ 0.f, 0.f, 125.f }, { 0.f, 0.f,-1.f }, matId_Solid_Magenta);
+
+		BuildAccelerationStructure();
 	}
 #pragma endregion
 
@@ -253,6 +410,7 @@ namespace dae {
 		//Light
 		AddPointLight({ 0.f,5.f,-5.f }, 70.f, colors::White);
 
+		BuildAccelerationStructure();
 	}
 
 
@@ -322,6 +480,8 @@ namespace dae {
 		//AddPointLight({ 0.f,5.f,5.f }, 25.f,colors::White);
 
 		//AddPointLight({ 0.f,2.5f,-5.f },25.f,colors::White);
+
+		BuildAccelerationStructure();
 	}
 
 
@@ -365,7 +525,7 @@ namespace dae {
 
 
 		pMesh = AddTriangleMesh(TriangleCullMode::NoCulling, matLambert_White);
-		Utils::ParseOBJ("Resources/lowpoly_bunny.obj", 
+		Utils::ParseOBJ("resources/lowpoly_bunny.obj", 
 						pMesh->positions,
 						pMesh->normals,
 						pMesh->indices);
@@ -374,7 +534,7 @@ namespace dae {
 		pMesh->Scale(Vector3(2,2,2));
 		pMesh->RotateY(60);
 		pMesh->UpdateTransforms();
-		pMesh->BuildBVH();
+		pMesh->BuildAccelerator();
 
 
 		//pMesh->positions = { { -0.75f, -1.f, 0.f}, //v0	
@@ -394,6 +554,8 @@ namespace dae {
 		AddPointLight({ 0.f, 5.f, 5.f }, 50.f, ColorRGB{ 1.f, .61f, .45f });  // Backlight
 		AddPointLight({ -2.5f, 5.f, -5.f }, 70.f, ColorRGB{ 1.f, .8f, .45f }); // Front Light Left
 		AddPointLight({ 2.5f, 5.f, -5.f }, 50.f, ColorRGB{ .34f, .47f, .68f }); // Front Light Right
+
+		BuildAccelerationStructure();
 	}
 
 	void Scene_W4_Bunny::Update(dae::Timer* pTimer)
@@ -402,6 +564,8 @@ namespace dae {
 		const auto yawAngle = (cos(pTimer->GetTotal()) + 1.f) / 2.f * PI_2;
 		pMesh->RotateY(yawAngle);
 		pMesh->UpdateTransforms();
+
+		RefitAccelerationStructure();
 	}
 
 
@@ -448,7 +612,6 @@ namespace dae {
 		m_Meshes[0]->Translate({ -1.75f, 4.5f, 0.f });
 		//m_Meshes[0]->UpdateAABB();
 		m_Meshes[0]->UpdateTransforms();
-		m_Meshes[0]->BuildBVH();
 
 
 		m_Meshes[1] = AddTriangleMesh(TriangleCullMode::FrontFaceCulling, matLambert_White);
@@ -456,7 +619,6 @@ namespace dae {
 		m_Meshes[1]->Translate({ 0.f, 4.5f, 0.f });
 		//m_Meshes[1]->UpdateAABB();
 		m_Meshes[1]->UpdateTransforms();
-		m_Meshes[1]->BuildBVH();
 
 
 		m_Meshes[2] = AddTriangleMesh(TriangleCullMode::NoCulling, matLambert_White);
@@ -464,7 +626,6 @@ namespace dae {
 		m_Meshes[2]->Translate({ 1.75f, 4.5f, 0.f });
 		//m_Meshes[2]->UpdateAABB();
 		m_Meshes[2]->UpdateTransforms();
-		m_Meshes[2]->BuildBVH();
 
 
 
@@ -473,6 +634,8 @@ namespace dae {
 		AddPointLight({ 0.f  , 5.f ,  5.f }, 50.f, ColorRGB{ 1.f  , 0.61f, 0.45f });   // BackLight
 		AddPointLight({ -2.5f , 5.f , -5.f }, 70.f, ColorRGB{ 1.f  , 0.8f , 0.45f });   // Front Light Left
 		AddPointLight({ 2.5f , 2.5f, -5.f }, 50.f, ColorRGB{ 0.34f, 0.47f, 0.68f });
+
+		BuildAccelerationStructure();
 	}
 
 	void Scene_W4_ReferenceScene::Update(dae::Timer* pTimer)
@@ -485,5 +648,121 @@ namespace dae {
 			m->RotateY(yawAngle);
 			m->UpdateTransforms();
 		}
+
+		RefitAccelerationStructure();
+	}
+
+	void Scene_W4_InstancedBunnies::Initialize()
+	{
+		sceneName = "Instanced Bunnies";
+		m_Camera.origin = { 0.f, 5.f, -8.f };
+		m_Camera.fovAngle = 45.f;
+		m_Camera.forward = Vector3{ 0.f, -0.4f, 1.f }.Normalized();
+
+		// Materials
+		const auto matLambert_GrayBlue = AddMaterial(new Material_Lambert({ 0.49f, 0.57f, 0.57f }, 1.f));
+		const auto matLambert_White = AddMaterial(new Material_Lambert(colors::White, 1.f));
+		const auto matCT_GrayMediumMetal = AddMaterial(new Material_CookTorrence({ 0.972f, 0.960f, 0.915f }, 1.f, 0.6f));
+
+		// Plane
+		AddPlane({ 0.f, 0.f, 0.f }, { 0.f, 1.f, 0.f }, matLambert_GrayBlue); // BOTTOM
+
+		// One bunny BLAS shared by every instance
+		TriangleMesh* pBunny = AddInstancedMesh(TriangleCullMode::NoCulling);
+		Utils::ParseOBJ("resources/lowpoly_bunny.obj",
+						pBunny->positions,
+						pBunny->normals,
+						pBunny->indices);
+		pBunny->UpdateTransforms();
+		pBunny->BuildAccelerator();
+
+		for (int idx{ 0 }; idx < m_GridSize * m_GridSize; ++idx)
+		{
+			AddMeshInstance(pBunny, GetBunnyTransform(idx, 0.f), idx % 2 ? matLambert_White : matCT_GrayMediumMetal);
+		}
+
+		// Light
+		AddPointLight({ -4.f, 10.f, -4.f }, 200.f, ColorRGB{ 1.f, .8f, .45f });
+		AddPointLight({ 6.f, 10.f, 18.f }, 200.f, ColorRGB{ .34f, .47f, .68f });
+
+		BuildAccelerationStructure();
+	}
+
+	void Scene_W4_InstancedBunnies::Update(dae::Timer* pTimer)
+	{
+		Scene::Update(pTimer);
+
+		// every instance spins, only the scene BVH bounds need to follow
+		const float yawAngle = pTimer->GetTotal();
+		for (int idx{ 0 }; idx < int(m_MeshInstances.size()); ++idx)
+		{
+			m_MeshInstances[idx].SetTransform(GetBunnyTransform(idx, yawAngle));
+		}
+
+		RefitAccelerationStructure();
+	}
+
+	Matrix Scene_W4_InstancedBunnies::GetBunnyTransform(int instanceIdx, float yaw) const
+	{
+		const int x{ instanceIdx % m_GridSize }, z{ instanceIdx / m_GridSize };
+		const Vector3 position{ (x - m_GridSize / 2) * 1.5f, 0.f, z * 1.5f };
+
+		return Matrix::CreateScale(0.6f, 0.6f, 0.6f) * Matrix::CreateRotationY(yaw + instanceIdx) * Matrix::CreateTranslation(position);
+	}
+
+	void Scene_Particles::Initialize()
+	{
+		sceneName = "Particles";
+		m_Camera.origin = { 0.f, 30.f, -60.f };
+		m_Camera.fovAngle = 45.f;
+		m_Camera.forward = Vector3{ 0.f, -0.45f, 1.f }.Normalized();
+
+		// Materials
+		const auto matLambert_GrayBlue = AddMaterial(new Material_Lambert({ 0.49f, 0.57f, 0.57f }, 1.f));
+		const unsigned char matLambert_Particles[]{
+			AddMaterial(new Material_Lambert({ 1.f, .61f, .45f }, 1.f)),
+			AddMaterial(new Material_Lambert({ .34f, .47f, .68f }, 1.f)),
+			AddMaterial(new Material_Lambert(colors::White, 1.f)) };
+
+		// Plane
+		AddPlane({ 0.f, -2.f, 0.f }, { 0.f, 1.f, 0.f }, matLambert_GrayBlue); // BOTTOM
+
+		// Particles, denser towards the center of the disc
+		uint32_t seed{ 13579 };
+		auto random = [&seed]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) / float(1 << 24); };
+		m_Orbits.reserve(m_NrOfParticles);
+		m_SphereGeometries.reserve(m_NrOfParticles);
+		for (int idx{ 0 }; idx < m_NrOfParticles; ++idx)
+		{
+			const float radius{ 2.f + 28.f * random() * random() };
+			m_Orbits.push_back({ radius, (random() - 0.5f) * 4.f * (1.f - radius / 40.f), random() * 2.f * PI });
+			AddSphere({}, 0.03f + 0.05f * random(), matLambert_Particles[idx % 3]);
+		}
+		UpdateParticles(0.f);
+
+		// Light
+		AddPointLight({ 0.f, 40.f, -20.f }, 6000.f, colors::White);
+		AddPointLight({ 20.f, 15.f, 30.f }, 2000.f, ColorRGB{ .34f, .47f, .68f });
+
+		BuildAccelerationStructure();
+	}
+
+	void Scene_Particles::Update(dae::Timer* pTimer)
+	{
+		Scene::Update(pTimer);
+
+		UpdateParticles(pTimer->GetTotal());
+		RefitAccelerationStructure();
+	}
+
+	void Scene_Particles::UpdateParticles(float time)
+	{
+		// inner particles orbit faster, every frame moves all of them
+		for (int idx{ 0 }; idx < m_NrOfParticles; ++idx)
+		{
+			const Vector3& orbit = m_Orbits[idx];
+			const float angle{ orbit.z + time * 8.f / orbit.x };
+			m_SphereGeometries[idx].origin = { orbit.x * cosf(angle), orbit.y, orbit.x * sinf(angle) };
+		}
 	}
 }
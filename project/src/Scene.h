@@ -1,10 +1,13 @@
 #pragma once
+#include <deque>
 #include <string>
 #include <vector>
 
 #include "Maths.h"
 #include "DataTypes.h"
 #include "Camera.h"
+#include "SphereBVH.h"
+#include "TLAS.h"
 
 namespace dae
 {
@@ -15,6 +18,14 @@ namespace dae
 	struct Sphere;
 	struct Light;
 
+	//Stable reference to a sphere or mesh instance. Removing objects reorders the geometry lists but not the handles,
+	//the generation tells a handle to a removed object apart from the object that reused its slot
+	struct SceneObjectHandle
+	{
+		uint32_t slotIdx{ UINT32_MAX };
+		uint32_t generation{ 0 };
+	};
+
 	//Scene Base Class
 	class Scene
 	{
@@ -40,7 +51,27 @@ namespace dae
 		const std::vector<Plane>& GetPlaneGeometries() const { return m_PlaneGeometries; }
 		const std::vector<Sphere>& GetSphereGeometries() const { return m_SphereGeometries; }
 		const std::vector<Light>& GetLights() const { return m_Lights; }
-		const std::vector<Material*> GetMaterials() const { return m_Materials; }
+		const std::vector<Material*>& GetMaterials() const { return m_Materials; }
+		const std::vector<TriangleMesh>& GetTriangleMeshGeometries() const { return m_TriangleMeshGeometries; }
+		const std::deque<TriangleMesh>& GetInstancedMeshes() const { return m_InstancedMeshes; }
+		const std::vector<MeshInstance>& GetMeshInstances() const { return m_MeshInstances; }
+		//Small meshes merged by BuildAccelerationStructure, has no accelerator when nothing was merged
+		const TriangleMesh& GetCombinedMesh() const { return m_CombinedMesh; }
+
+		//Spheres and mesh instances can be added and removed at any time,
+		//after BuildAccelerationStructure the scene BVH is updated in place instead of rebuilt.
+		//With a sphere BVH, spheres added or changed since it was built have their own leaves until the next RefitAccelerationStructure
+		SceneObjectHandle AddSphere(const Vector3& origin, float radius, unsigned char materialIndex = 0);
+		//Build the mesh's accelerator before adding instances of it
+		SceneObjectHandle AddMeshInstance(const TriangleMesh* pMesh, const Matrix& transform, unsigned char materialIndex = 0);
+		//Returns false when the handle's object was already removed
+		bool RemoveObject(SceneObjectHandle handle);
+		bool IsValid(SceneObjectHandle handle) const;
+		//nullptr when the handle is invalid or refers to the other kind of object, call UpdateObject after changing it
+		Sphere* GetSphere(SceneObjectHandle handle);
+		MeshInstance* GetMeshInstance(SceneObjectHandle handle);
+		//Reinserts one changed object in the scene BVH, cheaper than RefitAccelerationStructure when only a few objects moved
+		void UpdateObject(SceneObjectHandle handle);
 
 	protected:
 		std::string	sceneName;
@@ -54,12 +85,60 @@ namespace dae
 		//Temp (Individual Triangle Test)
 		std::vector<Triangle> m_Triangles{};
 
+		//Instancing: shared object space meshes and their placements. The instances point at their mesh, a deque never moves it
+		std::deque<TriangleMesh> m_InstancedMeshes{};
+		std::vector<MeshInstance> m_MeshInstances{};
+
+		//Meshes with at most this many triangles share one BVH instead of each having their own, 0 disables merging.
+		//Set it before BuildAccelerationStructure
+		uint32_t m_MaxCombinedMeshTriangles{ 64 };
+		//Triangles of the merged meshes with a material and cull mode per triangle, copied from them again by RefitAccelerationStructure
+		TriangleMesh m_CombinedMesh{};
+		std::vector<uint32_t> m_CombinedMeshSources{}; // indices in m_TriangleMeshGeometries
+
+		//Scenes with at least this many spheres keep them in one sphere BVH, rebuilt by every RefitAccelerationStructure,
+		//instead of giving each its own leaf in the scene BVH. 0 disables it. Set it before BuildAccelerationStructure
+		uint32_t m_MinSphereBVHSpheres{ 4096 };
+		SphereBVH m_SphereBVH{};
+		bool m_UseSphereBVH{ false };
+		//Index of every sphere in the sphere BVH, UINT32_MAX for the ones edited since it was built: those are left out of it
+		//and have a leaf of their own in the scene BVH
+		std::vector<uint32_t> m_SphereBVHIndices{};
+		bool m_HasSpheresOutsideSphereBVH{ false };
+
+		//Scene BVH over all bounded geometry, planes are tested separately
+		TLAS m_TLAS{};
+		bool m_IsAccelerationStructureBuilt{ false };
+
+		//Where the object of every handle currently is, slots of removed objects are reused
+		struct ObjectSlot
+		{
+			TLASObjectType type;
+			uint32_t geometryIdx;
+			uint32_t generation;
+		};
+		std::vector<ObjectSlot> m_ObjectSlots{};
+		std::vector<uint32_t> m_FreeObjectSlots{};
+		std::vector<uint32_t> m_SphereSlots{};       // slot of every sphere in m_SphereGeometries
+		std::vector<uint32_t> m_MeshInstanceSlots{}; // slot of every instance in m_MeshInstances
+
 		Camera m_Camera{};
 
 
-		Sphere* AddSphere(const Vector3& origin, float radius, unsigned char materialIndex = 0);
 		Plane* AddPlane(const Vector3& origin, const Vector3& normal, unsigned char materialIndex = 0);
 		TriangleMesh* AddTriangleMesh(TriangleCullMode cullMode, unsigned char materialIndex = 0);
+		//Mesh that is only rendered through instances, build its accelerator before adding instances
+		TriangleMesh* AddInstancedMesh(TriangleCullMode cullMode);
+		SceneObjectHandle AllocateObjectSlot(TLASObjectType type, uint32_t geometryIdx);
+		void BuildSphereBVH();
+
+		//Builds the scene BVH, call at the end of Initialize once all geometry is added.
+		//Small meshes are merged into the combined mesh first, see m_MaxCombinedMeshTriangles
+		void BuildAccelerationStructure();
+		//Updates the scene BVH bounds, call at the end of Update after geometry moved
+		void RefitAccelerationStructure();
+		void CombineSmallMeshes();
+		void UpdateCombinedMesh();
 
 		Light* AddPointLight(const Vector3& origin, float intensity, const ColorRGB& color);
 		Light* AddDirectionalLight(const Vector3& direction, float intensity, const ColorRGB& color);
@@ -150,5 +229,45 @@ namespace dae
 		TriangleMesh* m_Meshes[3]{  };
 	};
 
+	//WEEK 4 Instanced Bunnies Scene
+	class Scene_W4_InstancedBunnies final : public Scene
+	{
+	public:
+		Scene_W4_InstancedBunnies() = default;
+		~Scene_W4_InstancedBunnies() override = default;
+
+		Scene_W4_InstancedBunnies(const Scene_W4_InstancedBunnies&) = delete;
+		Scene_W4_InstancedBunnies(Scene_W4_InstancedBunnies&&) noexcept = delete;
+		Scene_W4_InstancedBunnies& operator=(const Scene_W4_InstancedBunnies&) = delete;
+		Scene_W4_InstancedBunnies& operator=(Scene_W4_InstancedBunnies&&) noexcept = delete;
+
+		void Initialize() override;
+		void Update(dae::Timer* pTimer) override;
+	private:
+		static constexpr int m_GridSize{ 16 };
+		Matrix GetBunnyTransform(int instanceIdx, float yaw) const;
+	};
+
+	//Particle Scene: a million spheres orbiting in a disc, the sphere BVH is rebuilt every frame
+	class Scene_Particles final : public Scene
+	{
+	public:
+		Scene_Particles() = default;
+		~Scene_Particles() override = default;
+
+		Scene_Particles(const Scene_Particles&) = delete;
+		Scene_Particles(Scene_Particles&&) noexcept = delete;
+		Scene_Particles& operator=(const Scene_Particles&) = delete;
+		Scene_Particles& operator=(Scene_Particles&&) noexcept = delete;
+
+		void Initialize() override;
+		void Update(dae::Timer* pTimer) override;
+	private:
+		static constexpr int m_NrOfParticles{ 1000000 };
+		void UpdateParticles(float time);
+		//Orbit of every particle: radius, height and start angle, the angular speed follows from the radius
+		std::vector<Vector3> m_Orbits{};
+	};
+
 
 }
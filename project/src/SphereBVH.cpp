@@ -0,0 +1,529 @@
+#include "SphereBVH.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <thread>
+
+#include "Utils.h"
+
+namespace dae
+{
+	namespace
+	{
+		// deeper nodes always become leaves, which bounds the traversal stack
+		constexpr uint32_t MaxSphereBVHDepth{ 64 };
+
+		uint32_t GetBinIdx(float center, float centroidMin, float binScale)
+		{
+			return std::min(SphereBVHSettings::NrOfBins - 1, uint32_t((center - centroidMin) * binScale));
+		}
+	}
+
+	SphereBVH::SphereBVH(const SphereBVHSettings& settings) :
+		settings{ settings }
+	{
+	}
+
+#pragma region Bounds
+	float SphereBVH::Bounds::HalfArea() const
+	{
+		if (bmax[0] < bmin[0]) return 0.f;
+		const float extentX = bmax[0] - bmin[0], extentY = bmax[1] - bmin[1], extentZ = bmax[2] - bmin[2];
+		return extentX * extentY + extentY * extentZ + extentZ * extentX;
+	}
+
+	aabb SphereBVH::Bounds::ToAABB() const
+	{
+		aabb bounds{};
+		if (bmax[0] < bmin[0]) return bounds;
+		bounds.bmin = { bmin[0], bmin[1], bmin[2] };
+		bounds.bmax = { bmax[0], bmax[1], bmax[2] };
+		return bounds;
+	}
+#pragma endregion
+
+#pragma region Build
+	void SphereBVH::Build(const std::vector<Sphere>& sceneSpheres)
+	{
+		const auto buildStart = std::chrono::steady_clock::now();
+		const uint32_t nrOfSpheres = uint32_t(sceneSpheres.size());
+		spheres.resize(nrOfSpheres);
+		materials.resize(nrOfSpheres);
+		sphereIndices.resize(nrOfSpheres);
+		packedIdxOfSphere.clear();
+		if (nrOfSpheres == 0)
+		{
+			nodes.clear();
+			return;
+		}
+
+		// worst case capacity, kept between frames so a rebuild doesn't reallocate
+		nodes.resize(nrOfSpheres * 2 - 1);
+		const uint32_t nrOfThreads = GetBuildThreadCount();
+		if (!workerPool || workerPool->GetNrOfWorkers() != nrOfThreads) workerPool = std::make_unique<WorkerPool>(nrOfThreads);
+		if (nrOfThreads > 1)
+		{
+			partitionSpheres.resize(nrOfSpheres);
+			partitionMaterials.resize(nrOfSpheres);
+			partitionSphereIndices.resize(nrOfSpheres);
+		}
+
+		// no split has more slices than there are threads
+		sliceBounds.assign(nrOfThreads, Bounds{});
+		sliceCentroidBounds.assign(nrOfThreads, Bounds{});
+		sliceChildBounds.resize(nrOfThreads);
+		sliceLeftCounts.resize(nrOfThreads);
+		sliceLeftStarts.resize(nrOfThreads);
+		sliceRightStarts.resize(nrOfThreads);
+		sliceBinSets.resize(nrOfThreads);
+
+		// pack the spheres and gather the root bounds, one set per slice
+		workerPool->ParallelForSlices(0, nrOfSpheres, nrOfThreads, [&](uint32_t sliceIdx, uint32_t first, uint32_t end)
+			{
+				for (uint32_t i = first; i < end; i++)
+				{
+					const Sphere& sphere = sceneSpheres[i];
+					spheres[i] = { sphere.origin.x, sphere.origin.y, sphere.origin.z, sphere.radius };
+					materials[i] = sphere.materialIndex;
+					sphereIndices[i] = i;
+
+					const float center[3]{ sphere.origin.x, sphere.origin.y, sphere.origin.z };
+					const float low[3]{ center[0] - sphere.radius, center[1] - sphere.radius, center[2] - sphere.radius };
+					const float high[3]{ center[0] + sphere.radius, center[1] + sphere.radius, center[2] + sphere.radius };
+					sliceBounds[sliceIdx].Grow(low, high);
+					sliceCentroidBounds[sliceIdx].Grow(center, center);
+				}
+			});
+
+		Bounds bounds{}, centroidBounds{};
+		for (uint32_t sliceIdx = 0; sliceIdx < nrOfThreads; sliceIdx++)
+		{
+			bounds.Grow(sliceBounds[sliceIdx]);
+			centroidBounds.Grow(sliceCentroidBounds[sliceIdx]);
+		}
+		nodes[0].aabb = bounds.ToAABB();
+
+		if (nrOfThreads > 1)
+		{
+			// split the top levels with parallel binning and partitioning, then build the subtrees below them as independent tasks
+			buildTasks.clear();
+			SubdivideTopLevel(0, 0, nrOfSpheres, centroidBounds, 0, nrOfThreads, buildTasks);
+			workerPool->ParallelFor(uint32_t(buildTasks.size()), [this](uint32_t taskIdx)
+				{
+					const BuildTask& task = buildTasks[taskIdx];
+					Subdivide(task.nodeIdx, task.first, task.count, task.centroidBounds, task.depth);
+				});
+		}
+		else
+		{
+			Subdivide(0, 0, nrOfSpheres, centroidBounds, 0);
+		}
+		buildTimeMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - buildStart).count();
+	}
+
+	uint32_t SphereBVH::GetBuildThreadCount() const
+	{
+		// waking the workers costs more than it saves on sets that fit in a single task
+		if (uint32_t(spheres.size()) < 2 * settings.minSpheresPerBuildTask) return 1;
+		return settings.nrOfBuildThreads > 0 ? settings.nrOfBuildThreads : std::max(std::thread::hardware_concurrency(), 1u);
+	}
+
+	void SphereBVH::BinSpheres(uint32_t first, uint32_t end, const Bounds& centroidBounds, BinSet& binSet) const
+	{
+		float binScale[3];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			const float extent = centroidBounds.bmax[axis] - centroidBounds.bmin[axis];
+			binScale[axis] = extent > 0.f ? float(SphereBVHSettings::NrOfBins) / extent : 0.f;
+		}
+
+		for (uint32_t i = first; i < end; i++)
+		{
+			const PackedSphere& sphere = spheres[i];
+			const float center[3]{ sphere.centerX, sphere.centerY, sphere.centerZ };
+			const float low[3]{ center[0] - sphere.radius, center[1] - sphere.radius, center[2] - sphere.radius };
+			const float high[3]{ center[0] + sphere.radius, center[1] + sphere.radius, center[2] + sphere.radius };
+			for (int axis = 0; axis < 3; axis++)
+			{
+				Bin& bin = binSet.bins[axis][GetBinIdx(center[axis], centroidBounds.bmin[axis], binScale[axis])];
+				bin.bounds.Grow(low, high);
+				bin.sphereCount++;
+			}
+		}
+	}
+
+	SphereBVH::Split SphereBVH::FindSplit(const BinSet& binSet, const Bounds& centroidBounds) const
+	{
+		constexpr uint32_t NrOfBins{ SphereBVHSettings::NrOfBins };
+
+		Split best{};
+		for (int axis = 0; axis < 3; axis++)
+		{
+			if (centroidBounds.bmax[axis] <= centroidBounds.bmin[axis]) continue;
+			const Bin* bins = binSet.bins[axis];
+
+			// left and right sweeps give the area and count on both sides of every plane between two bins
+			float leftArea[NrOfBins - 1], rightArea[NrOfBins - 1];
+			uint32_t leftCount[NrOfBins - 1], rightCount[NrOfBins - 1];
+			Bounds leftBounds{}, rightBounds{};
+			uint32_t leftSum = 0, rightSum = 0;
+			for (uint32_t i = 0; i < NrOfBins - 1; i++)
+			{
+				leftSum += bins[i].sphereCount;
+				leftCount[i] = leftSum;
+				leftBounds.Grow(bins[i].bounds);
+				leftArea[i] = leftBounds.HalfArea();
+
+				rightSum += bins[NrOfBins - 1 - i].sphereCount;
+				rightCount[NrOfBins - 2 - i] = rightSum;
+				rightBounds.Grow(bins[NrOfBins - 1 - i].bounds);
+				rightArea[NrOfBins - 2 - i] = rightBounds.HalfArea();
+			}
+
+			for (uint32_t i = 0; i < NrOfBins - 1; i++)
+			{
+				if (leftCount[i] == 0 || rightCount[i] == 0) continue;
+				const float cost = leftArea[i] * float(leftCount[i]) + rightArea[i] * float(rightCount[i]);
+				if (cost < best.cost)
+				{
+					best.axis = axis;
+					best.lastLeftBin = i;
+					best.cost = cost;
+				}
+			}
+		}
+		return best;
+	}
+
+	uint32_t SphereBVH::Partition(uint32_t first, uint32_t count, const Split& split, const Bounds& centroidBounds, ChildBounds& childBounds)
+	{
+		const int axis = split.axis;
+		const float centroidMin = centroidBounds.bmin[axis];
+		const float binScale = float(SphereBVHSettings::NrOfBins) / (centroidBounds.bmax[axis] - centroidMin);
+
+		// every sphere is classified once and grows the bounds of its side, the materials and indices are swapped along with it
+		int64_t i = first, j = int64_t(first) + count - 1;
+		while (i <= j)
+		{
+			const PackedSphere& sphere = spheres[i];
+			const float center[3]{ sphere.centerX, sphere.centerY, sphere.centerZ };
+			const float low[3]{ center[0] - sphere.radius, center[1] - sphere.radius, center[2] - sphere.radius };
+			const float high[3]{ center[0] + sphere.radius, center[1] + sphere.radius, center[2] + sphere.radius };
+			const int side = GetBinIdx(center[axis], centroidMin, binScale) <= split.lastLeftBin ? 0 : 1;
+			childBounds.bounds[side].Grow(low, high);
+			childBounds.centroidBounds[side].Grow(center, center);
+			if (side == 0)
+			{
+				i++;
+				continue;
+			}
+			std::swap(spheres[i], spheres[j]);
+			std::swap(materials[i], materials[j]);
+			std::swap(sphereIndices[i], sphereIndices[j]);
+			j--;
+		}
+		return uint32_t(i);
+	}
+
+	uint32_t SphereBVH::PartitionSlices(uint32_t first, uint32_t count, const Split& split, const Bounds& centroidBounds, uint32_t nrOfSlices,
+		ChildBounds& childBounds)
+	{
+		const int axis = split.axis;
+		const float centroidMin = centroidBounds.bmin[axis];
+		const float binScale = float(SphereBVHSettings::NrOfBins) / (centroidBounds.bmax[axis] - centroidMin);
+		auto isLeft = [&](const PackedSphere& sphere)
+			{
+				const float center[3]{ sphere.centerX, sphere.centerY, sphere.centerZ };
+				return GetBinIdx(center[axis], centroidMin, binScale) <= split.lastLeftBin;
+			};
+
+		// every slice counts its left spheres and grows the bounds of both sides
+		std::fill_n(sliceChildBounds.begin(), nrOfSlices, ChildBounds{});
+		workerPool->ParallelForSlices(first, count, nrOfSlices, [&](uint32_t sliceIdx, uint32_t sliceFirst, uint32_t sliceEnd)
+			{
+				ChildBounds& bounds = sliceChildBounds[sliceIdx];
+				uint32_t leftCount = 0;
+				for (uint32_t i = sliceFirst; i < sliceEnd; i++)
+				{
+					const PackedSphere& sphere = spheres[i];
+					const float center[3]{ sphere.centerX, sphere.centerY, sphere.centerZ };
+					const float low[3]{ center[0] - sphere.radius, center[1] - sphere.radius, center[2] - sphere.radius };
+					const float high[3]{ center[0] + sphere.radius, center[1] + sphere.radius, center[2] + sphere.radius };
+					const int side = isLeft(sphere) ? 0 : 1;
+					bounds.bounds[side].Grow(low, high);
+					bounds.centroidBounds[side].Grow(center, center);
+					leftCount += 1 - side;
+				}
+				sliceLeftCounts[sliceIdx] = leftCount;
+			});
+
+		// the left spheres of all slices come first, each slice writes behind the ones before it on both sides
+		uint32_t leftEnd = first;
+		for (uint32_t sliceIdx = 0; sliceIdx < nrOfSlices; sliceIdx++)
+		{
+			sliceLeftStarts[sliceIdx] = leftEnd;
+			leftEnd += sliceLeftCounts[sliceIdx];
+			for (int side = 0; side < 2; side++)
+			{
+				childBounds.bounds[side].Grow(sliceChildBounds[sliceIdx].bounds[side]);
+				childBounds.centroidBounds[side].Grow(sliceChildBounds[sliceIdx].centroidBounds[side]);
+			}
+		}
+		uint32_t rightEnd = leftEnd;
+		for (uint32_t sliceIdx = 0; sliceIdx < nrOfSlices; sliceIdx++)
+		{
+			sliceRightStarts[sliceIdx] = rightEnd;
+			rightEnd += uint32_t(uint64_t(count) * (sliceIdx + 1) / nrOfSlices - uint64_t(count) * sliceIdx / nrOfSlices) - sliceLeftCounts[sliceIdx];
+		}
+
+		// scatter into the scratch arrays, then copy the range back slice by slice
+		workerPool->ParallelForSlices(first, count, nrOfSlices, [&](uint32_t sliceIdx, uint32_t sliceFirst, uint32_t sliceEnd)
+			{
+				uint32_t sideIdx[2]{ sliceLeftStarts[sliceIdx], sliceRightStarts[sliceIdx] };
+				for (uint32_t i = sliceFirst; i < sliceEnd; i++)
+				{
+					const uint32_t targetIdx = sideIdx[isLeft(spheres[i]) ? 0 : 1]++;
+					partitionSpheres[targetIdx] = spheres[i];
+					partitionMaterials[targetIdx] = materials[i];
+					partitionSphereIndices[targetIdx] = sphereIndices[i];
+				}
+			});
+		workerPool->ParallelForSlices(first, count, nrOfSlices, [&](uint32_t, uint32_t sliceFirst, uint32_t sliceEnd)
+			{
+				std::copy(partitionSpheres.begin() + sliceFirst, partitionSpheres.begin() + sliceEnd, spheres.begin() + sliceFirst);
+				std::copy(partitionMaterials.begin() + sliceFirst, partitionMaterials.begin() + sliceEnd, materials.begin() + sliceFirst);
+				std::copy(partitionSphereIndices.begin() + sliceFirst, partitionSphereIndices.begin() + sliceEnd, sphereIndices.begin() + sliceFirst);
+			});
+		return leftEnd;
+	}
+
+	bool SphereBVH::SplitNode(uint32_t nodeIdx, uint32_t first, uint32_t count, const Bounds& centroidBounds, uint32_t depth, uint32_t nrOfThreads,
+		uint32_t& leftCount, ChildBounds& childBounds)
+	{
+		SphereBVHNode& node = nodes[nodeIdx];
+		if (count <= settings.maxSpheresPerLeaf || depth >= MaxSphereBVHDepth)
+		{
+			node.firstSphereIdx = first;
+			node.sphereCount = count;
+			return false;
+		}
+
+		// a slice per thread, but none smaller than a build task: waking the workers for less costs more than it saves
+		const uint32_t nrOfSlices = std::max(std::min(nrOfThreads, count / std::max(settings.minSpheresPerBuildTask, 1u)), 1u);
+
+		Split split{};
+		if (count <= settings.maxMidpointSplitSpheres)
+		{
+			// the middle of the widest axis is the boundary between the two halves of the bins
+			for (int axis = 0; axis < 3; axis++)
+			{
+				const float extent = centroidBounds.bmax[axis] - centroidBounds.bmin[axis];
+				if (extent > 0.f && (split.axis < 0 || extent > centroidBounds.bmax[split.axis] - centroidBounds.bmin[split.axis])) split.axis = axis;
+			}
+			split.lastLeftBin = SphereBVHSettings::NrOfBins / 2 - 1;
+		}
+		else
+		{
+			BinSet binSet{};
+			if (nrOfSlices > 1)
+			{
+				// every thread bins its own slice, the bins are merged afterwards
+				std::fill_n(sliceBinSets.begin(), nrOfSlices, BinSet{});
+				workerPool->ParallelForSlices(first, count, nrOfSlices, [&](uint32_t sliceIdx, uint32_t sliceFirst, uint32_t sliceEnd)
+					{
+						BinSpheres(sliceFirst, sliceEnd, centroidBounds, sliceBinSets[sliceIdx]);
+					});
+				for (uint32_t sliceIdx = 0; sliceIdx < nrOfSlices; sliceIdx++)
+				{
+					const BinSet& sliceBinSet = sliceBinSets[sliceIdx];
+					for (int axis = 0; axis < 3; axis++)
+					{
+						for (uint32_t i = 0; i < SphereBVHSettings::NrOfBins; i++)
+						{
+							binSet.bins[axis][i].bounds.Grow(sliceBinSet.bins[axis][i].bounds);
+							binSet.bins[axis][i].sphereCount += sliceBinSet.bins[axis][i].sphereCount;
+						}
+					}
+				}
+			}
+			else
+			{
+				BinSpheres(first, first + count, centroidBounds, binSet);
+			}
+			split = FindSplit(binSet, centroidBounds);
+		}
+
+		if (split.axis >= 0)
+		{
+			const uint32_t leftEnd = nrOfSlices > 1 ? PartitionSlices(first, count, split, centroidBounds, nrOfSlices, childBounds)
+				: Partition(first, count, split, centroidBounds, childBounds);
+			leftCount = leftEnd - first;
+		}
+		else
+		{
+			// every center coincides, halve the range
+			leftCount = count / 2;
+			for (uint32_t i = first; i < first + count; i++)
+			{
+				const PackedSphere& sphere = spheres[i];
+				const float low[3]{ sphere.centerX - sphere.radius, sphere.centerY - sphere.radius, sphere.centerZ - sphere.radius };
+				const float high[3]{ sphere.centerX + sphere.radius, sphere.centerY + sphere.radius, sphere.centerZ + sphere.radius };
+				childBounds.bounds[i < first + leftCount ? 0 : 1].Grow(low, high);
+			}
+			childBounds.centroidBounds[0] = childBounds.centroidBounds[1] = centroidBounds;
+		}
+
+		// a node over n spheres owns the 2n - 1 node slots starting at its own index, the most its subtree can use.
+		// The left child gets the 2 * leftCount - 1 slots after its parent and the right child the rest,
+		// so the tasks allocate from disjoint ranges without any locking
+		const uint32_t rightChildIdx = nodeIdx + 2 * leftCount;
+		nodes[nodeIdx + 1].aabb = childBounds.bounds[0].ToAABB();
+		nodes[rightChildIdx].aabb = childBounds.bounds[1].ToAABB();
+		node.rightNode = rightChildIdx;
+		node.sphereCount = 0;
+		return true;
+	}
+
+	void SphereBVH::Subdivide(uint32_t nodeIdx, uint32_t first, uint32_t count, const Bounds& centroidBounds, uint32_t depth)
+	{
+		uint32_t leftCount;
+		ChildBounds childBounds{};
+		if (!SplitNode(nodeIdx, first, count, centroidBounds, depth, 1, leftCount, childBounds)) return;
+
+		Subdivide(nodeIdx + 1, first, leftCount, childBounds.centroidBounds[0], depth + 1);
+		Subdivide(nodeIdx + 2 * leftCount, first + leftCount, count - leftCount, childBounds.centroidBounds[1], depth + 1);
+	}
+
+	void SphereBVH::SubdivideTopLevel(uint32_t nodeIdx, uint32_t first, uint32_t count, const Bounds& centroidBounds, uint32_t depth,
+		uint32_t nrOfThreads, std::vector<BuildTask>& tasks)
+	{
+		if (count < settings.minSpheresPerBuildTask)
+		{
+			tasks.push_back({ nodeIdx, first, count, depth, centroidBounds });
+			return;
+		}
+
+		uint32_t leftCount;
+		ChildBounds childBounds{};
+		if (!SplitNode(nodeIdx, first, count, centroidBounds, depth, nrOfThreads, leftCount, childBounds)) return;
+
+		SubdivideTopLevel(nodeIdx + 1, first, leftCount, childBounds.centroidBounds[0], depth + 1, nrOfThreads, tasks);
+		SubdivideTopLevel(nodeIdx + 2 * leftCount, first + leftCount, count - leftCount, childBounds.centroidBounds[1], depth + 1, nrOfThreads, tasks);
+	}
+#pragma endregion
+
+	void SphereBVH::RemoveSphere(uint32_t sphereIdx)
+	{
+		if (packedIdxOfSphere.empty())
+		{
+			packedIdxOfSphere.resize(sphereIndices.size());
+			for (uint32_t i = 0; i < uint32_t(sphereIndices.size()); i++) packedIdxOfSphere[sphereIndices[i]] = i;
+		}
+
+		// no distance compares as inside a NaN radius
+		spheres[packedIdxOfSphere[sphereIdx]].radius = std::numeric_limits<float>::quiet_NaN();
+	}
+
+#pragma region Traversal
+	template<bool IsAnyHit>
+	bool SphereBVH::Traverse(const Ray& ray, float& closestT, uint32_t& closestSphereIdx) const
+	{
+		if (nodes.empty() || GeometryUtils::IntersectAABB(ray, nodes[0].aabb, closestT) == FLT_MAX) return false;
+
+		const float originX = ray.origin.x, originY = ray.origin.y, originZ = ray.origin.z;
+		const float directionX = ray.direction.x, directionY = ray.direction.y, directionZ = ray.direction.z;
+
+		GeometryUtils::TraversalEntry stack[MaxSphereBVHDepth];
+		uint32_t stackSize = 0;
+		uint32_t nodeIdx = 0;
+		bool didHit = false;
+		while (true)
+		{
+			const SphereBVHNode& node = nodes[nodeIdx];
+			if (node.IsLeaf())
+			{
+				for (uint32_t i = node.firstSphereIdx; i < node.firstSphereIdx + node.sphereCount; i++)
+				{
+					// distance along the ray to the point nearest the center, and that point's squared distance to it.
+					// The offset is measured directly instead of as |toCenter|^2 - tNearest^2, which cancels badly far away
+					const PackedSphere& sphere = spheres[i];
+					const float toCenterX = sphere.centerX - originX, toCenterY = sphere.centerY - originY, toCenterZ = sphere.centerZ - originZ;
+					const float tNearest = toCenterX * directionX + toCenterY * directionY + toCenterZ * directionZ;
+					const float offsetX = toCenterX - directionX * tNearest, offsetY = toCenterY - directionY * tNearest, offsetZ = toCenterZ - directionZ * tNearest;
+					const float sqrOffset = offsetX * offsetX + offsetY * offsetY + offsetZ * offsetZ;
+					const float sqrRadius = sphere.radius * sphere.radius;
+					if (!(sqrOffset <= sqrRadius)) continue; // also skips removed spheres
+
+					const float halfChord = std::sqrt(sqrRadius - sqrOffset);
+					float t = tNearest - halfChord;
+					if (t < ray.min || t > ray.max)
+					{
+						t = tNearest + halfChord;
+						if (t < ray.min || t > ray.max) continue;
+					}
+					if (t >= closestT) continue;
+
+					closestT = t;
+					closestSphereIdx = i;
+					didHit = true;
+					if constexpr (IsAnyHit) return true;
+				}
+			}
+			else
+			{
+				// descend into the near child, the far one waits on the stack
+				GeometryUtils::TraversalEntry nearChild{ nodeIdx + 1, GeometryUtils::IntersectAABB(ray, nodes[nodeIdx + 1].aabb, closestT) };
+				GeometryUtils::TraversalEntry farChild{ node.rightNode, GeometryUtils::IntersectAABB(ray, nodes[node.rightNode].aabb, closestT) };
+				if (farChild.tEntry < nearChild.tEntry) std::swap(nearChild, farChild);
+
+				if (nearChild.tEntry != FLT_MAX)
+				{
+					if (farChild.tEntry != FLT_MAX) stack[stackSize++] = farChild;
+					nodeIdx = nearChild.nodeIdx;
+					continue;
+				}
+			}
+
+			// continue with the nearest stacked node that can still hold a closer hit
+			GeometryUtils::TraversalEntry entry{};
+			do
+			{
+				if (stackSize == 0) return didHit;
+				entry = stack[--stackSize];
+			} while (entry.tEntry >= closestT);
+			nodeIdx = entry.nodeIdx;
+		}
+	}
+
+	bool SphereBVH::ClosestHit(const Ray& ray, HitRecord& hitRecord) const
+	{
+		float closestT = hitRecord.t;
+		uint32_t closestSphereIdx = UINT32_MAX;
+		if (!Traverse<false>(ray, closestT, closestSphereIdx)) return false;
+
+		const PackedSphere& sphere = spheres[closestSphereIdx];
+		hitRecord.t = closestT;
+		hitRecord.didHit = true;
+		hitRecord.origin = ray.origin + closestT * ray.direction;
+		hitRecord.normal = (hitRecord.origin - Vector3{ sphere.centerX, sphere.centerY, sphere.centerZ }).Normalized();
+		hitRecord.materialIndex = materials[closestSphereIdx];
+		return true;
+	}
+
+	bool SphereBVH::AnyHit(const Ray& ray) const
+	{
+		float closestT = FLT_MAX;
+		uint32_t closestSphereIdx = UINT32_MAX;
+		return Traverse<true>(ray, closestT, closestSphereIdx);
+	}
+#pragma endregion
+
+	size_t SphereBVH::GetMemoryBytes() const
+	{
+		return nodes.size() * sizeof(SphereBVHNode) + spheres.size() * sizeof(PackedSphere) + materials.size()
+			+ (sphereIndices.size() + packedIdxOfSphere.size()) * sizeof(uint32_t);
+	}
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "BVH.h"
+#include "DataTypes.h"
+#include "WorkerPool.h"
+
+namespace dae
+{
+	// Sphere as a single float4. The material lives in a side array, so a leaf test only loads 16 bytes per sphere
+	struct alignas(16) PackedSphere
+	{
+		float centerX, centerY, centerZ, radius;
+	};
+
+	// Same depth-first layout as BVHNode: the left child directly follows its parent
+	struct alignas(32) SphereBVHNode
+	{
+		::aabb aabb;
+		union
+		{
+			uint32_t rightNode;      // inner nodes
+			uint32_t firstSphereIdx; // leaves
+		};
+		uint32_t sphereCount;
+
+		bool IsLeaf() const
+		{
+			return (sphereCount > 0);
+		};
+	};
+
+	struct SphereBVHSettings
+	{
+		static constexpr uint32_t NrOfBins{ 16 };
+
+		uint32_t maxSpheresPerLeaf{ 4 };
+		uint32_t maxMidpointSplitSpheres{ 1024 }; // nodes this small split at the middle of the widest axis, binning them costs more than it gains
+		uint32_t nrOfBuildThreads{ 0 };        // 0 = one per hardware thread, 1 builds on the calling thread only
+		uint32_t minSpheresPerBuildTask{ 8192 }; // smaller subtrees are built by a single thread, larger nodes are split in slices at least this large
+	};
+
+	// Binned SAH BVH over a large number of spheres, for particle scenes that move every sphere every frame.
+	// Rebuilding each frame is cheap enough that the tree never degrades like a refit one would: the spheres
+	// are packed in leaf order during the build, the top levels are binned and partitioned in parallel and the
+	// subtrees below them are built as independent tasks, all on a pool of threads kept between builds.
+	class SphereBVH final
+	{
+	public:
+		explicit SphereBVH(const SphereBVHSettings& settings = {});
+
+		void Build(const std::vector<Sphere>& spheres);
+		// Hides the sphere at this index of the list the BVH was built from until the next build, the bounds stay as they are
+		void RemoveSphere(uint32_t sphereIdx);
+
+		// Only overwrites the record with a hit closer than hitRecord.t, returns whether it did
+		bool ClosestHit(const Ray& ray, HitRecord& hitRecord) const;
+		bool AnyHit(const Ray& ray) const;
+
+		bool IsEmpty() const { return spheres.empty(); }
+		aabb GetBounds() const { return nodes.empty() ? aabb{} : nodes[0].aabb; }
+		uint32_t GetSphereCount() const { return uint32_t(spheres.size()); }
+		size_t GetMemoryBytes() const;
+		float GetBuildTimeMs() const { return buildTimeMs; }
+
+		const SphereBVHSettings& GetSettings() const { return settings; }
+		void SetSettings(const SphereBVHSettings& buildSettings) { settings = buildSettings; }
+
+	private:
+		// Bounds as plain floats, the build loops stay clear of Vector3's out of line operators
+		struct Bounds
+		{
+			float bmin[3]{ 1e30f, 1e30f, 1e30f };
+			float bmax[3]{ -1e30f, -1e30f, -1e30f };
+
+			void Grow(const float* low, const float* high)
+			{
+				for (int axis = 0; axis < 3; axis++)
+				{
+					bmin[axis] = low[axis] < bmin[axis] ? low[axis] : bmin[axis];
+					bmax[axis] = high[axis] > bmax[axis] ? high[axis] : bmax[axis];
+				}
+			}
+			void Grow(const Bounds& bounds) { Grow(bounds.bmin, bounds.bmax); }
+			float HalfArea() const;
+			aabb ToAABB() const;
+		};
+
+		struct Bin
+		{
+			Bounds bounds{};
+			uint32_t sphereCount{ 0 };
+		};
+
+		struct BinSet
+		{
+			Bin bins[3][SphereBVHSettings::NrOfBins]{};
+		};
+
+		// Spheres whose center falls in a bin up to lastLeftBin go left
+		struct Split
+		{
+			int axis{ -1 };
+			uint32_t lastLeftBin{ 0 };
+			float cost{ 1e30f };
+		};
+
+		// Both children of a split node, filled in while partitioning
+		struct ChildBounds
+		{
+			Bounds bounds[2]{}, centroidBounds[2]{};
+		};
+
+		// Subtree below the top levels, built by one thread in the node range its root reserved
+		struct BuildTask
+		{
+			uint32_t nodeIdx, first, count, depth;
+			Bounds centroidBounds;
+		};
+
+		uint32_t GetBuildThreadCount() const;
+		void BinSpheres(uint32_t first, uint32_t end, const Bounds& centroidBounds, BinSet& binSet) const;
+		Split FindSplit(const BinSet& binSet, const Bounds& centroidBounds) const;
+		uint32_t Partition(uint32_t first, uint32_t count, const Split& split, const Bounds& centroidBounds, ChildBounds& childBounds);
+		uint32_t PartitionSlices(uint32_t first, uint32_t count, const Split& split, const Bounds& centroidBounds, uint32_t nrOfSlices,
+			ChildBounds& childBounds);
+		bool SplitNode(uint32_t nodeIdx, uint32_t first, uint32_t count, const Bounds& centroidBounds, uint32_t depth, uint32_t nrOfThreads,
+			uint32_t& leftCount, ChildBounds& childBounds);
+		void Subdivide(uint32_t nodeIdx, uint32_t first, uint32_t count, const Bounds& centroidBounds, uint32_t depth);
+		void SubdivideTopLevel(uint32_t nodeIdx, uint32_t first, uint32_t count, const Bounds& centroidBounds, uint32_t depth,
+			uint32_t nrOfThreads, std::vector<BuildTask>& tasks);
+
+		template<bool IsAnyHit>
+		bool Traverse(const Ray& ray, float& closestT, uint32_t& closestSphereIdx) const;
+
+		SphereBVHSettings settings{};
+		std::vector<SphereBVHNode> nodes{}; // every node owns 2n - 1 slots for its n spheres, unused slots are never visited
+		std::vector<PackedSphere> spheres{};      // in leaf order
+		std::vector<unsigned char> materials{};   // parallel to spheres
+		std::vector<uint32_t> sphereIndices{};    // parallel to spheres, where each came from in the list given to Build
+		std::vector<uint32_t> packedIdxOfSphere{}; // inverse of sphereIndices, filled by the first RemoveSphere after a build
+
+		// parallel builds only, kept between frames like the nodes
+		std::unique_ptr<WorkerPool> workerPool{};
+		std::vector<PackedSphere> partitionSpheres{}; // the slices of a parallel partition scatter into these, then copy back
+		std::vector<unsigned char> partitionMaterials{};
+		std::vector<uint32_t> partitionSphereIndices{};
+		std::vector<Bounds> sliceBounds{}, sliceCentroidBounds{}; // one per slice, sized for the thread count by Build
+		std::vector<ChildBounds> sliceChildBounds{};
+		std::vector<uint32_t> sliceLeftCounts{}, sliceLeftStarts{}, sliceRightStarts{};
+		std::vector<BinSet> sliceBinSets{};
+		std::vector<BuildTask> buildTasks{};
+		float buildTimeMs{ 0.f };
+	};
+}
@@ -0,0 +1,476 @@
+#include "TLAS.h"
+
+#include <algorithm>
+#include <cfloat>
+
+#include "DataTypes.h"
+
+namespace dae
+{
+	MeshInstance::MeshInstance(const TriangleMesh* _pMesh, const Matrix& _transform, unsigned char _materialIndex) :
+		pMesh{ _pMesh }, materialIndex{ _materialIndex }
+	{
+		SetTransform(_transform);
+	}
+
+	void MeshInstance::SetTransform(const Matrix& _transform)
+	{
+		transform = _transform;
+		invTransform = Matrix::Inverse(transform);
+		normalTransform = Matrix::Transpose(invTransform);
+
+		// transform the 8 corners of the object space root box
+		const aabb objectBounds = pMesh->accelerator->GetBounds();
+		bounds = aabb{};
+		for (int corner = 0; corner < 8; corner++)
+		{
+			bounds.grow(transform.TransformPoint(
+				corner & 1 ? objectBounds.bmax.x : objectBounds.bmin.x,
+				corner & 2 ? objectBounds.bmax.y : objectBounds.bmin.y,
+				corner & 4 ? objectBounds.bmax.z : objectBounds.bmin.z));
+		}
+	}
+
+	void TLAS::Build(const TLASGeometry& _geometry)
+	{
+		geometry = _geometry;
+
+		// gather every bounded object
+		objects.clear();
+		auto addObjects = [this](TLASObjectType type, size_t count)
+			{
+				for (uint32_t idx = 0; idx < count; idx++)
+				{
+					if (type == TLASObjectType::TriangleMesh && (*geometry.pTriangleMeshes)[idx].accelerator == nullptr) continue;
+
+					TLASObject object{};
+					object.type = type;
+					object.geometryIdx = idx;
+					object.bounds = ComputeObjectBounds(object);
+					objects.push_back(object);
+				}
+			};
+		if (geometry.pSpheres && !geometry.pSphereBVH) addObjects(TLASObjectType::Sphere, geometry.pSpheres->size());
+		if (geometry.pTriangles) addObjects(TLASObjectType::Triangle, geometry.pTriangles->size());
+		if (geometry.pTriangleMeshes) addObjects(TLASObjectType::TriangleMesh, geometry.pTriangleMeshes->size());
+		if (geometry.pMeshInstances) addObjects(TLASObjectType::MeshInstance, geometry.pMeshInstances->size());
+		if (geometry.pCombinedMesh) addObjects(TLASObjectType::CombinedMesh, 1);
+		if (geometry.pSphereBVH) addObjects(TLASObjectType::SphereSet, 1);
+
+		if (geometry.pSpheres) objectIdxOfGeometry[uint8_t(TLASObjectType::Sphere)].assign(geometry.pSpheres->size(), UINT32_MAX);
+		if (geometry.pTriangles) objectIdxOfGeometry[uint8_t(TLASObjectType::Triangle)].assign(geometry.pTriangles->size(), UINT32_MAX);
+		if (geometry.pTriangleMeshes) objectIdxOfGeometry[uint8_t(TLASObjectType::TriangleMesh)].assign(geometry.pTriangleMeshes->size(), UINT32_MAX);
+		if (geometry.pMeshInstances) objectIdxOfGeometry[uint8_t(TLASObjectType::MeshInstance)].assign(geometry.pMeshInstances->size(), UINT32_MAX);
+		objectIdxOfGeometry[uint8_t(TLASObjectType::CombinedMesh)].assign(1, UINT32_MAX);
+		objectIdxOfGeometry[uint8_t(TLASObjectType::SphereSet)].assign(1, UINT32_MAX);
+
+		BuildNodes();
+	}
+
+	void TLAS::BuildNodes()
+	{
+		const uint32_t nrOfObjects = static_cast<uint32_t>(objects.size());
+
+		nodesUsed = 0;
+		tlasNodes.clear();
+		freeObjects.clear();
+		freeNodePairs.clear();
+		if (nrOfObjects == 0) return;
+
+		tlasNodes.resize(nrOfObjects * 2 - 1);
+
+		// assign all objects to root node
+		TLASNode& root = tlasNodes[0];
+		root.leftNode = 0;
+		root.firstObjectIdx = 0, root.objectCount = nrOfObjects;
+		root.parent = UINT32_MAX;
+		root.height = 0;
+		nodesUsed = 1;
+		UpdateNodeBounds(0);
+
+		Subdivide(0);
+
+		// the objects are in their final order now, link them to their leaves for the incremental updates
+		for (uint32_t nodeIdx = 0; nodeIdx < nodesUsed; nodeIdx++)
+		{
+			if (tlasNodes[nodeIdx].IsLeaf()) objects[tlasNodes[nodeIdx].firstObjectIdx].leafNode = nodeIdx;
+		}
+		for (uint32_t objectIdx = 0; objectIdx < nrOfObjects; objectIdx++)
+		{
+			objectIdxOfGeometry[uint8_t(objects[objectIdx].type)][objects[objectIdx].geometryIdx] = objectIdx;
+		}
+	}
+
+	void TLAS::Refit()
+	{
+		// inserts reuse freed node pairs, children are no longer guaranteed to follow their parent
+		if (!IsEmpty()) RefitNode(0);
+	}
+
+	aabb TLAS::RefitNode(uint32_t nodeIdx)
+	{
+		TLASNode& node = tlasNodes[nodeIdx];
+		if (node.IsLeaf())
+		{
+			TLASObject& object = objects[node.firstObjectIdx];
+			object.bounds = ComputeObjectBounds(object);
+			node.aabb = object.bounds;
+			return node.aabb;
+		}
+
+		aabb bounds = RefitNode(node.leftNode);
+		bounds.grow(RefitNode(node.leftNode + 1));
+		tlasNodes[nodeIdx].aabb = bounds;
+		return bounds;
+	}
+
+	aabb TLAS::ComputeObjectBounds(const TLASObject& object) const
+	{
+		aabb bounds{};
+		switch (object.type)
+		{
+		case TLASObjectType::Sphere:
+		{
+			const Sphere& sphere = (*geometry.pSpheres)[object.geometryIdx];
+			const Vector3 radius{ sphere.radius, sphere.radius, sphere.radius };
+			bounds.grow(sphere.origin - radius);
+			bounds.grow(sphere.origin + radius);
+			break;
+		}
+		case TLASObjectType::Triangle:
+		{
+			const Triangle& triangle = (*geometry.pTriangles)[object.geometryIdx];
+			bounds.grow(triangle.v0);
+			bounds.grow(triangle.v1);
+			bounds.grow(triangle.v2);
+			break;
+		}
+		case TLASObjectType::TriangleMesh:
+			// the mesh accelerator is built over the transformed positions, its bounds are in world space
+			bounds = (*geometry.pTriangleMeshes)[object.geometryIdx].accelerator->GetBounds();
+			break;
+		case TLASObjectType::MeshInstance:
+			bounds = (*geometry.pMeshInstances)[object.geometryIdx].bounds;
+			break;
+		case TLASObjectType::CombinedMesh:
+			bounds = geometry.pCombinedMesh->accelerator->GetBounds();
+			break;
+		case TLASObjectType::SphereSet:
+			bounds = geometry.pSphereBVH->GetBounds();
+			break;
+		}
+		return bounds;
+	}
+
+	void TLAS::UpdateNodeBounds(uint32_t nodeIdx)
+	{
+		TLASNode& node = tlasNodes[nodeIdx];
+		node.aabb = aabb{};
+		for (uint32_t i = 0; i < node.objectCount; i++)
+		{
+			node.aabb.grow(objects[node.firstObjectIdx + i].bounds);
+		}
+	}
+
+	void TLAS::Subdivide(uint32_t nodeIdx)
+	{
+		// one object per leaf, meshes and instances have their own BVH below it
+		TLASNode& node = tlasNodes[nodeIdx];
+		if (node.objectCount <= 1) return;
+
+		// median split along the widest axis of the object centers
+		aabb centerBounds{};
+		for (uint32_t i = 0; i < node.objectCount; i++)
+		{
+			const aabb& bounds = objects[node.firstObjectIdx + i].bounds;
+			centerBounds.grow((bounds.bmin + bounds.bmax) * 0.5f);
+		}
+
+		const Vector3 extent = centerBounds.bmax - centerBounds.bmin;
+		int axis = 0;
+		if (extent.y > extent.x) axis = 1;
+		if (extent.z > extent[axis]) axis = 2;
+
+		const uint32_t leftCount = node.objectCount / 2;
+		const auto first = objects.begin() + node.firstObjectIdx;
+		std::nth_element(first, first + leftCount, first + node.objectCount, [axis](const TLASObject& a, const TLASObject& b)
+			{
+				return a.bounds.bmin[axis] + a.bounds.bmax[axis] < b.bounds.bmin[axis] + b.bounds.bmax[axis];
+			});
+
+		// create child nodes
+		const uint32_t leftChildIdx = nodesUsed;
+		nodesUsed += 2;
+		const uint32_t rightChildIdx = leftChildIdx + 1;
+		tlasNodes[leftChildIdx].firstObjectIdx = node.firstObjectIdx;
+		tlasNodes[leftChildIdx].objectCount = leftCount;
+		tlasNodes[rightChildIdx].firstObjectIdx = node.firstObjectIdx + leftCount;
+		tlasNodes[rightChildIdx].objectCount = node.objectCount - leftCount;
+		tlasNodes[leftChildIdx].parent = tlasNodes[rightChildIdx].parent = nodeIdx;
+		tlasNodes[leftChildIdx].height = tlasNodes[rightChildIdx].height = 0;
+		node.leftNode = leftChildIdx;
+		node.objectCount = 0;
+		UpdateNodeBounds(leftChildIdx);
+		UpdateNodeBounds(rightChildIdx);
+		// recurse
+		Subdivide(leftChildIdx);
+		Subdivide(rightChildIdx);
+		node.height = 1 + std::max(tlasNodes[leftChildIdx].height, tlasNodes[rightChildIdx].height);
+	}
+
+	void TLAS::RebuildIfTooDeep()
+	{
+		if (IsEmpty() || tlasNodes[0].height <= MaxDepth) return;
+
+		// drop the slots of removed objects, the build packs the others in leaf order
+		std::erase_if(objects, [](const TLASObject& object) { return object.leafNode == UINT32_MAX; });
+		BuildNodes();
+	}
+
+#pragma region Incremental Updates
+	void TLAS::InsertObject(TLASObjectType type, uint32_t geometryIdx)
+	{
+		std::vector<uint32_t>& objectIndices = objectIdxOfGeometry[uint8_t(type)];
+		if (objectIndices.size() <= geometryIdx) objectIndices.resize(geometryIdx + 1, UINT32_MAX);
+
+		uint32_t objectIdx;
+		if (freeObjects.empty())
+		{
+			objectIdx = uint32_t(objects.size());
+			objects.emplace_back();
+		}
+		else
+		{
+			objectIdx = freeObjects.back();
+			freeObjects.pop_back();
+		}
+
+		TLASObject& object = objects[objectIdx];
+		object.type = type;
+		object.geometryIdx = geometryIdx;
+		object.bounds = ComputeObjectBounds(object);
+		objectIndices[geometryIdx] = objectIdx;
+
+		InsertLeaf(objectIdx);
+		RebuildIfTooDeep();
+	}
+
+	void TLAS::RemoveObject(TLASObjectType type, uint32_t geometryIdx, uint32_t lastGeometryIdx)
+	{
+		std::vector<uint32_t>& objectIndices = objectIdxOfGeometry[uint8_t(type)];
+		const uint32_t objectIdx = objectIndices[geometryIdx];
+		if (objectIdx != UINT32_MAX)
+		{
+			RemoveLeaf(objectIdx);
+			freeObjects.push_back(objectIdx);
+		}
+
+		// the last object of the list moves into the freed index
+		const uint32_t lastObjectIdx = objectIndices[lastGeometryIdx];
+		if (lastObjectIdx != UINT32_MAX) objects[lastObjectIdx].geometryIdx = geometryIdx;
+		objectIndices[geometryIdx] = lastObjectIdx;
+		objectIndices.pop_back();
+		RebuildIfTooDeep();
+	}
+
+	void TLAS::UpdateObject(TLASObjectType type, uint32_t geometryIdx)
+	{
+		const uint32_t objectIdx = objectIdxOfGeometry[uint8_t(type)][geometryIdx];
+		if (objectIdx == UINT32_MAX) return;
+
+		RemoveLeaf(objectIdx);
+		objects[objectIdx].bounds = ComputeObjectBounds(objects[objectIdx]);
+		InsertLeaf(objectIdx);
+		RebuildIfTooDeep();
+	}
+
+	void TLAS::InsertLeaf(uint32_t objectIdx)
+	{
+		const aabb& bounds = objects[objectIdx].bounds;
+		if (IsEmpty())
+		{
+			tlasNodes.assign(1, TLASNode{ bounds, 0, objectIdx, 1, UINT32_MAX, 0 });
+			nodesUsed = 1;
+			objects[objectIdx].leafNode = 0;
+			return;
+		}
+
+		// the sibling keeps its slot and becomes the new parent, its content moves to the left node of a new pair
+		const uint32_t siblingIdx = FindBestSibling(bounds);
+		const uint32_t pairIdx = AllocateNodePair();
+		tlasNodes[pairIdx] = tlasNodes[siblingIdx];
+		tlasNodes[pairIdx].parent = siblingIdx;
+		AttachChildren(pairIdx);
+		tlasNodes[pairIdx + 1] = TLASNode{ bounds, 0, objectIdx, 1, siblingIdx, 0 };
+		objects[objectIdx].leafNode = pairIdx + 1;
+
+		TLASNode& parent = tlasNodes[siblingIdx];
+		parent.leftNode = pairIdx;
+		parent.objectCount = 0;
+		RefitAncestors(siblingIdx);
+	}
+
+	void TLAS::RemoveLeaf(uint32_t objectIdx)
+	{
+		const uint32_t leafIdx = objects[objectIdx].leafNode;
+		objects[objectIdx].leafNode = UINT32_MAX;
+		const uint32_t parentIdx = tlasNodes[leafIdx].parent;
+		if (parentIdx == UINT32_MAX)
+		{
+			// that was the last object
+			tlasNodes.clear();
+			freeNodePairs.clear();
+			nodesUsed = 0;
+			return;
+		}
+
+		// the sibling takes over the parent's slot and the pair is released
+		const uint32_t pairIdx = tlasNodes[parentIdx].leftNode;
+		const uint32_t siblingIdx = leafIdx == pairIdx ? pairIdx + 1 : pairIdx;
+		const uint32_t grandParentIdx = tlasNodes[parentIdx].parent;
+		tlasNodes[parentIdx] = tlasNodes[siblingIdx];
+		tlasNodes[parentIdx].parent = grandParentIdx;
+		AttachChildren(parentIdx);
+		freeNodePairs.push_back(pairIdx);
+
+		if (grandParentIdx != UINT32_MAX) RefitAncestors(grandParentIdx);
+	}
+
+	uint32_t TLAS::FindBestSibling(const aabb& bounds) const
+	{
+		// Pairing with a node grows it and every ancestor: the cost is the area of the new parent
+		// plus the area its ancestors gain. That gain only grows further down, so subtrees whose
+		// lower bound can't beat the best candidate so far are skipped
+		struct Candidate
+		{
+			uint32_t nodeIdx;
+			float inheritedCost;
+		};
+
+		const float leafArea = bounds.halfArea();
+		uint32_t bestSibling = 0;
+		float bestCost = FLT_MAX;
+
+		std::vector<Candidate> stack{};
+		stack.push_back({ 0, 0.f });
+		while (!stack.empty())
+		{
+			const Candidate candidate = stack.back();
+			stack.pop_back();
+
+			const TLASNode& node = tlasNodes[candidate.nodeIdx];
+			aabb combined = node.aabb;
+			combined.grow(bounds);
+			const float combinedArea = combined.halfArea();
+			const float cost = combinedArea + candidate.inheritedCost;
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestSibling = candidate.nodeIdx;
+			}
+			if (node.IsLeaf()) continue;
+
+			const float childInheritedCost = candidate.inheritedCost + combinedArea - node.aabb.halfArea();
+			if (leafArea + childInheritedCost < bestCost)
+			{
+				stack.push_back({ node.leftNode, childInheritedCost });
+				stack.push_back({ node.leftNode + 1, childInheritedCost });
+			}
+		}
+		return bestSibling;
+	}
+
+	uint32_t TLAS::AllocateNodePair()
+	{
+		if (!freeNodePairs.empty())
+		{
+			const uint32_t pairIdx = freeNodePairs.back();
+			freeNodePairs.pop_back();
+			return pairIdx;
+		}
+
+		const uint32_t pairIdx = nodesUsed;
+		nodesUsed += 2;
+		tlasNodes.resize(nodesUsed);
+		return pairIdx;
+	}
+
+	void TLAS::RefitAncestors(uint32_t nodeIdx)
+	{
+		while (nodeIdx != UINT32_MAX)
+		{
+			UpdateInnerNode(nodeIdx);
+			Rotate(nodeIdx);
+			nodeIdx = tlasNodes[nodeIdx].parent;
+		}
+	}
+
+	void TLAS::Rotate(uint32_t nodeIdx)
+	{
+		// Tree rotations (Kensler 2008): swap a child with one of its grandchildren on the other side when that
+		// shrinks the inner child in between. The node's own bounds stay the same, only the child's area changes
+		const uint32_t childIdx[2]{ tlasNodes[nodeIdx].leftNode, tlasNodes[nodeIdx].leftNode + 1 };
+
+		float bestGain = 0.f;
+		uint32_t bestChild = UINT32_MAX, bestGrandChild = UINT32_MAX;
+		for (int side = 0; side < 2; side++)
+		{
+			const TLASNode& child = tlasNodes[childIdx[side]];
+			if (child.IsLeaf()) continue;
+
+			const TLASNode& otherChild = tlasNodes[childIdx[1 - side]];
+			const float childArea = child.aabb.halfArea();
+			for (uint32_t grandChild = 0; grandChild < 2; grandChild++)
+			{
+				// the other child takes the grandchild's place next to the remaining grandchild
+				aabb rotated = otherChild.aabb;
+				rotated.grow(tlasNodes[child.leftNode + 1 - grandChild].aabb);
+				const float gain = childArea - rotated.halfArea();
+				if (gain > bestGain)
+				{
+					bestGain = gain;
+					bestChild = childIdx[1 - side];
+					bestGrandChild = child.leftNode + grandChild;
+				}
+			}
+		}
+		if (bestChild == UINT32_MAX) return;
+
+		SwapSubtrees(bestChild, bestGrandChild);
+		UpdateInnerNode(tlasNodes[bestGrandChild].parent);
+		UpdateInnerNode(nodeIdx);
+	}
+
+	void TLAS::SwapSubtrees(uint32_t nodeIdxA, uint32_t nodeIdxB)
+	{
+		const uint32_t parentA = tlasNodes[nodeIdxA].parent, parentB = tlasNodes[nodeIdxB].parent;
+		std::swap(tlasNodes[nodeIdxA], tlasNodes[nodeIdxB]);
+		tlasNodes[nodeIdxA].parent = parentA;
+		tlasNodes[nodeIdxB].parent = parentB;
+		AttachChildren(nodeIdxA);
+		AttachChildren(nodeIdxB);
+	}
+
+	void TLAS::UpdateInnerNode(uint32_t nodeIdx)
+	{
+		TLASNode& node = tlasNodes[nodeIdx];
+		const TLASNode& left = tlasNodes[node.leftNode];
+		const TLASNode& right = tlasNodes[node.leftNode + 1];
+		node.aabb = left.aabb;
+		node.aabb.grow(right.aabb);
+		node.height = 1 + std::max(left.height, right.height);
+	}
+
+	void TLAS::AttachChildren(uint32_t nodeIdx)
+	{
+		const TLASNode& node = tlasNodes[nodeIdx];
+		if (node.IsLeaf())
+		{
+			objects[node.firstObjectIdx].leafNode = nodeIdx;
+			return;
+		}
+		tlasNodes[node.leftNode].parent = nodeIdx;
+		tlasNodes[node.leftNode + 1].parent = nodeIdx;
+	}
+#pragma endregion
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "BVH.h"
+#include "DataTypes.h"
+#include "Matrix.h"
+#include "SphereBVH.h"
+
+namespace dae
+{
+	// One placement of a shared mesh. The mesh's accelerator is the bottom-level structure (BLAS),
+	// built once in object space; the instance only stores where it sits in the world.
+	struct MeshInstance
+	{
+		MeshInstance() = default;
+		MeshInstance(const TriangleMesh* _pMesh, const Matrix& _transform, unsigned char _materialIndex);
+
+		void SetTransform(const Matrix& _transform);
+
+		const TriangleMesh* pMesh{ nullptr };
+		Matrix transform{};
+		Matrix invTransform{};
+		Matrix normalTransform{}; // inverse transpose, brings object space normals to world space
+		aabb bounds{};            // world space bounds of the BLAS root
+
+		unsigned char materialIndex{ 0 };
+	};
+
+	enum class TLASObjectType : uint8_t
+	{
+		Sphere,
+		Triangle,
+		TriangleMesh,
+		MeshInstance,
+		CombinedMesh,
+		SphereSet
+	};
+
+	// Leaf entry of the TLAS, refers to one bounded object in the scene's geometry lists
+	struct TLASObject
+	{
+		aabb bounds{};
+		uint32_t geometryIdx{ 0 };
+		TLASObjectType type{ TLASObjectType::Sphere };
+		uint32_t leafNode{ 0 };
+	};
+
+	// The geometry lists the TLAS is built over, the owning scene keeps them alive
+	struct TLASGeometry
+	{
+		const std::vector<Sphere>* pSpheres{ nullptr };
+		const std::vector<Triangle>* pTriangles{ nullptr };
+		const std::vector<TriangleMesh>* pTriangleMeshes{ nullptr }; // meshes without an accelerator are skipped, they are part of the combined mesh
+		const std::vector<MeshInstance>* pMeshInstances{ nullptr };
+		const TriangleMesh* pCombinedMesh{ nullptr };
+		const SphereBVH* pSphereBVH{ nullptr }; // holds the spheres of pSpheres when the TLAS is built, spheres inserted afterwards get their own leaves
+	};
+
+	struct TLASNode
+	{
+		::aabb aabb;
+		uint32_t leftNode, firstObjectIdx, objectCount;
+		uint32_t parent; // UINT32_MAX for the root
+		uint32_t height; // edges on the longest path down to a leaf, 0 for leaves
+
+		bool IsLeaf() const
+		{
+			return (objectCount > 0);
+		};
+	};
+
+	// Top-level BVH over every bounded object of a scene: spheres, loose triangles,
+	// triangle meshes (their own accelerator is the BLAS), mesh instances, the combined small meshes
+	// and the sphere BVH of large particle sets.
+	// Infinite geometry such as planes has no bounds and stays outside of it.
+	// After the build single objects can be inserted, removed or moved without touching the rest of the tree:
+	// every leaf holds one object and siblings are allocated in pairs, so a pair freed by a removal is reused by the next insert.
+	// Rotations only look at the area, so objects arriving in sorted order still grow a chain: an update that makes the tree
+	// deeper than MaxDepth rebuilds it from the objects it holds.
+	class TLAS
+	{
+	public:
+		// The traversal stack holds at most one entry per level
+		static constexpr uint32_t MaxDepth{ 64 };
+
+		TLAS() = default;
+		~TLAS() = default;
+
+		void Build(const TLASGeometry& geometry);
+		// Keeps the topology and recomputes the bounds after objects moved
+		void Refit();
+
+		// Adds the object that was appended to its geometry list. It becomes the sibling of the node that grows
+		// the total surface area least, found with a branch and bound descent, rotations on the way up keep the tree in shape
+		void InsertObject(TLASObjectType type, uint32_t geometryIdx);
+		// Removes the object before it is swapped with the last one of its list and popped:
+		// lastGeometryIdx is the index of that last object, which takes over geometryIdx
+		void RemoveObject(TLASObjectType type, uint32_t geometryIdx, uint32_t lastGeometryIdx);
+		// Reinserts one object after it moved, cheaper than a full refit when only a few objects changed
+		void UpdateObject(TLASObjectType type, uint32_t geometryIdx);
+
+		bool IsEmpty() const { return nodesUsed == 0; }
+		const TLASNode& GetNode(uint32_t nodeIdx) const { return tlasNodes[nodeIdx]; }
+		const TLASObject& GetObjectAtIdx(uint32_t idx) const { return objects[idx]; }
+		const TLASGeometry& GetGeometry() const { return geometry; }
+
+	private:
+		aabb ComputeObjectBounds(const TLASObject& object) const;
+		void UpdateNodeBounds(uint32_t nodeIdx);
+		// Builds the tree over every object in objects
+		void BuildNodes();
+		void Subdivide(uint32_t nodeIdx);
+		void RebuildIfTooDeep();
+		aabb RefitNode(uint32_t nodeIdx);
+
+		void InsertLeaf(uint32_t objectIdx);
+		void RemoveLeaf(uint32_t objectIdx);
+		uint32_t FindBestSibling(const aabb& bounds) const;
+		uint32_t AllocateNodePair();
+		// Walks from nodeIdx to the root, recomputing the bounds and heights and rotating subtrees where that lowers their area
+		void RefitAncestors(uint32_t nodeIdx);
+		void Rotate(uint32_t nodeIdx);
+		void SwapSubtrees(uint32_t nodeIdxA, uint32_t nodeIdxB);
+		void UpdateInnerNode(uint32_t nodeIdx);
+		// Points the children of nodeIdx, or its object for a leaf, back at it after the node moved to another slot
+		void AttachChildren(uint32_t nodeIdx);
+
+		TLASGeometry geometry{};
+		std::vector<TLASObject> objects{}; // reordered during the build so leaves are contiguous, afterwards every slot keeps its object
+		std::vector<uint32_t> freeObjects{};
+		std::vector<uint32_t> objectIdxOfGeometry[6]{}; // per TLASObjectType, UINT32_MAX for geometry outside the tree
+		std::vector<TLASNode> tlasNodes{};
+		std::vector<uint32_t> freeNodePairs{}; // left node of every pair released by RemoveObject
+		uint32_t nodesUsed{ 0 };
+	};
+}
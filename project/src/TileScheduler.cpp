@@ -0,0 +1,133 @@
+#include "TileScheduler.h"
+
+#include <algorithm>
+
+using namespace dae;
+
+namespace
+{
+	uint32_t ResolveNrOfWorkers(uint32_t nrOfWorkers)
+	{
+		return nrOfWorkers > 0 ? nrOfWorkers : std::max(std::thread::hardware_concurrency(), 1u);
+	}
+}
+
+TileScheduler::TileScheduler(uint32_t nrOfWorkers, uint32_t tileSize) :
+	m_TileSize{ std::max(tileSize, 1u) },
+	m_NrOfWorkers{ ResolveNrOfWorkers(nrOfWorkers) },
+	m_FrameStart{ std::ptrdiff_t(m_NrOfWorkers) },
+	m_FrameEnd{ std::ptrdiff_t(m_NrOfWorkers) }
+{
+	m_pDeques = std::make_unique<WorkerDeque[]>(m_NrOfWorkers);
+
+	//Worker 0 is whichever thread calls Execute
+	m_Threads.reserve(m_NrOfWorkers - 1);
+	for (uint32_t workerIdx = 1; workerIdx < m_NrOfWorkers; workerIdx++)
+	{
+		m_Threads.emplace_back(&TileScheduler::WorkerThread, this, workerIdx);
+	}
+}
+
+TileScheduler::~TileScheduler()
+{
+	//Release the workers from the start barrier, they see the flag and return
+	m_IsShuttingDown = true;
+	m_FrameStart.arrive_and_wait();
+
+	for (std::thread& thread : m_Threads) thread.join();
+}
+
+void TileScheduler::SetFrameSize(uint32_t width, uint32_t height)
+{
+	m_Width = width;
+	m_Height = height;
+	BuildTiles();
+}
+
+void TileScheduler::SetTileSize(uint32_t tileSize)
+{
+	m_TileSize = std::max(tileSize, 1u);
+	BuildTiles();
+}
+
+void TileScheduler::BuildTiles()
+{
+	m_Tiles.clear();
+
+	//Row-major tile order, so every worker starts on a compact band of the screen
+	for (uint32_t y = 0; y < m_Height; y += m_TileSize)
+	{
+		for (uint32_t x = 0; x < m_Width; x += m_TileSize)
+		{
+			m_Tiles.push_back({ x, y, std::min(x + m_TileSize, m_Width), std::min(y + m_TileSize, m_Height) });
+		}
+	}
+}
+
+void TileScheduler::ResetDeques()
+{
+	//Deal the tiles out in contiguous ranges of (almost) equal size
+	const uint32_t nrOfTiles = GetNrOfTiles();
+	for (uint32_t workerIdx = 0; workerIdx < m_NrOfWorkers; workerIdx++)
+	{
+		WorkerDeque& deque = m_pDeques[workerIdx];
+		std::lock_guard lock{ deque.mutex };
+		deque.front = uint32_t(uint64_t(nrOfTiles) * workerIdx / m_NrOfWorkers);
+		deque.back = uint32_t(uint64_t(nrOfTiles) * (workerIdx + 1) / m_NrOfWorkers);
+	}
+}
+
+void TileScheduler::RunFrame()
+{
+	ResetDeques();
+
+	m_FrameStart.arrive_and_wait();
+	RunWorker(0);
+	m_FrameEnd.arrive_and_wait();
+}
+
+void TileScheduler::WorkerThread(uint32_t workerIdx)
+{
+	while (true)
+	{
+		m_FrameStart.arrive_and_wait();
+		if (m_IsShuttingDown) return;
+
+		RunWorker(workerIdx);
+		m_FrameEnd.arrive_and_wait();
+	}
+}
+
+void TileScheduler::RunWorker(uint32_t workerIdx)
+{
+	uint32_t tileIdx{};
+	while (PopFront(workerIdx, tileIdx) || StealBack(workerIdx, tileIdx))
+	{
+		m_pProcessTile(m_pContext, m_Tiles[tileIdx]);
+	}
+}
+
+bool TileScheduler::PopFront(uint32_t workerIdx, uint32_t& tileIdx)
+{
+	WorkerDeque& deque = m_pDeques[workerIdx];
+	std::lock_guard lock{ deque.mutex };
+	if (deque.front >= deque.back) return false;
+
+	tileIdx = deque.front++;
+	return true;
+}
+
+bool TileScheduler::StealBack(uint32_t thiefIdx, uint32_t& tileIdx)
+{
+	//Visit the other workers round-robin, starting at the neighbour of the thief
+	for (uint32_t offset = 1; offset < m_NrOfWorkers; offset++)
+	{
+		WorkerDeque& victim = m_pDeques[(thiefIdx + offset) % m_NrOfWorkers];
+		std::lock_guard lock{ victim.mutex };
+		if (victim.front >= victim.back) continue;
+
+		tileIdx = --victim.back;
+		return true;
+	}
+	return false;
+}
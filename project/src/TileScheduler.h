@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <barrier>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace dae
+{
+	//Screen-space rectangle [minX, maxX) x [minY, maxY)
+	struct Tile
+	{
+		uint32_t minX{};
+		uint32_t minY{};
+		uint32_t maxX{};
+		uint32_t maxY{};
+	};
+
+	//Splits the frame into tiles and hands them out to a persistent pool of workers.
+	//Every worker owns a deque of tiles: it pops from the front of its own deque
+	//and, once empty, steals from the back of the other workers' deques.
+	//The workers are started once and wait on a barrier between frames, so
+	//Execute does not create threads or allocate memory.
+	class TileScheduler final
+	{
+	public:
+		TileScheduler(uint32_t nrOfWorkers = 0, uint32_t tileSize = 16);
+		~TileScheduler();
+
+		TileScheduler(const TileScheduler&) = delete;
+		TileScheduler(TileScheduler&&) noexcept = delete;
+		TileScheduler& operator=(const TileScheduler&) = delete;
+		TileScheduler& operator=(TileScheduler&&) noexcept = delete;
+
+		void SetFrameSize(uint32_t width, uint32_t height);
+		void SetTileSize(uint32_t tileSize);
+
+		uint32_t GetTileSize() const { return m_TileSize; }
+		uint32_t GetNrOfWorkers() const { return m_NrOfWorkers; }
+		uint32_t GetNrOfTiles() const { return static_cast<uint32_t>(m_Tiles.size()); }
+
+		//Blocks until every tile of the frame has been processed.
+		//The calling thread takes part as worker 0.
+		template<typename TileFunc>
+		void Execute(TileFunc& processTile)
+		{
+			m_pContext = &processTile;
+			m_pProcessTile = [](void* pContext, const Tile& tile) { (*static_cast<TileFunc*>(pContext))(tile); };
+			RunFrame();
+		}
+
+	private:
+		struct WorkerDeque
+		{
+			std::mutex mutex{};
+			uint32_t front{}; //next tile the owner pops
+			uint32_t back{};  //one past the last tile, thieves take from here
+		};
+
+		void BuildTiles();
+		void ResetDeques();
+		void RunFrame();
+		void WorkerThread(uint32_t workerIdx);
+		void RunWorker(uint32_t workerIdx);
+		bool PopFront(uint32_t workerIdx, uint32_t& tileIdx);
+		bool StealBack(uint32_t thiefIdx, uint32_t& tileIdx);
+
+		uint32_t m_Width{};
+		uint32_t m_Height{};
+		uint32_t m_TileSize{};
+		uint32_t m_NrOfWorkers{};
+
+		std::vector<Tile> m_Tiles{};
+		std::unique_ptr<WorkerDeque[]> m_pDeques{};
+
+		//Current frame job, type-erased without allocating
+		void* m_pContext{};
+		void (*m_pProcessTile)(void*, const Tile&) {};
+
+		std::barrier<> m_FrameStart;
+		std::barrier<> m_FrameEnd;
+		std::atomic<bool> m_IsShuttingDown{ false };
+		std::vector<std::thread> m_Threads{};
+	};
+}
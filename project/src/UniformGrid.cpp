@@ -0,0 +1,265 @@
+#include "UniformGrid.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+#include "Utils.h"
+
+namespace dae
+{
+	namespace
+	{
+		int GetCellCoordinate(const GridLevel& level, int axis, float position)
+		{
+			const int coordinate = int((position - level.bounds.bmin[axis]) * level.rcpCellSize[axis]);
+			return std::clamp(coordinate, 0, level.resolution[axis] - 1);
+		}
+	}
+
+	UniformGrid::UniformGrid(TriangleMesh* pMesh, const GridSettings& settings) :
+		pMesh{ pMesh }, settings{ settings }
+	{
+	}
+
+	void UniformGrid::Build()
+	{
+		const uint32_t nrOfTriangles = uint32_t(pMesh->indices.size() / 3);
+		triIntersect.resize(nrOfTriangles);
+		triBounds.resize(nrOfTriangles);
+		bounds = aabb{};
+		for (uint32_t triIdx = 0; triIdx < nrOfTriangles; triIdx++)
+		{
+			const Vector3& vertex0 = pMesh->transformedPositions[pMesh->indices[triIdx * 3]];
+			const Vector3& vertex1 = pMesh->transformedPositions[pMesh->indices[triIdx * 3 + 1]];
+			const Vector3& vertex2 = pMesh->transformedPositions[pMesh->indices[triIdx * 3 + 2]];
+			triIntersect[triIdx] = { vertex0, vertex1 - vertex0, vertex2 - vertex0 };
+
+			aabb& triangleBounds = triBounds[triIdx];
+			triangleBounds = aabb{};
+			triangleBounds.grow(vertex0);
+			triangleBounds.grow(vertex1);
+			triangleBounds.grow(vertex2);
+			bounds.grow(triangleBounds);
+		}
+
+		levels.clear();
+		cells.clear();
+		triIndices.clear();
+		if (nrOfTriangles == 0) return;
+
+		// padded so flat meshes still get a volume to spread the cells over
+		const Vector3 extent = bounds.bmax - bounds.bmin;
+		const float padding = std::max(std::max(std::max(extent.x, extent.y), extent.z) * 1e-3f, 1e-4f);
+		aabb gridBounds = bounds;
+		gridBounds.bmin = gridBounds.bmin - Vector3{ padding, padding, padding };
+		gridBounds.bmax = gridBounds.bmax + Vector3{ padding, padding, padding };
+
+		std::vector<uint32_t> allTriIndices(nrOfTriangles);
+		std::iota(allTriIndices.begin(), allTriIndices.end(), 0u);
+		BuildLevel(gridBounds, allTriIndices, settings.density, settings.maxResolution, settings.twoLevel);
+
+		levels.shrink_to_fit();
+		cells.shrink_to_fit();
+		triIndices.shrink_to_fit();
+		triBounds = {};
+	}
+
+	uint32_t UniformGrid::BuildLevel(const aabb& levelBounds, const std::vector<uint32_t>& levelTriIndices, float density, int maxResolution, bool allowSubgrids)
+	{
+		GridLevel level{};
+		level.bounds = levelBounds;
+		const Vector3 extent = levelBounds.bmax - levelBounds.bmin;
+		const float cellsPerUnit = std::cbrt(density * float(levelTriIndices.size()) / (extent.x * extent.y * extent.z));
+		for (int axis = 0; axis < 3; axis++)
+		{
+			level.resolution[axis] = std::clamp(int(extent[axis] * cellsPerUnit), 1, maxResolution);
+			level.cellSize[axis] = extent[axis] / float(level.resolution[axis]);
+			level.rcpCellSize[axis] = 1.f / level.cellSize[axis];
+		}
+		const uint32_t cellCount = uint32_t(level.resolution[0] * level.resolution[1] * level.resolution[2]);
+		level.firstCell = uint32_t(cells.size());
+		cells.resize(cells.size() + cellCount);
+
+		const uint32_t levelIdx = uint32_t(levels.size());
+		levels.push_back(level);
+
+		// counting sort of the references into cells, every triangle goes into each cell its bounds overlap
+		std::vector<uint32_t> cellOffsets(cellCount + 1, 0);
+		const auto forEachOverlappedCell = [&](uint32_t triIdx, auto&& visit)
+		{
+			const aabb& triangleBounds = triBounds[triIdx];
+			int low[3], high[3];
+			for (int axis = 0; axis < 3; axis++)
+			{
+				low[axis] = GetCellCoordinate(level, axis, triangleBounds.bmin[axis]);
+				high[axis] = GetCellCoordinate(level, axis, triangleBounds.bmax[axis]);
+			}
+			for (int z = low[2]; z <= high[2]; z++)
+				for (int y = low[1]; y <= high[1]; y++)
+					for (int x = low[0]; x <= high[0]; x++)
+						visit(uint32_t((z * level.resolution[1] + y) * level.resolution[0] + x));
+		};
+		for (const uint32_t triIdx : levelTriIndices)
+			forEachOverlappedCell(triIdx, [&](uint32_t cellIdx) { cellOffsets[cellIdx + 1]++; });
+		std::partial_sum(cellOffsets.begin(), cellOffsets.end(), cellOffsets.begin());
+
+		std::vector<uint32_t> cellTriIndices(cellOffsets.back());
+		std::vector<uint32_t> cellFill(cellOffsets.begin(), cellOffsets.end() - 1);
+		for (const uint32_t triIdx : levelTriIndices)
+			forEachOverlappedCell(triIdx, [&](uint32_t cellIdx) { cellTriIndices[cellFill[cellIdx]++] = triIdx; });
+
+		for (uint32_t cellIdx = 0; cellIdx < cellCount; cellIdx++)
+		{
+			const uint32_t first = cellOffsets[cellIdx], count = cellOffsets[cellIdx + 1] - first;
+			if (allowSubgrids && count > settings.subgridThreshold)
+			{
+				const int x = int(cellIdx % uint32_t(level.resolution[0]));
+				const int y = int(cellIdx / uint32_t(level.resolution[0]) % uint32_t(level.resolution[1]));
+				const int z = int(cellIdx / uint32_t(level.resolution[0] * level.resolution[1]));
+				aabb cellBounds{};
+				cellBounds.bmin = levelBounds.bmin + Vector3{ x * level.cellSize.x, y * level.cellSize.y, z * level.cellSize.z };
+				cellBounds.bmax = cellBounds.bmin + level.cellSize;
+
+				const std::vector<uint32_t> subgridTriIndices(cellTriIndices.begin() + first, cellTriIndices.begin() + first + count);
+				// cells is resized by the subgrid, so only index into it afterwards
+				const uint32_t subgridIdx = BuildLevel(cellBounds, subgridTriIndices, settings.subgridDensity, settings.maxSubgridResolution, false);
+				cells[level.firstCell + cellIdx].subgridIdx = subgridIdx;
+			}
+			else
+			{
+				GridCell& cell = cells[level.firstCell + cellIdx];
+				cell.firstTriIdx = uint32_t(triIndices.size());
+				cell.triCount = count;
+				triIndices.insert(triIndices.end(), cellTriIndices.begin() + first, cellTriIndices.begin() + first + count);
+			}
+		}
+		return levelIdx;
+	}
+
+	bool UniformGrid::TestCell(const GridCell& cell, const Ray& ray, float& closestT, uint32_t& closestTriIdx) const
+	{
+		bool didHit = false;
+		for (uint32_t i = cell.firstTriIdx; i < cell.firstTriIdx + cell.triCount; i++)
+		{
+			const uint32_t triIdx = triIndices[i];
+			float t;
+			if (GeometryUtils::IntersectTriangle(triIntersect[triIdx], pMesh->GetCullMode(triIdx), ray, t) && t < closestT)
+			{
+				closestT = t;
+				closestTriIdx = triIdx;
+				didHit = true;
+			}
+		}
+		return didHit;
+	}
+
+	template<bool IsAnyHit>
+	bool UniformGrid::TraverseLevel(uint32_t levelIdx, const Ray& ray, float tEntry, float tExit, float& closestT, uint32_t& closestTriIdx) const
+	{
+		const GridLevel& level = levels[levelIdx];
+
+		// Vector3's subscript isn't inlined, copy out what the per-axis setup reads
+		const Vector3 entry = ray.origin + ray.direction * tEntry;
+		const float entryPoint[3]{ entry.x, entry.y, entry.z };
+		const float direction[3]{ ray.direction.x, ray.direction.y, ray.direction.z };
+		const float rcpDirection[3]{ ray.rcpDirection.x, ray.rcpDirection.y, ray.rcpDirection.z };
+		const float levelMin[3]{ level.bounds.bmin.x, level.bounds.bmin.y, level.bounds.bmin.z };
+		const float cellSize[3]{ level.cellSize.x, level.cellSize.y, level.cellSize.z };
+		const float rcpCellSize[3]{ level.rcpCellSize.x, level.rcpCellSize.y, level.rcpCellSize.z };
+
+		// 3D-DDA: tNext is where the ray crosses into the next cell on each axis, tDelta how far apart those crossings are
+		int cell[3], step[3], end[3];
+		float tNext[3], tDelta[3];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			cell[axis] = std::clamp(int((entryPoint[axis] - levelMin[axis]) * rcpCellSize[axis]), 0, level.resolution[axis] - 1);
+			if (direction[axis] > 0.f)
+			{
+				const float nextPlane = levelMin[axis] + float(cell[axis] + 1) * cellSize[axis];
+				tNext[axis] = tEntry + (nextPlane - entryPoint[axis]) * rcpDirection[axis];
+				tDelta[axis] = cellSize[axis] * rcpDirection[axis];
+				step[axis] = 1;
+				end[axis] = level.resolution[axis];
+			}
+			else if (direction[axis] < 0.f)
+			{
+				const float nextPlane = levelMin[axis] + float(cell[axis]) * cellSize[axis];
+				tNext[axis] = tEntry + (nextPlane - entryPoint[axis]) * rcpDirection[axis];
+				tDelta[axis] = -cellSize[axis] * rcpDirection[axis];
+				step[axis] = -1;
+				end[axis] = -1;
+			}
+			else
+			{
+				tNext[axis] = FLT_MAX;
+				tDelta[axis] = FLT_MAX;
+				step[axis] = 0;
+				end[axis] = -1;
+			}
+		}
+
+		bool didHit = false;
+		while (true)
+		{
+			const GridCell& gridCell = cells[level.firstCell + uint32_t((cell[2] * level.resolution[1] + cell[1]) * level.resolution[0] + cell[0])];
+			if (gridCell.subgridIdx != UINT32_MAX)
+			{
+				float subgridEntry, subgridExit;
+				if (GeometryUtils::ClipRayToAABB(ray, levels[gridCell.subgridIdx].bounds, closestT, subgridEntry, subgridExit)
+					&& TraverseLevel<IsAnyHit>(gridCell.subgridIdx, ray, subgridEntry, subgridExit, closestT, closestTriIdx))
+				{
+					didHit = true;
+					if constexpr (IsAnyHit) return true;
+				}
+			}
+			else if (gridCell.triCount > 0 && TestCell(gridCell, ray, closestT, closestTriIdx))
+			{
+				didHit = true;
+				if constexpr (IsAnyHit) return true;
+			}
+
+			const int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+			// cells are visited front to back, nothing in the ones after this can be closer than a hit before its exit
+			if (didHit && closestT <= tNext[axis]) return true;
+			if (tNext[axis] > tExit) return didHit;
+
+			cell[axis] += step[axis];
+			if (cell[axis] == end[axis]) return didHit;
+			tNext[axis] += tDelta[axis];
+		}
+	}
+
+	bool UniformGrid::ClosestHit(const Ray& ray, HitRecord& hitRecord) const
+	{
+		float tEntry, tExit;
+		if (levels.empty() || !GeometryUtils::ClipRayToAABB(ray, levels[0].bounds, hitRecord.t, tEntry, tExit)) return hitRecord.didHit;
+
+		float closestT = hitRecord.t;
+		uint32_t closestTriIdx = UINT32_MAX;
+		if (!TraverseLevel<false>(0, ray, tEntry, tExit, closestT, closestTriIdx)) return hitRecord.didHit;
+
+		hitRecord.t = closestT;
+		hitRecord.didHit = true;
+		hitRecord.origin = ray.origin + ray.direction * closestT;
+		hitRecord.normal = pMesh->transformedNormals[closestTriIdx].Normalized();
+		hitRecord.materialIndex = pMesh->GetMaterialIndex(closestTriIdx);
+		return true;
+	}
+
+	bool UniformGrid::AnyHit(const Ray& ray) const
+	{
+		float tEntry, tExit;
+		if (levels.empty() || !GeometryUtils::ClipRayToAABB(ray, levels[0].bounds, ray.max, tEntry, tExit)) return false;
+
+		float closestT = ray.max;
+		uint32_t closestTriIdx = UINT32_MAX;
+		return TraverseLevel<true>(0, ray, tEntry, tExit, closestT, closestTriIdx);
+	}
+
+	size_t UniformGrid::GetMemoryBytes() const
+	{
+		return levels.size() * sizeof(GridLevel) + cells.size() * sizeof(GridCell)
+			+ triIndices.size() * sizeof(uint32_t) + triIntersect.size() * sizeof(TriIntersect);
+	}
+}
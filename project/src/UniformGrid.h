@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "BVH.h"
+#include "MeshAccelerator.h"
+
+namespace dae
+{
+	struct TriangleMesh;
+
+	struct GridSettings
+	{
+		float density{ 2.f };             // cells per triangle, spread over the bounds so the cells are as cubic as possible
+		int maxResolution{ 128 };         // per axis
+		bool twoLevel{ true };            // give cells with many triangles a grid of their own
+		uint32_t subgridThreshold{ 16 };  // triangles a cell needs to get a subgrid
+		float subgridDensity{ 2.f };
+		int maxSubgridResolution{ 8 };
+	};
+
+	// One grid, the top level or the subgrid of a cell. Its cells are stored x-first from firstCell on
+	struct GridLevel
+	{
+		aabb bounds{};
+		int resolution[3]{};
+		Vector3 cellSize{};
+		Vector3 rcpCellSize{};
+		uint32_t firstCell{ 0 };
+	};
+
+	struct GridCell
+	{
+		uint32_t firstTriIdx{ 0 };
+		uint32_t triCount{ 0 };
+		uint32_t subgridIdx{ UINT32_MAX }; // the level holding the cell's triangles instead, UINT32_MAX when there is none
+	};
+
+	// Uniform grid over a mesh's transformed triangles, walked cell by cell with a 3D-DDA. A triangle is referenced by every cell its bounds overlap,
+	// dense cells get a small grid of their own so clustered meshes don't need a fine top level
+	class UniformGrid final : public MeshAccelerator
+	{
+	public:
+		explicit UniformGrid(TriangleMesh* pMesh, const GridSettings& settings = {});
+
+		void Build() override;
+		// the cells a triangle overlaps change when it moves, so refitting is a rebuild
+		void Refit() override { Build(); }
+		void SetMesh(TriangleMesh* pTriangleMesh) override { pMesh = pTriangleMesh; }
+		bool ClosestHit(const Ray& ray, HitRecord& hitRecord) const override;
+		bool AnyHit(const Ray& ray) const override;
+		aabb GetBounds() const override { return bounds; }
+		size_t GetMemoryBytes() const override;
+		AcceleratorType GetType() const override { return AcceleratorType::Grid; }
+
+		uint32_t GetLevelCount() const { return uint32_t(levels.size()); }
+		uint32_t GetCellCount() const { return uint32_t(cells.size()); }
+		uint32_t GetReferenceCount() const { return uint32_t(triIndices.size()); }
+
+	private:
+		uint32_t BuildLevel(const aabb& levelBounds, const std::vector<uint32_t>& levelTriIndices, float density, int maxResolution, bool allowSubgrids);
+		bool TestCell(const GridCell& cell, const Ray& ray, float& closestT, uint32_t& closestTriIdx) const;
+		template<bool IsAnyHit>
+		bool TraverseLevel(uint32_t levelIdx, const Ray& ray, float tEntry, float tExit, float& closestT, uint32_t& closestTriIdx) const;
+
+		TriangleMesh* pMesh;
+		GridSettings settings;
+		aabb bounds{};
+		std::vector<GridLevel> levels{};
+		std::vector<GridCell> cells{};
+		std::vector<uint32_t> triIndices{};      // mesh triangle of every cell reference
+		std::vector<TriIntersect> triIntersect{}; // per mesh triangle
+		std::vector<aabb> triBounds{};            // per mesh triangle, build only
+	};
+}
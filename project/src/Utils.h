@@ -1,7 +1,13 @@
 #pragma once
+#include <bit>
+#include <cstring>
+#include <emmintrin.h>
 #include <fstream>
+#include <type_traits>
+#include <xmmintrin.h>
 #include "Maths.h"
 #include "DataTypes.h"
+#include "TLAS.h"
 
 namespace dae
 {
@@ -202,20 +208,41 @@ namespace dae
 
 #pragma region  BVH HitTest
 
-		inline bool IntersectAABB(const Ray& ray, const Vector3 bmin, const Vector3 bmax,HitRecord& hitRecord)
+		// Returns the distance at which the ray enters the box, FLT_MAX when it misses the box or enters it beyond closestT
+		inline float IntersectAABB(const Ray& ray, const aabb& bounds, float closestT)
 		{
-			float tx1 = (bmin.x - ray.origin.x) / ray.direction.x, tx2 = (bmax.x - ray.origin.x) / ray.direction.x;
-			float tmin = std::min(tx1, tx2), tmax = std::max(tx1, tx2);
-
-			float ty1 = (bmin.y - ray.origin.y) / ray.direction.y, ty2 = (bmax.y - ray.origin.y) / ray.direction.y;
-			tmin = std::max(tmin, std::min(ty1, ty2)), tmax = std::min(tmax, std::max(ty1, ty2));
-
-			float tz1 = (bmin.z - ray.origin.z) / ray.direction.z, tz2 = (bmax.z - ray.origin.z) / ray.direction.z;
-			tmin = std::max(tmin, std::min(tz1, tz2)), tmax = std::min(tmax, std::max(tz1, tz2));
+			const float tx1 = ((ray.sign[0] ? bounds.bmax.x : bounds.bmin.x) - ray.origin.x) * ray.rcpDirection.x;
+			const float tx2 = ((ray.sign[0] ? bounds.bmin.x : bounds.bmax.x) - ray.origin.x) * ray.rcpDirection.x;
+			const float ty1 = ((ray.sign[1] ? bounds.bmax.y : bounds.bmin.y) - ray.origin.y) * ray.rcpDirection.y;
+			const float ty2 = ((ray.sign[1] ? bounds.bmin.y : bounds.bmax.y) - ray.origin.y) * ray.rcpDirection.y;
+			const float tz1 = ((ray.sign[2] ? bounds.bmax.z : bounds.bmin.z) - ray.origin.z) * ray.rcpDirection.z;
+			const float tz2 = ((ray.sign[2] ? bounds.bmin.z : bounds.bmax.z) - ray.origin.z) * ray.rcpDirection.z;
+			const float tmin = std::max(std::max(tx1, ty1), tz1);
+			const float tmax = std::min(std::min(tx2, ty2), tz2);
+			if (tmax >= tmin && tmin < std::min(ray.max, closestT) && tmax > 0) return tmin;
+			return FLT_MAX;
+		}
 
-			return tmax >= tmin && tmin < ray.max && tmax > 0;
+		// The part of the ray inside the box as [tEntry, tExit], clipped to start at 0 and end at closestT. False when nothing is left
+		inline bool ClipRayToAABB(const Ray& ray, const aabb& bounds, float closestT, float& tEntry, float& tExit)
+		{
+			const float tx1 = ((ray.sign[0] ? bounds.bmax.x : bounds.bmin.x) - ray.origin.x) * ray.rcpDirection.x;
+			const float tx2 = ((ray.sign[0] ? bounds.bmin.x : bounds.bmax.x) - ray.origin.x) * ray.rcpDirection.x;
+			const float ty1 = ((ray.sign[1] ? bounds.bmax.y : bounds.bmin.y) - ray.origin.y) * ray.rcpDirection.y;
+			const float ty2 = ((ray.sign[1] ? bounds.bmin.y : bounds.bmax.y) - ray.origin.y) * ray.rcpDirection.y;
+			const float tz1 = ((ray.sign[2] ? bounds.bmax.z : bounds.bmin.z) - ray.origin.z) * ray.rcpDirection.z;
+			const float tz2 = ((ray.sign[2] ? bounds.bmin.z : bounds.bmax.z) - ray.origin.z) * ray.rcpDirection.z;
+			tEntry = std::max(std::max(std::max(tx1, ty1), tz1), 0.f);
+			tExit = std::min(std::min(std::min(tx2, ty2), tz2), std::min(ray.max, closestT));
+			return tEntry <= tExit;
 		}
 
+		// Node waiting on a traversal stack, with the distance at which the ray enters it
+		struct TraversalEntry
+		{
+			uint32_t nodeIdx;
+			float tEntry;
+		};
 #pragma endregion
 
 #pragma region TriangeMesh HitTest
@@ -244,50 +271,684 @@ namespace dae
 
 		}
 
-		inline bool HitTest_TriangleMesh(const TriangleMesh& mesh, const int nodeIdx, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
+		// Moller-Trumbore on the packed leaf data, accepts the same hits as HitTest_Triangle does for a closest hit
+		inline bool IntersectTriangle(const TriIntersect& tri, TriangleCullMode cullMode, const Ray& ray, float& t)
 		{
-			const BVHNode& node = mesh.bvh->GetBvhNodes(nodeIdx);
+			const Vector3 h = Vector3::Cross(ray.direction, tri.edge2);
+			const float a = Vector3::Dot(tri.edge1, h);
+			if (a > -FLT_EPSILON && a < FLT_EPSILON) return false; // ray parallel to triangle
 
-			
-			if (!IntersectAABB(ray, node.aabb.bmin, node.aabb.bmax,hitRecord)) return false;
+			if (cullMode == TriangleCullMode::BackFaceCulling && a < 0.001) return false;
+			if (cullMode == TriangleCullMode::FrontFaceCulling && a > 0.001) return false;
+
+			const float f = 1 / a;
+			const Vector3 s = ray.origin - tri.vertex0;
+			const float u = f * Vector3::Dot(s, h);
+			if (u < 0 || u > 1) return false;
+
+			const Vector3 q = Vector3::Cross(s, tri.edge1);
+			const float v = f * Vector3::Dot(ray.direction, q);
+			if (v < 0 || u + v > 1) return false;
+
+			t = f * Vector3::Dot(tri.edge2, q);
+			return t > ray.min && t < ray.max;
+		}
+
+		// A ray broadcast to all four lanes, set up once per traversal for the SSE node and triangle tests
+		struct RaySSE
+		{
+			explicit RaySSE(const Ray& ray) :
+				origin{ _mm_set1_ps(ray.origin.x), _mm_set1_ps(ray.origin.y), _mm_set1_ps(ray.origin.z) },
+				direction{ _mm_set1_ps(ray.direction.x), _mm_set1_ps(ray.direction.y), _mm_set1_ps(ray.direction.z) },
+				rcpDirection{ _mm_set1_ps(ray.rcpDirection.x), _mm_set1_ps(ray.rcpDirection.y), _mm_set1_ps(ray.rcpDirection.z) },
+				min{ _mm_set1_ps(ray.min) }
+			{
+			}
+
+			__m128 origin[3];
+			__m128 direction[3];
+			__m128 rcpDirection[3];
+			__m128 min;
+		};
+
+		// The determinants IntersectTriangle accepts for a cull mode as a range, detMin <= a < detMax
+		inline void GetDeterminantRange(TriangleCullMode cullMode, __m128& detMin, __m128& detMax)
+		{
+			detMin = _mm_set1_ps(cullMode == TriangleCullMode::BackFaceCulling ? 0.001f : -FLT_MAX);
+			detMax = _mm_set1_ps(cullMode == TriangleCullMode::FrontFaceCulling ? 0.001f : INFINITY);
+		}
+
+		// GetDeterminantRange with a cull mode per lane, for meshes with one per triangle. Lanes past count are left to the empty triangle data
+		template<typename GetLaneCullMode>
+		inline void GetDeterminantRange4(uint32_t count, GetLaneCullMode&& getLaneCullMode, __m128& detMin, __m128& detMax)
+		{
+			alignas(16) float laneMin[4], laneMax[4];
+			for (uint32_t lane = 0; lane < 4; lane++)
+			{
+				const TriangleCullMode cullMode = lane < count ? getLaneCullMode(lane) : TriangleCullMode::NoCulling;
+				laneMin[lane] = cullMode == TriangleCullMode::BackFaceCulling ? 0.001f : -FLT_MAX;
+				laneMax[lane] = cullMode == TriangleCullMode::FrontFaceCulling ? 0.001f : INFINITY;
+			}
+			detMin = _mm_load_ps(laneMin);
+			detMax = _mm_load_ps(laneMax);
+		}
+
+		inline void GetLeafDeterminantRange4(const BVH& bvh, uint32_t firstTriIdx, uint32_t count, __m128& detMin, __m128& detMax)
+		{
+			GetDeterminantRange4(count, [&](uint32_t lane) { return bvh.GetTriCullMode(firstTriIdx + lane); }, detMin, detMax);
+		}
+
+		// IntersectTriangle on four triangles at once, every operation is done in the same order so t is bit-identical.
+		// Returns one bit per lane that was hit in (ray.min, rayMax) and stores the distances in t
+		inline int IntersectTriangle4(const TriIntersect4& tris, const RaySSE& ray, const __m128 detMin, const __m128 detMax, const __m128 rayMax, __m128& t)
+		{
+			const __m128 edge1X = _mm_load_ps(tris.edge1X), edge1Y = _mm_load_ps(tris.edge1Y), edge1Z = _mm_load_ps(tris.edge1Z);
+			const __m128 edge2X = _mm_load_ps(tris.edge2X), edge2Y = _mm_load_ps(tris.edge2Y), edge2Z = _mm_load_ps(tris.edge2Z);
+
+			// h = direction x edge2, a = edge1 . h
+			const __m128 hX = _mm_sub_ps(_mm_mul_ps(ray.direction[1], edge2Z), _mm_mul_ps(ray.direction[2], edge2Y));
+			const __m128 hY = _mm_sub_ps(_mm_mul_ps(ray.direction[2], edge2X), _mm_mul_ps(ray.direction[0], edge2Z));
+			const __m128 hZ = _mm_sub_ps(_mm_mul_ps(ray.direction[0], edge2Y), _mm_mul_ps(ray.direction[1], edge2X));
+			const __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(edge1X, hX), _mm_mul_ps(edge1Y, hY)), _mm_mul_ps(edge1Z, hZ));
+
+			// not parallel, which also rejects the empty lanes, and a facing the cull mode accepts
+			__m128 valid = _mm_or_ps(_mm_cmple_ps(a, _mm_set1_ps(-FLT_EPSILON)), _mm_cmpge_ps(a, _mm_set1_ps(FLT_EPSILON)));
+			valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(a, detMin), _mm_cmplt_ps(a, detMax)));
+
+			const __m128 f = _mm_div_ps(_mm_set1_ps(1.f), a);
+			const __m128 sX = _mm_sub_ps(ray.origin[0], _mm_load_ps(tris.vertex0X));
+			const __m128 sY = _mm_sub_ps(ray.origin[1], _mm_load_ps(tris.vertex0Y));
+			const __m128 sZ = _mm_sub_ps(ray.origin[2], _mm_load_ps(tris.vertex0Z));
+			const __m128 u = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sX, hX), _mm_mul_ps(sY, hY)), _mm_mul_ps(sZ, hZ)));
+			valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, _mm_setzero_ps()), _mm_cmple_ps(u, _mm_set1_ps(1.f))));
+
+			// q = s x edge1
+			const __m128 qX = _mm_sub_ps(_mm_mul_ps(sY, edge1Z), _mm_mul_ps(sZ, edge1Y));
+			const __m128 qY = _mm_sub_ps(_mm_mul_ps(sZ, edge1X), _mm_mul_ps(sX, edge1Z));
+			const __m128 qZ = _mm_sub_ps(_mm_mul_ps(sX, edge1Y), _mm_mul_ps(sY, edge1X));
+			const __m128 v = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(ray.direction[0], qX), _mm_mul_ps(ray.direction[1], qY)), _mm_mul_ps(ray.direction[2], qZ)));
+			valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, _mm_setzero_ps()), _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.f))));
+
+			t = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(edge2X, qX), _mm_mul_ps(edge2Y, qY)), _mm_mul_ps(edge2Z, qZ)));
+			valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t, ray.min), _mm_cmplt_ps(t, rayMax)));
+			return _mm_movemask_ps(valid);
+		}
+
+		// Leaf test on the TriIntersect4 groups, picks the same triangle as the scalar loop in HitTest_BVHLeaf
+		inline bool HitTest_BVHLeaf4(const TriangleMesh& mesh, uint32_t firstTriIdx, uint32_t triCount, const Ray& ray, const RaySSE& raySSE, HitRecord& hitRecord)
+		{
+			const BVH& bvh = *mesh.bvh;
+			__m128 detMin, detMax;
+			GetDeterminantRange(mesh.cullMode, detMin, detMax);
+
+			uint32_t closestTriIdx{ UINT32_MAX };
+			float closestT{ hitRecord.t };
+			const uint32_t firstGroupIdx = bvh.GetLeafFirstGroup(firstTriIdx);
+			for (uint32_t groupOffset{ 0 }; groupOffset * 4 < triCount; ++groupOffset)
+			{
+				if (bvh.HasTriCullModes()) GetLeafDeterminantRange4(bvh, firstTriIdx + groupOffset * 4, std::min(4u, triCount - groupOffset * 4), detMin, detMax);
+
+				__m128 t;
+				int hitMask = IntersectTriangle4(bvh.GetTriGroupAtIdx(firstGroupIdx + groupOffset), raySSE, detMin, detMax, _mm_set1_ps(std::min(ray.max, closestT)), t);
+				if (hitMask == 0) continue;
+
+				alignas(16) float laneT[4];
+				_mm_store_ps(laneT, t);
+				while (hitMask != 0)
+				{
+					const uint32_t lane = uint32_t(std::countr_zero(unsigned(hitMask)));
+					hitMask &= hitMask - 1;
+					if (laneT[lane] < closestT)
+					{
+						closestT = laneT[lane];
+						closestTriIdx = firstTriIdx + groupOffset * 4 + lane;
+					}
+				}
+			}
+			if (closestTriIdx == UINT32_MAX) return hitRecord.didHit;
+
+			hitRecord.t = closestT;
+			hitRecord.didHit = true;
+			hitRecord.origin = ray.origin + ray.direction * closestT;
+			const Tri& closestTri = bvh.GetTriAtIdx(closestTriIdx);
+			hitRecord.normal = closestTri.normals;
+			hitRecord.materialIndex = mesh.GetMaterialIndex(closestTri.meshTriIdx);
+			return true;
+		}
+
+		inline bool HitTest_BVHLeaf(const TriangleMesh& mesh, uint32_t firstTriIdx, uint32_t triCount, const Ray& ray, const RaySSE& raySSE, HitRecord& hitRecord)
+		{
+			const BVH& bvh = *mesh.bvh;
+			if (bvh.HasTriGroups()) return HitTest_BVHLeaf4(mesh, firstTriIdx, triCount, ray, raySSE, hitRecord);
 
+			// only the packed data is read in the loop, the normal is fetched for the closest triangle afterwards
+			uint32_t closestTriIdx{ UINT32_MAX };
+			float closestT{ hitRecord.t };
+			for (uint32_t triIdx{ firstTriIdx }; triIdx < firstTriIdx + triCount; ++triIdx)
+			{
+				float t;
+				const TriangleCullMode cullMode = bvh.HasTriCullModes() ? bvh.GetTriCullMode(triIdx) : mesh.cullMode;
+				if (IntersectTriangle(bvh.GetTriIntersectAtIdx(triIdx), cullMode, ray, t) && t < closestT)
+				{
+					closestT = t;
+					closestTriIdx = triIdx;
+				}
+			}
+			if (closestTriIdx == UINT32_MAX) return hitRecord.didHit;
+
+			hitRecord.t = closestT;
+			hitRecord.didHit = true;
+			hitRecord.origin = ray.origin + ray.direction * closestT;
+			const Tri& closestTri = bvh.GetTriAtIdx(closestTriIdx);
+			hitRecord.normal = closestTri.normals;
+			hitRecord.materialIndex = mesh.GetMaterialIndex(closestTri.meshTriIdx);
+			return true;
+		}
 
-			if (node.IsLeaf())
+		// Any-hit version of HitTest_BVHLeaf for shadow rays, stops at the first triangle that is hit
+		inline bool HitTest_BVHLeafOcclusion(const TriangleMesh& mesh, uint32_t firstTriIdx, uint32_t triCount, const Ray& ray, const RaySSE& raySSE)
+		{
+			const BVH& bvh = *mesh.bvh;
+			if (bvh.HasTriGroups())
 			{
-				HitRecord newClosestHit{};
-					for (int triIdxOffset{}; triIdxOffset < node.triCount; ++triIdxOffset)
+				__m128 detMin, detMax;
+				GetDeterminantRange(mesh.cullMode, detMin, detMax);
+				const __m128 rayMax = _mm_set1_ps(ray.max);
+
+				const uint32_t firstGroupIdx = bvh.GetLeafFirstGroup(firstTriIdx);
+				for (uint32_t groupOffset{ 0 }; groupOffset * 4 < triCount; ++groupOffset)
 				{
-					int triIdx = (node.firstTriIdx + triIdxOffset);
+					if (bvh.HasTriCullModes()) GetLeafDeterminantRange4(bvh, firstTriIdx + groupOffset * 4, std::min(4u, triCount - groupOffset * 4), detMin, detMax);
+
+					__m128 t;
+					if (IntersectTriangle4(bvh.GetTriGroupAtIdx(firstGroupIdx + groupOffset), raySSE, detMin, detMax, rayMax, t) != 0) return true;
+				}
+				return false;
+			}
+
+			for (uint32_t triIdx{ firstTriIdx }; triIdx < firstTriIdx + triCount; ++triIdx)
+			{
+				float t;
+				const TriangleCullMode cullMode = bvh.HasTriCullModes() ? bvh.GetTriCullMode(triIdx) : mesh.cullMode;
+				if (IntersectTriangle(bvh.GetTriIntersectAtIdx(triIdx), cullMode, ray, t)) return true;
+			}
+			return false;
+		}
+
+		// Slab test of a ray against the four child boxes of a BVH4 node at once,
+		// returns one bit per child that was hit and stores the entry distances in tEntry
+		inline int IntersectAABB4(const BVH4Node& node, const __m128 rayOrigin[3], const __m128 rayRcpDirection[3], const __m128 rayMax, float tEntry[4])
+		{
+			const __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bminX), rayOrigin[0]), rayRcpDirection[0]);
+			const __m128 tx2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bmaxX), rayOrigin[0]), rayRcpDirection[0]);
+			const __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bminY), rayOrigin[1]), rayRcpDirection[1]);
+			const __m128 ty2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bmaxY), rayOrigin[1]), rayRcpDirection[1]);
+			const __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bminZ), rayOrigin[2]), rayRcpDirection[2]);
+			const __m128 tz2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bmaxZ), rayOrigin[2]), rayRcpDirection[2]);
+
+			const __m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx1, tx2), _mm_min_ps(ty1, ty2)), _mm_min_ps(tz1, tz2));
+			const __m128 tmax = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx1, tx2), _mm_max_ps(ty1, ty2)), _mm_max_ps(tz1, tz2));
+			_mm_storeu_ps(tEntry, tmin);
+
+			const __m128 didHit = _mm_and_ps(_mm_cmpge_ps(tmax, tmin), _mm_and_ps(_mm_cmplt_ps(tmin, rayMax), _mm_cmpgt_ps(tmax, _mm_setzero_ps())));
+			return _mm_movemask_ps(didHit) & ((1 << node.childCount) - 1);
+		}
+
+		template<typename NodeType>
+		inline const NodeType& GetWideNode(const BVH& bvh, uint32_t nodeIdx)
+		{
+			if constexpr (std::is_same_v<NodeType, BVH4QuantizedNode>) return bvh.GetQuantizedNode(nodeIdx);
+			else return bvh.GetBvh4Node(nodeIdx);
+		}
+
+		// Decodes four quantized child coordinates on one axis, in the same order of operations as BVH::QuantizeNode
+		inline __m128 DecodeQuantized4(const BVH4QuantizedNode& node, const uint8_t quantized[4], int axis)
+		{
+			int32_t packed;
+			std::memcpy(&packed, quantized, sizeof(packed));
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i values = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+			return _mm_add_ps(_mm_set1_ps(node.origin[axis]), _mm_mul_ps(_mm_cvtepi32_ps(values), _mm_set1_ps(node.GetSpacing(axis))));
+		}
+
+		// IntersectAABB4 on the decoded boxes of a quantized node, they enclose the exact ones
+		inline int IntersectAABB4(const BVH4QuantizedNode& node, const __m128 rayOrigin[3], const __m128 rayRcpDirection[3], const __m128 rayMax, float tEntry[4])
+		{
+			const __m128 tx1 = _mm_mul_ps(_mm_sub_ps(DecodeQuantized4(node, node.qminX, 0), rayOrigin[0]), rayRcpDirection[0]);
+			const __m128 tx2 = _mm_mul_ps(_mm_sub_ps(DecodeQuantized4(node, node.qmaxX, 0), rayOrigin[0]), rayRcpDirection[0]);
+			const __m128 ty1 = _mm_mul_ps(_mm_sub_ps(DecodeQuantized4(node, node.qminY, 1), rayOrigin[1]), rayRcpDirection[1]);
+			const __m128 ty2 = _mm_mul_ps(_mm_sub_ps(DecodeQuantized4(node, node.qmaxY, 1), rayOrigin[1]), rayRcpDirection[1]);
+			const __m128 tz1 = _mm_mul_ps(_mm_sub_ps(DecodeQuantized4(node, node.qminZ, 2), rayOrigin[2]), rayRcpDirection[2]);
+			const __m128 tz2 = _mm_mul_ps(_mm_sub_ps(DecodeQuantized4(node, node.qmaxZ, 2), rayOrigin[2]), rayRcpDirection[2]);
+
+			const __m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx1, tx2), _mm_min_ps(ty1, ty2)), _mm_min_ps(tz1, tz2));
+			const __m128 tmax = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx1, tx2), _mm_max_ps(ty1, ty2)), _mm_max_ps(tz1, tz2));
+			_mm_storeu_ps(tEntry, tmin);
+
+			const __m128 didHit = _mm_and_ps(_mm_cmpge_ps(tmax, tmin), _mm_and_ps(_mm_cmplt_ps(tmin, rayMax), _mm_cmpgt_ps(tmax, _mm_setzero_ps())));
+			return _mm_movemask_ps(didHit) & ((1 << node.childCount) - 1);
+		}
+
+		// Gathers up to four triangles of a compressed BVH leaf from the mesh's vertex buffer, unused lanes never hit
+		inline void LoadTriGroup(const TriangleMesh& mesh, uint32_t firstIdx, uint32_t count, TriIntersect4& group)
+		{
+			const BVH& bvh = *mesh.bvh;
+			group = {};
+			for (uint32_t lane = 0; lane < count; lane++)
+			{
+				const uint32_t meshTriIdx = bvh.GetLeafMeshTriIdx(firstIdx + lane);
+				const Vector3& vertex0 = mesh.transformedPositions[mesh.indices[meshTriIdx * 3]];
+				const Vector3 edge1 = mesh.transformedPositions[mesh.indices[meshTriIdx * 3 + 1]] - vertex0;
+				const Vector3 edge2 = mesh.transformedPositions[mesh.indices[meshTriIdx * 3 + 2]] - vertex0;
+				group.vertex0X[lane] = vertex0.x, group.vertex0Y[lane] = vertex0.y, group.vertex0Z[lane] = vertex0.z;
+				group.edge1X[lane] = edge1.x, group.edge1Y[lane] = edge1.y, group.edge1Z[lane] = edge1.z;
+				group.edge2X[lane] = edge2.x, group.edge2Y[lane] = edge2.y, group.edge2Z[lane] = edge2.z;
+			}
+		}
 
-					Triangle triangle(mesh.bvh->GetTriAtIdx(triIdx).vertex0, mesh.bvh->GetTriAtIdx(triIdx).vertex1, mesh.bvh->GetTriAtIdx(triIdx).vertex2, mesh.bvh->GetTriAtIdx(triIdx).normals);
-					triangle.cullMode = mesh.cullMode;
-					triangle.materialIndex = mesh.materialIndex;
+		// HitTest_BVHLeaf4 for compressed BVHs, the leaf only holds mesh triangle indices
+		inline bool HitTest_BVHLeafIndexed(const TriangleMesh& mesh, uint32_t firstIdx, uint32_t triCount, const Ray& ray, const RaySSE& raySSE, HitRecord& hitRecord)
+		{
+			__m128 detMin, detMax;
+			GetDeterminantRange(mesh.cullMode, detMin, detMax);
 
-					HitTest_Triangle(triangle, ray, newClosestHit);
-					if (newClosestHit.didHit)
+			uint32_t closestIdx{ UINT32_MAX };
+			float closestT{ hitRecord.t };
+			for (uint32_t groupIdx{ firstIdx }; groupIdx < firstIdx + triCount; groupIdx += 4)
+			{
+				const uint32_t count = std::min(4u, firstIdx + triCount - groupIdx);
+				TriIntersect4 group;
+				LoadTriGroup(mesh, groupIdx, count, group);
+				if (!mesh.triangleCullModes.empty())
+					GetDeterminantRange4(count, [&](uint32_t lane) { return mesh.triangleCullModes[mesh.bvh->GetLeafMeshTriIdx(groupIdx + lane)]; }, detMin, detMax);
+
+				__m128 t;
+				int hitMask = IntersectTriangle4(group, raySSE, detMin, detMax, _mm_set1_ps(std::min(ray.max, closestT)), t);
+				if (hitMask == 0) continue;
+
+				alignas(16) float laneT[4];
+				_mm_store_ps(laneT, t);
+				while (hitMask != 0)
+				{
+					const uint32_t lane = uint32_t(std::countr_zero(unsigned(hitMask)));
+					hitMask &= hitMask - 1;
+					if (laneT[lane] < closestT)
 					{
-						if (newClosestHit.t < hitRecord.t) hitRecord = newClosestHit;
+						closestT = laneT[lane];
+						closestIdx = groupIdx + lane;
 					}
 				}
-				return hitRecord.didHit;
 			}
+			if (closestIdx == UINT32_MAX) return hitRecord.didHit;
+
+			hitRecord.t = closestT;
+			hitRecord.didHit = true;
+			hitRecord.origin = ray.origin + ray.direction * closestT;
+			const uint32_t meshTriIdx = mesh.bvh->GetLeafMeshTriIdx(closestIdx);
+			hitRecord.normal = mesh.transformedNormals[meshTriIdx].Normalized();
+			hitRecord.materialIndex = mesh.GetMaterialIndex(meshTriIdx);
+			return true;
+		}
+
+		inline bool HitTest_BVHLeafIndexedOcclusion(const TriangleMesh& mesh, uint32_t firstIdx, uint32_t triCount, const RaySSE& raySSE, float rayMax)
+		{
+			__m128 detMin, detMax;
+			GetDeterminantRange(mesh.cullMode, detMin, detMax);
+			for (uint32_t groupIdx{ firstIdx }; groupIdx < firstIdx + triCount; groupIdx += 4)
+			{
+				const uint32_t count = std::min(4u, firstIdx + triCount - groupIdx);
+				TriIntersect4 group;
+				LoadTriGroup(mesh, groupIdx, count, group);
+				if (!mesh.triangleCullModes.empty())
+					GetDeterminantRange4(count, [&](uint32_t lane) { return mesh.triangleCullModes[mesh.bvh->GetLeafMeshTriIdx(groupIdx + lane)]; }, detMin, detMax);
+
+				__m128 t;
+				if (IntersectTriangle4(group, raySSE, detMin, detMax, _mm_set1_ps(rayMax), t) != 0) return true;
+			}
+			return false;
+		}
 
-			else
+		// Closest hit through the 4-wide nodes, BVH4Node or the compressed BVH4QuantizedNode
+		template<typename NodeType>
+		inline bool HitTest_TriangleMeshBVH4(const TriangleMesh& mesh, const Ray& ray, HitRecord& hitRecord)
+		{
+			constexpr bool isQuantized = std::is_same_v<NodeType, BVH4QuantizedNode>;
+			const BVH& bvh = *mesh.bvh;
+			const RaySSE raySSE{ ray };
+
+			// every visited node pushes at most 3 entries
+			TraversalEntry stack[256];
+			uint32_t stackSize = 0;
+			uint32_t nodeIdx = 0;
+			while (true)
 			{
-				bool hitLeft = false, hitRight = false;
+				const NodeType& node = GetWideNode<NodeType>(bvh, nodeIdx);
+				float tEntry[4];
+				int hitMask = IntersectAABB4(node, raySSE.origin, raySSE.rcpDirection, _mm_set1_ps(std::min(ray.max, hitRecord.t)), tEntry);
+
+				// sort the children that were hit from near to far
+				uint32_t order[4];
+				uint32_t nrOfHits = 0;
+				while (hitMask != 0)
+				{
+					const uint32_t childIdx = uint32_t(std::countr_zero(unsigned(hitMask)));
+					hitMask &= hitMask - 1;
 
-				hitLeft = HitTest_TriangleMesh(mesh, node.leftNode, ray, hitRecord);
-				hitRight = HitTest_TriangleMesh(mesh, node.leftNode +1, ray, hitRecord);
+					uint32_t insertIdx = nrOfHits++;
+					for (; insertIdx > 0 && tEntry[order[insertIdx - 1]] > tEntry[childIdx]; --insertIdx) order[insertIdx] = order[insertIdx - 1];
+					order[insertIdx] = childIdx;
+				}
 
-				return hitLeft || hitRight;
+				// leaves first, near to far, so they can shrink the closest t before inner nodes are visited
+				for (uint32_t i = 0; i < nrOfHits; i++)
+				{
+					const uint32_t childIdx = order[i];
+					if (node.triCount[childIdx] == 0 || tEntry[childIdx] >= hitRecord.t) continue;
+
+					if constexpr (isQuantized) HitTest_BVHLeafIndexed(mesh, node.child[childIdx], node.triCount[childIdx], ray, raySSE, hitRecord);
+					else HitTest_BVHLeaf(mesh, node.child[childIdx], node.triCount[childIdx], ray, raySSE, hitRecord);
+				}
+
+				// push the inner nodes far to near, then continue with the nearest one that can still hold a closer hit
+				for (uint32_t i = nrOfHits; i-- > 0;)
+				{
+					const uint32_t childIdx = order[i];
+					if (node.triCount[childIdx] == 0) stack[stackSize++] = { node.child[childIdx], tEntry[childIdx] };
+				}
+
+				TraversalEntry entry{};
+				do
+				{
+					if (stackSize == 0) return hitRecord.didHit;
+					entry = stack[--stackSize];
+				} while (entry.tEntry >= hitRecord.t);
+				nodeIdx = entry.nodeIdx;
+			}
+		}
+
+		// Closest hit through the skip nodes without a traversal stack: a hit node continues at the next node,
+		// its first child or the one after a leaf, a missed node at its skip link. The order is fixed, so unlike the stack traversals
+		// the near child isn't visited first and fewer boxes get culled by the closest t
+		inline bool HitTest_TriangleMeshStackless(const TriangleMesh& mesh, const Ray& ray, HitRecord& hitRecord)
+		{
+			const BVH& bvh = *mesh.bvh;
+			const RaySSE raySSE{ ray };
+			const uint32_t nodeCount = bvh.GetNodeCount();
+			uint32_t nodeIdx = 0;
+			while (nodeIdx < nodeCount)
+			{
+				const BVHSkipNode& node = bvh.GetSkipNode(nodeIdx);
+				if (IntersectAABB(ray, node.aabb, hitRecord.t) == FLT_MAX)
+				{
+					nodeIdx = node.IsLeaf() ? nodeIdx + 1 : node.skipNode;
+					continue;
+				}
+
+				if (node.IsLeaf()) HitTest_BVHLeaf(mesh, node.firstTriIdx, node.triCount, ray, raySSE, hitRecord);
+				nodeIdx++;
+			}
+			return hitRecord.didHit;
+		}
+
+		inline bool HitTest_TriangleMesh(const TriangleMesh& mesh, const int nodeIdx, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
+		{
+			// kd-trees and grids traverse themselves, BVHs are traversed inline below
+			if (mesh.bvh == nullptr) return mesh.accelerator->ClosestHit(ray, hitRecord);
+			// a traversal copy replaces the whole binary traversal when it was built, compressed trees only have the 4-wide one
+			if (nodeIdx == 0 && mesh.bvh->HasQuantizedNodes()) return HitTest_TriangleMeshBVH4<BVH4QuantizedNode>(mesh, ray, hitRecord);
+			if (nodeIdx == 0 && mesh.bvh->HasSkipNodes()) return HitTest_TriangleMeshStackless(mesh, ray, hitRecord);
+			if (nodeIdx == 0 && mesh.bvh->HasBVH4()) return HitTest_TriangleMeshBVH4<BVH4Node>(mesh, ray, hitRecord);
+
+			const BVH& bvh = *mesh.bvh;
+			uint32_t currentNodeIdx = uint32_t(nodeIdx);
+			const BVHNode* node = &bvh.GetBvhNode(currentNodeIdx);
+			if (IntersectAABB(ray, node->aabb, hitRecord.t) == FLT_MAX) return false;
+
+			const RaySSE raySSE{ ray };
+			TraversalEntry stack[128];
+			uint32_t stackSize = 0;
+			while (true)
+			{
+				if (node->IsLeaf())
+				{
+					HitTest_BVHLeaf(mesh, node->firstTriIdx, node->triCount, ray, raySSE, hitRecord);
+				}
+				else
+				{
+					// descend into the near child, the far one waits on the stack. The left child is stored right after its parent
+					TraversalEntry nearChild{ currentNodeIdx + 1, IntersectAABB(ray, bvh.GetBvhNode(currentNodeIdx + 1).aabb, hitRecord.t) };
+					TraversalEntry farChild{ node->rightNode, IntersectAABB(ray, bvh.GetBvhNode(node->rightNode).aabb, hitRecord.t) };
+					if (farChild.tEntry < nearChild.tEntry) std::swap(nearChild, farChild);
+
+					if (nearChild.tEntry != FLT_MAX)
+					{
+						if (farChild.tEntry != FLT_MAX) stack[stackSize++] = farChild;
+						currentNodeIdx = nearChild.nodeIdx;
+						node = &bvh.GetBvhNode(currentNodeIdx);
+						continue;
+					}
+				}
+
+				// continue with the nearest stacked node that can still hold a closer hit
+				TraversalEntry entry{};
+				do
+				{
+					if (stackSize == 0) return hitRecord.didHit;
+					entry = stack[--stackSize];
+				} while (entry.tEntry >= hitRecord.t);
+				currentNodeIdx = entry.nodeIdx;
+				node = &bvh.GetBvhNode(currentNodeIdx);
 			}
 		}
 		
 
+		template<typename NodeType>
+		inline bool HitTest_TriangleMeshBVH4Occlusion(const TriangleMesh& mesh, const Ray& ray)
+		{
+			constexpr bool isQuantized = std::is_same_v<NodeType, BVH4QuantizedNode>;
+			const BVH& bvh = *mesh.bvh;
+			const RaySSE raySSE{ ray };
+			const __m128 rayMax = _mm_set1_ps(ray.max);
+
+			// any occluder will do, so there is no ordering and no culling by distance
+			uint32_t stack[256];
+			uint32_t stackSize = 0;
+			stack[stackSize++] = 0;
+			while (stackSize > 0)
+			{
+				const NodeType& node = GetWideNode<NodeType>(bvh, stack[--stackSize]);
+				float tEntry[4];
+				int hitMask = IntersectAABB4(node, raySSE.origin, raySSE.rcpDirection, rayMax, tEntry);
+				while (hitMask != 0)
+				{
+					const uint32_t childIdx = uint32_t(std::countr_zero(unsigned(hitMask)));
+					hitMask &= hitMask - 1;
+
+					if (node.triCount[childIdx] == 0) stack[stackSize++] = node.child[childIdx];
+					else if constexpr (isQuantized)
+					{
+						if (HitTest_BVHLeafIndexedOcclusion(mesh, node.child[childIdx], node.triCount[childIdx], raySSE, ray.max)) return true;
+					}
+					else if (HitTest_BVHLeafOcclusion(mesh, node.child[childIdx], node.triCount[childIdx], ray, raySSE)) return true;
+				}
+			}
+			return false;
+		}
+
+		// Any-hit version of HitTest_TriangleMeshStackless, the fixed order costs nothing here
+		inline bool HitTest_TriangleMeshStacklessOcclusion(const TriangleMesh& mesh, const Ray& ray)
+		{
+			const BVH& bvh = *mesh.bvh;
+			const RaySSE raySSE{ ray };
+			const uint32_t nodeCount = bvh.GetNodeCount();
+			uint32_t nodeIdx = 0;
+			while (nodeIdx < nodeCount)
+			{
+				const BVHSkipNode& node = bvh.GetSkipNode(nodeIdx);
+				if (IntersectAABB(ray, node.aabb, ray.max) == FLT_MAX)
+				{
+					nodeIdx = node.IsLeaf() ? nodeIdx + 1 : node.skipNode;
+					continue;
+				}
+
+				if (node.IsLeaf() && HitTest_BVHLeafOcclusion(mesh, node.firstTriIdx, node.triCount, ray, raySSE)) return true;
+				nodeIdx++;
+			}
+			return false;
+		}
+
 		inline bool HitTest_TriangleMesh(const TriangleMesh& mesh, const Ray& ray)
 		{
+			if (mesh.bvh == nullptr) return mesh.accelerator->AnyHit(ray);
+			if (mesh.bvh->HasQuantizedNodes()) return HitTest_TriangleMeshBVH4Occlusion<BVH4QuantizedNode>(mesh, ray);
+			if (mesh.bvh->HasSkipNodes()) return HitTest_TriangleMeshStacklessOcclusion(mesh, ray);
+			if (mesh.bvh->HasBVH4()) return HitTest_TriangleMeshBVH4Occlusion<BVH4Node>(mesh, ray);
+
+			const BVH& bvh = *mesh.bvh;
+			const RaySSE raySSE{ ray };
+			uint32_t stack[128];
+			uint32_t stackSize = 0;
+			stack[stackSize++] = 0;
+			while (stackSize > 0)
+			{
+				const uint32_t nodeIdx = stack[--stackSize];
+				const BVHNode& node = bvh.GetBvhNode(nodeIdx);
+				if (IntersectAABB(ray, node.aabb, ray.max) == FLT_MAX) continue;
+
+				if (!node.IsLeaf())
+				{
+					stack[stackSize++] = node.rightNode;
+					stack[stackSize++] = nodeIdx + 1;
+				}
+				else if (HitTest_BVHLeafOcclusion(mesh, node.firstTriIdx, node.triCount, ray, raySSE)) return true;
+			}
+			return false;
+		}
+#pragma endregion
+
+#pragma region Instance & TLAS HitTest
+
+		inline bool HitTest_MeshInstance(const MeshInstance& instance, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
+		{
+			// trace the shared BLAS in object space, the direction is not renormalized so t stays the same
+			Ray objectRay{ instance.invTransform.TransformPoint(ray.origin), instance.invTransform.TransformVector(ray.direction), ray.min, ray.max };
+
+			if (ignoreHitRecord) return HitTest_TriangleMesh(*instance.pMesh, objectRay);
+
+			HitRecord objectHit{};
+			objectHit.t = hitRecord.t;
+			if (!HitTest_TriangleMesh(*instance.pMesh, 0, objectRay, objectHit)) return false;
+
+			hitRecord.t = objectHit.t;
+			hitRecord.didHit = true;
+			hitRecord.origin = ray.origin + ray.direction * objectHit.t;
+			hitRecord.normal = instance.normalTransform.TransformVector(objectHit.normal).Normalized();
+			hitRecord.materialIndex = instance.materialIndex;
+			return true;
+		}
+
+		inline bool HitTest_TLASObject(const TLAS& tlas, const TLASObject& object, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
+		{
+			const TLASGeometry& geometry = tlas.GetGeometry();
+			switch (object.type)
+			{
+			case TLASObjectType::Sphere:
+			{
+				const Sphere& sphere = (*geometry.pSpheres)[object.geometryIdx];
+				if (ignoreHitRecord) return HitTest_Sphere(sphere, ray);
+
+				HitRecord tempHit{};
+				if (!HitTest_Sphere(sphere, ray, tempHit) || tempHit.t >= hitRecord.t) return false;
+				hitRecord = tempHit;
+				return true;
+			}
+			case TLASObjectType::Triangle:
+			{
+				const Triangle& triangle = (*geometry.pTriangles)[object.geometryIdx];
+				if (ignoreHitRecord) return HitTest_Triangle(triangle, ray);
+
+				HitRecord tempHit{};
+				if (!HitTest_Triangle(triangle, ray, tempHit) || tempHit.t >= hitRecord.t) return false;
+				hitRecord = tempHit;
+				return true;
+			}
+			case TLASObjectType::TriangleMesh:
+			case TLASObjectType::CombinedMesh:
+			{
+				const TriangleMesh& mesh = object.type == TLASObjectType::CombinedMesh ? *geometry.pCombinedMesh : (*geometry.pTriangleMeshes)[object.geometryIdx];
+				if (ignoreHitRecord) return HitTest_TriangleMesh(mesh, ray);
+
+				// the mesh BVH only overwrites the record with closer hits
+				const float closestT = hitRecord.t;
+				HitTest_TriangleMesh(mesh, 0, ray, hitRecord);
+				return hitRecord.t < closestT;
+			}
+			case TLASObjectType::MeshInstance:
+				return HitTest_MeshInstance((*geometry.pMeshInstances)[object.geometryIdx], ray, hitRecord, ignoreHitRecord);
+			case TLASObjectType::SphereSet:
+				if (ignoreHitRecord) return geometry.pSphereBVH->AnyHit(ray);
+				return geometry.pSphereBVH->ClosestHit(ray, hitRecord);
+			}
+			return false;
+		}
+
+		inline bool HitTest_TLAS(const TLAS& tlas, const uint32_t nodeIdx, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
+		{
+			const TLASNode* node = &tlas.GetNode(nodeIdx);
+			if (IntersectAABB(ray, node->aabb, hitRecord.t) == FLT_MAX) return false;
+
+			bool didHit = false;
+			TraversalEntry stack[TLAS::MaxDepth];
+			uint32_t stackSize = 0;
+			while (true)
+			{
+				if (node->IsLeaf())
+				{
+					for (uint32_t objectIdxOffset{}; objectIdxOffset < node->objectCount; ++objectIdxOffset)
+					{
+						didHit |= HitTest_TLASObject(tlas, tlas.GetObjectAtIdx(node->firstObjectIdx + objectIdxOffset), ray, hitRecord, ignoreHitRecord);
+						if (didHit && ignoreHitRecord) return true;
+					}
+				}
+				else
+				{
+					// descend into the near child, the far one waits on the stack
+					TraversalEntry nearChild{ node->leftNode, IntersectAABB(ray, tlas.GetNode(node->leftNode).aabb, hitRecord.t) };
+					TraversalEntry farChild{ node->leftNode + 1, IntersectAABB(ray, tlas.GetNode(node->leftNode + 1).aabb, hitRecord.t) };
+					if (farChild.tEntry < nearChild.tEntry) std::swap(nearChild, farChild);
+
+					if (nearChild.tEntry != FLT_MAX)
+					{
+						if (farChild.tEntry != FLT_MAX) stack[stackSize++] = farChild;
+						node = &tlas.GetNode(nearChild.nodeIdx);
+						continue;
+					}
+				}
+
+				// continue with the nearest stacked node that can still hold a closer hit
+				TraversalEntry entry{};
+				do
+				{
+					if (stackSize == 0) return didHit;
+					entry = stack[--stackSize];
+				} while (entry.tEntry >= hitRecord.t);
+				node = &tlas.GetNode(entry.nodeIdx);
+			}
+		}
+
+		inline bool HitTest_TLAS(const TLAS& tlas, const Ray& ray, HitRecord& hitRecord)
+		{
+			if (tlas.IsEmpty()) return false;
+
+			return HitTest_TLAS(tlas, 0, ray, hitRecord);
+		}
+
+		inline bool HitTest_TLAS(const TLAS& tlas, const Ray& ray)
+		{
+			if (tlas.IsEmpty()) return false;
+
 			HitRecord temp{};
-			return HitTest_TriangleMesh(mesh, 0 ,ray, temp, true);
+			return HitTest_TLAS(tlas, 0, ray, temp, true);
 		}
 #pragma endregion
 
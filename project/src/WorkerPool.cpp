@@ -0,0 +1,62 @@
+#include "WorkerPool.h"
+
+#include <algorithm>
+
+using namespace dae;
+
+namespace
+{
+	uint32_t ResolveNrOfWorkers(uint32_t nrOfWorkers)
+	{
+		return nrOfWorkers > 0 ? nrOfWorkers : std::max(std::thread::hardware_concurrency(), 1u);
+	}
+}
+
+WorkerPool::WorkerPool(uint32_t nrOfWorkers) :
+	m_NrOfWorkers{ ResolveNrOfWorkers(nrOfWorkers) },
+	m_LoopStart{ std::ptrdiff_t(m_NrOfWorkers) },
+	m_LoopEnd{ std::ptrdiff_t(m_NrOfWorkers) }
+{
+	//Worker 0 is whichever thread calls ParallelFor
+	m_Threads.reserve(m_NrOfWorkers - 1);
+	for (uint32_t workerIdx = 1; workerIdx < m_NrOfWorkers; workerIdx++)
+	{
+		m_Threads.emplace_back(&WorkerPool::WorkerThread, this);
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	//Release the workers from the start barrier, they see the flag and return
+	m_IsShuttingDown = true;
+	m_LoopStart.arrive_and_wait();
+
+	for (std::thread& thread : m_Threads) thread.join();
+}
+
+void WorkerPool::RunLoop(uint32_t nrOfTasks)
+{
+	m_NrOfTasks = nrOfTasks;
+	m_NextTaskIdx = 0;
+
+	m_LoopStart.arrive_and_wait();
+	RunWorker();
+	m_LoopEnd.arrive_and_wait();
+}
+
+void WorkerPool::WorkerThread()
+{
+	while (true)
+	{
+		m_LoopStart.arrive_and_wait();
+		if (m_IsShuttingDown) return;
+
+		RunWorker();
+		m_LoopEnd.arrive_and_wait();
+	}
+}
+
+void WorkerPool::RunWorker()
+{
+	for (uint32_t taskIdx = m_NextTaskIdx++; taskIdx < m_NrOfTasks; taskIdx = m_NextTaskIdx++) m_pRunTask(m_pContext, taskIdx);
+}
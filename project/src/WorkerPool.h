@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <barrier>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+namespace dae
+{
+	//Persistent pool for builds that run many short parallel loops, like the top levels of the BVHs.
+	//The workers are started once and wait on a barrier between loops, so a loop costs two barrier
+	//crossings instead of starting and joining a thread per worker.
+	//A loop must not start another loop on the same pool.
+	class WorkerPool final
+	{
+	public:
+		explicit WorkerPool(uint32_t nrOfWorkers = 0);
+		~WorkerPool();
+
+		WorkerPool(const WorkerPool&) = delete;
+		WorkerPool(WorkerPool&&) noexcept = delete;
+		WorkerPool& operator=(const WorkerPool&) = delete;
+		WorkerPool& operator=(WorkerPool&&) noexcept = delete;
+
+		uint32_t GetNrOfWorkers() const { return m_NrOfWorkers; }
+
+		//Runs job(taskIdx) for every task and blocks until all are done.
+		//The calling thread takes part as worker 0, tasks are handed out through an atomic counter
+		template<typename Job>
+		void ParallelFor(uint32_t nrOfTasks, const Job& job)
+		{
+			if (nrOfTasks == 0) return;
+			if (nrOfTasks == 1 || m_NrOfWorkers == 1)
+			{
+				for (uint32_t taskIdx = 0; taskIdx < nrOfTasks; taskIdx++) job(taskIdx);
+				return;
+			}
+
+			m_pContext = &job;
+			m_pRunTask = [](const void* pContext, uint32_t taskIdx) { (*static_cast<const Job*>(pContext))(taskIdx); };
+			RunLoop(nrOfTasks);
+		}
+
+		//Splits [first, first + count) into nrOfSlices contiguous slices and runs job(sliceIdx, sliceFirst, sliceEnd) on each
+		template<typename Job>
+		void ParallelForSlices(uint32_t first, uint32_t count, uint32_t nrOfSlices, const Job& job)
+		{
+			ParallelFor(nrOfSlices, [&](uint32_t sliceIdx)
+				{
+					job(sliceIdx, first + uint32_t(uint64_t(count) * sliceIdx / nrOfSlices), first + uint32_t(uint64_t(count) * (sliceIdx + 1) / nrOfSlices));
+				});
+		}
+
+	private:
+		void RunLoop(uint32_t nrOfTasks);
+		void WorkerThread();
+		void RunWorker();
+
+		uint32_t m_NrOfWorkers{};
+
+		//Current loop, type-erased without allocating
+		const void* m_pContext{};
+		void (*m_pRunTask)(const void*, uint32_t) {};
+		uint32_t m_NrOfTasks{};
+		std::atomic<uint32_t> m_NextTaskIdx{ 0 };
+
+		std::barrier<> m_LoopStart;
+		std::barrier<> m_LoopEnd;
+		std::atomic<bool> m_IsShuttingDown{ false };
+		std::vector<std::thread> m_Threads{};
+	};
+}
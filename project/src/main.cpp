@@ -22,6 +22,22 @@ void ShutDown(SDL_Window* pWindow)
 	SDL_Quit();
 }
 
+void ReadCameraInput(Camera& camera)
+{
+	const uint8_t* pKeyboardState = SDL_GetKeyboardState(nullptr);
+
+	CameraInput& input = camera.input;
+	input.moveForward = pKeyboardState[SDL_SCANCODE_W];
+	input.moveBackward = pKeyboardState[SDL_SCANCODE_S];
+	input.moveRight = pKeyboardState[SDL_SCANCODE_D];
+	input.moveLeft = pKeyboardState[SDL_SCANCODE_A];
+	input.moveUp = pKeyboardState[SDL_SCANCODE_SPACE];
+	input.moveDown = pKeyboardState[SDL_SCANCODE_LSHIFT];
+
+	const uint32_t mouseState = SDL_GetRelativeMouseState(&input.mouseDeltaX, &input.mouseDeltaY);
+	input.isRotating = mouseState & SDL_BUTTON(SDL_BUTTON_RIGHT);
+}
+
 int main(int argc, char* args[])
 {
 	//Unreferenced parameters
@@ -43,9 +59,19 @@ int main(int argc, char* args[])
 	if (!pWindow)
 		return 1;
 
+	SDL_SetRelativeMouseMode(SDL_TRUE);
+
 	//Initialize "framework"
+	SDL_Surface* pWindowSurface = SDL_GetWindowSurface(pWindow);
+	PixelFormat windowFormat{};
+	windowFormat.rShift = pWindowSurface->format->Rshift;
+	windowFormat.gShift = pWindowSurface->format->Gshift;
+	windowFormat.bShift = pWindowSurface->format->Bshift;
+	windowFormat.aMask = pWindowSurface->format->Amask;
+
 	const auto pTimer = new Timer();
-	const auto pRenderer = new Renderer(pWindow);
+	const auto pRenderer = new Renderer(width, height, static_cast<uint32_t*>(pWindowSurface->pixels), windowFormat);
+	pRenderer->PrintSchedulingMode();
 
 	const auto pScene = new Scene_W4_ReferenceScene();
 	const auto pScene2 = new Scene_W4_Bunny();
@@ -88,11 +114,17 @@ int main(int argc, char* args[])
 				if (e.key.keysym.scancode == SDL_SCANCODE_F4)
 				{
 					pRenderer->ToggleMultiThreading();
+					pRenderer->PrintSchedulingMode();
 				}
 				if (e.key.keysym.scancode == SDL_SCANCODE_F5)
 				{
 					isBunnyScene = !isBunnyScene;
 				}
+				if (e.key.keysym.scancode == SDL_SCANCODE_F7)
+				{
+					pRenderer->CycleTileSize();
+					pRenderer->PrintSchedulingMode();
+				}
 				break;
 			}
 
@@ -104,10 +136,12 @@ int main(int argc, char* args[])
 		//--------- Update ---------
 		if (isBunnyScene)
 		{
+			ReadCameraInput(pScene2->GetCamera());
 			pScene2->Update(pTimer);
 		}
 		else
 		{
+			ReadCameraInput(pScene->GetCamera());
 			pScene->Update(pTimer);
 		}
 	
@@ -121,6 +155,7 @@ int main(int argc, char* args[])
 		{
 			pRenderer->Render(pScene);
 		}
+		SDL_UpdateWindowSurface(pWindow);
 		
 
 		//--------- Timer ---------
@@ -129,13 +164,13 @@ int main(int argc, char* args[])
 		if (printTimer >= 1.f)
 		{
 			printTimer = 0.f;
-			std::cout << "dFPS: " << pTimer->GetdFPS() << std::endl;
+			std::cout << "dFPS: " << pTimer->GetdFPS() << " (" << 1000.f / pTimer->GetdFPS() << " ms/frame)" << std::endl;
 		}
 
 		//Save screenshot after full render
 		if (takeScreenshot)
 		{
-			if (!pRenderer->SaveBufferToImage())
+			if (pRenderer->SaveBufferToImage())
 				std::cout << "Screenshot saved!" << std::endl;
 			else
 				std::cout << "Something went wrong. Screenshot not saved!" << std::endl;
@@ -0,0 +1,249 @@
+//Headless entry point: renders a scene offscreen without SDL or a display
+//Usage: GP1_Raytracer_Headless --scene W4_Bunny --width 640 --height 480 --frames 100 --out frame.bmp
+
+//Standard includes
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <vector>
+
+//Project includes
+#include "BVHCache.h"
+#include "Timer.h"
+#include "Renderer.h"
+#include "Scene.h"
+
+using namespace dae;
+
+namespace
+{
+	struct HeadlessSettings
+	{
+		std::string sceneName{ "W4_Reference" };
+		int width{ 640 };
+		int height{ 480 };
+		int nrOfFrames{ 1 };
+		uint32_t nrOfThreads{ 0 };
+		std::string outputPath{};
+		std::string bvhCacheDirectory{};
+		bool printBVHStats{ false };
+		std::string bvhDumpPath{};
+		AcceleratorType accelerator{ AcceleratorType::BVH };
+	};
+
+	void PrintUsage()
+	{
+		std::cout << "Usage: GP1_Raytracer_Headless [options]\n"
+			<< "  --scene <name>    W1, W2, W3, W4_Bunny, W4_Reference, W4_Instanced, Particles (default W4_Reference)\n"
+			<< "  --width <px>      image width (default 640)\n"
+			<< "  --height <px>     image height (default 480)\n"
+			<< "  --frames <n>      number of frames to render (default 1)\n"
+			<< "  --threads <n>     render threads, 0 = hardware concurrency (default 0)\n"
+			<< "  --out <file.bmp>  write the last frame to a BMP file\n"
+			<< "  --accelerator <a> mesh acceleration structure: bvh, kdtree or grid (default bvh)\n"
+			<< "  --bvh-cache <dir> load mesh BVHs from dir, and store the ones that had to be built there\n"
+			<< "  --bvh-stats       print quality and size statistics of every mesh BVH\n"
+			<< "  --bvh-dump <file> write every mesh BVH to a text file, one line per node\n";
+	}
+
+	//Whole string as a number, false for anything else including values out of range
+	template<typename T>
+	bool ParseNumber(const std::string& value, T& number)
+	{
+		const char* pEnd{ value.data() + value.size() };
+		const auto [pLast, error] = std::from_chars(value.data(), pEnd, number);
+		return error == std::errc{} && pLast == pEnd;
+	}
+
+	bool ParseArguments(int argc, char* args[], HeadlessSettings& settings)
+	{
+		for (int i{ 1 }; i < argc; ++i)
+		{
+			const std::string argument{ args[i] };
+			if (argument == "--help" || argument == "-h")
+				return false;
+			if (argument == "--bvh-stats")
+			{
+				settings.printBVHStats = true;
+				continue;
+			}
+
+			if (i + 1 >= argc)
+			{
+				std::cout << "Missing value for " << argument << "\n";
+				return false;
+			}
+
+			const std::string value{ args[++i] };
+			bool isValidNumber{ true };
+			if (argument == "--scene") settings.sceneName = value;
+			else if (argument == "--width") isValidNumber = ParseNumber(value, settings.width);
+			else if (argument == "--height") isValidNumber = ParseNumber(value, settings.height);
+			else if (argument == "--frames") isValidNumber = ParseNumber(value, settings.nrOfFrames);
+			else if (argument == "--threads") isValidNumber = ParseNumber(value, settings.nrOfThreads);
+			else if (argument == "--out") settings.outputPath = value;
+			else if (argument == "--bvh-cache") settings.bvhCacheDirectory = value;
+			else if (argument == "--bvh-dump") settings.bvhDumpPath = value;
+			else if (argument == "--accelerator")
+			{
+				if (!ParseAcceleratorType(value, settings.accelerator))
+				{
+					std::cout << "Unknown accelerator " << value << "\n";
+					return false;
+				}
+			}
+			else
+			{
+				std::cout << "Unknown option " << argument << "\n";
+				return false;
+			}
+
+			if (!isValidNumber)
+			{
+				std::cout << "Invalid value " << value << " for " << argument << "\n";
+				return false;
+			}
+		}
+
+		return settings.width > 0 && settings.height > 0 && settings.nrOfFrames > 0;
+	}
+
+	std::unique_ptr<Scene> CreateScene(const std::string& sceneName)
+	{
+		if (sceneName == "W1") return std::make_unique<Scene_W1>();
+		if (sceneName == "W2") return std::make_unique<Scene_W2>();
+		if (sceneName == "W3") return std::make_unique<Scene_W3>();
+		if (sceneName == "W4_Bunny") return std::make_unique<Scene_W4_Bunny>();
+		if (sceneName == "W4_Reference") return std::make_unique<Scene_W4_ReferenceScene>();
+		if (sceneName == "W4_Instanced") return std::make_unique<Scene_W4_InstancedBunnies>();
+		if (sceneName == "Particles") return std::make_unique<Scene_Particles>();
+		return nullptr;
+	}
+
+	//Reports on the BVH of every mesh in the scene, instanced meshes and the combined small meshes included
+	bool ReportBVHs(const Scene& scene, const HeadlessSettings& settings)
+	{
+		std::vector<const TriangleMesh*> meshes{};
+		for (const TriangleMesh& mesh : scene.GetTriangleMeshGeometries()) meshes.push_back(&mesh);
+		for (const TriangleMesh& mesh : scene.GetInstancedMeshes()) meshes.push_back(&mesh);
+		meshes.push_back(&scene.GetCombinedMesh());
+		const size_t combinedMeshIdx{ meshes.size() - 1 };
+
+		std::ofstream dumpFile{};
+		if (!settings.bvhDumpPath.empty())
+		{
+			dumpFile.open(settings.bvhDumpPath);
+			if (!dumpFile)
+			{
+				std::cout << "Could not open " << settings.bvhDumpPath << "\n";
+				return false;
+			}
+		}
+
+		for (size_t meshIdx{ 0 }; meshIdx < meshes.size(); ++meshIdx)
+		{
+			const MeshAccelerator* pAccelerator{ meshes[meshIdx]->accelerator.get() };
+			if (pAccelerator == nullptr) continue;
+
+			const std::string meshName{ meshIdx == combinedMeshIdx ? "combined mesh" : "mesh " + std::to_string(meshIdx) };
+			const BVH* pBVH{ meshes[meshIdx]->bvh };
+			if (pBVH == nullptr)
+			{
+				//kd-trees and grids only report their size
+				if (settings.printBVHStats)
+					std::cout << GetAcceleratorName(pAccelerator->GetType()) << " of " << meshName << "\n  memory " << pAccelerator->GetMemoryBytes() / 1024.f << " KiB\n";
+				continue;
+			}
+
+			if (settings.printBVHStats)
+			{
+				std::cout << "BVH of " << meshName << "\n";
+				pBVH->ComputeStats().Print(std::cout);
+			}
+			if (dumpFile.is_open())
+			{
+				dumpFile << "# " << meshName << "\n";
+				pBVH->DumpTree(dumpFile);
+			}
+		}
+
+		if (dumpFile.is_open()) std::cout << "Saved " << settings.bvhDumpPath << "\n";
+		return true;
+	}
+}
+
+int main(int argc, char* args[])
+{
+	HeadlessSettings settings{};
+	if (!ParseArguments(argc, args, settings))
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	const std::unique_ptr<Scene> pScene{ CreateScene(settings.sceneName) };
+	if (!pScene)
+	{
+		std::cout << "Unknown scene " << settings.sceneName << "\n";
+		PrintUsage();
+		return 1;
+	}
+
+	BVHCache::SetDirectory(settings.bvhCacheDirectory);
+	SetDefaultAcceleratorType(settings.accelerator);
+
+	const auto setupStart = std::chrono::steady_clock::now();
+	pScene->Initialize();
+	const float setupTime = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - setupStart).count();
+
+	if ((settings.printBVHStats || !settings.bvhDumpPath.empty()) && !ReportBVHs(*pScene, settings))
+		return 1;
+
+	Timer timer{};
+	Renderer renderer{ settings.width, settings.height, settings.nrOfThreads };
+
+	std::vector<float> frameTimes{};
+	frameTimes.reserve(settings.nrOfFrames);
+
+	timer.Start();
+	for (int frame{ 0 }; frame < settings.nrOfFrames; ++frame)
+	{
+		const auto frameStart = std::chrono::steady_clock::now();
+
+		pScene->Update(&timer);
+		renderer.Render(pScene.get());
+
+		const auto frameEnd = std::chrono::steady_clock::now();
+		frameTimes.push_back(std::chrono::duration<float, std::milli>(frameEnd - frameStart).count());
+
+		timer.Update();
+	}
+	timer.Stop();
+
+	const float totalTime = std::accumulate(frameTimes.begin(), frameTimes.end(), 0.f);
+	std::cout << "Scene: " << settings.sceneName << " (" << settings.width << "x" << settings.height << ")\n"
+		<< "Frames: " << settings.nrOfFrames << "\n"
+		<< ">> SETUP = " << setupTime << " ms\n"
+		<< ">> AVG = " << totalTime / float(settings.nrOfFrames) << " ms\n"
+		<< ">> LOW = " << *std::min_element(frameTimes.begin(), frameTimes.end()) << " ms\n"
+		<< ">> HIGH = " << *std::max_element(frameTimes.begin(), frameTimes.end()) << " ms\n"
+		<< ">> FPS = " << 1000.f * float(settings.nrOfFrames) / totalTime << std::endl;
+
+	if (!settings.outputPath.empty())
+	{
+		if (renderer.SaveBufferToImage(settings.outputPath))
+			std::cout << "Saved " << settings.outputPath << std::endl;
+		else
+		{
+			std::cout << "Something went wrong. " << settings.outputPath << " not saved!" << std::endl;
+			return 1;
+		}
+	}
+
+	return 0;
+}
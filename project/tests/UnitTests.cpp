@@ -1,7 +1,11 @@
 #include <gtest/gtest.h>
+#include <filesystem>
+#include "../src/BVHCache.h"
 #include "../src/Vector3.h"
 #include "../src/Vector4.h"
 #include "../src/Matrix.h"
+#include "../src/Utils.h"
+#include "../src/Scene.h"
 
 namespace dae
 {
@@ -35,7 +39,985 @@ namespace dae
 		EXPECT_EQ(dae::Vector3(-3.0f, 6.0f, -3.0f), dae::Vector3::Cross(v1, v2));
 	}
 
-	// W1
+	// W4
+	TEST(Matrix, Inverse) {
+		const Matrix transform = Matrix::CreateScale(2.f, 3.f, 0.5f) * Matrix::CreateRotation(0.3f, 1.2f, -0.7f) * Matrix::CreateTranslation(4.f, -2.f, 7.f);
+		const Matrix inverse = Matrix::Inverse(transform);
+
+		const Vector3 point{ 1.f, -5.f, 3.f };
+		const Vector3 roundTrip = inverse.TransformPoint(transform.TransformPoint(point));
+		EXPECT_NEAR(point.x, roundTrip.x, 1e-4f);
+		EXPECT_NEAR(point.y, roundTrip.y, 1e-4f);
+		EXPECT_NEAR(point.z, roundTrip.z, 1e-4f);
+	}
+
+	// W4
+	namespace
+	{
+		// Bumpy grid of triangles, enough of them to get a deep BVH
+		TriangleMesh CreateTestMesh(int resolution = 24)
+		{
+			TriangleMesh mesh{};
+			mesh.cullMode = TriangleCullMode::NoCulling;
+			for (int z{ 0 }; z <= resolution; ++z)
+			{
+				for (int x{ 0 }; x <= resolution; ++x)
+				{
+					mesh.positions.emplace_back(float(x), std::sin(x * 0.7f) * std::cos(z * 0.3f) * 2.f, float(z));
+				}
+			}
+			for (int z{ 0 }; z < resolution; ++z)
+			{
+				for (int x{ 0 }; x < resolution; ++x)
+				{
+					const int i0 = z * (resolution + 1) + x, i1 = i0 + 1, i2 = i0 + resolution + 1, i3 = i2 + 1;
+					mesh.indices.insert(mesh.indices.end(), { i0, i2, i1, i1, i2, i3 });
+				}
+			}
+			mesh.CalculateNormals();
+			mesh.UpdateTransforms();
+			return mesh;
+		}
+
+		bool HitTest_BruteForce(const TriangleMesh& mesh, const Ray& ray, HitRecord& closestHit)
+		{
+			for (size_t idx{ 0 }; idx < mesh.indices.size(); idx += 3)
+			{
+				Triangle triangle{ mesh.transformedPositions[mesh.indices[idx]], mesh.transformedPositions[mesh.indices[idx + 1]],
+					mesh.transformedPositions[mesh.indices[idx + 2]], mesh.transformedNormals[idx / 3] };
+				triangle.cullMode = mesh.cullMode;
+				triangle.materialIndex = mesh.materialIndex;
+
+				HitRecord hit{};
+				if (GeometryUtils::HitTest_Triangle(triangle, ray, hit) && hit.t < closestHit.t) closestHit = hit;
+			}
+			return closestHit.didHit;
+		}
+
+		// Rays from above the grid, aimed at random points on it
+		std::vector<Ray> CreateTestRays(int count)
+		{
+			std::vector<Ray> rays{};
+			uint32_t seed{ 12345 };
+			auto random = [&seed]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) / float(1 << 24); };
+			for (int i{ 0 }; i < count; ++i)
+			{
+				const Vector3 origin{ random() * 30.f - 3.f, 6.f + random() * 4.f, random() * 30.f - 3.f };
+				const Vector3 target{ random() * 24.f, 0.f, random() * 24.f };
+				rays.push_back(Ray{ origin, (target - origin).Normalized() });
+			}
+			return rays;
+		}
+
+		// Random spheres above the test grid, only reachable through the scene BVH
+		class SphereFieldScene final : public Scene
+		{
+		public:
+			explicit SphereFieldScene(uint32_t minSphereBVHSpheres = 4096)
+			{
+				m_MinSphereBVHSpheres = minSphereBVHSpheres;
+			}
+
+			void Initialize() override
+			{
+				uint32_t seed{ 6789 };
+				auto random = [&seed]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) / float(1 << 24); };
+				for (int i{ 0 }; i < 500; ++i)
+				{
+					handles.push_back(AddSphere({ random() * 24.f, random() * 3.f, random() * 24.f }, 0.2f + random() * 0.6f, static_cast<unsigned char>(i % 7)));
+				}
+				BuildAccelerationStructure();
+			}
+
+			std::vector<SceneObjectHandle> handles{};
+
+			void Move(const Vector3& offset)
+			{
+				for (int idx{ 0 }; idx < int(m_SphereGeometries.size()); ++idx)
+				{
+					m_SphereGeometries[idx].origin += offset * float(idx % 3);
+				}
+				RefitAccelerationStructure();
+			}
+
+			// Longest path from the root of the scene BVH down to a leaf
+			uint32_t ComputeTLASDepth() const
+			{
+				if (m_TLAS.IsEmpty()) return 0;
+
+				uint32_t maxDepth{ 0 };
+				std::vector<std::pair<uint32_t, uint32_t>> stack{ { 0u, 0u } };
+				while (!stack.empty())
+				{
+					const auto [nodeIdx, depth] = stack.back();
+					stack.pop_back();
+					maxDepth = std::max(maxDepth, depth);
+					const TLASNode& node = m_TLAS.GetNode(nodeIdx);
+					if (node.IsLeaf()) continue;
+					stack.push_back({ node.leftNode, depth + 1 });
+					stack.push_back({ node.leftNode + 1, depth + 1 });
+				}
+				return maxDepth;
+			}
+		};
+
+		// The test grid cut into many two-triangle meshes with mixed cull modes and materials, plus one mesh too large to be merged
+		class SmallMeshScene final : public Scene
+		{
+		public:
+			void Initialize() override
+			{
+				const TriangleMesh grid = CreateTestMesh();
+				const TriangleCullMode cullModes[]{ TriangleCullMode::NoCulling, TriangleCullMode::BackFaceCulling, TriangleCullMode::FrontFaceCulling };
+				for (size_t firstIdx{ 0 }; firstIdx < grid.indices.size(); firstIdx += 6)
+				{
+					const size_t quadIdx{ firstIdx / 6 };
+					TriangleMesh* pMesh = AddTriangleMesh(cullModes[quadIdx % 3], static_cast<unsigned char>(quadIdx % 5));
+					for (int idx{ 0 }; idx < 6; ++idx)
+					{
+						pMesh->positions.push_back(grid.positions[grid.indices[firstIdx + idx]]);
+						pMesh->indices.push_back(idx);
+					}
+					pMesh->CalculateNormals();
+					pMesh->UpdateTransforms();
+				}
+
+				TriangleMesh* pLargeMesh = AddTriangleMesh(TriangleCullMode::BackFaceCulling, 5);
+				const TriangleMesh largeGrid = CreateTestMesh(12);
+				pLargeMesh->positions = largeGrid.positions;
+				pLargeMesh->indices = largeGrid.indices;
+				pLargeMesh->CalculateNormals();
+				pLargeMesh->Translate({ 6.f, 1.f, 6.f });
+				pLargeMesh->UpdateTransforms();
+
+				BuildAccelerationStructure();
+			}
+
+			void Move(const Vector3& offset)
+			{
+				for (int idx{ 0 }; idx < int(m_TriangleMeshGeometries.size()); ++idx)
+				{
+					m_TriangleMeshGeometries[idx].Translate(offset * float(idx % 3));
+					m_TriangleMeshGeometries[idx].UpdateTransforms();
+				}
+				RefitAccelerationStructure();
+			}
+		};
+
+		// Instances of one small grid, placed with uniform and non-uniform scales on top of rotations and translations
+		class InstanceScene final : public Scene
+		{
+		public:
+			explicit InstanceScene(AcceleratorType acceleratorType = AcceleratorType::BVH) :
+				m_AcceleratorType{ acceleratorType }
+			{
+			}
+
+			void Initialize() override
+			{
+				const TriangleMesh grid = CreateTestMesh(8);
+				pGrid = AddInstancedMesh(TriangleCullMode::BackFaceCulling);
+				pGrid->positions = grid.positions;
+				pGrid->indices = grid.indices;
+				pGrid->CalculateNormals();
+				pGrid->UpdateTransforms();
+				pGrid->BuildAccelerator(m_AcceleratorType);
+
+				for (int idx{ 0 }; idx < int(std::size(transforms)); ++idx)
+				{
+					handles.push_back(AddMeshInstance(pGrid, transforms[idx], static_cast<unsigned char>(idx + 1)));
+				}
+				BuildAccelerationStructure();
+			}
+
+			void Spin(float yaw)
+			{
+				for (int idx{ 0 }; idx < int(m_MeshInstances.size()); ++idx)
+				{
+					m_MeshInstances[idx].SetTransform(Matrix::CreateRotationY(yaw * float(idx % 3)) * transforms[idx]);
+				}
+				RefitAccelerationStructure();
+			}
+
+			TriangleMesh* pGrid{ nullptr };
+			std::vector<SceneObjectHandle> handles{};
+			const Matrix transforms[4]
+			{
+				Matrix::CreateTranslation(2.f, 0.f, 2.f),
+				Matrix::CreateScale(1.5f, 1.5f, 1.5f) * Matrix::CreateRotationY(0.6f) * Matrix::CreateTranslation(12.f, 0.f, 1.f),
+				Matrix::CreateScale(2.f, 0.5f, 1.f) * Matrix::CreateRotation(0.2f, 0.9f, -0.3f) * Matrix::CreateTranslation(4.f, 1.f, 14.f),
+				Matrix::CreateScale(0.6f, 2.5f, 1.8f) * Matrix::CreateTranslation(15.f, -1.f, 9.f)
+			};
+
+		private:
+			AcceleratorType m_AcceleratorType;
+		};
+
+		// The instance's mesh with the instance transform baked into its vertices
+		TriangleMesh CreateTransformedMesh(const MeshInstance& instance)
+		{
+			TriangleMesh mesh{};
+			for (const Vector3& position : instance.pMesh->transformedPositions) mesh.positions.push_back(instance.transform.TransformPoint(position));
+			mesh.indices = instance.pMesh->indices;
+			mesh.cullMode = instance.pMesh->cullMode;
+			mesh.materialIndex = instance.materialIndex;
+			mesh.CalculateNormals();
+			mesh.UpdateTransforms();
+			return mesh;
+		}
+
+		bool HitTest_BruteForce(const std::vector<Sphere>& spheres, const Ray& ray, HitRecord& closestHit)
+		{
+			for (const Sphere& sphere : spheres)
+			{
+				HitRecord hit{};
+				if (GeometryUtils::HitTest_Sphere(sphere, ray, hit) && hit.t < closestHit.t) closestHit = hit;
+			}
+			return closestHit.didHit;
+		}
+
+		// Closest hit and occlusion of the mesh's accelerator against testing every triangle
+		void ExpectMatchesBruteForce(const TriangleMesh& mesh, const std::vector<Ray>& rays)
+		{
+			for (const Ray& ray : rays)
+			{
+				HitRecord expected{}, actual{};
+				ASSERT_EQ(HitTest_BruteForce(mesh, ray, expected), GeometryUtils::HitTest_TriangleMesh(mesh, 0, ray, actual));
+				ASSERT_EQ(expected.didHit, GeometryUtils::HitTest_TriangleMesh(mesh, ray));
+				if (expected.didHit)
+				{
+					EXPECT_FLOAT_EQ(expected.t, actual.t);
+					EXPECT_EQ(expected.materialIndex, actual.materialIndex);
+				}
+			}
+		}
+
+		// Same for the scene BVH against every sphere, mesh and instance, tTolerance 0 expects the same distance as the brute force tests
+		void ExpectMatchesBruteForce(const Scene& scene, const std::vector<Ray>& rays, float tTolerance = 0.f)
+		{
+			std::vector<TriangleMesh> instanceMeshes{};
+			for (const MeshInstance& instance : scene.GetMeshInstances()) instanceMeshes.push_back(CreateTransformedMesh(instance));
+
+			for (const Ray& ray : rays)
+			{
+				HitRecord expected{}, actual{};
+				HitTest_BruteForce(scene.GetSphereGeometries(), ray, expected);
+				for (const TriangleMesh& mesh : scene.GetTriangleMeshGeometries()) HitTest_BruteForce(mesh, ray, expected);
+				for (const TriangleMesh& mesh : instanceMeshes) HitTest_BruteForce(mesh, ray, expected);
+				scene.GetClosestHit(ray, actual);
+
+				ASSERT_EQ(expected.didHit, actual.didHit);
+				ASSERT_EQ(expected.didHit, scene.DoesHit(ray));
+				if (expected.didHit)
+				{
+					if (tTolerance > 0.f)
+					{
+						EXPECT_NEAR(expected.t, actual.t, tTolerance);
+					}
+					else
+					{
+						EXPECT_FLOAT_EQ(expected.t, actual.t);
+					}
+					EXPECT_EQ(expected.materialIndex, actual.materialIndex);
+					EXPECT_NEAR(Vector3::Dot(expected.normal, actual.normal), 1.f, 1e-3f);
+				}
+			}
+		}
+	}
+
+	// W4
+	TEST(BVH, ClosestHitMatchesBruteForce) {
+		TriangleMesh mesh = CreateTestMesh();
+		mesh.BuildBVH();
+		ExpectMatchesBruteForce(mesh, CreateTestRays(2000));
+	}
+
+	// W4
+	TEST(BVH, DepthFirstNodeLayout) {
+		TriangleMesh mesh = CreateTestMesh();
+		mesh.BuildBVH();
+		const BVH& bvh = *mesh.bvh;
+
+		// every triangle sits in exactly one leaf and each left child follows its parent
+		uint32_t nrOfLeafTriangles{ 0 };
+		for (uint32_t nodeIdx{ 0 }; nodeIdx < bvh.GetNodeCount(); ++nodeIdx)
+		{
+			const BVHNode& node = bvh.GetBvhNode(nodeIdx);
+			EXPECT_EQ(reinterpret_cast<uintptr_t>(&node) % 32, 0u);
+			if (node.IsLeaf())
+			{
+				nrOfLeafTriangles += node.triCount;
+				continue;
+			}
+
+			ASSERT_GT(node.rightNode, nodeIdx + 1);
+			ASSERT_LT(node.rightNode, bvh.GetNodeCount());
+		}
+		EXPECT_EQ(nrOfLeafTriangles, uint32_t(mesh.normals.size()));
+	}
+
+	// W4
+	TEST(BVH, ParallelBuildMatchesSerial) {
+		BVHBuildSettings serialSettings{};
+		serialSettings.nrOfBuildThreads = 1;
+		TriangleMesh serialMesh = CreateTestMesh();
+		serialMesh.BuildBVH(serialSettings);
+
+		// small tasks so the test mesh gets parallel top levels and several subtree tasks
+		BVHBuildSettings parallelSettings{};
+		parallelSettings.nrOfBuildThreads = 4;
+		parallelSettings.minTrianglesPerBuildTask = 64;
+		TriangleMesh parallelMesh = CreateTestMesh();
+		parallelMesh.BuildBVH(parallelSettings);
+
+		// the parallel build makes the same decisions, so the trees are identical
+		const BVH& serial = *serialMesh.bvh;
+		const BVH& parallel = *parallelMesh.bvh;
+		ASSERT_EQ(serial.GetNodeCount(), parallel.GetNodeCount());
+		for (uint32_t nodeIdx{ 0 }; nodeIdx < serial.GetNodeCount(); ++nodeIdx)
+		{
+			const BVHNode& expected = serial.GetBvhNode(nodeIdx);
+			const BVHNode& actual = parallel.GetBvhNode(nodeIdx);
+			ASSERT_EQ(expected.triCount, actual.triCount);
+			ASSERT_EQ(expected.firstTriIdx, actual.firstTriIdx);
+			EXPECT_EQ(expected.aabb.bmin, actual.aabb.bmin);
+			EXPECT_EQ(expected.aabb.bmax, actual.aabb.bmax);
+		}
+		for (uint32_t triIdx{ 0 }; triIdx < uint32_t(serialMesh.normals.size()); ++triIdx)
+		{
+			EXPECT_EQ(serial.GetTriAtIdx(triIdx).meshTriIdx, parallel.GetTriAtIdx(triIdx).meshTriIdx);
+		}
+	}
+
+	// W4
+	TEST(BVH, LBVHMatchesBruteForce) {
+		for (const bool optimizeTreelets : { false, true })
+		{
+			for (const uint32_t nrOfThreads : { 1u, 4u })
+			{
+				BVHBuildSettings settings{};
+				settings.builder = BVHBuilder::LBVH;
+				settings.optimizeTreelets = optimizeTreelets;
+				settings.nrOfBuildThreads = nrOfThreads;
+				settings.minTrianglesPerBuildTask = 64;
+				TriangleMesh mesh = CreateTestMesh();
+				mesh.BuildBVH(settings);
+				ExpectMatchesBruteForce(mesh, CreateTestRays(1000));
+
+				// treelets may only lower the cost, the SAH builder stays the reference for quality
+				if (optimizeTreelets)
+				{
+					BVHBuildSettings plainSettings{ settings };
+					plainSettings.optimizeTreelets = false;
+					TriangleMesh plainMesh = CreateTestMesh();
+					plainMesh.BuildBVH(plainSettings);
+					EXPECT_LE(mesh.bvh->ComputeSAHCost(), plainMesh.bvh->ComputeSAHCost());
+				}
+			}
+		}
+	}
+
+	// W4
+	TEST(BVH, SBVHMatchesBruteForce) {
+		BVHBuildSettings settings{};
+		settings.builder = BVHBuilder::SBVH;
+		TriangleMesh mesh = CreateTestMesh();
+		// diagonal to the axes, so the triangle bounds overlap and spatial splits pay off
+		mesh.RotateY(0.785f);
+		mesh.UpdateTransforms();
+		mesh.BuildBVH(settings);
+
+		const uint32_t nrOfTriangles = uint32_t(mesh.indices.size() / 3);
+		EXPECT_GT(mesh.bvh->GetReferenceCount(), nrOfTriangles);
+		EXPECT_LE(mesh.bvh->GetReferenceCount(), nrOfTriangles + uint32_t(nrOfTriangles * settings.spatialSplitBudget));
+
+		BVHBuildSettings sahSettings{};
+		TriangleMesh sahMesh = CreateTestMesh();
+		sahMesh.RotateY(0.785f);
+		sahMesh.UpdateTransforms();
+		sahMesh.BuildBVH(sahSettings);
+		EXPECT_LT(mesh.bvh->ComputeOverlap(), sahMesh.bvh->ComputeOverlap());
+
+		// the refit keeps the duplicated references, with bounds of the whole triangles
+		for (const float yaw : { 0.785f, 0.8f })
+		{
+			mesh.RotateY(yaw);
+			mesh.UpdateTransforms();
+			ExpectMatchesBruteForce(mesh, CreateTestRays(1000));
+		}
+	}
+
+	// W4
+	TEST(BVH, RefitMatchesBruteForce) {
+		TriangleMesh mesh = CreateTestMesh();
+		mesh.BuildBVH();
+
+		// small rotation keeps the refitted tree, large ones may trigger a rebuild, both must stay exact
+		for (const float yaw : { 0.05f, 0.8f, 2.5f })
+		{
+			mesh.RotateY(yaw);
+			mesh.UpdateTransforms();
+			ExpectMatchesBruteForce(mesh, CreateTestRays(500));
+		}
+	}
+
+	// W4
+	TEST(BVH, CompressedMatchesUncompressed) {
+		for (const TriangleCullMode cullMode : { TriangleCullMode::NoCulling, TriangleCullMode::BackFaceCulling })
+		{
+			TriangleMesh mesh = CreateTestMesh();
+			mesh.cullMode = cullMode;
+			mesh.BuildBVH();
+
+			BVHBuildSettings settings{};
+			settings.compressNodes = true;
+			TriangleMesh compressedMesh = CreateTestMesh();
+			compressedMesh.cullMode = cullMode;
+			compressedMesh.BuildBVH(settings);
+			ASSERT_TRUE(compressedMesh.bvh->HasQuantizedNodes());
+
+			// the leaves read the same vertices and the decoded boxes only ever grow, so every hit is identical
+			for (const Ray& ray : CreateTestRays(1000))
+			{
+				HitRecord expected{}, actual{};
+				ASSERT_EQ(GeometryUtils::HitTest_TriangleMesh(mesh, 0, ray, expected), GeometryUtils::HitTest_TriangleMesh(compressedMesh, 0, ray, actual));
+				EXPECT_EQ(expected.t, actual.t);
+				EXPECT_EQ(expected.normal, actual.normal);
+				EXPECT_EQ(GeometryUtils::HitTest_TriangleMesh(mesh, ray), GeometryUtils::HitTest_TriangleMesh(compressedMesh, ray));
+			}
+
+			const BVHStats stats = mesh.bvh->ComputeStats();
+			const BVHStats compressedStats = compressedMesh.bvh->ComputeStats();
+			EXPECT_LT(3 * (compressedStats.nodeBytes + compressedStats.triangleBytes), stats.nodeBytes + stats.triangleBytes);
+		}
+	}
+
+	// W4
+	TEST(BVH, StatsMatchTheTree) {
+		for (const BVHBuilder builder : { BVHBuilder::BinnedSAH, BVHBuilder::LBVH, BVHBuilder::SBVH })
+		{
+			BVHBuildSettings settings{};
+			settings.builder = builder;
+			TriangleMesh mesh = CreateTestMesh();
+			mesh.BuildBVH(settings);
+			const BVHStats stats = mesh.bvh->ComputeStats();
+
+			// a binary tree, every leaf counted once in each histogram and every reference in one leaf
+			EXPECT_EQ(stats.nodeCount, mesh.bvh->GetNodeCount());
+			EXPECT_EQ(stats.nodeCount, 2 * stats.leafCount - 1);
+			EXPECT_EQ(stats.triangleCount, uint32_t(mesh.normals.size()));
+			EXPECT_EQ(stats.referenceCount, mesh.bvh->GetReferenceCount());
+			EXPECT_FLOAT_EQ(stats.sahCost, mesh.bvh->ComputeSAHCost());
+			EXPECT_EQ(stats.leavesPerDepth.size(), stats.maxDepth + 1);
+
+			uint32_t leavesByDepth{ 0 }, leavesBySize{ 0 }, references{ 0 };
+			for (const uint32_t count : stats.leavesPerDepth) leavesByDepth += count;
+			for (uint32_t size{ 0 }; size < stats.leavesPerSize.size(); ++size)
+			{
+				leavesBySize += stats.leavesPerSize[size];
+				references += size * stats.leavesPerSize[size];
+			}
+			EXPECT_EQ(leavesByDepth, stats.leafCount);
+			EXPECT_EQ(leavesBySize, stats.leafCount);
+			EXPECT_EQ(references, stats.referenceCount);
+			EXPECT_GE(stats.nodeBytes, stats.nodeCount * sizeof(BVHNode));
+			EXPECT_GT(stats.buildTimeMs, 0.f);
+		}
+	}
+
+	// W4
+	TEST(BVH, CacheMapsTheSameTree) {
+		const std::filesystem::path cacheDirectory{ std::filesystem::temp_directory_path() / "gp1_bvh_cache_test" };
+		std::filesystem::remove_all(cacheDirectory);
+		BVHCache::SetDirectory(cacheDirectory.string());
+
+		// the first build stores the tree, the second mesh maps it
+		TriangleMesh builtMesh = CreateTestMesh();
+		builtMesh.BuildBVH();
+		ASSERT_FALSE(builtMesh.bvh->IsMappedFromCache());
+		TriangleMesh mappedMesh = CreateTestMesh();
+		mappedMesh.BuildBVH();
+		ASSERT_TRUE(mappedMesh.bvh->IsMappedFromCache());
+
+		ASSERT_EQ(builtMesh.bvh->GetNodeCount(), mappedMesh.bvh->GetNodeCount());
+		EXPECT_FLOAT_EQ(builtMesh.bvh->ComputeSAHCost(), mappedMesh.bvh->ComputeSAHCost());
+		ExpectMatchesBruteForce(mappedMesh, CreateTestRays(1000));
+
+		// other settings are another tree
+		BVHBuildSettings settings{};
+		settings.nrOfBins = 8;
+		TriangleMesh otherMesh = CreateTestMesh();
+		otherMesh.BuildBVH(settings);
+		EXPECT_FALSE(otherMesh.bvh->IsMappedFromCache());
+
+		// refitting copies the mapped tree first
+		mappedMesh.RotateY(0.3f);
+		mappedMesh.UpdateTransforms();
+		EXPECT_FALSE(mappedMesh.bvh->IsMappedFromCache());
+		ExpectMatchesBruteForce(mappedMesh, CreateTestRays(200));
+
+		BVHCache::SetDirectory({});
+		std::filesystem::remove_all(cacheDirectory);
+	}
+
+	// W4
+	TEST(BVH, BVH4MatchesBinary) {
+		TriangleMesh binaryMesh = CreateTestMesh();
+		BVHBuildSettings binarySettings{};
+		binarySettings.collapseToBVH4 = false;
+		binaryMesh.BuildBVH(binarySettings);
+		ASSERT_FALSE(binaryMesh.bvh->HasBVH4());
+
+		TriangleMesh wideMesh = CreateTestMesh();
+		wideMesh.BuildBVH();
+		ASSERT_TRUE(wideMesh.bvh->HasBVH4());
+
+		for (const Ray& ray : CreateTestRays(2000))
+		{
+			HitRecord expected{}, actual{};
+			ASSERT_EQ(GeometryUtils::HitTest_TriangleMesh(binaryMesh, 0, ray, expected), GeometryUtils::HitTest_TriangleMesh(wideMesh, 0, ray, actual));
+			if (expected.didHit)
+			{
+				EXPECT_FLOAT_EQ(expected.t, actual.t);
+			}
+		}
+	}
+
+	// W4
+	TEST(BVH, StacklessMatchesBruteForce) {
+		BVHBuildSettings settings{};
+		settings.stacklessTraversal = true;
+		TriangleMesh mesh = CreateTestMesh();
+		mesh.cullMode = TriangleCullMode::BackFaceCulling;
+		mesh.BuildBVH(settings);
+		ASSERT_TRUE(mesh.bvh->HasSkipNodes());
+		ASSERT_FALSE(mesh.bvh->HasBVH4());
+
+		// a missed inner left child skips its whole subtree, up to its sibling
+		const BVH& bvh = *mesh.bvh;
+		EXPECT_EQ(bvh.GetSkipNode(0).skipNode, bvh.GetNodeCount());
+		for (uint32_t nodeIdx = 0; nodeIdx < bvh.GetNodeCount(); nodeIdx++)
+		{
+			const BVHNode& node = bvh.GetBvhNode(nodeIdx);
+			if (!node.IsLeaf() && !bvh.GetSkipNode(nodeIdx + 1).IsLeaf())
+			{
+				EXPECT_EQ(bvh.GetSkipNode(nodeIdx + 1).skipNode, node.rightNode);
+			}
+		}
+
+		// the skip nodes follow the refitted and the rebuilt tree
+		for (const float yaw : { 0.f, 0.05f, 2.5f })
+		{
+			mesh.RotateY(yaw);
+			mesh.UpdateTransforms();
+			ASSERT_TRUE(mesh.bvh->HasSkipNodes());
+			ExpectMatchesBruteForce(mesh, CreateTestRays(1000));
+		}
+	}
+
+	// W4
+	TEST(BVH, SimdLeavesMatchScalar) {
+		for (const TriangleCullMode cullMode : { TriangleCullMode::NoCulling, TriangleCullMode::BackFaceCulling, TriangleCullMode::FrontFaceCulling })
+		{
+			BVHBuildSettings scalarSettings{};
+			scalarSettings.simdLeaves = false;
+			TriangleMesh scalarMesh = CreateTestMesh();
+			scalarMesh.cullMode = cullMode;
+			scalarMesh.BuildBVH(scalarSettings);
+			ASSERT_FALSE(scalarMesh.bvh->HasTriGroups());
+
+			TriangleMesh simdMesh = CreateTestMesh();
+			simdMesh.cullMode = cullMode;
+			simdMesh.BuildBVH();
+			ASSERT_TRUE(simdMesh.bvh->HasTriGroups());
+
+			for (const Ray& ray : CreateTestRays(2000))
+			{
+				HitRecord expected{}, actual{};
+				ASSERT_EQ(GeometryUtils::HitTest_TriangleMesh(scalarMesh, 0, ray, expected), GeometryUtils::HitTest_TriangleMesh(simdMesh, 0, ray, actual));
+				ASSERT_EQ(expected.didHit, GeometryUtils::HitTest_TriangleMesh(simdMesh, ray));
+				if (!expected.didHit) continue;
+
+				// same operations in the same order, so the distance is bit-identical
+				EXPECT_EQ(expected.t, actual.t);
+				EXPECT_FLOAT_EQ(expected.normal.x, actual.normal.x);
+				EXPECT_FLOAT_EQ(expected.normal.y, actual.normal.y);
+				EXPECT_FLOAT_EQ(expected.normal.z, actual.normal.z);
+			}
+		}
+	}
+
+	// W4
+	TEST(BVH, OcclusionMatchesClosestHit) {
+		for (const bool collapseToBVH4 : { false, true })
+		{
+			BVHBuildSettings settings{};
+			settings.collapseToBVH4 = collapseToBVH4;
+			TriangleMesh mesh = CreateTestMesh();
+			mesh.cullMode = TriangleCullMode::BackFaceCulling;
+			mesh.BuildBVH(settings);
+
+			// shorten the rays so some of them stop before the grid
+			int rayIdx{ 0 };
+			for (const Ray& fullRay : CreateTestRays(2000))
+			{
+				const Ray ray{ fullRay.origin, fullRay.direction, fullRay.min, 4.f + float(rayIdx++ % 8) };
+
+				HitRecord closestHit{};
+				GeometryUtils::HitTest_TriangleMesh(mesh, 0, ray, closestHit);
+				ASSERT_EQ(closestHit.didHit, GeometryUtils::HitTest_TriangleMesh(mesh, ray));
+			}
+		}
+	}
+
+	// W4
+	TEST(MeshAccelerator, KdTreeAndGridMatchBruteForce) {
+		for (const AcceleratorType type : { AcceleratorType::KdTree, AcceleratorType::Grid })
+		{
+			for (const TriangleCullMode cullMode : { TriangleCullMode::NoCulling, TriangleCullMode::BackFaceCulling })
+			{
+				TriangleMesh mesh = CreateTestMesh();
+				mesh.cullMode = cullMode;
+				mesh.materialIndex = 3;
+				mesh.BuildAccelerator(type);
+				ASSERT_EQ(mesh.accelerator->GetType(), type);
+				ASSERT_EQ(mesh.bvh, nullptr);
+
+				// the second pass rebuilds after the mesh turned
+				for (const float yaw : { 0.f, 0.8f })
+				{
+					mesh.RotateY(yaw);
+					mesh.UpdateTransforms();
+
+					// some rays start inside the mesh bounds, some stop before reaching the grid
+					std::vector<Ray> rays{};
+					int rayIdx{ 0 };
+					for (const Ray& fullRay : CreateTestRays(1000))
+					{
+						const Vector3 origin = rayIdx % 2 ? fullRay.origin + fullRay.direction * 5.f : fullRay.origin;
+						rays.push_back(Ray{ origin, fullRay.direction, fullRay.min, rayIdx++ % 3 ? FLT_MAX : 4.f + float(rayIdx % 8) });
+					}
+					ExpectMatchesBruteForce(mesh, rays);
+				}
+			}
+		}
+	}
+
+	// W4
+	TEST(MeshAccelerator, FollowsMovedMesh) {
+		// a growing vector moves its meshes, the accelerators have to refit over the moved ones
+		for (const AcceleratorType type : { AcceleratorType::BVH, AcceleratorType::KdTree, AcceleratorType::Grid })
+		{
+			std::vector<TriangleMesh> meshes{};
+			for (int idx{ 0 }; idx < 40; ++idx)
+			{
+				TriangleMesh mesh = CreateTestMesh();
+				mesh.BuildAccelerator(type);
+				meshes.push_back(std::move(mesh));
+			}
+
+			TriangleMesh& mesh = meshes.front();
+			ASSERT_EQ(mesh.bvh != nullptr, type == AcceleratorType::BVH);
+			mesh.RotateY(0.8f);
+			mesh.UpdateTransforms();
+			ExpectMatchesBruteForce(mesh, CreateTestRays(500));
+		}
+	}
+
+	// W4
+	TEST(SceneBVH, ClosestHitMatchesBruteForce) {
+		SphereFieldScene scene{};
+		scene.Initialize();
+
+		for (const Vector3& offset : { Vector3{}, Vector3{ 0.5f, 1.f, -0.5f } })
+		{
+			scene.Move(offset);
+			ExpectMatchesBruteForce(scene, CreateTestRays(1000));
+		}
+	}
+
+	// W4
+	TEST(SceneBVH, CombinedMeshesMatchBruteForce) {
+		SmallMeshScene scene{};
+		scene.Initialize();
+		ASSERT_NE(scene.GetCombinedMesh().bvh, nullptr);
+		EXPECT_EQ(scene.GetCombinedMesh().bvh->GetReferenceCount(), 24u * 24u * 2u);
+
+		const std::vector<TriangleMesh>& meshes = scene.GetTriangleMeshGeometries();
+		EXPECT_EQ(meshes.front().bvh, nullptr);
+		EXPECT_NE(meshes.back().bvh, nullptr);
+
+		// the combined mesh follows the meshes it was made from
+		for (const Vector3& offset : { Vector3{}, Vector3{ 0.5f, 1.f, -0.5f } })
+		{
+			scene.Move(offset);
+			ExpectMatchesBruteForce(scene, CreateTestRays(1000));
+		}
+	}
+
+	// W4
+	TEST(SceneBVH, InstancesMatchBruteForce) {
+		// the object space rays of scaled instances aren't unit length, the distances still have to be world space ones
+		for (const AcceleratorType type : { AcceleratorType::BVH, AcceleratorType::KdTree, AcceleratorType::Grid })
+		{
+			InstanceScene scene{ type };
+			scene.Initialize();
+
+			std::vector<Ray> rays{};
+			int rayIdx{ 0 };
+			for (const Ray& fullRay : CreateTestRays(1000))
+			{
+				rays.push_back(Ray{ fullRay.origin, fullRay.direction, fullRay.min, rayIdx++ % 3 ? FLT_MAX : 4.f + float(rayIdx % 8) });
+			}
+			for (const float yaw : { 0.f, 0.7f })
+			{
+				scene.Spin(yaw);
+				ExpectMatchesBruteForce(scene, rays, 1e-4f);
+			}
+		}
+	}
+
+	// W4
+	TEST(SceneBVH, InsertAndRemoveMatchBruteForce) {
+		SphereFieldScene scene{};
+		scene.Initialize();
+
+		const std::vector<Ray> rays = CreateTestRays(1000);
+
+		// removing every other sphere swaps later ones into the freed indices, their handles follow them
+		std::vector<SceneObjectHandle> handles = scene.handles;
+		std::vector<Vector3> origins{};
+		for (const SceneObjectHandle& handle : handles) origins.push_back(scene.GetSphere(handle)->origin);
+		for (size_t idx{ 0 }; idx < handles.size(); idx += 2) EXPECT_TRUE(scene.RemoveObject(handles[idx]));
+		EXPECT_FALSE(scene.RemoveObject(handles[0]));
+		EXPECT_EQ(scene.GetSphereGeometries().size(), handles.size() / 2);
+		for (size_t idx{ 1 }; idx < handles.size(); idx += 2)
+		{
+			ASSERT_NE(scene.GetSphere(handles[idx]), nullptr);
+			EXPECT_EQ(scene.GetSphere(handles[idx])->origin, origins[idx]);
+		}
+		ExpectMatchesBruteForce(scene, rays);
+
+		// new spheres reuse the freed slots without reviving the old handles
+		uint32_t seed{ 4321 };
+		auto random = [&seed]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) / float(1 << 24); };
+		for (int i{ 0 }; i < 300; ++i)
+		{
+			handles.push_back(scene.AddSphere({ random() * 24.f, random() * 3.f, random() * 24.f }, 0.2f + random() * 0.6f));
+		}
+		EXPECT_FALSE(scene.IsValid(handles[0]));
+		EXPECT_EQ(scene.GetSphere(handles[0]), nullptr);
+		EXPECT_EQ(scene.GetMeshInstance(handles[1]), nullptr);
+
+		for (size_t idx{ 1 }; idx < handles.size(); idx += 4)
+		{
+			if (Sphere* pSphere = scene.GetSphere(handles[idx]))
+			{
+				pSphere->origin += Vector3{ 3.f, 2.f, -3.f };
+				scene.UpdateObject(handles[idx]);
+			}
+		}
+		ExpectMatchesBruteForce(scene, rays);
+
+		// emptying the scene leaves nothing to hit, the next sphere starts a new tree
+		for (const SceneObjectHandle& handle : handles) scene.RemoveObject(handle);
+		EXPECT_TRUE(scene.GetSphereGeometries().empty());
+		ExpectMatchesBruteForce(scene, rays);
+		scene.AddSphere({ 12.f, 0.f, 12.f }, 5.f);
+		ExpectMatchesBruteForce(scene, rays);
+	}
+
+	// W4
+	TEST(SceneBVH, InstanceHandlesMatchBruteForce) {
+		InstanceScene scene{};
+		scene.Initialize();
+		const std::vector<Ray> rays = CreateTestRays(1000);
+
+		// instances added after the build, mixed with spheres so the slots of both kinds get reused by the other
+		uint32_t seed{ 8642 };
+		auto random = [&seed]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) / float(1 << 24); };
+		std::vector<SceneObjectHandle> handles = scene.handles;
+		for (int i{ 0 }; i < 60; ++i)
+		{
+			const Vector3 position{ random() * 22.f, random() * 2.f, random() * 22.f };
+			if (i % 2)
+			{
+				handles.push_back(scene.AddSphere(position, 0.2f + random() * 0.6f, static_cast<unsigned char>(i % 7)));
+				continue;
+			}
+			const Matrix transform = Matrix::CreateScale(0.2f + random() * 0.4f, 0.1f + random(), 0.2f + random() * 0.4f) *
+				Matrix::CreateRotation(random() - 0.5f, random() * 6.f, random() - 0.5f) * Matrix::CreateTranslation(position);
+			handles.push_back(scene.AddMeshInstance(scene.pGrid, transform, static_cast<unsigned char>(i % 5)));
+		}
+		ExpectMatchesBruteForce(scene, rays, 1e-4f);
+
+		// removing every third object swaps later instances into the freed indices, their handles follow them
+		std::vector<Matrix> transforms{};
+		std::vector<bool> isInstance{};
+		for (const SceneObjectHandle& handle : handles)
+		{
+			const MeshInstance* pInstance = scene.GetMeshInstance(handle);
+			transforms.push_back(pInstance ? pInstance->transform : Matrix{});
+			isInstance.push_back(pInstance != nullptr);
+		}
+		for (size_t idx{ 0 }; idx < handles.size(); idx += 3) EXPECT_TRUE(scene.RemoveObject(handles[idx]));
+		for (size_t idx{ 0 }; idx < handles.size(); ++idx)
+		{
+			if (idx % 3 == 0 || !isInstance[idx]) continue;
+			ASSERT_NE(scene.GetMeshInstance(handles[idx]), nullptr);
+			EXPECT_EQ(scene.GetMeshInstance(handles[idx])->transform, transforms[idx]);
+		}
+		ExpectMatchesBruteForce(scene, rays, 1e-4f);
+
+		// moved instances are reinserted one by one
+		for (size_t idx{ 1 }; idx < handles.size(); idx += 3)
+		{
+			if (MeshInstance* pInstance = scene.GetMeshInstance(handles[idx]))
+			{
+				pInstance->SetTransform(pInstance->transform * Matrix::CreateTranslation(2.f, 1.f, -2.f));
+				scene.UpdateObject(handles[idx]);
+			}
+		}
+		ExpectMatchesBruteForce(scene, rays, 1e-4f);
+
+		// the freed slots are reused by the other kind of object, the stale handles can't remove what reused them
+		std::vector<SceneObjectHandle> newHandles{};
+		for (size_t idx{ 0 }; idx < handles.size(); idx += 3)
+		{
+			newHandles.push_back(isInstance[idx] ? scene.AddSphere({ random() * 22.f, 1.f, random() * 22.f }, 0.5f)
+				: scene.AddMeshInstance(scene.pGrid, Matrix::CreateScale(0.5f, 2.f, 0.5f) * Matrix::CreateTranslation(random() * 22.f, 0.f, random() * 22.f)));
+		}
+		for (size_t idx{ 0 }; idx < handles.size(); idx += 3)
+		{
+			EXPECT_FALSE(scene.IsValid(handles[idx]));
+			EXPECT_FALSE(scene.RemoveObject(handles[idx]));
+			EXPECT_EQ(scene.GetMeshInstance(handles[idx]), nullptr);
+			EXPECT_EQ(scene.GetSphere(handles[idx]), nullptr);
+		}
+		for (const SceneObjectHandle& newHandle : newHandles)
+		{
+			EXPECT_TRUE(scene.IsValid(newHandle));
+		}
+		ExpectMatchesBruteForce(scene, rays, 1e-4f);
+
+		// removing everything through the handles leaves nothing to hit
+		for (const SceneObjectHandle& handle : handles) scene.RemoveObject(handle);
+		for (const SceneObjectHandle& handle : newHandles) EXPECT_TRUE(scene.RemoveObject(handle));
+		EXPECT_TRUE(scene.GetMeshInstances().empty());
+		EXPECT_TRUE(scene.GetSphereGeometries().empty());
+		ExpectMatchesBruteForce(scene, rays);
+	}
+
+	// W4
+	TEST(SphereBVH, MatchesBruteForce) {
+		// some spheres share a center, so the build has to split ranges it can't partition
+		std::vector<Sphere> spheres{};
+		uint32_t seed{ 2468 };
+		auto random = [&seed]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) / float(1 << 24); };
+		for (int i{ 0 }; i < 3000; ++i)
+		{
+			const Vector3 origin = (i % 10 == 0) ? Vector3{ 12.f, 1.f, 12.f } : Vector3{ random() * 24.f, random() * 3.f, random() * 24.f };
+			spheres.push_back(Sphere{ origin, 0.05f + random() * 0.3f, static_cast<unsigned char>(i % 7) });
+		}
+
+		// serial, and parallel with tasks small enough that the top levels are split across threads
+		for (const uint32_t nrOfBuildThreads : { 1u, 4u })
+		{
+			SphereBVHSettings settings{};
+			settings.nrOfBuildThreads = nrOfBuildThreads;
+			settings.minSpheresPerBuildTask = 64;
+			settings.maxMidpointSplitSpheres = 32;
+			SphereBVH sphereBVH{ settings };
+			sphereBVH.Build(spheres);
+			ASSERT_EQ(sphereBVH.GetSphereCount(), spheres.size());
+
+			for (const Ray& ray : CreateTestRays(1000))
+			{
+				HitRecord expected{}, actual{};
+				const bool expectedHit = HitTest_BruteForce(spheres, ray, expected);
+				ASSERT_EQ(expectedHit, sphereBVH.ClosestHit(ray, actual));
+				EXPECT_EQ(expectedHit, sphereBVH.AnyHit(ray));
+				if (!expectedHit) continue;
+
+				EXPECT_NEAR(expected.t, actual.t, 1e-4f);
+				EXPECT_EQ(expected.materialIndex, actual.materialIndex);
+				EXPECT_NEAR(Vector3::Dot(expected.normal, actual.normal), 1.f, 1e-3f);
+			}
+		}
+
+		// the scene keeps its spheres in one and rebuilds it when they move
+		SphereFieldScene scene{ 100 };
+		scene.Initialize();
+		for (const Vector3& offset : { Vector3{}, Vector3{ 0.5f, 1.f, -0.5f } })
+		{
+			scene.Move(offset);
+			ExpectMatchesBruteForce(scene, CreateTestRays(1000), 1e-4f);
+		}
+	}
+
+	// W4
+	TEST(SphereBVH, EditsMatchBruteForce) {
+		SphereFieldScene scene{ 100 };
+		scene.Initialize();
+		const std::vector<Ray> rays = CreateTestRays(1000);
+
+		// removed spheres are hidden in the sphere BVH, added and moved ones get leaves of their own until the next refit
+		std::vector<SceneObjectHandle> handles = scene.handles;
+		for (size_t idx{ 0 }; idx < handles.size(); idx += 3) EXPECT_TRUE(scene.RemoveObject(handles[idx]));
+		ExpectMatchesBruteForce(scene, rays, 1e-4f);
+
+		uint32_t seed{ 1357 };
+		auto random = [&seed]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) / float(1 << 24); };
+		for (int i{ 0 }; i < 200; ++i)
+		{
+			handles.push_back(scene.AddSphere({ random() * 24.f, random() * 3.f, random() * 24.f }, 0.2f + random() * 0.6f));
+		}
+		ExpectMatchesBruteForce(scene, rays, 1e-4f);
+
+		// moving a sphere twice, and removing added and moved ones, keeps the sphere BVH indices in step
+		for (int pass{ 0 }; pass < 2; ++pass)
+		{
+			for (size_t idx{ 1 }; idx < handles.size(); idx += 4)
+			{
+				if (Sphere* pSphere = scene.GetSphere(handles[idx]))
+				{
+					pSphere->origin += Vector3{ 3.f, 2.f, -3.f };
+					scene.UpdateObject(handles[idx]);
+				}
+			}
+		}
+		for (size_t idx{ 5 }; idx < handles.size(); idx += 8) scene.RemoveObject(handles[idx]);
+		ExpectMatchesBruteForce(scene, rays, 1e-4f);
+
+		// the refit takes every sphere back into the sphere BVH, later edits start over from there
+		scene.Move({ 0.5f, 1.f, -0.5f });
+		ExpectMatchesBruteForce(scene, rays, 1e-4f);
+		for (size_t idx{ 2 }; idx < handles.size(); idx += 4) scene.RemoveObject(handles[idx]);
+		scene.AddSphere({ 12.f, 0.f, 12.f }, 2.f);
+		ExpectMatchesBruteForce(scene, rays, 1e-4f);
+	}
+
+	// W4
+	TEST(SceneBVH, SkewedInsertsStayShallow) {
+		// every sphere lands just past the previous one and each step is larger than the last, so each insert pairs the new
+		// sphere with the whole tree and deepens the chain. The radius grows along so the spheres never overlap
+		SphereFieldScene scene{ 0 };
+		scene.Initialize();
+
+		std::vector<Ray> rays = CreateTestRays(100);
+		for (int i{ 0 }; i < 25000; ++i)
+		{
+			const float x{ 30.f * std::pow(1.001f, float(i)) };
+			scene.AddSphere({ x, 1.5f, 12.f }, x * 0.0004f);
+			if ((i + 1) % 5000 != 0) continue;
+
+			// rays along the chain descend to its deepest leaves first
+			EXPECT_LE(scene.ComputeTLASDepth(), TLAS::MaxDepth);
+			rays.push_back(Ray{ { -5.f, 1.5f, 12.f }, { 1.f, 0.f, 0.f } });
+			rays.push_back(Ray{ { x * 1.1f, 1.6f, 12.f }, { -1.f, 0.f, 0.f } });
+			ExpectMatchesBruteForce(scene, rays);
+		}
+	}
 
 	int main(int argc, char** argv) {
 		::testing::InitGoogleTest(&argc, argv);